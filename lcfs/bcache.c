@@ -836,13 +836,31 @@ lc_flushDirtyPages(struct gfs *gfs, struct fs *fs) {
         fs->fs_dpagesLast = NULL;
         count = fs->fs_dpcount;
         fs->fs_dpcount = 0;
+        fs->fs_wpcount += count;
         pthread_mutex_unlock(&fs->fs_plock);
         if (count) {
             lc_flushPageCluster(gfs, fs, page, count);
+            pthread_mutex_lock(&fs->fs_plock);
+            assert(fs->fs_wpcount >= count);
+            fs->fs_wpcount -= count;
+            if (fs->fs_wpcount == 0) {
+                pthread_cond_broadcast(&fs->fs_wcond);
+            }
+            pthread_mutex_unlock(&fs->fs_plock);
         }
     }
 }
 
+/* Wait for dirty pages being written by other threads to be written */
+void
+lc_waitDirtyPages(struct fs *fs) {
+    pthread_mutex_lock(&fs->fs_plock);
+    while (fs->fs_wpcount) {
+        pthread_cond_wait(&fs->fs_wcond, &fs->fs_plock);
+    }
+    pthread_mutex_unlock(&fs->fs_plock);
+}
+
 /* Invalidate dirty pages */
 void
 lc_invalidateDirtyPages(struct gfs *gfs, struct fs *fs) {
@@ -859,25 +877,86 @@ lc_invalidateDirtyPages(struct gfs *gfs, struct fs *fs) {
     }
 }
 
+/* Measure rates at which pages are dirtied and written back */
+static void
+lc_updateWriteRates(struct gfs *gfs, struct timeval *now) {
+    uint64_t msec = (now->tv_sec * 1000ul) + (now->tv_usec / 1000);
+    uint64_t elapsed = msec - gfs->gfs_rateTime, dirtied, written;
+
+    if (elapsed < LC_FLUSH_INTERVAL_MIN) {
+        return;
+    }
+    dirtied = gfs->gfs_dirtied;
+    written = gfs->gfs_wblocks;
+
+    /* Smooth out the rates, writeback rate is updated only when there were
+     * writes as that is not known when the device is idle.
+     */
+    if (gfs->gfs_rateTime) {
+        gfs->gfs_dirtyRate = ((gfs->gfs_dirtyRate * 3) +
+                              (((dirtied - gfs->gfs_rateDirtied) * 1000ul) /
+                               elapsed)) / 4;
+        if (written > gfs->gfs_rateWritten) {
+            gfs->gfs_writeRate = ((gfs->gfs_writeRate * 3) +
+                                  (((written - gfs->gfs_rateWritten) *
+                                    1000ul) / elapsed)) / 4;
+        }
+    }
+    gfs->gfs_rateDirtied = dirtied;
+    gfs->gfs_rateWritten = written;
+    gfs->gfs_rateTime = msec;
+}
+
+/* Find time in milliseconds before flusher needs to run again, based on how
+ * soon dirty pages will reach the background limit at the current rate.
+ */
+static uint64_t
+lc_flushInterval(struct gfs *gfs) {
+    uint64_t dirty = gfs->gfs_dcount, background = lc_dirtyBackground();
+    uint64_t msec = LC_FLUSH_INTERVAL * 1000ul;
+
+    if (dirty >= background) {
+        return LC_FLUSH_INTERVAL_MIN;
+    }
+    if (gfs->gfs_dirtyRate) {
+        msec = ((background - dirty) * 1000ul) / gfs->gfs_dirtyRate;
+        if (msec < LC_FLUSH_INTERVAL_MIN) {
+            msec = LC_FLUSH_INTERVAL_MIN;
+        } else if (msec > (LC_FLUSH_INTERVAL * 1000ul)) {
+            msec = LC_FLUSH_INTERVAL * 1000ul;
+        }
+    }
+    return msec;
+}
+
 /* Background thread for flushing dirty pages */
 void *
 lc_flusher(void *data) {
     struct gfs *gfs = (struct gfs *)data;
     struct timespec interval;
+    bool force, background;
     struct timeval now;
     time_t recent = 0;
+    uint64_t msec;
     struct fs *fs;
-    bool force;
     int i;
 
-    interval.tv_nsec = 0;
     while (!gfs->gfs_unmounting) {
         gettimeofday(&now, NULL);
-        interval.tv_sec = now.tv_sec + LC_FLUSH_INTERVAL;
+        msec = lc_flushInterval(gfs);
+        interval.tv_sec = now.tv_sec + (msec / 1000);
+        interval.tv_nsec = (now.tv_usec * 1000) + ((msec % 1000) * 1000000);
+        if (interval.tv_nsec >= 1000000000) {
+            interval.tv_sec++;
+            interval.tv_nsec -= 1000000000;
+        }
         pthread_mutex_lock(&gfs->gfs_flock);
         pthread_cond_timedwait(&gfs->gfs_flusherCond, &gfs->gfs_flock,
                                &interval);
         pthread_mutex_unlock(&gfs->gfs_flock);
+        gettimeofday(&now, NULL);
+        lc_updateWriteRates(gfs, &now);
+        background = gfs->gfs_dcount >= lc_dirtyBackground();
         rcu_register_thread();
         rcu_read_lock();
 
@@ -899,19 +978,19 @@ lc_flusher(void *data) {
              * created.
              */
             if (!fs->fs_readOnly && fs->fs_pcount &&
-                ((fs->fs_pcount >= LC_MAX_LAYER_DIRTYPAGES) ||
-                 force || (fs->fs_super->sb_ctime < recent)) &&
+                ((fs->fs_pcount >= LC_MAX_LAYER_DIRTYPAGES) || force ||
+                 background || (fs->fs_super->sb_ctime < recent)) &&
                 !(fs->fs_super->sb_flags & LC_SUPER_INIT) &&
                 !lc_tryLock(fs, false)) {
                 rcu_read_unlock();
                 if (fs->fs_pcount) {
-                    lc_flushDirtyInodeList(fs, force);
+                    lc_flushDirtyInodeList(fs, force || background);
                 }
                 lc_flushDirtyPages(gfs, fs);
                 lc_unlock(fs);
                 rcu_read_lock();
             } else if (((fs->fs_dpcount >= LC_SYNCER_DIRTY_COUNT) ||
-                        (fs->fs_dpcount && force)) &&
+                        (fs->fs_dpcount && (force || background))) &&
                        !lc_tryLock(fs, false)) {
                 rcu_read_unlock();
 
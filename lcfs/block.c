@@ -263,6 +263,7 @@ lc_blockFreeExtents(struct gfs *gfs, struct fs *fs, struct extent *extents,
                     uint8_t flags) {
     bool flush = flags & LC_EXTENT_FLUSH, efree = flags & LC_EXTENT_EFREE;
     uint64_t count = LC_EXTENT_BLOCK, pcount = 0, block, freed = 0;
+    uint64_t *sblock, *scount;
     struct fs *rfs = flush ? lc_getGlobalFs(gfs) : NULL;
     struct extent *extent = extents, *tmp;
     bool free = !(flags & LC_EXTENT_KEEP);
@@ -321,16 +322,23 @@ lc_blockFreeExtents(struct gfs *gfs, struct fs *fs, struct extent *extents,
         assert(pcount);
         if (layer) {
             super = fs->fs_super;
-            if (super->sb_extentCount) {
-                lc_freeExtentBlocks(gfs, rfs, super->sb_extentBlock,
-                                    super->sb_extentCount, false);
+            if (flags & LC_EXTENT_DEDUP) {
+                sblock = &super->sb_dedupBlock;
+                scount = &super->sb_dedupCount;
+            } else {
+                sblock = &super->sb_extentBlock;
+                scount = &super->sb_extentCount;
+            }
+            if (*scount) {
+                lc_freeExtentBlocks(gfs, rfs, *sblock, *scount, false);
             }
 
             /* Allocate a new block */
             block = lc_blockAllocExact(rfs, pcount, true, false);
-            super->sb_extentBlock = block;
-            super->sb_extentCount = pcount;
-            lc_printf("Syncing allocated map layer %d block %ld count %ld\n",
+            *sblock = block;
+            *scount = pcount;
+            lc_printf("Syncing %s map layer %d block %ld count %ld\n",
+                      (flags & LC_EXTENT_DEDUP) ? "shared" : "allocated",
                       fs->fs_gindex, block, pcount);
         } else {
 
@@ -347,27 +355,15 @@ lc_blockFreeExtents(struct gfs *gfs, struct fs *fs, struct extent *extents,
     return freed;
 }
 
-/* Read extents list */
-void
-lc_readExtents(struct gfs *gfs, struct fs *fs) {
-    uint64_t block, count = 0, ecount = 0;
-    struct fs *rfs = lc_getGlobalFs(gfs);
-    bool allocated = (fs != rfs);
+/* Read a list of extents stored in a chain of blocks */
+static uint64_t
+lc_readExtentList(struct gfs *gfs, struct fs *fs, uint64_t block,
+                  struct extent **extents, uint64_t *ecountp) {
     struct dextentBlock *eblock;
+    uint64_t count = 0, ecount = 0;
     struct dextent *dextent;
-    struct extent **extents;
     int i;
 
-    block = fs->fs_super->sb_extentBlock;
-    if (block == LC_INVALID_BLOCK) {
-
-        /* This could happen if layer crashed before unmounting */
-        assert(fs->fs_gindex);
-        assert(!fs->fs_frozen);
-        assert(fs->fs_super->sb_flags & LC_SUPER_DIRTY);
-        return;
-    }
-    extents = allocated ? &fs->fs_aextents : &gfs->gfs_extents;
     lc_mallocBlockAligned(fs, (void **)&eblock, LC_MEMTYPE_BLOCK);
     while (block != LC_INVALID_BLOCK) {
         //lc_printf("Reading extents from block %ld\n", block);
@@ -389,9 +385,32 @@ lc_readExtents(struct gfs *gfs, struct fs *fs) {
         block = eblock->de_next;
         ecount++;
     }
+    lc_free(fs, eblock, LC_BLOCK_SIZE, LC_MEMTYPE_BLOCK);
+    *ecountp = ecount;
+    return count;
+}
+
+/* Read extents list */
+void
+lc_readExtents(struct gfs *gfs, struct fs *fs) {
+    struct fs *rfs = lc_getGlobalFs(gfs);
+    bool allocated = (fs != rfs);
+    uint64_t block, count, ecount;
+    struct extent **extents;
+
+    block = fs->fs_super->sb_extentBlock;
+    if (block == LC_INVALID_BLOCK) {
+
+        /* This could happen if layer crashed before unmounting */
+        assert(fs->fs_gindex);
+        assert(!fs->fs_frozen);
+        assert(fs->fs_super->sb_flags & LC_SUPER_DIRTY);
+        return;
+    }
+    extents = allocated ? &fs->fs_aextents : &gfs->gfs_extents;
+    count = lc_readExtentList(gfs, fs, block, extents, &ecount);
     assert((ecount == fs->fs_super->sb_extentCount) ||
            (!allocated && (ecount < fs->fs_super->sb_extentCount)));
-    lc_free(fs, eblock, LC_BLOCK_SIZE, LC_MEMTYPE_BLOCK);
     if (allocated) {
         fs->fs_blocks = count;
         lc_printf("Total blocks in use in layer %ld\n", fs->fs_blocks);
@@ -406,6 +425,24 @@ lc_readExtents(struct gfs *gfs, struct fs *fs) {
     }
 }
 
+/* Read list of extents allocated in other layers shared by the layer */
+void
+lc_readSharedExtents(struct gfs *gfs, struct fs *fs) {
+    uint64_t count, ecount;
+
+    if (fs->fs_super->sb_dedupCount == 0) {
+        return;
+    }
+    count = lc_readExtentList(gfs, fs, fs->fs_super->sb_dedupBlock,
+                              &fs->fs_dextents, &ecount);
+    assert(ecount == fs->fs_super->sb_dedupCount);
+    if (fs->fs_dextents) {
+        fs->fs_dnext = gfs->gfs_dedupLayers;
+        gfs->gfs_dedupLayers = fs;
+    }
+    lc_printf("Blocks shared from other layers %ld\n", count);
+}
+
 /* Free blocks in the specified extent if it was allocated for the layer */
 static uint64_t
 lc_freeLayerExtent(struct gfs *gfs, struct fs *fs, struct fs *rfs,
@@ -507,6 +544,81 @@ lc_blockAllocExact(struct fs *fs, uint64_t count, bool meta, bool reserve) {
     return block;
 }
 
+/* Take blocks in the specified range which are free in the global pool and
+ * add those to the list of blocks allocated in the layer.  Used for claiming
+ * blocks allocated after last checkpoint while replaying the intent log.
+ */
+uint64_t
+lc_blockClaim(struct gfs *gfs, struct fs *fs, uint64_t block, uint64_t count) {
+    uint64_t start, end = block + count, estart, eend, claimed = 0;
+    struct fs *rfs = lc_getGlobalFs(gfs);
+    struct extent *extent;
+
+    assert(fs != rfs);
+    assert(end < gfs->gfs_super->sb_tblocks);
+    pthread_mutex_lock(&gfs->gfs_alock);
+    extent = gfs->gfs_extents;
+    while (extent) {
+        estart = lc_getExtentStart(extent);
+        if (estart >= end) {
+            break;
+        }
+        eend = estart + lc_getExtentCount(extent);
+        if (eend <= block) {
+            extent = extent->ex_next;
+            continue;
+        }
+
+        /* Remove the overlapping portion from the free list */
+        start = (estart > block) ? estart : block;
+        count = ((eend < end) ? eend : end) - start;
+        count = lc_removeExtent(rfs, &gfs->gfs_extents, start, count);
+        assert(count);
+        gfs->gfs_super->sb_blocks += count;
+        pthread_mutex_lock(&fs->fs_alock);
+        lc_addSpaceExtent(gfs, fs, &fs->fs_aextents, start, count, true);
+        fs->fs_blocks += count;
+        pthread_mutex_unlock(&fs->fs_alock);
+        claimed += count;
+
+        /* List could have changed, so start over from the beginning */
+        block = start + count;
+        extent = gfs->gfs_extents;
+    }
+    pthread_mutex_unlock(&gfs->gfs_alock);
+    if (claimed) {
+        lc_markExtentsDirty(fs);
+        lc_markExtentsDirty(rfs);
+    }
+    return claimed;
+}
+
+/* Check if all blocks in the specified range are free in the global pool */
+bool
+lc_blockRangeFree(struct gfs *gfs, uint64_t block, uint64_t count) {
+    uint64_t end = block + count, estart, eend;
+    struct extent *extent;
+
+    if (end >= gfs->gfs_super->sb_tblocks) {
+        return false;
+    }
+    pthread_mutex_lock(&gfs->gfs_alock);
+    extent = gfs->gfs_extents;
+    while (extent && (block < end)) {
+        estart = lc_getExtentStart(extent);
+        if (estart > block) {
+            break;
+        }
+        eend = estart + lc_getExtentCount(extent);
+        if (eend > block) {
+            block = eend;
+        }
+        extent = extent->ex_next;
+    }
+    pthread_mutex_unlock(&gfs->gfs_alock);
+    return block >= end;
+}
+
 /* Free file system blocks */
 void
 lc_blockFree(struct gfs *gfs, struct fs *fs, uint64_t block,
@@ -601,6 +713,29 @@ lc_moveExtents(struct fs *fs, struct extent **extents,
     }
 }
 
+/* Write out the list of extents shared from other layers */
+static void
+lc_flushSharedExtents(struct gfs *gfs, struct fs *fs) {
+    struct super *super = fs->fs_super;
+
+    pthread_mutex_lock(&gfs->gfs_dlock);
+    if (fs->fs_dextents) {
+        lc_blockFreeExtents(gfs, fs, fs->fs_dextents,
+                            LC_EXTENT_FLUSH | LC_EXTENT_LAYER |
+                            LC_EXTENT_KEEP | LC_EXTENT_DEDUP);
+    } else if (super->sb_dedupCount) {
+
+        /* Extents are not shared anymore */
+        lc_freeExtentBlocks(gfs, lc_getGlobalFs(gfs), super->sb_dedupBlock,
+                            super->sb_dedupCount, true);
+        super->sb_dedupBlock = LC_INVALID_BLOCK;
+        super->sb_dedupCount = 0;
+    }
+    fs->fs_dedupDirty = false;
+    pthread_mutex_unlock(&gfs->gfs_dlock);
+    lc_markSuperDirty(fs);
+}
+
 /* Process blocks allocated/freed in a layer */
 void
 lc_processLayerBlocks(struct gfs *gfs, struct fs *fs, bool unmount,
@@ -609,6 +744,11 @@ lc_processLayerBlocks(struct gfs *gfs, struct fs *fs, bool unmount,
     /* Release any unused reservation */
     lc_releaseReservedBlocks(gfs, fs);
 
+    /* Write out extents shared from other layers if modified */
+    if (fs->fs_dedupDirty && !remove) {
+        lc_flushSharedExtents(gfs, fs);
+    }
+
     /* Process blocks freed in layer.  These blocks may or may not be
      * allocated in the layer
      */
@@ -43,7 +43,7 @@ cmd_group lcfs_cmd_group[] = {
 #ifndef __MUSL__
             "[-p] "
 #endif
-            "[-f] [-d] [-m] [-r] [-t] [-v]",
+            "[-f] [-d] [-m] [-r] [-t] [-v] [-i <count>] [-w]",
         "\tdevice     - device or file - image layers will be saved here\n"
         "\thost-mount - mount point on host\n"
         "\thost-mount - mount point propogated to the plugin\n"
@@ -57,7 +57,10 @@ cmd_group lcfs_cmd_group[] = {
         "\t-p         - enable profiling (optional)\n"
 #endif
         "\t-s         - swap layers when committed\n"
-        "\t-v         - enable verbose mode (optional)\n",
+        "\t-v         - enable verbose mode (optional)\n"
+        "\t-i <count> - number of idle threads kept for serving requests "
+        "(optional)\n"
+        "\t-w         - let kernel cache writes (optional)\n",
         3,
         cmd_daemon
     },
@@ -71,6 +74,14 @@ cmd_group lcfs_cmd_group[] = {
         2,
         cmd_ioctl
     },
+    {
+        "hot",
+        "Display hot files and layers",
+        "<mnt>",
+        "\tmnt     - mount point\n",
+        1,
+        cmd_ioctl
+    },
     {
         "commit",
         "Commit to disk",
@@ -97,6 +108,57 @@ cmd_group lcfs_cmd_group[] = {
         2,
         cmd_ioctl
     },
+    {
+        "receive",
+        "Receive a layer from a stream read from a layer send file",
+        "<mnt> <id> <file> [parent]",
+        "\tmnt                  - mount point\n"
+        "\tid                   - name of the new layer\n"
+        "\tfile                 - file with the stream of the layer\n"
+        "\tparent               - parent layer the layer was created on\n",
+        3,
+        cmd_ioctl
+    },
+    {
+        "extract",
+        "Create a layer from a tar archive, optionally compressed with gzip",
+        "<mnt> <id> <file> [parent]",
+        "\tmnt                  - mount point\n"
+        "\tid                   - name of the new layer\n"
+        "\tfile                 - tar archive with the files of the layer\n"
+        "\tparent               - parent layer (optional)\n",
+        3,
+        cmd_ioctl
+    },
+    {
+        "create",
+        "Create read-write layers on a parent layer in one request",
+        "<mnt> <parent> <id> [id...]",
+        "\tmnt                  - mount point\n"
+        "\tparent               - parent layer\n"
+        "\tid                   - names of the new layers\n",
+        3,
+        cmd_ioctl
+    },
+    {
+        "remove",
+        "Remove layers, space of those is freed in the background",
+        "<mnt> <id> [id...]",
+        "\tmnt                  - mount point\n"
+        "\tid                   - names of the layers\n",
+        2,
+        cmd_ioctl
+    },
+    {
+        "log",
+        "Enable/Disable intent log used by fsync in a layer",
+        "<mnt> <id> [enable|disable]",
+        "\tmnt                  - mount point\n"
+        "\tid                   - layer name\n"
+        "\t[enable|disable]     - enable/disable intent log\n",
+        3,
+        cmd_ioctl
+    },
     {
         "flush",
         "Release pages not in use",
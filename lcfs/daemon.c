@@ -20,7 +20,8 @@ usage(char *prog) {
 #ifndef __MUSL__
                        " [-p]"
 #endif
-                       " [-f] [-c] [-d] [-m] [-r] [-t] [-s] [-v]\n",
+                       " [-f] [-c] [-d] [-m] [-r] [-t] [-s] [-v]"
+                       " [-i <count>] [-w] [-D]\n",
                        prog);
     lc_syslog(LOG_ERR, "\tdevice        - device or file - image layers"
                        " will be saved here\n"
@@ -37,7 +38,13 @@ usage(char *prog) {
                     "\t-p            - enable profiling (optional)\n"
 #endif
                     "\t-s            - swap layers when committed\n"
-                    "\t-v            - enable verbose mode (optional)\n");
+                    "\t-v            - enable verbose mode (optional)\n"
+                    "\t-i <count>    - number of idle threads kept for"
+                                       " serving requests, with libfuse 3.2"
+                                       " or newer (optional)\n"
+                    "\t-w            - let kernel cache writes (optional)\n"
+                    "\t-D            - share blocks between identical files in"
+                                       " image layers (optional)\n");
 }
 
 /* Notify parent process completion */
@@ -104,7 +111,7 @@ lc_stopSession(struct gfs *gfs, struct fuse_session *se, enum lc_mountId id) {
 static void *
 lc_startThreads(void *data) {
     struct gfs *gfs = (struct gfs *)data;
-    pthread_t flusher, syncer;
+    pthread_t flusher, syncer, reclaimer;
     int err;
 
     /* Start a thread to flush dirty pages */
@@ -115,9 +122,19 @@ lc_startThreads(void *data) {
     err = pthread_create(&syncer, NULL, lc_syncer, gfs);
     assert(err == 0);
 
+    /* Start a thread to free resources of removed layers */
+    err = pthread_create(&reclaimer, NULL, lc_reclaimer, gfs);
+    assert(err == 0);
+
     /* Flush and purge pages in the background */
     lc_cleaner();
 
+    /* Wait for reclaimer to free removed layers and exit */
+    pthread_mutex_lock(&gfs->gfs_rlock);
+    pthread_cond_signal(&gfs->gfs_reclaimCond);
+    pthread_mutex_unlock(&gfs->gfs_rlock);
+    pthread_join(reclaimer, NULL);
+
     /* Wait for flusher and syncer to exit */
     pthread_cond_signal(&gfs->gfs_flusherCond);
     pthread_cond_signal(&gfs->gfs_syncerCond);
@@ -131,6 +148,9 @@ static void *
 lc_serve(void *data) {
     enum lc_mountId id = (enum lc_mountId)data, other;
     struct gfs *gfs = getfs();
+#if defined(FUSE3) && (FUSE_USE_VERSION >= 32)
+    struct fuse_loop_config config;
+#endif
     struct fuse_session *se;
     bool fcancel = false;
     pthread_t cleaner;
@@ -161,14 +181,23 @@ lc_serve(void *data) {
         }
     }
     if (!err) {
-        err = fuse_session_loop_mt(gfs->gfs_se[id]
 #ifdef FUSE3
-                                   , 0);
-    }
+
+        /* Let every thread read requests from a cloned fuse device, so that
+         * threads do not contend on a single queue.  Number of idle threads
+         * could be configured with libfuse 3.2 or newer only.
+         */
+#if FUSE_USE_VERSION >= 32
+        config.clone_fd = 1;
+        config.max_idle_threads = gfs->gfs_idleThreads;
+        err = fuse_session_loop_mt(gfs->gfs_se[id], &config);
 #else
-                                   );
-    }
+        err = fuse_session_loop_mt(gfs->gfs_se[id], 1);
 #endif
+#else
+        err = fuse_session_loop_mt(gfs->gfs_se[id]);
+#endif
+    }
 
 out:
     gfs->gfs_unmounting = true;
@@ -314,7 +343,8 @@ lc_start(struct gfs *gfs, char *device, enum lc_mountId id) {
 int
 lcfs_main(char *pgm, int argc, char *argv[]) {
     bool daemon = true, format = false, ftypes = false, swap = false;
-    int i, err = -1, waiter[2], fd, count;
+    bool writeback = false, dedup = false;
+    int i, err = -1, waiter[2], fd, count, idle = 0;
     char *arg[argc + 1], completed;
     struct fuse_session *se;
 #ifndef __MUSL__
@@ -407,6 +437,18 @@ lcfs_main(char *pgm, int argc, char *argv[]) {
             swap = true;
         } else if (!strcmp(argv[i], "-v")) {
             lc_verbose = true;
+        } else if (!strcmp(argv[i], "-w")) {
+            writeback = true;
+        } else if (!strcmp(argv[i], "-D")) {
+            dedup = true;
+        } else if (!strcmp(argv[i], "-i") && ((i + 1) < argc)) {
+            idle = atoi(argv[++i]);
+            if (idle <= 0) {
+                usage(pgm);
+                close(fd);
+                closelog();
+                exit(EINVAL);
+            }
         } else {
             if (!strcmp(argv[i], "-f") ||
                 !strcmp(argv[i], "-d")) {
@@ -462,6 +504,17 @@ lcfs_main(char *pgm, int argc, char *argv[]) {
     gfs->gfs_profiling = profiling;
 #endif
     gfs->gfs_swapLayersForCommit = swap;
+    gfs->gfs_writeback = writeback;
+    gfs->gfs_dedupEnabled = dedup;
+
+    /* Keep an idle thread per cpu for serving requests by default */
+    if (idle == 0) {
+        idle = sysconf(_SC_NPROCESSORS_ONLN);
+        if (idle < LC_FUSE_IDLE_THREADS) {
+            idle = LC_FUSE_IDLE_THREADS;
+        }
+    }
+    gfs->gfs_idleThreads = idle;
 
     /* Setup arguments for fuse mount */
     arg[0] = pgm;
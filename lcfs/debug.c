@@ -132,7 +132,6 @@ lc_validate(struct gfs *gfs) {
     struct super *super;
     int i;
 
-    assert(gfs->gfs_fextents == NULL);
     for (i = 0; i <= gfs->gfs_scount; i++) {
         fs = gfs->gfs_fs[i];
         if (fs) {
@@ -169,6 +168,11 @@ lc_validate(struct gfs *gfs) {
      * whole file system.
      */
     lc_copyExtents(gfs, rfs, gfs->gfs_extents, &extents, NULL);
+
+    /* Blocks of removed layers reclaimed while mounting are freed after the
+     * next checkpoint.
+     */
+    lc_copyExtents(gfs, rfs, gfs->gfs_fextents, &extents, NULL);
     assert(extents->ex_next == NULL);
     assert(lc_getExtentStart(extents) == LC_START_BLOCK);
     assert(lc_getExtentCount(extents) ==
@@ -0,0 +1,357 @@
+#include "includes.h"
+
+/* Multipliers used while mixing in words of data to the hash */
+#define LC_DEDUP_PRIME1     0x9E3779B185EBCA87ul
+#define LC_DEDUP_PRIME2     0xC2B2AE3D27D4EB4Ful
+
+/* Initialize the index of contents of files if enabled */
+void
+lc_dedupInit(struct gfs *gfs) {
+    size_t size = LC_DEDUP_HASH_SIZE * sizeof(struct dedup *);
+
+    pthread_mutex_init(&gfs->gfs_dlock, NULL);
+    if (gfs->gfs_dedupEnabled) {
+        gfs->gfs_dedup = lc_malloc(NULL, size, LC_MEMTYPE_GFS);
+        memset(gfs->gfs_dedup, 0, size);
+    }
+}
+
+/* Free the index of contents of files */
+void
+lc_dedupDeinit(struct gfs *gfs) {
+    assert(gfs->gfs_dedupLayers == NULL);
+    if (gfs->gfs_dedup) {
+        lc_free(NULL, gfs->gfs_dedup,
+                LC_DEDUP_HASH_SIZE * sizeof(struct dedup *), LC_MEMTYPE_GFS);
+        gfs->gfs_dedup = NULL;
+    }
+#ifdef LC_MUTEX_DESTROY
+    pthread_mutex_destroy(&gfs->gfs_dlock);
+#endif
+}
+
+/* Check if files of a layer could share blocks with files in other layers.
+ * Only image layers being populated are considered, as files in those are not
+ * modified after the layer is frozen.
+ */
+bool
+lc_dedupLayer(struct gfs *gfs, struct fs *fs) {
+    return gfs->gfs_dedup && !gfs->gfs_swapLayersForCommit &&
+           !fs->fs_frozen && !fs->fs_removed &&
+           (fs != lc_getGlobalFs(gfs)) &&
+           (fs->fs_readOnly || (fs->fs_super->sb_flags & LC_SUPER_INIT));
+}
+
+/* Mix in data to the hash */
+uint64_t
+lc_dedupHash(uint64_t hash, const char *data, size_t size) {
+    const uint64_t *word = (const uint64_t *)data;
+    size_t i, count = size / sizeof(uint64_t);
+    uint64_t last = 0;
+
+    for (i = 0; i < count; i++) {
+        hash ^= word[i] * LC_DEDUP_PRIME1;
+        hash = ((hash << 31) | (hash >> 33)) * LC_DEDUP_PRIME2;
+    }
+    if (size % sizeof(uint64_t)) {
+        memcpy(&last, &data[count * sizeof(uint64_t)],
+               size % sizeof(uint64_t));
+        hash ^= last * LC_DEDUP_PRIME1;
+        hash = ((hash << 31) | (hash >> 33)) * LC_DEDUP_PRIME2;
+    }
+    return hash;
+}
+
+/* Find an extent in a frozen layer with contents matching the hash and size.
+ * Returns the generation of the index, which is used for making sure the
+ * extent is still in use when it is shared.
+ */
+uint64_t
+lc_dedupLookup(struct gfs *gfs, uint64_t hash, uint64_t size,
+               uint64_t *count, uint64_t *gen) {
+    uint64_t block = LC_INVALID_BLOCK;
+    struct dedup *dedup;
+
+    pthread_mutex_lock(&gfs->gfs_dlock);
+    dedup = gfs->gfs_dedup[hash % LC_DEDUP_HASH_SIZE];
+    while (dedup) {
+        if ((dedup->dd_hash == hash) && (dedup->dd_size == size)) {
+            block = dedup->dd_block;
+            *count = dedup->dd_count;
+            break;
+        }
+        dedup = dedup->dd_next;
+    }
+    *gen = gfs->gfs_dedupGen;
+    pthread_mutex_unlock(&gfs->gfs_dlock);
+    return block;
+}
+
+/* Check if an extent overlaps with any extent in the sorted list */
+static bool
+lc_dedupOverlap(struct extent *extent, uint64_t block, uint64_t count) {
+    uint64_t estart;
+
+    while (extent) {
+        estart = lc_getExtentStart(extent);
+        if (estart >= (block + count)) {
+            break;
+        }
+        if ((estart + lc_getExtentCount(extent)) > block) {
+            return true;
+        }
+        extent = extent->ex_next;
+    }
+    return false;
+}
+
+/* Record an extent allocated in another layer being shared by a file in the
+ * layer.  Fails if files were dropped from the index after the extent was
+ * looked up, as the extent may not be in use anymore.
+ */
+bool
+lc_dedupShare(struct gfs *gfs, struct fs *fs, uint64_t block, uint64_t count,
+              uint64_t gen) {
+    pthread_mutex_lock(&gfs->gfs_dlock);
+    if (gen != gfs->gfs_dedupGen) {
+        pthread_mutex_unlock(&gfs->gfs_dlock);
+        return false;
+    }
+
+    /* Track layers sharing extents of other layers */
+    if (fs->fs_dextents == NULL) {
+        fs->fs_dnext = gfs->gfs_dedupLayers;
+        gfs->gfs_dedupLayers = fs;
+    }
+
+    /* Many files in the layer could be sharing the same extent */
+    if (!lc_dedupOverlap(fs->fs_dextents, block, count)) {
+        lc_addSpaceExtent(gfs, fs, &fs->fs_dextents, block, count, true);
+        fs->fs_dedupDirty = true;
+    }
+    gfs->gfs_dedupFiles++;
+    gfs->gfs_dedupBlocks += count;
+    pthread_mutex_unlock(&gfs->gfs_dlock);
+    lc_markExtentsDirty(fs);
+    return true;
+}
+
+/* Remember a file flushed to a single extent, so that the file could be
+ * indexed once the layer is frozen.
+ */
+void
+lc_dedupAdd(struct gfs *gfs, struct fs *fs, struct inode *inode,
+            uint64_t hash) {
+    struct dedup *dedup;
+
+    assert(inode->i_extentLength);
+    dedup = lc_malloc(fs, sizeof(struct dedup), LC_MEMTYPE_DEDUP);
+    dedup->dd_hash = hash;
+    dedup->dd_size = inode->i_size;
+    dedup->dd_block = inode->i_extentBlock;
+    dedup->dd_count = inode->i_extentLength;
+    dedup->dd_ino = inode->i_ino;
+    dedup->dd_fs = fs;
+    pthread_mutex_lock(&gfs->gfs_dlock);
+    dedup->dd_next = fs->fs_dpending;
+    fs->fs_dpending = dedup;
+    pthread_mutex_unlock(&gfs->gfs_dlock);
+}
+
+/* Add files flushed in a layer to the index after the layer is frozen and
+ * data of those written to disk.  Files modified after flushed are skipped.
+ */
+void
+lc_dedupPublish(struct gfs *gfs, struct fs *fs) {
+    struct dedup *dedup, *next, **prev;
+    struct inode *inode;
+    uint64_t count = 0;
+
+    assert(fs->fs_frozen);
+    pthread_mutex_lock(&gfs->gfs_dlock);
+    dedup = fs->fs_dpending;
+    fs->fs_dpending = NULL;
+    while (dedup) {
+        next = dedup->dd_next;
+        inode = lc_lookupInodeCache(fs, dedup->dd_ino, -1);
+        if (gfs->gfs_dedup && !fs->fs_removed && inode &&
+            !(inode->i_flags & LC_INODE_REMOVED) &&
+            (inode->i_size == dedup->dd_size) &&
+            (inode->i_extentBlock == dedup->dd_block) &&
+            (inode->i_extentLength == dedup->dd_count)) {
+            prev = &gfs->gfs_dedup[dedup->dd_hash % LC_DEDUP_HASH_SIZE];
+            dedup->dd_next = *prev;
+            *prev = dedup;
+            count++;
+        } else {
+            lc_free(fs, dedup, sizeof(struct dedup), LC_MEMTYPE_DEDUP);
+        }
+        dedup = next;
+    }
+    pthread_mutex_unlock(&gfs->gfs_dlock);
+    if (count) {
+        lc_printf("Indexed %ld files of layer %d\n", count, fs->fs_gindex);
+    }
+}
+
+/* Free entries of the layer in the index and extents shared by the layer */
+static void
+lc_dedupFreeLocked(struct gfs *gfs, struct fs *fs) {
+    struct dedup *dedup, **prev;
+    struct fs **fsp;
+    int i;
+
+    /* Drop files in the layer from the index */
+    for (i = 0; gfs->gfs_dedup && (i < LC_DEDUP_HASH_SIZE); i++) {
+        prev = &gfs->gfs_dedup[i];
+        dedup = *prev;
+        while (dedup) {
+            if (dedup->dd_fs == fs) {
+                *prev = dedup->dd_next;
+                lc_free(fs, dedup, sizeof(struct dedup), LC_MEMTYPE_DEDUP);
+            } else {
+                prev = &dedup->dd_next;
+            }
+            dedup = *prev;
+        }
+    }
+    gfs->gfs_dedupGen++;
+    while ((dedup = fs->fs_dpending)) {
+        fs->fs_dpending = dedup->dd_next;
+        lc_free(fs, dedup, sizeof(struct dedup), LC_MEMTYPE_DEDUP);
+    }
+
+    /* Stop tracking extents shared from other layers */
+    if (fs->fs_dextents) {
+        fsp = &gfs->gfs_dedupLayers;
+        while (*fsp != fs) {
+            fsp = &(*fsp)->fs_dnext;
+        }
+        *fsp = fs->fs_dnext;
+        fs->fs_dnext = NULL;
+        lc_blockFreeExtents(gfs, fs, fs->fs_dextents, 0);
+        fs->fs_dextents = NULL;
+    }
+    fs->fs_dedupDirty = false;
+}
+
+/* Free entries of a layer being unmounted */
+void
+lc_dedupFree(struct gfs *gfs, struct fs *fs) {
+    pthread_mutex_lock(&gfs->gfs_dlock);
+    lc_dedupFreeLocked(gfs, fs);
+    pthread_mutex_unlock(&gfs->gfs_dlock);
+}
+
+/* Move a portion of an extent shared by a layer from the layer being removed
+ * to that layer.  Returns false if no portion of the extent is allocated in
+ * the layer being removed.
+ */
+static bool
+lc_dedupMove(struct gfs *gfs, struct fs *fs, struct fs *dfs,
+             uint64_t block, uint64_t count) {
+    uint64_t start, end = block + count, estart, eend, moved;
+    struct extent *extent;
+
+    /* Find the first extent allocated in the layer overlapping the range */
+    pthread_mutex_lock(&fs->fs_alock);
+    extent = fs->fs_aextents;
+    while (extent) {
+        estart = lc_getExtentStart(extent);
+        if (estart >= end) {
+            extent = NULL;
+            break;
+        }
+        eend = estart + lc_getExtentCount(extent);
+        if (eend > block) {
+            break;
+        }
+        extent = extent->ex_next;
+    }
+    if (extent == NULL) {
+        pthread_mutex_unlock(&fs->fs_alock);
+        return false;
+    }
+    start = (estart > block) ? estart : block;
+    count = ((eend < end) ? eend : end) - start;
+    moved = lc_removeExtent(fs, &fs->fs_aextents, start, count);
+    assert(moved == count);
+    fs->fs_blocks -= moved;
+    pthread_mutex_unlock(&fs->fs_alock);
+
+    /* The layer sharing the extent owns it from now on */
+    pthread_mutex_lock(&dfs->fs_alock);
+    lc_addSpaceExtent(gfs, dfs, &dfs->fs_aextents, start, moved, true);
+    dfs->fs_blocks += moved;
+    pthread_mutex_unlock(&dfs->fs_alock);
+    moved = lc_removeExtent(dfs, &dfs->fs_dextents, start, count);
+    assert(moved == count);
+    dfs->fs_dedupDirty = true;
+    lc_markExtentsDirty(dfs);
+    lc_printf("Moved blocks %ld-%ld shared with layer %d from layer %d\n",
+              start, start + count - 1, dfs->fs_gindex, fs->fs_gindex);
+    return true;
+}
+
+/* Hand over extents allocated in a layer being removed to other layers
+ * sharing those, before blocks allocated in the layer are freed.
+ */
+void
+lc_dedupRelease(struct gfs *gfs, struct fs *fs) {
+    struct fs *dfs, *next, **prev;
+    struct extent *extent;
+    bool locked, moved;
+
+    assert(fs->fs_removed);
+
+retry:
+    pthread_mutex_lock(&gfs->gfs_dlock);
+
+    /* Take files of this layer off of the index first, so that blocks of
+     * those are not shared anymore.
+     */
+    lc_dedupFreeLocked(gfs, fs);
+    prev = &gfs->gfs_dedupLayers;
+    dfs = gfs->gfs_dedupLayers;
+    while (dfs) {
+        next = dfs->fs_dnext;
+        locked = false;
+        extent = dfs->fs_dextents;
+        while (extent) {
+            if (!locked && lc_dedupOverlap(fs->fs_aextents,
+                                           lc_getExtentStart(extent),
+                                           lc_getExtentCount(extent))) {
+
+                /* Layers may be locked while waiting for the lock held here,
+                 * so just retry if the layer cannot be locked right now.
+                 */
+                if (lc_tryLock(dfs, false)) {
+                    pthread_mutex_unlock(&gfs->gfs_dlock);
+                    sched_yield();
+                    goto retry;
+                }
+                locked = true;
+            }
+            moved = locked && lc_dedupMove(gfs, fs, dfs,
+                                           lc_getExtentStart(extent),
+                                           lc_getExtentCount(extent));
+
+            /* List is modified when an extent is moved, so start over */
+            extent = moved ? dfs->fs_dextents : extent->ex_next;
+        }
+        if (locked) {
+            lc_unlock(dfs);
+        }
+
+        /* Take the layer off the list if it is not sharing extents anymore */
+        if (dfs->fs_dextents == NULL) {
+            *prev = next;
+            dfs->fs_dnext = NULL;
+        } else {
+            prev = &dfs->fs_dnext;
+        }
+        dfs = next;
+    }
+    pthread_mutex_unlock(&gfs->gfs_dlock);
+}
+
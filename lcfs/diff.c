@@ -10,6 +10,78 @@ lc_changeInode(ino_t ino, ino_t lastIno) {
     return (ino > lastIno) ? LC_ADDED : LC_MODIFIED;
 }
 
+/* Check if a file could be linked from many directories.  Hardlinks are not
+ * tracked after remount, so records are rebuilt for files with many links.
+ */
+static inline bool
+lc_inodeMlinks(struct fs *fs, struct inode *inode) {
+    return (inode->i_flags & LC_INODE_MLINKS) ||
+           (fs->fs_rfs->fs_restarted && (inode->i_nlink > 1));
+}
+
+/* Check if an inode is added to the change list being built */
+static bool
+lc_inodeTracked(struct fs *fs, ino_t ino) {
+    uint64_t i, mask = fs->fs_tsize - 1;
+
+    if (fs->fs_tracked == NULL) {
+        return false;
+    }
+    for (i = ino & mask; fs->fs_tracked[i]; i = (i + 1) & mask) {
+        if (fs->fs_tracked[i] == ino) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Track an inode added to the change list being built.  Inodes are tracked
+ * in a table private to the diff instead of flagging those, as the layer is
+ * locked shared while the change list is built.
+ */
+static void
+lc_trackInode(struct fs *fs, ino_t ino) {
+    uint64_t i, mask, size = fs->fs_tsize;
+    ino_t *tracked = fs->fs_tracked;
+
+    /* Double the size of the table once half full */
+    if ((fs->fs_tcount * 2) >= size) {
+        fs->fs_tsize = size ? (size * 2) : LC_TRACK_MIN;
+        fs->fs_tracked = lc_malloc(fs, fs->fs_tsize * sizeof(ino_t),
+                                   LC_MEMTYPE_CTRACK);
+        memset(fs->fs_tracked, 0, fs->fs_tsize * sizeof(ino_t));
+        fs->fs_tcount = 0;
+        for (i = 0; i < size; i++) {
+            if (tracked[i]) {
+                lc_trackInode(fs, tracked[i]);
+            }
+        }
+        if (tracked) {
+            lc_free(fs, tracked, size * sizeof(ino_t), LC_MEMTYPE_CTRACK);
+        }
+    }
+    mask = fs->fs_tsize - 1;
+    for (i = ino & mask; fs->fs_tracked[i]; i = (i + 1) & mask) {
+        if (fs->fs_tracked[i] == ino) {
+            return;
+        }
+    }
+    fs->fs_tracked[i] = ino;
+    fs->fs_tcount++;
+}
+
+/* Free the table of inodes tracked while building a change list */
+static void
+lc_freeTracked(struct fs *fs) {
+    if (fs->fs_tracked) {
+        lc_free(fs, fs->fs_tracked, fs->fs_tsize * sizeof(ino_t),
+                LC_MEMTYPE_CTRACK);
+        fs->fs_tracked = NULL;
+        fs->fs_tcount = 0;
+        fs->fs_tsize = 0;
+    }
+}
+
 /* Add a file to the change list */
 static void
 lc_addFile(struct fs *fs, struct cdir *cdir, ino_t ino, char *name,
@@ -29,7 +101,12 @@ lc_addFile(struct fs *fs, struct cdir *cdir, ino_t ino, char *name,
     if (cfile && (cfile->cf_len == len) &&
         !strncmp(cfile->cf_name, name, len)) {
         if ((cfile->cf_type == LC_REMOVED) && (ctype == LC_ADDED)) {
+
+            /* File was removed and created again, so attributes of the new
+             * file are reported.
+             */
             cfile->cf_type = LC_MODIFIED;
+            cfile->cf_ino = ino;
         } else {
             assert((cfile->cf_type == LC_ADDED) ||
                    (cfile->cf_type == LC_MODIFIED));
@@ -38,11 +115,15 @@ lc_addFile(struct fs *fs, struct cdir *cdir, ino_t ino, char *name,
         return;
     }
 
-    /* Create a new entry and add at the end of the list */
+    /* Create a new entry and add at the end of the list.  Name is copied as
+     * the directory could be modified while the diff is in progress.
+     */
     cfile = lc_malloc(fs, sizeof(struct cfile), LC_MEMTYPE_CFILE);
     cfile->cf_type = ctype;
-    cfile->cf_name = name;
+    cfile->cf_name = lc_malloc(fs, len, LC_MEMTYPE_PATH);
+    memcpy(cfile->cf_name, name, len);
     cfile->cf_len = len;
+    cfile->cf_ino = ino;
     cfile->cf_next = NULL;
     *prev = cfile;
 }
@@ -318,6 +399,7 @@ lc_addDirectoryPath(struct fs *fs, ino_t ino, ino_t parent, struct cdir *new,
                 assert(new->cd_type == LC_ADDED);
                 assert(cfile->cf_type == LC_REMOVED);
                 *prev = cfile->cf_next;
+                lc_free(fs, cfile->cf_name, len, LC_MEMTYPE_PATH);
                 lc_free(fs, cfile, sizeof(struct cfile), LC_MEMTYPE_CFILE);
                 new->cd_type = LC_MODIFIED;
             }
@@ -335,7 +417,9 @@ lc_addDirectoryPath(struct fs *fs, ino_t ino, ino_t parent, struct cdir *new,
     }
 }
 
-/* Add a directory to the change list */
+/* Add a directory to the change list.  Directory is locked here while its
+ * entries are processed, after adding its parent directories.
+ */
 static struct cdir *
 lc_addDirectory(struct fs *fs, struct inode *dir, char *name, uint16_t len,
                 ino_t lastIno, enum lc_changeType ctype) {
@@ -363,16 +447,16 @@ retry:
         new = cdir;
         goto out;
     }
-    assert(!(dir->i_flags & LC_INODE_CTRACKED));
+    assert(!lc_inodeTracked(fs, ino));
 
     /* Add all directories in the path */
     if ((ino != parent) && path) {
-        pdir = lc_getInode(fs, parent, NULL, false, false);
-        if (!(pdir->i_flags & LC_INODE_CTRACKED)) {
+        if (!lc_inodeTracked(fs, parent)) {
+            pdir = lc_getInode(fs, parent, NULL, false, false);
+            lc_inodeUnlock(pdir);
             pcdir = lc_addDirectory(fs, pdir, NULL, 0, lastIno,
                                     lc_changeInode(pdir->i_ino, lastIno));
         }
-        lc_inodeUnlock(pdir);
         path = false;
         goto retry;
     }
@@ -387,50 +471,94 @@ retry:
     lc_addDirectoryPath(fs, ino, parent, new, pcdir, name, len);
 
 out:
-    if ((dir->i_fs == fs) && !(dir->i_flags & LC_INODE_CTRACKED)) {
-        dir->i_flags |= LC_INODE_CTRACKED;
+    if ((dir->i_fs == fs) && !lc_inodeTracked(fs, ino)) {
+        lc_trackInode(fs, ino);
         if (ino == parent) {
             pcdir = new;
         }
 
         /* Add the complete directory tree */
+        lc_inodeLock(dir, false);
         lc_addDirectoryTree(fs, dir, new, pcdir, lastIno);
+        lc_inodeUnlock(dir);
     }
     return new;
 }
 
+/* Add links to the inode from the directory to the change list.  Names are
+ * copied with the directory locked, as entries could be removed while the
+ * diff is in progress.
+ */
+static void
+lc_addLinks(struct fs *fs, struct cdir *cdir, ino_t parent, ino_t ino,
+            uint32_t count, ino_t lastIno) {
+    struct inode *dir = lc_getInode(fs, parent, NULL, false, false);
+    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
+    int i, max = hashed ? LC_DIRCACHE_SIZE : 1;
+    struct dirent *dirent;
+
+    for (i = 0; (i < max) && count; i++) {
+        dirent = hashed ? dir->i_hdirent[i] : dir->i_dirent;
+        while (dirent && count) {
+            if (dirent->di_ino == ino) {
+                lc_addFile(fs, cdir, ino, dirent->di_name, dirent->di_size,
+                           lc_changeInode(ino, lastIno));
+                count--;
+            }
+            dirent = dirent->di_next;
+        }
+    }
+    lc_inodeUnlock(dir);
+}
+
 /* Add an inode to the change list */
 static void
 lc_addModifiedInode(struct fs *fs, struct inode *inode, ino_t lastIno) {
-    ino_t ino = inode->i_ino, parent = LC_INVALID_INODE;
-    uint32_t nlink = inode->i_nlink, plink = 0;
-    struct hldata *hldata = fs->fs_hlinks;
-    struct dirent *dirent;
+    ino_t ino = inode->i_ino, parent = LC_INVALID_INODE, iparent;
+    uint32_t nlink, plink = 0, records = 0, i;
+    struct hldata *hldata;
     struct inode *dir;
     struct cdir *cdir;
-    int hash = 0;
 
-    assert(!(inode->i_flags & LC_INODE_CTRACKED));
+    assert(!lc_inodeTracked(fs, ino));
     assert(inode->i_fs == fs);
 
+    /* Links could be added or removed while the diff is in progress */
+    lc_inodeLock(inode, false);
+    nlink = inode->i_nlink;
+    iparent = inode->i_parent;
+    lc_inodeUnlock(inode);
+
     /* Add each link of the inode to the change list */
     while (nlink) {
-        if (!(inode->i_flags & LC_INODE_MLINKS)) {
-            parent = inode->i_parent;
+        if (!lc_inodeMlinks(fs, inode)) {
+            parent = iparent;
             plink = 1;
         } else {
 
             /* Find next directory with a link to this inode */
-            while (hldata && (hldata->hl_ino != ino)) {
+            pthread_mutex_lock(&fs->fs_hlock);
+            hldata = fs->fs_hlinks;
+            i = 0;
+            while (hldata &&
+                   ((hldata->hl_ino != ino) || (i++ != records))) {
                 hldata = hldata->hl_next;
             }
-            assert(hldata->hl_nlink > 0);
-            parent = hldata->hl_parent;
+            if (hldata) {
+                assert(hldata->hl_nlink > 0);
+                parent = hldata->hl_parent;
+                plink = hldata->hl_nlink;
+            }
+            pthread_mutex_unlock(&fs->fs_hlock);
+
+            /* Links could be removed while the diff is in progress */
+            if (hldata == NULL) {
+                break;
+            }
             if (parent == LC_ROOT_INODE) {
                 parent = fs->fs_root;
             }
-            plink = hldata->hl_nlink;
-            hldata = hldata->hl_next;
+            records++;
         }
         if ((inode->i_fs != fs) && (inode->i_fs->fs_root == parent)) {
             parent = fs->fs_root;
@@ -445,26 +573,21 @@ lc_addModifiedInode(struct fs *fs, struct inode *inode, ino_t lastIno) {
         /* If an entry for the parent doesn't exist, add one */
         if (cdir == NULL) {
             dir = lc_getInode(fs, parent, NULL, false, false);
+            lc_inodeUnlock(dir);
             assert(dir->i_ino < lastIno);
             cdir = lc_addDirectory(fs, dir, NULL, 0, lastIno, LC_MODIFIED);
-            lc_inodeUnlock(dir);
         }
         assert(cdir->cd_ino == parent);
-        assert(!(inode->i_flags & LC_INODE_CTRACKED));
-        assert(plink <= nlink);
+        assert(!lc_inodeTracked(fs, ino));
+        if (plink > nlink) {
+            plink = nlink;
+        }
         nlink -= plink;
-        dirent = NULL;
-        hash = 0;
 
         /* Add each link from the directory to the change list */
-        while (plink) {
-            dirent = lc_getDirent(fs, parent, ino, &hash, dirent);
-            lc_addFile(fs, cdir, ino, dirent->di_name, dirent->di_size,
-                       lc_changeInode(ino, lastIno));
-            plink--;
-        }
+        lc_addLinks(fs, cdir, parent, ino, plink, lastIno);
     }
-    inode->i_flags |= LC_INODE_CTRACKED;
+    lc_trackInode(fs, ino);
 }
 
 /* Add a record to the change list */
@@ -476,30 +599,76 @@ lc_addName(struct fs *fs, struct cdir *cdir, ino_t ino, char *name,
 
     if (S_ISDIR(mode) && (ctype != LC_REMOVED)) {
         dir = lc_getInode(fs, ino, NULL, false, false);
-        if (!(dir->i_flags & LC_INODE_CTRACKED) || (ctype == LC_ADDED)) {
+        lc_inodeUnlock(dir);
+        if (!lc_inodeTracked(fs, ino) || (ctype == LC_ADDED)) {
             lc_addDirectory(fs, dir, name, len, lastIno, ctype);
         }
-        lc_inodeUnlock(dir);
     } else {
         lc_addFile(fs, cdir, ino, name, len, ctype);
 
-        /* Flag the inode as tracked in change list */
+        /* Track the inode as added to the change list */
         if (ctype != LC_REMOVED) {
             inode = lc_lookupInodeCache(fs, ino, -1);
-            if (inode && ((ino > lastIno) ||
-                          !(inode->i_flags & LC_INODE_MLINKS))) {
+            if (inode && ((ino > lastIno) || !lc_inodeMlinks(fs, inode))) {
                 assert(inode->i_fs == fs);
-                inode->i_flags |= LC_INODE_CTRACKED;
+                lc_trackInode(fs, ino);
             }
         }
     }
 }
 
-/* Respond with diff data */
-static void
-lc_replyDiff(fuse_req_t req, struct fs *fs) {
-    char buf[LC_BLOCK_SIZE];
+/* Add a record for a change to the buffer, with attributes of the file if
+ * requested.  Returns size of the record, or 0 if it does not fit.
+ */
+static int
+lc_addChange(struct fs *fs, char *buf, int size, int max, bool attrs,
+             enum lc_changeType ctype, ino_t ino, char *path, uint16_t len) {
+    struct pchange2 *pchange2;
     struct pchange *pchange;
+    struct inode *inode;
+    int plen;
+
+    plen = len + (attrs ? sizeof(struct pchange2) : sizeof(struct pchange));
+    if ((size + plen) >= max) {
+        return 0;
+    }
+    if (!attrs) {
+        pchange = (struct pchange *)&buf[size];
+        pchange->ch_type = ctype;
+        pchange->ch_len = len;
+        memcpy(&pchange->ch_path, path, len);
+        return plen;
+    }
+    pchange2 = (struct pchange2 *)&buf[size];
+    memset(pchange2, 0, sizeof(struct pchange2));
+    pchange2->ch_type = ctype;
+    pchange2->ch_len = len;
+    memcpy(&pchange2->ch_path, path, len);
+    if (ctype != LC_REMOVED) {
+        inode = lc_getInode(fs, ino, NULL, false, false);
+        if (inode) {
+            pchange2->ch_mode = inode->i_mode;
+            pchange2->ch_uid = inode->i_dinode.di_uid;
+            pchange2->ch_gid = inode->i_dinode.di_gid;
+            pchange2->ch_size = inode->i_size;
+            pchange2->ch_mtime = inode->i_dinode.di_mtime.tv_sec;
+            pchange2->ch_mtimensec = inode->i_dinode.di_mtime.tv_nsec;
+            pchange2->ch_ctime = inode->i_dinode.di_ctime.tv_sec;
+            pchange2->ch_ctimensec = inode->i_dinode.di_ctime.tv_nsec;
+            if (inode->i_xattrData) {
+                pchange2->ch_flags |= LC_CHANGE_XATTR;
+            }
+            lc_inodeUnlock(inode);
+        }
+    }
+    return plen;
+}
+
+/* Fill up the buffer with records from the change list, freeing records
+ * added.  Returns size of the records added.
+ */
+static int
+lc_fillDiff(struct fs *fs, char *buf, int max, bool attrs, uint32_t *count) {
     struct cfile *cfile;
     int size = 0, plen;
     struct cdir *cdir;
@@ -512,30 +681,27 @@ lc_replyDiff(fuse_req_t req, struct fs *fs) {
 
         /* Add a record for the new or modified directory */
         if ((cdir->cd_type != LC_NONE) || cdir->cd_file) {
-            plen = cdir->cd_len + sizeof(struct pchange);
-            if ((size + plen) >= LC_BLOCK_SIZE) {
+            plen = lc_addChange(fs, buf, size, max, attrs, cdir->cd_type,
+                                cdir->cd_ino, cdir->cd_path, cdir->cd_len);
+            if (plen == 0) {
                 break;
             }
-            pchange = (struct pchange *)&buf[size];
-            pchange->ch_type = cdir->cd_type;
-            pchange->ch_len = cdir->cd_len;
-            memcpy(&pchange->ch_path, cdir->cd_path, cdir->cd_len);
             cdir->cd_type = LC_NONE;
             size += plen;
+            (*count)++;
         }
 
         /* Add records for changes in the directory */
         while ((cfile = cdir->cd_file)) {
-            plen = cfile->cf_len + sizeof(struct pchange);
-            if ((size + plen) >= LC_BLOCK_SIZE) {
-                goto out;
+            plen = lc_addChange(fs, buf, size, max, attrs, cfile->cf_type,
+                                cfile->cf_ino, cfile->cf_name, cfile->cf_len);
+            if (plen == 0) {
+                return size;
             }
-            pchange = (struct pchange *)&buf[size];
-            pchange->ch_type = cfile->cf_type;
-            pchange->ch_len = cfile->cf_len;
-            memcpy(&pchange->ch_path, cfile->cf_name, cfile->cf_len);
             size += plen;
+            (*count)++;
             cdir->cd_file = cfile->cf_next;
+            lc_free(fs, cfile->cf_name, cfile->cf_len, LC_MEMTYPE_PATH);
             lc_free(fs, cfile, sizeof(struct cfile), LC_MEMTYPE_CFILE);
         }
         if (cdir->cd_path) {
@@ -551,8 +717,24 @@ lc_replyDiff(fuse_req_t req, struct fs *fs) {
             break;
         }
     }
+    return size;
+}
 
-out:
+/* Respond with diff data */
+static void
+lc_replyDiff(fuse_req_t req, struct fs *fs) {
+    char buf[LC_BLOCK_SIZE];
+    uint32_t count = 0;
+    int size;
+
+    size = lc_fillDiff(fs, buf, LC_BLOCK_SIZE, false, &count);
+
+    /* A record too large for the buffer cannot be returned ever */
+    if ((size == 0) && fs->fs_changes) {
+        lc_freeChangeList(fs);
+        fuse_reply_err(req, ERANGE);
+        return;
+    }
     if (size != LC_BLOCK_SIZE) {
         memset(&buf[size], 0, LC_BLOCK_SIZE - size);
     }
@@ -562,6 +744,70 @@ out:
     }
 }
 
+/* Free the last batch of changes returned */
+static void
+lc_freeDiffBatch(struct fs *fs) {
+    if (fs->fs_diffBuf) {
+        lc_free(fs, fs->fs_diffBuf, fs->fs_diffSize, LC_MEMTYPE_DIFF);
+        fs->fs_diffBuf = NULL;
+        fs->fs_diffSize = 0;
+    }
+}
+
+/* Respond with a batch of changes along with attributes of changed files.
+ * The batch is kept until the next one is requested, in case the same batch
+ * is requested again.
+ */
+static void
+lc_replyDiffBatch(fuse_req_t req, struct fs *fs, size_t size,
+                  uint64_t cursor) {
+    struct pbatch *pbatch = (struct pbatch *)fs->fs_diffBuf;
+    char *buf;
+
+    /* Return the last batch again if requested */
+    if (pbatch && (pbatch->pb_cursor != cursor) &&
+        ((pbatch->pb_cursor - pbatch->pb_count) == cursor)) {
+        fuse_reply_buf(req, fs->fs_diffBuf,
+                       sizeof(struct pbatch) + pbatch->pb_size);
+        return;
+    }
+    if (cursor != fs->fs_diffCursor) {
+        lc_reportError(__func__, __LINE__, fs->fs_root, EINVAL);
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    lc_freeDiffBatch(fs);
+    if (size > LC_DIFF_BATCH_MAX) {
+        size = LC_DIFF_BATCH_MAX;
+    }
+    buf = lc_malloc(fs, size, LC_MEMTYPE_DIFF);
+    pbatch = (struct pbatch *)buf;
+    pbatch->pb_count = 0;
+    pbatch->pb_size = lc_fillDiff(fs, &buf[sizeof(struct pbatch)],
+                                  size - sizeof(struct pbatch), true,
+                                  &pbatch->pb_count);
+
+    /* Changes are kept if the next record is too large for the buffer, so
+     * that the batch could be requested again with a larger buffer.
+     */
+    if ((pbatch->pb_count == 0) && fs->fs_changes) {
+        lc_free(fs, buf, size, LC_MEMTYPE_DIFF);
+        fuse_reply_err(req, ERANGE);
+        return;
+    }
+    fs->fs_diffCursor += pbatch->pb_count;
+    pbatch->pb_cursor = fs->fs_diffCursor;
+    fuse_reply_buf(req, buf, sizeof(struct pbatch) + pbatch->pb_size);
+    if (pbatch->pb_count) {
+        fs->fs_diffBuf = buf;
+        fs->fs_diffSize = size;
+    } else {
+        lc_free(fs, buf, size, LC_MEMTYPE_DIFF);
+        lc_freeChangeList(fs);
+        lc_printf("Diff done on layer %d\n", fs->fs_gindex);
+    }
+}
+
 /* Free the list created for tracking changes in the layer */
 void
 lc_freeChangeList(struct fs *fs) {
@@ -573,6 +819,7 @@ lc_freeChangeList(struct fs *fs) {
         while (cfile) {
             file = cfile;
             cfile = cfile->cf_next;
+            lc_free(fs, file->cf_name, file->cf_len, LC_MEMTYPE_PATH);
             lc_free(fs, file, sizeof(struct cfile), LC_MEMTYPE_CFILE);
         }
         if (cdir->cd_path) {
@@ -583,17 +830,454 @@ lc_freeChangeList(struct fs *fs) {
         lc_free(fs, dir, sizeof(struct cdir), LC_MEMTYPE_CDIR);
     }
     fs->fs_changes = NULL;
+    lc_freeDiffBatch(fs);
+    fs->fs_diffCursor = 0;
+    fs->fs_diffBase = 0;
 }
 
-/* Produce diff between a layer and its parent layer */
+/* Record an inode added to or modified in a layer, so that changes in the
+ * layer could be found without scanning the whole inode cache.  Journal is
+ * dropped if it grows too big, and the inode cache is scanned for changes
+ * from then on.
+ */
+void
+lc_journalAdd(struct fs *fs, struct inode *inode) {
+    uint64_t size;
+    ino_t *journal;
+
+    inode->i_flags |= LC_INODE_JOURNAL;
+
+    /* Journal is not kept for layers frozen when mounted */
+    if (fs->fs_jfull || (fs->fs_frozen && (fs->fs_journal == NULL))) {
+        return;
+    }
+    pthread_mutex_lock(&fs->fs_jlock);
+    if (fs->fs_jfull) {
+        pthread_mutex_unlock(&fs->fs_jlock);
+        return;
+    }
+    if (fs->fs_jcount == fs->fs_jsize) {
+
+        /* Journal is freed after any diff in progress is done with it */
+        if (fs->fs_jsize == LC_JOURNAL_MAX) {
+            lc_printf("Journal of layer %d full, diff will scan inode cache\n",
+                      fs->fs_gindex);
+            fs->fs_jfull = true;
+            pthread_mutex_unlock(&fs->fs_jlock);
+            return;
+        }
+        size = fs->fs_jsize ? (fs->fs_jsize * 2) : LC_JOURNAL_MIN;
+        journal = lc_malloc(fs, size * sizeof(ino_t), LC_MEMTYPE_JOURNAL);
+        if (fs->fs_journal) {
+            memcpy(journal, fs->fs_journal, fs->fs_jcount * sizeof(ino_t));
+            lc_free(fs, fs->fs_journal, fs->fs_jsize * sizeof(ino_t),
+                    LC_MEMTYPE_JOURNAL);
+        }
+        fs->fs_journal = journal;
+        fs->fs_jsize = size;
+    }
+    fs->fs_journal[fs->fs_jcount++] = inode->i_ino;
+    pthread_mutex_unlock(&fs->fs_jlock);
+}
+
+/* Free the journal of inodes of a layer */
+void
+lc_journalFree(struct fs *fs) {
+    if (fs->fs_journal) {
+        lc_free(fs, fs->fs_journal, fs->fs_jsize * sizeof(ino_t),
+                LC_MEMTYPE_JOURNAL);
+        fs->fs_journal = NULL;
+        fs->fs_jcount = 0;
+        fs->fs_jsize = 0;
+    }
+}
+
+/* Return the next inode in the layer, from the journal if requested,
+ * otherwise from the inode cache.
+ */
+static struct inode *
+lc_nextChangedInode(struct fs *fs, struct inode *inode, uint64_t *index,
+                    bool journal) {
+    ino_t ino;
+
+    if (journal) {
+        for (;;) {
+            pthread_mutex_lock(&fs->fs_jlock);
+            ino = (*index < fs->fs_jcount) ? fs->fs_journal[(*index)++] :
+                                             LC_INVALID_INODE;
+            pthread_mutex_unlock(&fs->fs_jlock);
+            if (ino == LC_INVALID_INODE) {
+                return NULL;
+            }
+            inode = lc_lookupInodeCache(fs, ino, -1);
+            if (inode) {
+                return inode;
+            }
+        }
+    }
+    if (inode && inode->i_cnext) {
+        return inode->i_cnext;
+    }
+    while (*index < fs->fs_icacheSize) {
+        inode = fs->fs_icache[(*index)++].ic_head;
+        if (inode) {
+            return inode;
+        }
+    }
+    return NULL;
+}
+
+/* Build the list of changes in a layer compared to its parent layer, with
+ * the layer locked shared and diffs of the layer serialized.
+ */
+int
+lc_buildChangeList(struct fs *fs) {
+    struct inode *inode;
+    uint64_t index, count;
+    bool journal;
+    ino_t lastIno;
+    int err;
+
+    lc_printf("Starting diff on layer %d\n", fs->fs_gindex);
+
+    /* Hardlinks are not tracked after remount, so find those now */
+    if (fs->fs_rfs->fs_restarted) {
+        err = lc_rebuildHlinks(fs);
+        if (err) {
+            return err;
+        }
+    }
+    lc_lock(fs->fs_parent, false);
+    lastIno = fs->fs_parent->fs_super->sb_lastInode;
+    pthread_mutex_lock(&fs->fs_jlock);
+    journal = fs->fs_journal && !fs->fs_jfull;
+    pthread_mutex_unlock(&fs->fs_jlock);
+
+    /* Add the root inode to the change list first */
+    lc_addDirectory(fs, fs->fs_rootInode, NULL, 0, lastIno, LC_MODIFIED);
+
+    /* Look for modified directories in this layer */
+    index = 0;
+    inode = NULL;
+    while ((inode = lc_nextChangedInode(fs, inode, &index, journal))) {
+
+        /* Skip removed directories and those already processed */
+        if (S_ISDIR(inode->i_mode) &&
+            !(inode->i_flags & LC_INODE_REMOVED) &&
+            !lc_inodeTracked(fs, inode->i_ino)) {
+            lc_addDirectory(fs, inode, NULL, 0, lastIno,
+                            lc_changeInode(inode->i_ino, lastIno));
+        }
+    }
+
+    /* Look for modified files in this layer */
+    index = 0;
+    inode = NULL;
+    while ((inode = lc_nextChangedInode(fs, inode, &index, journal))) {
+
+        /* Skip removed files and those already processed */
+        if (!S_ISDIR(inode->i_mode) &&
+            !(inode->i_flags & LC_INODE_REMOVED) &&
+            !lc_inodeTracked(fs, inode->i_ino)) {
+            lc_addModifiedInode(fs, inode, lastIno);
+        }
+    }
+    lc_unlock(fs->fs_parent);
+    lc_freeTracked(fs);
+    if (fs->fs_rfs->fs_restarted) {
+        lc_freeHlinks(fs);
+    }
+
+    /* Compact the journal, dropping removed inodes */
+    pthread_mutex_lock(&fs->fs_jlock);
+    if (fs->fs_jfull) {
+        lc_journalFree(fs);
+    } else if (fs->fs_journal) {
+        count = 0;
+        for (index = 0; index < fs->fs_jcount; index++) {
+            inode = lc_lookupInodeCache(fs, fs->fs_journal[index], -1);
+            if (inode && !(inode->i_flags & LC_INODE_REMOVED)) {
+                fs->fs_journal[count++] = fs->fs_journal[index];
+            }
+        }
+        fs->fs_jcount = count;
+    }
+    pthread_mutex_unlock(&fs->fs_jlock);
+    return 0;
+}
+
+/* Find the directory with the path in a layer, returned locked */
+static struct inode *
+lc_rangeLookup(struct fs *fs, char *path, uint16_t len) {
+    struct inode *dir = fs->fs_rootInode, *inode;
+    struct dirent *dirent;
+    uint16_t i = 1, j;
+
+    assert(path[0] == '/');
+    lc_inodeLock(dir, false);
+    while (i < len) {
+        j = i;
+        while ((j < len) && (path[j] != '/')) {
+            j++;
+        }
+        dirent = lc_dirFindEntry(dir, &path[i], j - i);
+        inode = (dirent && S_ISDIR(dirent->di_mode)) ?
+                lc_getInode(fs, dirent->di_ino, NULL, false, false) : NULL;
+        lc_inodeUnlock(dir);
+        if (inode == NULL) {
+            return NULL;
+        }
+        dir = inode;
+        i = j + 1;
+    }
+    return dir;
+}
+
+/* Find the record for a directory in a merged change list, adding one along
+ * with records for its parent directories if needed.
+ */
+static struct cdir *
+lc_rangeDirectory(struct fs *fs, struct cdir *changes, char *path,
+                  uint16_t len) {
+    struct cdir *cdir = changes, *pcdir;
+    uint16_t plen;
+
+    while (cdir && ((cdir->cd_len != len) ||
+                    memcmp(cdir->cd_path, path, len))) {
+        cdir = cdir->cd_next;
+    }
+    if (cdir) {
+        return cdir;
+    }
+
+    /* Add the directory after the parent, which is added if needed */
+    assert(len > 1);
+    plen = len - 1;
+    while (plen && (path[plen] != '/')) {
+        plen--;
+    }
+    pcdir = lc_rangeDirectory(fs, changes, path, plen ? plen : 1);
+    cdir = lc_malloc(fs, sizeof(struct cdir), LC_MEMTYPE_CDIR);
+    cdir->cd_ino = 0;
+    cdir->cd_type = LC_NONE;
+    cdir->cd_len = len;
+    cdir->cd_path = lc_malloc(fs, len, LC_MEMTYPE_PATH);
+    memcpy(cdir->cd_path, path, len);
+    cdir->cd_file = NULL;
+    cdir->cd_next = pcdir->cd_next;
+    pcdir->cd_next = cdir;
+    return cdir;
+}
+
+/* Find the record for a file in a directory of a merged change list, adding
+ * one with a copy of the name if needed.
+ */
+static struct cfile *
+lc_rangeFile(struct fs *fs, struct cdir *cdir, char *name, uint16_t len) {
+    struct cfile *cfile = cdir->cd_file, **prev = &cdir->cd_file;
+
+    while (cfile &&
+           ((cfile->cf_len != len) || strncmp(cfile->cf_name, name, len))) {
+        prev = &cfile->cf_next;
+        cfile = cfile->cf_next;
+    }
+    if (cfile) {
+        return cfile;
+    }
+    cfile = lc_malloc(fs, sizeof(struct cfile), LC_MEMTYPE_CFILE);
+    cfile->cf_name = lc_malloc(fs, len, LC_MEMTYPE_PATH);
+    memcpy(cfile->cf_name, name, len);
+    cfile->cf_len = len;
+    cfile->cf_type = LC_NONE;
+    cfile->cf_ino = LC_INVALID_INODE;
+    cfile->cf_next = NULL;
+    *prev = cfile;
+    return cfile;
+}
+
+/* Merge the change list of a layer into a change list of a descendant layer.
+ * Only paths are merged, with types of changes settled afterwards.
+ */
+static void
+lc_mergeChangeList(struct fs *fs, struct cdir *changes, struct fs *lfs) {
+    struct cdir *cdir, *rcdir;
+    struct cfile *cfile;
+
+    for (cdir = lfs->fs_changes; cdir; cdir = cdir->cd_next) {
+        rcdir = lc_rangeDirectory(fs, changes, cdir->cd_path, cdir->cd_len);
+        if ((cdir->cd_type != LC_NONE) && (cdir->cd_ino != lfs->fs_root)) {
+            rcdir->cd_type = LC_MODIFIED;
+        }
+        for (cfile = cdir->cd_file; cfile; cfile = cfile->cf_next) {
+            lc_rangeFile(fs, rcdir, cfile->cf_name, cfile->cf_len);
+        }
+    }
+}
+
+/* Settle the type of changes in a merged change list by looking up each path
+ * in both layers.  Paths which exist in neither are dropped.
+ */
+static void
+lc_settleChangeList(struct fs *fs, struct fs *bfs, struct cdir *changes) {
+    struct dirent *dirent, *bdirent;
+    struct cfile *cfile, **prev;
+    struct cdir *cdir, *last = NULL;
+    struct inode *dir, *bdir;
+    bool replaced;
+    char *name;
+    int i, max;
+
+    for (cdir = changes; cdir; cdir = last->cd_next) {
+        dir = lc_rangeLookup(fs, cdir->cd_path, cdir->cd_len);
+
+        /* Directory is removed from the layer, along with everything in it */
+        if (dir == NULL) {
+            assert(cdir != changes);
+            last->cd_next = cdir->cd_next;
+            while ((cfile = cdir->cd_file)) {
+                cdir->cd_file = cfile->cf_next;
+                lc_free(fs, cfile->cf_name, cfile->cf_len, LC_MEMTYPE_PATH);
+                lc_free(fs, cfile, sizeof(struct cfile), LC_MEMTYPE_CFILE);
+            }
+            lc_free(fs, cdir->cd_path, cdir->cd_len, LC_MEMTYPE_PATH);
+            lc_free(fs, cdir, sizeof(struct cdir), LC_MEMTYPE_CDIR);
+            continue;
+        }
+        cdir->cd_ino = dir->i_ino;
+        bdir = lc_rangeLookup(bfs, cdir->cd_path, cdir->cd_len);
+        replaced = bdir && (cdir != changes) && (bdir->i_ino != dir->i_ino);
+        if (bdir == NULL) {
+            cdir->cd_type = LC_ADDED;
+        } else if (replaced) {
+            cdir->cd_type = LC_MODIFIED;
+        }
+
+        /* Settle files based on which layers have those */
+        prev = &cdir->cd_file;
+        while ((cfile = *prev)) {
+            name = cfile->cf_name;
+            dirent = lc_dirFindEntry(dir, name, cfile->cf_len);
+            bdirent = bdir ? lc_dirFindEntry(bdir, name, cfile->cf_len) :
+                             NULL;
+            if (dirent && !S_ISDIR(dirent->di_mode)) {
+                cfile->cf_type = bdirent ? LC_MODIFIED : LC_ADDED;
+                cfile->cf_ino = dirent->di_ino;
+            } else if ((dirent == NULL) && bdirent) {
+                cfile->cf_type = LC_REMOVED;
+                cfile->cf_ino = bdirent->di_ino;
+            } else {
+
+                /* Directories have records of their own */
+                *prev = cfile->cf_next;
+                lc_free(fs, name, cfile->cf_len, LC_MEMTYPE_PATH);
+                lc_free(fs, cfile, sizeof(struct cfile), LC_MEMTYPE_CFILE);
+                continue;
+            }
+            prev = &cfile->cf_next;
+        }
+
+        /* Entries of a replaced directory missing from the new one are
+         * removed.
+         */
+        if (replaced) {
+            max = (bdir->i_flags & LC_INODE_DHASHED) ? LC_DIRCACHE_SIZE : 1;
+            for (i = 0; i < max; i++) {
+                bdirent = (bdir->i_flags & LC_INODE_DHASHED) ?
+                          bdir->i_hdirent[i] : bdir->i_dirent;
+                while (bdirent) {
+                    if (!lc_dirFindEntry(dir, bdirent->di_name,
+                                         bdirent->di_size)) {
+                        cfile = lc_rangeFile(fs, cdir, bdirent->di_name,
+                                             bdirent->di_size);
+                        cfile->cf_type = LC_REMOVED;
+                        cfile->cf_ino = bdirent->di_ino;
+                    }
+                    bdirent = bdirent->di_next;
+                }
+            }
+        }
+        if (bdir) {
+            lc_inodeUnlock(bdir);
+        }
+        lc_inodeUnlock(dir);
+        last = cdir;
+    }
+}
+
+/* Build the list of changes in a layer compared to an ancestor layer, by
+ * merging change lists of the layers in between.
+ */
+static int
+lc_buildRangeChangeList(struct fs *fs, struct fs *bfs) {
+    struct fs *pfs, **layers;
+    int i, count = 0, err = 0;
+    struct cdir *changes;
+
+    for (pfs = fs; pfs && (pfs != bfs); pfs = pfs->fs_parent) {
+        count++;
+    }
+    if ((pfs == NULL) || (count == 0)) {
+        return EINVAL;
+    }
+    layers = alloca(count * sizeof(struct fs *));
+    i = count;
+    for (pfs = fs; pfs != bfs; pfs = pfs->fs_parent) {
+        layers[--i] = pfs;
+    }
+    lc_printf("Starting diff on layer %d against layer %d\n",
+              fs->fs_gindex, bfs->fs_gindex);
+    changes = lc_malloc(fs, sizeof(struct cdir), LC_MEMTYPE_CDIR);
+    changes->cd_ino = fs->fs_root;
+    changes->cd_type = LC_MODIFIED;
+    changes->cd_len = 1;
+    changes->cd_path = lc_malloc(fs, 1, LC_MEMTYPE_PATH);
+    changes->cd_path[0] = '/';
+    changes->cd_file = NULL;
+    changes->cd_next = NULL;
+
+    /* Merge changes of each layer, starting with the oldest one */
+    for (i = 0; i < count; i++) {
+        pfs = layers[i];
+        if (pfs != fs) {
+            lc_lock(pfs, false);
+            pthread_mutex_lock(&pfs->fs_dlock);
+            err = (pfs->fs_changes || pfs->fs_diffBuf) ? EBUSY : 0;
+        }
+        if (err == 0) {
+            err = lc_buildChangeList(pfs);
+        }
+        if (err == 0) {
+            lc_mergeChangeList(fs, changes, pfs);
+            lc_freeChangeList(pfs);
+        }
+        if (pfs != fs) {
+            pthread_mutex_unlock(&pfs->fs_dlock);
+            lc_unlock(pfs);
+        }
+        if (err) {
+            fs->fs_changes = changes;
+            lc_freeChangeList(fs);
+            return err;
+        }
+    }
+    lc_settleChangeList(fs, bfs, changes);
+    fs->fs_changes = changes;
+    return 0;
+}
+
+/* Produce diff between a layer and its parent layer, or an ancestor layer
+ * when named as <ancestor>/<layer>.
+ */
 int
 lc_layerDiff(fuse_req_t req, const char *name, size_t size) {
+    struct fs *fs, *rfs, *bfs = NULL;
     struct gfs *gfs = getfs();
-    struct fs *fs, *rfs;
-    struct inode *inode;
-    ino_t ino, lastIno;
-    char *data;
-    int i;
+    char *data, *bname = NULL;
+    ino_t ino, base = 0;
+    uint64_t cursor = 0;
+    struct pbatch pbatch, *pbatchp;
+    bool attrs = false;
+    int err;
 
     /* Respond to plugin checking whether swapping of layers enabled or not */
     if (!strcmp(name, ".")) {
@@ -607,86 +1291,115 @@ lc_layerDiff(fuse_req_t req, const char *name, size_t size) {
         fuse_reply_buf(req, data, sizeof(uint64_t));
         return 0;
     }
+
+    /* Parse the cursor of a request for a batch of changes */
+    if (!strncmp(name, LC_DIFF_PREFIX, strlen(LC_DIFF_PREFIX))) {
+        cursor = strtoull(&name[strlen(LC_DIFF_PREFIX)], &data, 10);
+        if ((*data != '.') || (size < LC_BLOCK_SIZE)) {
+            return EINVAL;
+        }
+        name = &data[1];
+        attrs = true;
+    } else if ((size != sizeof(uint64_t)) && (size != LC_BLOCK_SIZE)) {
+        return EINVAL;
+    }
+
+    /* Split the name of the ancestor layer changes are compared against */
+    data = strchr(name, '/');
+    if (data) {
+        if (size < LC_BLOCK_SIZE) {
+            return EINVAL;
+        }
+        bname = alloca(data - name + 1);
+        memcpy(bname, name, data - name);
+        bname[data - name] = 0;
+        name = &data[1];
+    }
     rfs = lc_getLayerLocked(LC_ROOT_INODE, false);
     ino = lc_getRootIno(rfs, name, NULL, true);
+    if (bname && (ino != LC_INVALID_INODE)) {
+        base = lc_getRootIno(rfs, bname, NULL, true);
+        if (base != LC_INVALID_INODE) {
+            bfs = gfs->gfs_fs[lc_getFsHandle(base)];
+        }
+        if (bfs == NULL) {
+            ino = LC_INVALID_INODE;
+        }
+    }
     if (ino == LC_INVALID_INODE) {
         lc_unlock(rfs);
         return EINVAL;
     }
-    fs = lc_getLayerLocked(ino, true);
+    fs = lc_getLayerLocked(ino, false);
     assert(fs->fs_root == lc_getInodeHandle(ino));
+    pthread_mutex_lock(&fs->fs_dlock);
 
     /* Layer diff is bypassed when layers are swapped during commit */
     if (gfs->gfs_swapLayersForCommit) {
-        assert(size == sizeof(uint64_t));
-        fuse_reply_buf(req, (char *)&fs->fs_size, sizeof(uint64_t));
+        if (attrs || bfs) {
+            fuse_reply_err(req, EOPNOTSUPP);
+        } else {
+            assert(size == sizeof(uint64_t));
+            fuse_reply_buf(req, (char *)&fs->fs_size, sizeof(uint64_t));
+        }
         goto out;
     }
-    assert(size == LC_BLOCK_SIZE);
-    if (fs->fs_removed || fs->fs_rfs->fs_restarted ||
-        (fs->fs_parent == NULL)) {
-        lc_unlock(fs);
-        lc_unlock(rfs);
+    assert(attrs || (size == LC_BLOCK_SIZE));
+    if (fs->fs_removed || (fs->fs_parent == NULL)) {
         fuse_reply_err(req, EIO);
-        return 0;
+        goto out;
     }
 
-    /* If this is a continuation request, respond with remaining diff data */
-    if (fs->fs_changes) {
-        lc_replyDiff(req, fs);
-        lc_unlock(fs);
-        lc_unlock(rfs);
-        return 0;
+    /* A request for the first batch starts a new diff if a diff was
+     * abandoned after returning more than the first batch, or was against
+     * another layer.
+     */
+    pbatchp = (struct pbatch *)fs->fs_diffBuf;
+    if (attrs && (cursor == 0) && (fs->fs_changes || pbatchp) &&
+        ((fs->fs_diffBase != base) ||
+         (pbatchp && (pbatchp->pb_cursor != pbatchp->pb_count)))) {
+        lc_printf("Restarting diff on layer %d\n", fs->fs_gindex);
+        lc_freeChangeList(fs);
     }
-    lc_printf("Starting diff on layer %d\n", fs->fs_gindex);
-
-    lc_lock(fs->fs_parent, false);
-    lastIno = fs->fs_parent->fs_super->sb_lastInode;
 
-    /* Add the root inode to the change list first */
-    lc_addDirectory(fs, fs->fs_rootInode, NULL, 0, lastIno, LC_MODIFIED);
-
-    /* Traverse inode cache, looking for modified directories in this layer */
-    for (i = 0; i < fs->fs_icacheSize; i++) {
-        inode = fs->fs_icache[i].ic_head;
-        while (inode) {
+    /* Start a new diff unless this is a continuation request */
+    if ((fs->fs_changes == NULL) && (fs->fs_diffBuf == NULL)) {
+        if (attrs && cursor) {
 
-            /* Skip removed directories and those already processed */
-            if (S_ISDIR(inode->i_mode) &&
-                !(inode->i_flags & (LC_INODE_REMOVED | LC_INODE_CTRACKED))) {
-                lc_addDirectory(fs, inode, NULL, 0, lastIno,
-                                lc_changeInode(inode->i_ino, lastIno));
-            }
-            inode = inode->i_cnext;
+            /* Repeated request for the batch marking the end of changes */
+            memset(&pbatch, 0, sizeof(struct pbatch));
+            pbatch.pb_cursor = cursor;
+            fuse_reply_buf(req, (char *)&pbatch, sizeof(struct pbatch));
+            goto out;
         }
-    }
-
-    /* Traverse inode cache, looking for modified files in this layer */
-    for (i = 0; i < fs->fs_icacheSize; i++) {
-        inode = fs->fs_icache[i].ic_head;
-        while (inode) {
-
-            /* Skip removed files and those already processed */
-            if (!(inode->i_flags & (LC_INODE_REMOVED | LC_INODE_CTRACKED)) &&
-                !S_ISDIR(inode->i_mode)) {
-                lc_addModifiedInode(fs, inode, lastIno);
+        if (bfs) {
+            err = lc_buildRangeChangeList(fs, bfs);
+            if (err) {
+                fuse_reply_err(req, err);
+                goto out;
+            }
+            fs->fs_diffBase = base;
+        } else {
+            err = lc_buildChangeList(fs);
+            if (err) {
+                fuse_reply_err(req, err);
+                goto out;
             }
-            inode = inode->i_cnext;
         }
-    }
-    lc_unlock(fs->fs_parent);
-    lc_replyDiff(req, fs);
+    } else if (fs->fs_diffBase != base) {
 
-    /* Reset LC_INODE_CTRACKED flags on inodes */
-    for (i = 0; i < fs->fs_icacheSize; i++) {
-        inode = fs->fs_icache[i].ic_head;
-        while (inode) {
-            inode->i_flags &= ~LC_INODE_CTRACKED;
-            inode = inode->i_cnext;
-        }
+        /* A diff against another layer is in progress */
+        fuse_reply_err(req, EBUSY);
+        goto out;
+    }
+    if (attrs) {
+        lc_replyDiffBatch(req, fs, size, cursor);
+    } else {
+        lc_replyDiff(req, fs);
     }
 
 out:
+    pthread_mutex_unlock(&fs->fs_dlock);
     lc_unlock(fs);
     lc_unlock(rfs);
     return 0;
@@ -26,6 +26,9 @@ struct cfile {
     /* Next file in the list */
     struct cfile *cf_next;
 
+    /* Inode number of the file */
+    ino_t cf_ino;
+
     /* Length of name */
     uint16_t cf_len:14;
 
@@ -55,4 +58,179 @@ struct cdir {
     struct cfile *cd_file;
 } __attribute__((packed));
 
+/* Initial number of entries in the journal of inodes of a layer */
+#define LC_JOURNAL_MIN      1024
+
+/* Maximum number of entries in the journal of inodes of a layer */
+#define LC_JOURNAL_MAX      (1024 * 1024)
+
+/* Initial size of the table of inodes tracked while building a diff */
+#define LC_TRACK_MIN        1024
+
+/* Size of a tar block */
+#define LC_TAR_BLOCK        512
+
+/* Size of the buffer staging a tar stream */
+#define LC_EXPORT_BUFSIZE   (1024 * 1024)
+
+/* Prefix of names of files added to a tar stream for removed files */
+#define LC_WHITEOUT_PREFIX  ".wh."
+
+/* Name of the file added to a directory hiding all entries of parent layers */
+#define LC_WHITEOUT_OPAQUE  ".wh..wh..opq"
+
+/* Header of a file in a tar stream */
+struct theader {
+    char th_name[100];
+    char th_mode[8];
+    char th_uid[8];
+    char th_gid[8];
+    char th_size[12];
+    char th_mtime[12];
+    char th_chksum[8];
+    char th_type;
+    char th_linkname[100];
+    char th_magic[8];
+    char th_uname[32];
+    char th_gname[32];
+    char th_devmajor[8];
+    char th_devminor[8];
+    char th_pad[167];
+} __attribute__((packed));
+
+/* A change added to a tar stream */
+struct xchange {
+
+    /* Inode number of the file, LC_INVALID_INODE for a removed file */
+    ino_t xc_ino;
+
+    /* Offset of the path in the buffer of paths */
+    uint64_t xc_path;
+
+    /* Index of the change this is a hard link to, plus one */
+    uint32_t xc_link;
+};
+
+/* A tar stream of changes in a layer against its parent layer */
+struct export {
+
+    /* Layer exported */
+    struct fs *ex_fs;
+
+    /* Changes in the layer */
+    struct xchange *ex_changes;
+
+    /* Paths of changed files */
+    char *ex_paths;
+
+    /* Size of the buffer of paths */
+    uint64_t ex_psize;
+
+    /* Number of changes */
+    uint32_t ex_count;
+
+    /* Next change to add to the stream */
+    uint32_t ex_next;
+
+    /* Regular file being added to the stream */
+    ino_t ex_ino;
+
+    /* Size of the file when its header was added */
+    uint64_t ex_fsize;
+
+    /* Offset in the file to be added next */
+    uint64_t ex_foff;
+
+    /* Offset of the end of file data padded to a tar block */
+    uint64_t ex_fend;
+
+    /* Buffer staging the tar stream */
+    char *ex_buf;
+
+    /* Length of valid data in the staging buffer */
+    uint64_t ex_blen;
+
+    /* Offset of data in staging buffer not returned yet */
+    uint64_t ex_boff;
+
+    /* Offset in the stream returned so far */
+    off_t ex_off;
+
+    /* State of compression */
+    z_stream ex_zstream;
+
+    /* Set if the stream is compressed */
+    bool ex_gzip;
+
+    /* Set after end of the tar stream is staged */
+    bool ex_eof;
+
+    /* Set after the whole stream is returned */
+    bool ex_done;
+
+    /* Set for a stream of a layer instead of a tar stream of changes */
+    bool ex_send;
+
+    /* Set while an inode block is being filled in the staging buffer */
+    bool ex_iopen;
+
+    /* Offset of the inode block being filled in the staging buffer */
+    uint64_t ex_iblock;
+
+    /* Sequence number of the next block in a stream of a layer */
+    uint64_t ex_seq;
+
+    /* Inodes added to a stream of a layer */
+    ino_t *ex_inos;
+
+    /* Record of the inode being added */
+    char *ex_rec;
+
+    /* Size of the buffer, length and offset of the record not added yet */
+    uint64_t ex_rsize, ex_rlen, ex_roff;
+
+    /* Pages of the file being added */
+    char *ex_data;
+
+    /* First page, number of pages and next page to add in the buffer */
+    uint64_t ex_dpage, ex_dcount, ex_dnext;
+};
+
+/* A stream of a layer being received */
+struct receive {
+
+    /* Layer the stream is received into */
+    struct fs *rc_fs;
+
+    /* Layer block of the stream */
+    struct slayer rc_layer;
+
+    /* File the stream is read from */
+    int rc_fd;
+
+    /* Block of the stream read last */
+    char *rc_block;
+
+    /* Buffer of inode records not applied yet */
+    char *rc_buf;
+
+    /* Size of the buffer, length and offset of records not applied */
+    uint64_t rc_bsize, rc_blen, rc_boff;
+
+    /* Sequence number of the next block */
+    uint64_t rc_seq;
+
+    /* Number of inode records applied */
+    uint64_t rc_icount;
+
+    /* Regular file data is being received for */
+    struct inode *rc_inode;
+
+    /* Number of dirty pages added to the file */
+    uint64_t rc_pcount;
+
+    /* Set if an extent is reserved for data of the file */
+    bool rc_reserved;
+};
+
 #endif
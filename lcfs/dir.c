@@ -62,26 +62,33 @@ lc_dirGetDirent(struct inode *dir, const char *name, int len,
     return dirent;
 }
 
-/* Lookup the specified name in the directory and return correponding inode
- * number if found.
+/* Lookup the name of specified length in the directory and return the
+ * directory entry if found.
  */
-ino_t
-lc_dirLookup(struct fs *fs, struct inode *dir, const char *name) {
+struct dirent *
+lc_dirFindEntry(struct inode *dir, const char *name, int len) {
     struct dirent *dirent;
-    int len = strlen(name);
-    ino_t dino;
 
     assert(S_ISDIR(dir->i_mode));
     dirent = lc_dirGetDirent(dir, name, len, NULL, NULL);
     while (dirent != NULL) {
         if ((len == dirent->di_size) &&
-            (strcmp(name, dirent->di_name) == 0)) {
-            dino = dirent->di_ino;
-            return dino;
+            (strncmp(name, dirent->di_name, len) == 0)) {
+            return dirent;
         }
         dirent = dirent->di_next;
     }
-    return LC_INVALID_INODE;
+    return NULL;
+}
+
+/* Lookup the specified name in the directory and return correponding inode
+ * number if found.
+ */
+ino_t
+lc_dirLookup(struct fs *fs, struct inode *dir, const char *name) {
+    struct dirent *dirent = lc_dirFindEntry(dir, name, strlen(name));
+
+    return dirent ? dirent->di_ino : LC_INVALID_INODE;
 }
 
 /* Add a new directory entry to the given directory */
@@ -631,17 +638,31 @@ lc_dirRemoveName(struct fs *fs, struct inode *dir,
     return ENOENT;
 }
 
+/* Find inodes for the next few entries in a directory list together */
+static int
+lc_dirResolve(struct fs *fs, struct dirent *dirent, struct inode **inodes) {
+    ino_t inos[LC_DIRENT_BATCH];
+    int count = 0;
+
+    while (dirent && (count < LC_DIRENT_BATCH)) {
+        inos[count++] = dirent->di_ino;
+        dirent = dirent->di_next;
+    }
+    lc_getInodesBatch(fs, inos, inodes, count);
+    return count;
+}
+
 /* Return directory entries */
 int
 lc_dirReaddir(fuse_req_t req, struct fs *fs, struct inode *dir,
               uint64_t parent, size_t size, off_t off, struct stat *st) {
     bool hashed = (dir->i_flags & LC_INODE_DHASHED);
+    struct inode *inode, *inodes[LC_DIRENT_BATCH];
+    int max, start, gindex, bindex, bcount;
     struct dirent *dirent = NULL;
     struct fuse_entry_param ep;
     size_t csize = 0, esize;
-    int max, start, gindex;
     struct fs *nfs = NULL;
-    struct inode *inode;
     char buf[size];
     off_t i, hoff;
     ino_t ino;
@@ -684,6 +705,8 @@ lc_dirReaddir(fuse_req_t req, struct fs *fs, struct inode *dir,
         }
         off = 0;
         hoff = (hashed ? i : LC_DIRCACHE_SIZE) << LC_DIRHASH_SHIFT;
+        bindex = 0;
+        bcount = 0;
         while (dirent != NULL) {
             ino = dirent->di_ino;
             assert(ino > LC_ROOT_INODE);
@@ -698,6 +721,7 @@ lc_dirReaddir(fuse_req_t req, struct fs *fs, struct inode *dir,
             } else {
 
                 /* For readdirplus, get attributes of the inode as well */
+                inode = NULL;
                 if (parent == fs->fs_gfs->gfs_layerRoot) {
                     gindex = lc_getIndex(fs, parent, ino);
                     if (fs->fs_gindex != gindex) {
@@ -706,8 +730,17 @@ lc_dirReaddir(fuse_req_t req, struct fs *fs, struct inode *dir,
                     }
                 } else {
                     gindex = fs->fs_gindex;
+
+                    /* Look up inodes of next few entries in the parent
+                     * chain together and pass those as hints.
+                     */
+                    if (bindex == bcount) {
+                        bcount = lc_dirResolve(fs, dirent, inodes);
+                        bindex = 0;
+                    }
+                    inode = inodes[bindex++];
                 }
-                inode = lc_getInode(nfs ? nfs : fs, ino, NULL, false, false);
+                inode = lc_getInode(nfs ? nfs : fs, ino, inode, false, false);
                 if (inode == NULL) {
                     lc_reportError(__func__, __LINE__, ino, ENOENT);
                     fuse_reply_err(req, ENOENT);
@@ -718,12 +751,13 @@ lc_dirReaddir(fuse_req_t req, struct fs *fs, struct inode *dir,
                 }
                 lc_copyStat(&ep.attr, inode);
                 lc_inodeUnlock(inode);
+                ep.ino = lc_setHandle(gindex, ino);
+                lc_epInit(&ep);
+                lc_epTimeout(&ep, fs, dir, nfs ? nfs : fs, inode);
                 if (nfs) {
                     lc_unlock(nfs);
                 }
                 nfs = NULL;
-                ep.ino = lc_setHandle(gindex, ino);
-                lc_epInit(&ep);
 #ifdef FUSE3
                 esize = fuse_add_direntry_plus(req, &buf[csize], size - csize,
                                                dirent->di_name, &ep,
@@ -739,6 +773,11 @@ lc_dirReaddir(fuse_req_t req, struct fs *fs, struct inode *dir,
                 csize -= esize;
                 goto out;
             }
+
+            /* Kernel takes a reference on entries returned by readdirplus */
+            if (st == NULL) {
+                lc_inodeRef(inode);
+            }
             dirent = dirent->di_next;
         }
     }
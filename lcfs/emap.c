@@ -48,10 +48,100 @@ lc_inodeEmapExtentLookup(struct gfs *gfs, struct inode *inode, uint64_t page,
     return LC_PAGE_HOLE;
 }
 
+/* Find the unwritten extent containing or following the page specified */
+struct extent *
+lc_inodeNextUnwritten(struct inode *inode, uint64_t page) {
+    struct extent *extent = lc_inodeGetUnwritten(inode);
+
+    /* List is sorted, so stop at the first extent ending past the page */
+    while (extent &&
+           (page >= (lc_getExtentStart(extent) + lc_getExtentCount(extent)))) {
+        extent = extent->ex_next;
+    }
+    return extent;
+}
+
+/* Stop tracking the specified range of pages as unwritten */
+static void
+lc_removeUnwritten(struct fs *fs, struct inode *inode, uint64_t page,
+                   uint64_t pcount) {
+    uint64_t end = page + pcount, freed;
+    struct extent *extent;
+
+    while (page < end) {
+        extent = lc_inodeNextUnwritten(inode, page);
+        if ((extent == NULL) || (lc_getExtentStart(extent) >= end)) {
+            break;
+        }
+        if (page < lc_getExtentStart(extent)) {
+            page = lc_getExtentStart(extent);
+        }
+        freed = lc_removeExtent(fs, lc_inodeGetUnwrittenPtr(inode), page,
+                                end - page);
+        assert(freed);
+        page += freed;
+    }
+}
+
+/* Free unwritten extents starting from the page specified */
+void
+lc_freeUnwritten(struct fs *fs, struct inode *inode, uint64_t page) {
+    struct extent **prev = lc_inodeGetUnwrittenPtr(inode), *extent = *prev;
+    uint64_t estart, ecount;
+
+    while (extent) {
+        estart = lc_getExtentStart(extent);
+        ecount = lc_getExtentCount(extent);
+        if (page <= estart) {
+            lc_freeExtent(fs->fs_gfs, fs, extent, prev, true);
+        } else {
+            if (page < (estart + ecount)) {
+
+                /* Trim the extent */
+                lc_decrExtentCount(fs->fs_gfs, extent,
+                                   (estart + ecount) - page);
+            }
+            prev = &extent->ex_next;
+        }
+        extent = *prev;
+    }
+}
+
+/* Mark a page written to its preallocated block */
+void
+lc_inodeEmapConvert(struct fs *fs, struct inode *inode, uint64_t page) {
+    lc_removeUnwritten(fs, inode, page, 1);
+}
+
+/* Copy unwritten extents of the parent inode */
+void
+lc_copyUnwritten(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                 struct inode *parent) {
+    struct extent **extents = lc_inodeGetUnwrittenPtr(inode);
+    struct extent *extent = lc_inodeGetUnwritten(parent);
+
+    assert(*extents == NULL);
+    while (extent) {
+        lc_addEmapExtent(gfs, fs, extents, lc_getExtentStart(extent),
+                         lc_getExtentBlock(extent), lc_getExtentCount(extent));
+        extents = &((*extents)->ex_next);
+        extent = extent->ex_next;
+    }
+}
+
 /* Lookup inode emap for the specified page */
 uint64_t
 lc_inodeEmapLookup(struct gfs *gfs, struct inode *inode, uint64_t page,
                    struct extent **extents) {
+    struct extent *extent;
+
+    /* Preallocated blocks read as zeroes until written */
+    if (unlikely(lc_inodeGetUnwritten(inode))) {
+        extent = lc_inodeNextUnwritten(inode, page);
+        if (extent && (page >= lc_getExtentStart(extent))) {
+            return LC_PAGE_HOLE;
+        }
+    }
 
     /* Check if the inode has a single direct extent */
     if (inode->i_extentLength && (page < inode->i_extentLength)) {
@@ -98,6 +188,11 @@ lc_inodeEmapUpdate(struct gfs *gfs, struct fs *fs, struct inode *inode,
     assert(inode->i_extentLength == 0);
     assert(count);
 
+    /* Pages written or punched are not unwritten anymore */
+    if (unlikely(lc_inodeGetUnwritten(inode))) {
+        lc_removeUnwritten(fs, inode, pstart, pcount);
+    }
+
     /* XXX Combine emap lookup and removal into a single operation */
     /* Remove existing blocks for the specified range from inode emap */
     while (count) {
@@ -220,6 +315,226 @@ lc_copyEmap(struct gfs *gfs, struct fs *fs, struct inode *inode) {
     inode->i_flags &= ~LC_INODE_SHARED;
 }
 
+/* Preallocate blocks for holes in the specified range of pages.  New blocks
+ * are tracked as unwritten, so that those are read as zeroes until written.
+ */
+int
+lc_emapPrealloc(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                uint64_t pstart, uint64_t pcount) {
+    uint64_t page = pstart, end = pstart + pcount, count, block;
+    struct extent *extents = NULL, *extent;
+
+    assert(S_ISREG(inode->i_mode));
+    assert(pcount);
+    if (inode->i_flags & LC_INODE_SHARED) {
+        lc_copyEmap(gfs, fs, inode);
+    }
+
+    /* Allocate a single direct extent for a file without any blocks */
+    if ((inode->i_dinode.di_blocks == 0) && (pstart == 0)) {
+        assert(inode->i_extentLength == 0);
+        assert(lc_inodeGetEmap(inode) == NULL);
+        block = lc_blockAlloc(fs, pcount, false, true);
+        if (block != LC_INVALID_BLOCK) {
+            inode->i_extentBlock = block;
+            inode->i_extentLength = pcount;
+            inode->i_dinode.di_blocks = pcount;
+            lc_addEmapExtent(gfs, fs, lc_inodeGetUnwrittenPtr(inode),
+                             0, block, pcount);
+            return 0;
+        }
+    }
+    if (inode->i_extentLength) {
+
+        /* Nothing to do if the range is covered by the direct extent */
+        if (end <= inode->i_extentLength) {
+            return 0;
+        }
+        lc_expandEmap(gfs, fs, inode);
+    }
+    while (page < end) {
+        extent = lc_inodeGetEmap(inode);
+        block = lc_inodeEmapExtentLookup(gfs, inode, page, &extent);
+        if (block != LC_PAGE_HOLE) {
+
+            /* Skip over blocks allocated already */
+            page = lc_getExtentStart(extent) + lc_getExtentCount(extent);
+            continue;
+        }
+        count = ((extent == NULL) || (lc_getExtentStart(extent) >= end)) ?
+                end - page : lc_getExtentStart(extent) - page;
+
+        /* Allocate smaller chunks if space is fragmented */
+        do {
+            block = lc_blockAlloc(fs, count, false, true);
+            if (block != LC_INVALID_BLOCK) {
+                break;
+            }
+            count /= 2;
+        } while (count);
+        if (block == LC_INVALID_BLOCK) {
+            return ENOSPC;
+        }
+        lc_inodeEmapUpdate(gfs, fs, inode, page, block, count, &extents);
+        assert(extents == NULL);
+        lc_addEmapExtent(gfs, fs, lc_inodeGetUnwrittenPtr(inode),
+                         page, block, count);
+        page += count;
+    }
+    return 0;
+}
+
+/* Free blocks mapping to the specified range of pages */
+void
+lc_emapPunch(struct gfs *gfs, struct fs *fs, struct inode *inode,
+             uint64_t pstart, uint64_t pcount) {
+    uint64_t page = pstart, end = pstart + pcount, bcount = 0, count;
+    struct extent *extents = NULL, *extent, *next;
+    uint64_t estart, eend;
+
+    assert(S_ISREG(inode->i_mode));
+    if (inode->i_flags & LC_INODE_SHARED) {
+        lc_copyEmap(gfs, fs, inode);
+    }
+
+    /* Trim the direct extent if the range covers the tail of it */
+    if (inode->i_extentLength && (pstart < inode->i_extentLength)) {
+        if (end >= inode->i_extentLength) {
+            bcount = inode->i_extentLength - pstart;
+            lc_addSpaceExtent(gfs, fs, &extents, inode->i_extentBlock + pstart,
+                              bcount, false);
+            inode->i_extentLength = pstart;
+            if (pstart == 0) {
+                inode->i_extentBlock = 0;
+            }
+        } else {
+            lc_expandEmap(gfs, fs, inode);
+        }
+    }
+
+    /* Remove emap entries within the range */
+    extent = lc_inodeGetEmap(inode);
+    while (extent && (page < end)) {
+        estart = lc_getExtentStart(extent);
+        eend = estart + lc_getExtentCount(extent);
+        next = extent->ex_next;
+        if (eend <= page) {
+            extent = next;
+            continue;
+        }
+        if (estart >= end) {
+            break;
+        }
+        if (page < estart) {
+            page = estart;
+        }
+        count = ((eend < end) ? eend : end) - page;
+        lc_removeInodeExtents(gfs, fs, inode, page,
+                              lc_getExtentBlock(extent) + (page - estart),
+                              count, &extents);
+        bcount += count;
+        page += count;
+        extent = next;
+    }
+    if (bcount) {
+        assert(inode->i_dinode.di_blocks >= bcount);
+        inode->i_dinode.di_blocks -= bcount;
+        lc_freeInodeDataBlocks(gfs, fs, &extents);
+        lc_layerChanged(gfs, false, false);
+    }
+    if (lc_inodeGetUnwritten(inode)) {
+        lc_removeUnwritten(fs, inode, pstart, pcount);
+    }
+}
+
+/* Return the block a page is mapped to, ignoring whether it is written */
+static uint64_t
+lc_emapCurrent(struct gfs *gfs, struct inode *inode, uint64_t page,
+               struct extent **extents) {
+    if (inode->i_extentLength) {
+        return (page < inode->i_extentLength) ?
+               inode->i_extentBlock + page : LC_PAGE_HOLE;
+    }
+    return lc_inodeEmapExtentLookup(gfs, inode, page, extents);
+}
+
+/* Check if a range of pages recorded in the intent log could be mapped to the
+ * blocks logged.  Blocks not mapped to the same pages already should be free,
+ * otherwise those were freed and reused by others after being logged.
+ */
+bool
+lc_emapReplayValid(struct gfs *gfs, struct inode *inode, uint64_t pstart,
+                   uint64_t bstart, uint64_t pcount) {
+    struct extent *extent = lc_inodeGetEmap(inode);
+    uint64_t i = 0, start;
+
+    assert(S_ISREG(inode->i_mode));
+    while (i < pcount) {
+        while ((i < pcount) &&
+               (lc_emapCurrent(gfs, inode, pstart + i, &extent) ==
+                (bstart + i))) {
+            i++;
+        }
+        start = i;
+        while ((i < pcount) &&
+               (lc_emapCurrent(gfs, inode, pstart + i, &extent) !=
+                (bstart + i))) {
+            i++;
+        }
+        if ((i > start) &&
+            !lc_blockRangeFree(gfs, bstart + start, i - start)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Map a range of pages to blocks as recorded in the intent log.  Pages already
+ * mapped to the same blocks are left alone, other than marking those written.
+ */
+void
+lc_emapReplay(struct gfs *gfs, struct fs *fs, struct inode *inode,
+              uint64_t pstart, uint64_t bstart, uint64_t pcount) {
+    uint64_t i = 0, start, count;
+    struct extent *extents = NULL, *extent;
+
+    assert(S_ISREG(inode->i_mode));
+    while (i < pcount) {
+
+        /* Skip over pages which are mapped already */
+        extent = lc_inodeGetEmap(inode);
+        while ((i < pcount) &&
+               (lc_emapCurrent(gfs, inode, pstart + i, &extent) ==
+                (bstart + i))) {
+            if (lc_inodeGetUnwritten(inode)) {
+                lc_inodeEmapConvert(fs, inode, pstart + i);
+            }
+            i++;
+        }
+        start = i;
+        while ((i < pcount) &&
+               (lc_emapCurrent(gfs, inode, pstart + i, &extent) !=
+                (bstart + i))) {
+            i++;
+        }
+        count = i - start;
+        if (count == 0) {
+            continue;
+        }
+        if (inode->i_flags & LC_INODE_SHARED) {
+            lc_copyEmap(gfs, fs, inode);
+        }
+        if (inode->i_extentLength) {
+            lc_expandEmap(gfs, fs, inode);
+        }
+        lc_inodeEmapUpdate(gfs, fs, inode, pstart + start, bstart + start,
+                           count, &extents);
+    }
+    if (extents) {
+        lc_freeInodeDataBlocks(gfs, fs, &extents);
+    }
+}
+
 /* Allocate a emap block and flush to disk */
 static uint64_t
 lc_flushEmapBlocks(struct gfs *gfs, struct fs *fs,
@@ -251,16 +566,24 @@ lc_flushEmapBlocks(struct gfs *gfs, struct fs *fs,
 void
 lc_emapFlush(struct gfs *gfs, struct fs *fs, struct inode *inode) {
     uint64_t bcount = 0, pcount = 0, block = LC_INVALID_BLOCK;
+    uint64_t estart, eblk, ecount, ucount, uend;
     struct emapBlock *eblock = NULL;
+    struct extent *extent, *unwritten;
     int count = LC_EMAP_BLOCK;
     struct page *page = NULL;
-    struct extent *extent;
     struct emap *emap;
+    uint32_t flags;
 
     assert(S_ISREG(inode->i_mode));
 
     /* Flush all the dirty pages */
     lc_flushPages(gfs, fs, inode, true, false);
+
+    /* Unwritten blocks can be tracked on disk only in emap blocks */
+    unwritten = lc_inodeGetUnwritten(inode);
+    if (unwritten && inode->i_extentLength) {
+        lc_expandEmap(gfs, fs, inode);
+    }
     extent = lc_inodeGetEmap(inode);
     if (extent) {
         lc_printf("File %ld fragmented\n", inode->i_ino);
@@ -275,20 +598,49 @@ lc_emapFlush(struct gfs *gfs, struct fs *fs, struct inode *inode) {
 
     /* Add emap blocks with emap entries */
     while (extent) {
-        if (count >= LC_EMAP_BLOCK) {
-            if (eblock) {
-                page = lc_getPageNoBlock(gfs, fs, (char *)eblock, page);
+        estart = lc_getExtentStart(extent);
+        eblk = lc_getExtentBlock(extent);
+        ecount = lc_getExtentCount(extent);
+        while (ecount) {
+
+            /* Split the extent where unwritten extents begin or end */
+            while (unwritten &&
+                   (estart >= (lc_getExtentStart(unwritten) +
+                               lc_getExtentCount(unwritten)))) {
+                unwritten = unwritten->ex_next;
+            }
+            ucount = ecount;
+            flags = 0;
+            if (unwritten) {
+                uend = lc_getExtentStart(unwritten) +
+                       lc_getExtentCount(unwritten);
+                if (lc_getExtentStart(unwritten) <= estart) {
+                    if ((uend - estart) < ucount) {
+                        ucount = uend - estart;
+                    }
+                    flags = LC_EMAP_UNWRITTEN;
+                } else if (lc_getExtentStart(unwritten) < (estart + ecount)) {
+                    ucount = lc_getExtentStart(unwritten) - estart;
+                }
             }
-            lc_mallocBlockAligned(fs->fs_rfs, (void **)&eblock,
-                                  LC_MEMTYPE_DATA);
-            pcount++;
-            count = 0;
+            if (count >= LC_EMAP_BLOCK) {
+                if (eblock) {
+                    page = lc_getPageNoBlock(gfs, fs, (char *)eblock, page);
+                }
+                lc_mallocBlockAligned(fs->fs_rfs, (void **)&eblock,
+                                      LC_MEMTYPE_DATA);
+                pcount++;
+                count = 0;
+            }
+            emap = &eblock->eb_emap[count++];
+            emap->e_off = estart;
+            emap->e_block = eblk;
+            emap->e_count = ucount | flags;
+            bcount += ucount;
+            estart += ucount;
+            eblk += ucount;
+            ecount -= ucount;
         }
-        emap = &eblock->eb_emap[count++];
-        emap->e_off = lc_getExtentStart(extent);
-        emap->e_block = lc_getExtentBlock(extent);
-        emap->e_count = lc_getExtentCount(extent);
-        bcount += emap->e_count;
         extent = extent->ex_next;
     }
     assert(inode->i_dinode.di_blocks == bcount);
@@ -316,16 +668,18 @@ lc_emapFlush(struct gfs *gfs, struct fs *fs, struct inode *inode) {
 void
 lc_emapRead(struct gfs *gfs, struct fs *fs, struct inode *inode,
              void *buf) {
+    struct extent **unwritten = lc_inodeGetUnwrittenPtr(inode);
     struct extent **extents = lc_inodeGetEmapPtr(inode);
+    uint64_t i, bcount = 0, count;
     struct emapBlock *eblock = buf;
-    uint64_t i, bcount = 0;
     struct emap *emap;
     uint64_t block;
 
     assert(S_ISREG(inode->i_mode));
 
-    /* Nothing to read for an empty file */
-    assert(inode->i_size || (inode->i_dinode.di_blocks == 0));
+    /* Nothing to read for an empty file.  A file may have blocks preallocated
+     * past its size.
+     */
     if (inode->i_dinode.di_blocks == 0) {
         assert(inode->i_extentLength == 0);
         return;
@@ -358,11 +712,19 @@ lc_emapRead(struct gfs *gfs, struct fs *fs, struct inode *inode,
             if (emap->e_block == 0) {
                 break;
             }
-            assert(emap->e_count > 0);
+            count = emap->e_count & ~LC_EMAP_UNWRITTEN;
+            assert(count > 0);
             lc_addEmapExtent(gfs, fs, extents,
-                             emap->e_off, emap->e_block, emap->e_count);
+                             emap->e_off, emap->e_block, count);
             extents = &((*extents)->ex_next);
-            inode->i_dinode.di_blocks += emap->e_count;
+            inode->i_dinode.di_blocks += count;
+
+            /* Track blocks preallocated, but not written yet */
+            if (emap->e_count & LC_EMAP_UNWRITTEN) {
+                lc_addEmapExtent(gfs, fs, unwritten,
+                                 emap->e_off, emap->e_block, count);
+                unwritten = &((*unwritten)->ex_next);
+            }
         }
         block = eblock->eb_next;
     }
@@ -488,6 +850,13 @@ lc_emapTruncate(struct gfs *gfs, struct fs *fs, struct inode *inode,
         }
     }
 
+    /* Free unwritten extents past the new size */
+    if (lc_inodeGetUnwritten(inode)) {
+        lc_freeUnwritten(fs, inode,
+                         remove ? (size + LC_BLOCK_SIZE - 1) / LC_BLOCK_SIZE :
+                                  0);
+    }
+
     /* Free blocks */
     if (bcount) {
         lc_freeInodeDataBlocks(gfs, fs, &extents);
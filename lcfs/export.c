@@ -0,0 +1,525 @@
+#include "includes.h"
+#ifndef __APPLE__
+#include <sys/sysmacros.h>
+#endif
+
+/* Round up a size to a tar block */
+static uint64_t
+lc_tarRound(uint64_t size) {
+    return (size + LC_TAR_BLOCK - 1) & ~((uint64_t)LC_TAR_BLOCK - 1);
+}
+
+/* Format a numeric field of a tar header, switching to base-256 encoding for
+ * values too large for octal.
+ */
+static void
+lc_tarNumber(char *field, int len, uint64_t value) {
+    int i;
+
+    if (value < (1ul << (3 * (len - 1)))) {
+        snprintf(field, len, "%0*lo", len - 1, value);
+        return;
+    }
+    for (i = len - 1; i > 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+/* Stage a header in the tar stream, preceded by GNU records for names not
+ * fitting in the header.
+ */
+static void
+lc_tarHeader(struct export *ex, const char *name, const char *link,
+             char type, struct stat *st) {
+    size_t len = strlen(name), llen = link ? strlen(link) : 0;
+    struct theader *header;
+    uint32_t i, sum = 0;
+    struct stat lst;
+
+    /* Long names are added as contents of records preceding the header */
+    if ((len >= sizeof(header->th_name)) ||
+        (llen >= sizeof(header->th_linkname))) {
+        memset(&lst, 0, sizeof(struct stat));
+        if (len >= sizeof(header->th_name)) {
+            lst.st_size = len + 1;
+            lc_tarHeader(ex, "././@LongLink", NULL, 'L', &lst);
+            memset(&ex->ex_buf[ex->ex_blen], 0, lc_tarRound(len + 1));
+            memcpy(&ex->ex_buf[ex->ex_blen], name, len);
+            ex->ex_blen += lc_tarRound(len + 1);
+            len = sizeof(header->th_name);
+        }
+        if (llen >= sizeof(header->th_linkname)) {
+            lst.st_size = llen + 1;
+            lc_tarHeader(ex, "././@LongLink", NULL, 'K', &lst);
+            memset(&ex->ex_buf[ex->ex_blen], 0, lc_tarRound(llen + 1));
+            memcpy(&ex->ex_buf[ex->ex_blen], link, llen);
+            ex->ex_blen += lc_tarRound(llen + 1);
+            llen = sizeof(header->th_linkname);
+        }
+    }
+    header = (struct theader *)&ex->ex_buf[ex->ex_blen];
+    memset(header, 0, sizeof(struct theader));
+    memcpy(header->th_name, name, len);
+    if (llen) {
+        memcpy(header->th_linkname, link, llen);
+    }
+    lc_tarNumber(header->th_mode, sizeof(header->th_mode),
+                 st->st_mode & 07777);
+    lc_tarNumber(header->th_uid, sizeof(header->th_uid), st->st_uid);
+    lc_tarNumber(header->th_gid, sizeof(header->th_gid), st->st_gid);
+    lc_tarNumber(header->th_size, sizeof(header->th_size), st->st_size);
+    lc_tarNumber(header->th_mtime, sizeof(header->th_mtime),
+                 st->st_mtime);
+    if ((type == '3') || (type == '4')) {
+        lc_tarNumber(header->th_devmajor, sizeof(header->th_devmajor),
+                     major(st->st_rdev));
+        lc_tarNumber(header->th_devminor, sizeof(header->th_devminor),
+                     minor(st->st_rdev));
+    }
+    header->th_type = type;
+    memcpy(header->th_magic, "ustar  ", sizeof(header->th_magic));
+
+    /* Checksum is computed with the checksum field filled with spaces */
+    memset(header->th_chksum, ' ', sizeof(header->th_chksum));
+    for (i = 0; i < sizeof(struct theader); i++) {
+        sum += ((unsigned char *)header)[i];
+    }
+    snprintf(header->th_chksum, sizeof(header->th_chksum) - 1, "%06o", sum);
+    ex->ex_blen += sizeof(struct theader);
+}
+
+/* Return space needed in the staging buffer for the header of a change */
+static uint64_t
+lc_exportSpace(struct export *ex, struct xchange *xc) {
+    uint64_t llen = PATH_MAX;
+
+    if (xc->xc_link) {
+        llen = strlen(&ex->ex_paths[ex->ex_changes[xc->xc_link - 1].xc_path]);
+    }
+    return (3 * LC_TAR_BLOCK) +
+           lc_tarRound(strlen(&ex->ex_paths[xc->xc_path]) + 1) +
+           lc_tarRound(llen + 1);
+}
+
+/* Stage the header of a change in the tar stream */
+static void
+lc_exportChange(struct fs *fs, struct export *ex, struct xchange *xc) {
+    char *name = &ex->ex_paths[xc->xc_path], *link = NULL, type;
+    struct inode *inode;
+    struct stat st;
+
+    /* Removed files are added as empty files with whiteout names */
+    if (xc->xc_ino == LC_INVALID_INODE) {
+        memset(&st, 0, sizeof(struct stat));
+        lc_tarHeader(ex, name, NULL, '0', &st);
+        return;
+    }
+
+    /* Skip files removed after the stream was opened */
+    inode = lc_getInode(fs, xc->xc_ino, NULL, false, false);
+    if (inode == NULL) {
+        return;
+    }
+    lc_copyStat(&st, inode);
+    if (xc->xc_link) {
+        type = '1';
+        link = &ex->ex_paths[ex->ex_changes[xc->xc_link - 1].xc_path];
+        st.st_size = 0;
+    } else if (S_ISREG(st.st_mode)) {
+        type = '0';
+        ex->ex_ino = xc->xc_ino;
+        ex->ex_fsize = st.st_size;
+        ex->ex_foff = 0;
+        ex->ex_fend = lc_tarRound(st.st_size);
+    } else if (S_ISDIR(st.st_mode)) {
+        type = '5';
+        st.st_size = 0;
+    } else if (S_ISLNK(st.st_mode)) {
+        type = '2';
+        link = inode->i_target;
+        st.st_size = 0;
+    } else if (S_ISCHR(st.st_mode)) {
+        type = '3';
+        st.st_size = 0;
+    } else if (S_ISBLK(st.st_mode)) {
+        type = '4';
+        st.st_size = 0;
+    } else if (S_ISFIFO(st.st_mode)) {
+        type = '6';
+        st.st_size = 0;
+    } else {
+
+        /* Sockets cannot be archived */
+        lc_inodeUnlock(inode);
+        return;
+    }
+    lc_tarHeader(ex, name, link, type, &st);
+    lc_inodeUnlock(inode);
+}
+
+/* Stage data of the regular file being added to the tar stream.  Data past
+ * the current size of the file and padding are zeroes.
+ */
+static void
+lc_exportData(struct fs *fs, struct export *ex, uint64_t count) {
+    char *buf = &ex->ex_buf[ex->ex_blen];
+    struct inode *inode;
+    uint64_t size = 0;
+
+    inode = lc_getInode(fs, ex->ex_ino, NULL, false, false);
+    if (inode) {
+        if (S_ISREG(inode->i_mode) && (ex->ex_foff < ex->ex_fsize) &&
+            (ex->ex_foff < inode->i_size)) {
+            size = ((ex->ex_fsize < inode->i_size) ?
+                    ex->ex_fsize : inode->i_size) - ex->ex_foff;
+            if (size > count) {
+                size = count;
+            }
+            lc_readFileData(fs, inode, ex->ex_foff, size, buf);
+        }
+        lc_inodeUnlock(inode);
+    }
+    if (size < count) {
+        memset(&buf[size], 0, count - size);
+    }
+    ex->ex_foff += count;
+    ex->ex_blen += count;
+}
+
+/* Refill the staging buffer with the tar stream */
+static void
+lc_exportFill(struct fs *fs, struct export *ex) {
+    uint64_t space, count;
+
+    ex->ex_blen = 0;
+    ex->ex_boff = 0;
+    while (!ex->ex_eof) {
+        space = LC_EXPORT_BUFSIZE - ex->ex_blen;
+
+        /* Add data of the current file in multiples of pages */
+        if (ex->ex_foff < ex->ex_fend) {
+            count = ex->ex_fend - ex->ex_foff;
+            if (count > space) {
+                count = space & ~((uint64_t)LC_BLOCK_SIZE - 1);
+                if (count == 0) {
+                    break;
+                }
+            }
+            lc_exportData(fs, ex, count);
+            continue;
+        }
+
+        /* Stream ends with two zero blocks */
+        if (ex->ex_next == ex->ex_count) {
+            if (space < (2 * LC_TAR_BLOCK)) {
+                break;
+            }
+            memset(&ex->ex_buf[ex->ex_blen], 0, 2 * LC_TAR_BLOCK);
+            ex->ex_blen += 2 * LC_TAR_BLOCK;
+            ex->ex_eof = true;
+            break;
+        }
+        if (space < lc_exportSpace(ex, &ex->ex_changes[ex->ex_next])) {
+            break;
+        }
+        lc_exportChange(fs, ex, &ex->ex_changes[ex->ex_next]);
+        ex->ex_next++;
+    }
+    assert(ex->ex_blen);
+}
+
+/* Add a change with space for its path */
+static char *
+lc_exportAdd(struct export *ex, ino_t ino) {
+    struct xchange *xc = &ex->ex_changes[ex->ex_count++];
+
+    xc->xc_ino = ino;
+    xc->xc_link = 0;
+    xc->xc_path = ex->ex_psize;
+    return &ex->ex_paths[ex->ex_psize];
+}
+
+/* Flatten the list of changes in a layer into paths of files added to the
+ * tar stream.  Directories precede files in those.
+ */
+static void
+lc_exportChanges(struct fs *fs, struct export *ex) {
+    struct fs *rfs = lc_getGlobalFs(fs->fs_gfs);
+    uint32_t count = 0, lcount = 0, i, j;
+    uint64_t psize = 0, dlen;
+    struct inode *inode;
+    struct cfile *cfile;
+    struct cdir *cdir;
+    uint32_t *links;
+    char *dir, *path;
+
+    /* Find space needed for the changes and their paths */
+    for (cdir = fs->fs_changes; cdir; cdir = cdir->cd_next) {
+        count++;
+        psize += cdir->cd_len + 1;
+        for (cfile = cdir->cd_file; cfile; cfile = cfile->cf_next) {
+            count++;
+            psize += cdir->cd_len + strlen(LC_WHITEOUT_PREFIX) +
+                     cfile->cf_len + 2;
+        }
+    }
+    ex->ex_changes = lc_malloc(rfs, count * sizeof(struct xchange),
+                               LC_MEMTYPE_EXPORT);
+    ex->ex_paths = lc_malloc(rfs, psize, LC_MEMTYPE_EXPORT);
+    ex->ex_psize = 0;
+    for (cdir = fs->fs_changes; cdir; cdir = cdir->cd_next) {
+
+        /* Paths in the stream are relative to the root of the layer */
+        dir = &cdir->cd_path[1];
+        dlen = cdir->cd_len - 1;
+        if ((cdir->cd_ino != fs->fs_root) && (cdir->cd_type != LC_NONE)) {
+            path = lc_exportAdd(ex, cdir->cd_ino);
+            memcpy(path, dir, dlen);
+            path[dlen] = '/';
+            path[dlen + 1] = 0;
+            ex->ex_psize += dlen + 2;
+        }
+        for (cfile = cdir->cd_file; cfile; cfile = cfile->cf_next) {
+            if (cfile->cf_type == LC_REMOVED) {
+                path = lc_exportAdd(ex, LC_INVALID_INODE);
+            } else {
+                path = lc_exportAdd(ex, cfile->cf_ino);
+            }
+            ex->ex_psize += sprintf(path, "%.*s%s%s%.*s", (int)dlen, dir,
+                                    dlen ? "/" : "",
+                                    (cfile->cf_type == LC_REMOVED) ?
+                                    LC_WHITEOUT_PREFIX : "",
+                                    cfile->cf_len, cfile->cf_name) + 1;
+        }
+    }
+    assert(ex->ex_count <= count);
+    assert(ex->ex_psize <= psize);
+    ex->ex_psize = psize;
+
+    /* Add files with many links once, with the rest as hard links to that */
+    links = lc_malloc(rfs, (count + 1) * sizeof(uint32_t), LC_MEMTYPE_EXPORT);
+    for (i = 0; i < ex->ex_count; i++) {
+        if (ex->ex_changes[i].xc_ino == LC_INVALID_INODE) {
+            continue;
+        }
+        inode = lc_getInode(fs, ex->ex_changes[i].xc_ino, NULL, false, false);
+        if (inode == NULL) {
+            continue;
+        }
+        if (!S_ISDIR(inode->i_mode) && (inode->i_nlink > 1)) {
+            for (j = 0; j < lcount; j++) {
+                if (ex->ex_changes[links[j]].xc_ino ==
+                    ex->ex_changes[i].xc_ino) {
+                    ex->ex_changes[i].xc_link = links[j] + 1;
+                    break;
+                }
+            }
+            if (j == lcount) {
+                links[lcount++] = i;
+            }
+        }
+        lc_inodeUnlock(inode);
+    }
+    lc_free(rfs, links, (count + 1) * sizeof(uint32_t), LC_MEMTYPE_EXPORT);
+}
+
+/* Open a tar stream of changes in a layer against its parent layer */
+struct export *
+lc_exportOpen(struct gfs *gfs, ino_t ino, int *errp) {
+    bool send = (lc_getInodeHandle(ino) == LC_SEND_INODE);
+    struct fs *rfs = lc_getGlobalFs(gfs), *fs;
+    int gindex = lc_getFsHandle(ino);
+    struct export *ex;
+    int err = 0;
+
+    /* Keep the layer from being removed while the stream is open */
+    pthread_mutex_lock(&gfs->gfs_lock);
+    fs = gfs->gfs_fs[gindex];
+    if (fs) {
+        __sync_add_and_fetch(&fs->fs_exports, 1);
+    }
+    pthread_mutex_unlock(&gfs->gfs_lock);
+    if (fs == NULL) {
+        *errp = ENOENT;
+        return NULL;
+    }
+    lc_lock(fs, false);
+    pthread_mutex_lock(&fs->fs_dlock);
+    if (send) {
+
+        /* Layers are sent once frozen, including base layers */
+        if (fs->fs_removed || (fs == rfs) || gfs->gfs_swapLayersForCommit) {
+            err = EIO;
+        } else if (!fs->fs_frozen) {
+            err = EBUSY;
+        }
+    } else if (fs->fs_removed || (fs->fs_parent == NULL) ||
+        gfs->gfs_swapLayersForCommit) {
+        err = EIO;
+    } else if (fs->fs_changes || fs->fs_diffBuf) {
+
+        /* A diff of the layer is in progress */
+        err = EBUSY;
+    }
+    if (err == 0) {
+        ex = lc_malloc(rfs, sizeof(struct export), LC_MEMTYPE_EXPORT);
+        memset(ex, 0, sizeof(struct export));
+        ex->ex_fs = fs;
+        ex->ex_gzip = (lc_getInodeHandle(ino) == LC_EXPORT_GZIP_INODE);
+        if (send) {
+            lc_sendInodes(fs, ex);
+        } else {
+            err = lc_buildChangeList(fs);
+            if (err == 0) {
+                lc_exportChanges(fs, ex);
+                lc_freeChangeList(fs);
+            } else {
+                lc_free(rfs, ex, sizeof(struct export), LC_MEMTYPE_EXPORT);
+            }
+        }
+    }
+    pthread_mutex_unlock(&fs->fs_dlock);
+    lc_unlock(fs);
+    if (err) {
+        __sync_sub_and_fetch(&fs->fs_exports, 1);
+        lc_reportError(__func__, __LINE__, ino, err);
+        *errp = err;
+        return NULL;
+    }
+    ex->ex_buf = lc_malloc(rfs, LC_EXPORT_BUFSIZE, LC_MEMTYPE_EXPORT);
+    if (ex->ex_gzip) {
+
+        /* Window bits above 15 select gzip format */
+        err = deflateInit2(&ex->ex_zstream, Z_DEFAULT_COMPRESSION,
+                           Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        assert(err == Z_OK);
+    }
+    lc_printf("Exporting %d %s in layer %d\n", ex->ex_count,
+              send ? "inodes" : "changes", gindex);
+    return ex;
+}
+
+/* Read from a tar stream of changes in a layer.  Stream is generated as it is
+ * read, so reads are expected to be sequential.
+ */
+void
+lc_exportRead(fuse_req_t req, struct export *ex, size_t size, off_t off) {
+    struct fs *fs = ex->ex_fs, *rfs = lc_getGlobalFs(fs->fs_gfs);
+    z_stream *zstream = &ex->ex_zstream;
+    size_t len = 0, avail;
+    int flush, err;
+    char *buf;
+
+    if (off != ex->ex_off) {
+        lc_reportError(__func__, __LINE__, fs->fs_root, ESPIPE);
+        fuse_reply_err(req, ESPIPE);
+        return;
+    }
+    buf = lc_malloc(rfs, size, LC_MEMTYPE_EXPORT);
+    lc_lock(fs, false);
+    while ((len < size) && !ex->ex_done) {
+        if ((ex->ex_boff == ex->ex_blen) && !ex->ex_eof) {
+            if (ex->ex_send) {
+                lc_sendFill(fs, ex);
+            } else {
+                lc_exportFill(fs, ex);
+            }
+        }
+        avail = ex->ex_blen - ex->ex_boff;
+        if (!ex->ex_gzip) {
+            if (avail == 0) {
+                ex->ex_done = true;
+                break;
+            }
+            if (avail > (size - len)) {
+                avail = size - len;
+            }
+            memcpy(&buf[len], &ex->ex_buf[ex->ex_boff], avail);
+            ex->ex_boff += avail;
+            len += avail;
+            continue;
+        }
+
+        /* Finish compressed stream after the tar stream is consumed */
+        flush = (ex->ex_eof && (avail == 0)) ? Z_FINISH : Z_NO_FLUSH;
+        zstream->next_in = (Bytef *)&ex->ex_buf[ex->ex_boff];
+        zstream->avail_in = avail;
+        zstream->next_out = (Bytef *)&buf[len];
+        zstream->avail_out = size - len;
+        err = deflate(zstream, flush);
+        assert(err != Z_STREAM_ERROR);
+        ex->ex_boff += avail - zstream->avail_in;
+        len = size - zstream->avail_out;
+        if (err == Z_STREAM_END) {
+            ex->ex_done = true;
+        }
+    }
+    lc_unlock(fs);
+    ex->ex_off += len;
+    fuse_reply_buf(req, buf, len);
+    lc_free(rfs, buf, size, LC_MEMTYPE_EXPORT);
+}
+
+/* Close a tar stream of changes in a layer */
+void
+lc_exportRelease(struct gfs *gfs, struct export *ex) {
+    struct fs *rfs = lc_getGlobalFs(gfs);
+
+    if (ex->ex_gzip) {
+        deflateEnd(&ex->ex_zstream);
+    }
+    __sync_sub_and_fetch(&ex->ex_fs->fs_exports, 1);
+    lc_printf("Exported %ld bytes from layer %d\n",
+              ex->ex_off, ex->ex_fs->fs_gindex);
+    lc_free(rfs, ex->ex_buf, LC_EXPORT_BUFSIZE, LC_MEMTYPE_EXPORT);
+    if (ex->ex_send) {
+        lc_sendFree(ex->ex_fs, ex);
+    } else {
+        lc_free(rfs, ex->ex_paths, ex->ex_psize, LC_MEMTYPE_EXPORT);
+        lc_free(rfs, ex->ex_changes,
+                ex->ex_count * sizeof(struct xchange), LC_MEMTYPE_EXPORT);
+    }
+    lc_free(rfs, ex, sizeof(struct export), LC_MEMTYPE_EXPORT);
+}
+
+/* Find the inode exporting changes in the layer named in a file name, or
+ * streaming the layer.
+ */
+ino_t
+lc_exportLookup(struct fs *rfs, const char *name) {
+    size_t len = strlen(name), plen = strlen(LC_EXPORT_PREFIX);
+    size_t slen = strlen(LC_EXPORT_SUFFIX);
+    ino_t ino = LC_EXPORT_INODE, root;
+    char *layer;
+
+    if (rfs->fs_gfs->gfs_layerRootInode == NULL) {
+        return LC_INVALID_INODE;
+    }
+    if ((len > strlen(LC_SEND_PREFIX)) &&
+        !strncmp(name, LC_SEND_PREFIX, strlen(LC_SEND_PREFIX))) {
+        plen = strlen(LC_SEND_PREFIX);
+        slen = 0;
+        ino = LC_SEND_INODE;
+    } else if ((len <= (plen + slen)) ||
+               strncmp(name, LC_EXPORT_PREFIX, plen)) {
+        return LC_INVALID_INODE;
+    } else if ((len > (plen + strlen(LC_EXPORT_GZIP_SUFFIX))) &&
+               !strcmp(&name[len - strlen(LC_EXPORT_GZIP_SUFFIX)],
+                       LC_EXPORT_GZIP_SUFFIX)) {
+        slen = strlen(LC_EXPORT_GZIP_SUFFIX);
+        ino = LC_EXPORT_GZIP_INODE;
+    } else if (strcmp(&name[len - slen], LC_EXPORT_SUFFIX)) {
+        return LC_INVALID_INODE;
+    }
+    len -= plen + slen;
+    layer = alloca(len + 1);
+    memcpy(layer, &name[plen], len);
+    layer[len] = 0;
+    root = lc_getRootIno(rfs, layer, NULL, false);
+    if (root == LC_INVALID_INODE) {
+        return LC_INVALID_INODE;
+    }
+    return lc_setHandle(lc_getFsHandle(root), ino);
+}
@@ -184,5 +184,34 @@ lc_extentAdjacent(uint64_t estart, uint64_t eblock, uint64_t count,
 #define LC_EXTENT_LAYER 0x04  /* Keep the extents in layer pool */
 #define LC_EXTENT_KEEP  0x08  /* Keep the extents after flush */
 #define LC_EXTENT_REUSE 0x10  /* Do not release to free pool */
+#define LC_EXTENT_DEDUP 0x20  /* List of extents shared from other layers */
+
+/* Size of the hash table indexing contents of files */
+#define LC_DEDUP_HASH_SIZE  4096
+
+/* A file with contents in a single extent, indexed by a hash of contents */
+struct dedup {
+
+    /* Hash of contents of the file */
+    uint64_t dd_hash;
+
+    /* Size of the file */
+    uint64_t dd_size;
+
+    /* First block of the extent */
+    uint64_t dd_block;
+
+    /* Number of blocks in the extent */
+    uint64_t dd_count;
+
+    /* Inode number of the file */
+    ino_t dd_ino;
+
+    /* Layer the extent is allocated in */
+    struct fs *dd_fs;
+
+    /* Next entry in the hash list */
+    struct dedup *dd_next;
+};
 
 #endif
@@ -2,6 +2,27 @@
 
 #define LC_TIMEOUT_SEC  1.0
 
+/* Frozen layers do not change, so kernel could cache those for ever */
+#define LC_TIMEOUT_FROZEN_SEC   (365.0 * 24 * 60 * 60)
+
+/* Check if kernel could cache attributes of an inode or entries of a
+ * directory for long.  Only inodes owned by a frozen layer qualify, as
+ * inodes inherited from parent layers are resolved through a different
+ * parent once a layer is committed.  Root directories of frozen layers are
+ * excluded too as those are rebuilt when a layer is committed.
+ */
+static inline bool
+lc_cacheLong(struct fs *fs, struct inode *inode) {
+    return fs->fs_frozen && (inode->i_fs == fs) &&
+           (inode->i_ino != fs->fs_root);
+}
+
+/* Return how long kernel could cache the specified inode */
+static inline double
+lc_cacheTimeout(struct fs *fs, struct inode *inode) {
+    return lc_cacheLong(fs, inode) ? LC_TIMEOUT_FROZEN_SEC : LC_TIMEOUT_SEC;
+}
+
 /* Initialize default values in fuse_entry_param structure.
  */
 void
@@ -13,6 +34,16 @@ lc_epInit(struct fuse_entry_param *ep) {
     ep->entry_timeout = LC_TIMEOUT_SEC;
 }
 
+/* Set up timeouts for an entry found in directory dir in layer dfs, for an
+ * inode in layer fs.
+ */
+void
+lc_epTimeout(struct fuse_entry_param *ep, struct fs *dfs, struct inode *dir,
+             struct fs *fs, struct inode *inode) {
+    ep->attr_timeout = lc_cacheTimeout(fs, inode);
+    ep->entry_timeout = lc_cacheTimeout(dfs, dir);
+}
+
 /* Create a new directory entry and associated inode */
 static int
 lc_createInode(struct fs *fs, ino_t parent, const char *name, mode_t mode,
@@ -76,6 +107,7 @@ lc_createInode(struct fs *fs, ino_t parent, const char *name, mode_t mode,
         inode->i_ocount++;
         fi->fh = (uint64_t)inode;
     }
+    lc_inodeRef(inode);
     lc_inodeUnlock(inode);
     ep->ino = lc_setHandle(fs->fs_gindex, ino);
     lc_epInit(ep);
@@ -292,9 +324,34 @@ lc_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
             goto out;
         }
 
+        /* Return the virtual file exporting stats */
+        if ((lc_getInodeHandle(parent) == LC_ROOT_INODE) &&
+            !lc_getFsHandle(parent) && !strcmp(name, LC_STATS_FILE)) {
+            memset(&ep, 0, sizeof(struct fuse_entry_param));
+            lc_statsFileStat(&ep.attr);
+            ep.ino = LC_STATS_INODE;
+            ep.generation = 1;
+            fuse_reply_entry(req, &ep);
+            goto out;
+        }
+
+        /* Return a virtual file exporting changes in a layer */
+        if ((lc_getInodeHandle(parent) == LC_ROOT_INODE) &&
+            !lc_getFsHandle(parent)) {
+            ino = lc_exportLookup(fs, name);
+            if (ino != LC_INVALID_INODE) {
+                memset(&ep, 0, sizeof(struct fuse_entry_param));
+                lc_exportFileStat(&ep.attr, ino);
+                ep.ino = ino;
+                ep.generation = 1;
+                fuse_reply_entry(req, &ep);
+                goto out;
+            }
+        }
+
         /* Let kernel remember lookup failure as a negative entry */
         memset(&ep, 0, sizeof(struct fuse_entry_param));
-        ep.entry_timeout = LC_TIMEOUT_SEC;
+        ep.entry_timeout = lc_cacheTimeout(fs, dir);
         fuse_reply_entry(req, &ep);
         err = ENOENT;
         goto out;
@@ -319,9 +376,11 @@ lc_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
         err = ENOENT;
     } else {
         lc_copyStat(&ep.attr, inode);
+        lc_inodeRef(inode);
         lc_inodeUnlock(inode);
         ep.ino = lc_setHandle(gindex, ino);
         lc_epInit(&ep);
+        lc_epTimeout(&ep, fs, dir, nfs ? nfs : fs, inode);
         fuse_reply_entry(req, &ep);
     }
 
@@ -333,18 +392,53 @@ out:
     }
 }
 
+/* Kernel dropped references on an inode */
+static void
+lc_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    struct fuse_forget_data forget;
+
+    lc_displayEntry(__func__, ino, 0, NULL);
+    forget.ino = ino;
+    forget.nlookup = nlookup;
+    lc_forgetInodes(getfs(), &forget, 1);
+    fuse_reply_none(req);
+}
+
+/* Kernel dropped references on a batch of inodes */
+static void
+lc_forget_multi(fuse_req_t req, size_t count,
+                struct fuse_forget_data *forgets) {
+    lc_forgetInodes(getfs(), forgets, count);
+    fuse_reply_none(req);
+}
+
 /* Get attributes of a file */
 static void
 lc_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
     struct timeval start;
     struct inode *inode;
     struct stat stbuf;
+    double timeout;
     struct fs *fs;
     ino_t parent;
     int err = 0;
 
     lc_displayEntry(__func__, 0, ino, NULL);
 
+    /* Size of the file exporting stats is not known until read */
+    if (ino == LC_STATS_INODE) {
+        lc_statsFileStat(&stbuf);
+        fuse_reply_attr(req, &stbuf, 0);
+        return;
+    }
+
+    /* Size of a tar stream of changes in a layer is not known either */
+    if (lc_exportInode(ino)) {
+        lc_exportFileStat(&stbuf, ino);
+        fuse_reply_attr(req, &stbuf, 0);
+        return;
+    }
+
     /* Check if the operation is on the fake inode */
     if ((lc_getInodeHandle(ino) == LC_COMMIT_TRIGGER_INODE) &&
         lc_getFsHandle(ino)) {
@@ -364,10 +458,11 @@ lc_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
     }
     lc_copyStat(&stbuf, inode);
     parent = inode->i_parent;
+    timeout = lc_cacheTimeout(fs, inode);
     lc_inodeUnlock(inode);
     stbuf.st_ino = lc_setHandle(lc_getIndex(fs, parent, stbuf.st_ino),
                                 stbuf.st_ino);
-    fuse_reply_attr(req, &stbuf, LC_TIMEOUT_SEC);
+    fuse_reply_attr(req, &stbuf, timeout);
 
 out:
     lc_statsAdd(fs, LC_GETATTR, err, &start);
@@ -387,6 +482,12 @@ lc_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 
     lc_displayEntry(__func__, ino, 0, NULL);
 
+    /* Files exporting stats or changes cannot be modified */
+    if ((ino == LC_STATS_INODE) || lc_exportInode(ino)) {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
     /* Check if the operation is on the fake inode */
     if ((lc_getInodeHandle(ino) == LC_COMMIT_TRIGGER_INODE) &&
         lc_getFsHandle(ino)) {
@@ -906,6 +1007,7 @@ lc_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
     lc_updateInodeTimes(inode, false, true);
     lc_markInodeDirty(inode, 0);
     lc_copyStat(&ep.attr, inode);
+    lc_inodeRef(inode);
     lc_inodeUnlock(inode);
     ep.ino = lc_setHandle(fs->fs_gindex, ino);
     lc_epInit(&ep);
@@ -1071,6 +1173,38 @@ lc_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 
     lc_statsBegin(&start);
     lc_displayEntry(__func__, 0, ino, NULL);
+
+    /* Stats are rendered when the file exporting those is opened */
+    if (ino == LC_STATS_INODE) {
+        if (fi->flags & (O_WRONLY | O_RDWR)) {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+        fi->fh = (uint64_t)lc_statsExport(getfs());
+        fi->direct_io = 1;
+        if (fuse_reply_open(req, fi)) {
+            lc_statsExportFree(getfs(), (struct sbuf *)fi->fh);
+        }
+        return;
+    }
+
+    /* Changes in the layer are found when a tar stream of those is opened */
+    if (lc_exportInode(ino)) {
+        if (fi->flags & (O_WRONLY | O_RDWR)) {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+        fi->fh = (uint64_t)lc_exportOpen(getfs(), ino, &err);
+        if (fi->fh == 0) {
+            fuse_reply_err(req, err);
+            return;
+        }
+        fi->direct_io = 1;
+        if (fuse_reply_open(req, fi)) {
+            lc_exportRelease(getfs(), (struct export *)fi->fh);
+        }
+        return;
+    }
     fs = lc_getLayerLocked(ino, false);
     err = lc_openInode(fs, ino, fi);
     if (unlikely(err)) {
@@ -1097,6 +1231,7 @@ lc_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
     struct inode *inode;
     struct page **pages;
     char **dbuf = NULL;
+    struct sbuf *sb;
     off_t endoffset;
     uint64_t pcount;
     int i, err = 0;
@@ -1111,6 +1246,25 @@ lc_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
         fuse_reply_buf(req, NULL, 0);
         return;
     }
+
+    /* Read stats rendered when the file was opened */
+    if (ino == LC_STATS_INODE) {
+        sb = (struct sbuf *)fi->fh;
+        if (off >= sb->sb_len) {
+            fuse_reply_buf(req, NULL, 0);
+        } else {
+            fuse_reply_buf(req, &sb->sb_buf[off],
+                           ((off + size) > sb->sb_len) ?
+                           (sb->sb_len - off) : size);
+        }
+        return;
+    }
+
+    /* Tar stream of changes in a layer is generated as it is read */
+    if (lc_exportInode(ino)) {
+        lc_exportRead(req, (struct export *)fi->fh, size, off);
+        return;
+    }
     endoffset = off + size;
     pcount = ((endoffset + LC_BLOCK_SIZE - 1) -
               (off & ~(LC_BLOCK_SIZE - 1))) / LC_BLOCK_SIZE;
@@ -1158,7 +1312,7 @@ retry:
     }
 
 out:
-    lc_waitMemory(fs->fs_gfs, false);
+    lc_waitMemory(fs->fs_gfs, false, 0);
     lc_statsAdd(fs, LC_READ, err, &start);
     lc_unlock(fs);
 }
@@ -1170,6 +1324,9 @@ lc_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 
     lc_displayEntry(__func__, ino, 0, NULL);
     fuse_reply_err(req, 0);
+    if ((ino == LC_STATS_INODE) || lc_exportInode(ino)) {
+        return;
+    }
     if (inode) {
         lc_statsAdd(inode->i_fs, LC_FLUSH, 0, NULL);
     } else {
@@ -1199,6 +1356,16 @@ lc_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
     bool inval;
 
     lc_displayEntry(__func__, ino, 0, NULL);
+    if (ino == LC_STATS_INODE) {
+        fuse_reply_err(req, 0);
+        lc_statsExportFree(gfs, (struct sbuf *)fi->fh);
+        return;
+    }
+    if (lc_exportInode(ino)) {
+        fuse_reply_err(req, 0);
+        lc_exportRelease(gfs, (struct export *)fi->fh);
+        return;
+    }
     if ((struct inode *)fi->fh == NULL) {
         fuse_reply_err(req, 0);
         assert(lc_getInodeHandle(ino) == LC_COMMIT_TRIGGER_INODE);
@@ -1219,18 +1386,57 @@ lc_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
     lc_unlock(fs);
 }
 
+/* Wait for a checkpoint to make changes in a layer durable and complete the
+ * request.  Called with the layer unlocked so that the layer could be
+ * checkpointed, and the layer is not looked up again as it could be removed
+ * in the meantime.
+ */
+static void
+lc_fsyncWait(fuse_req_t req, ino_t ino) {
+    int err = lc_waitCheckpoint(getfs());
+
+    if (err) {
+        lc_reportError(__func__, __LINE__, ino, err);
+    }
+    fuse_reply_err(req, err);
+}
+
 /* Sync a file */
 static void
 lc_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
           struct fuse_file_info *fi) {
-    struct inode *inode = (struct inode *)fi->fh;
+    bool checkpoint = false;
+    struct timeval start;
+    struct inode *inode;
+    struct fs *fs;
+    int err = 0;
 
-    /* Fsync is disabled in this file system as layers are made persistent when
-     * needed.
+    /* Fsync is a no-op unless intent log is enabled for the layer, as layers
+     * are made persistent when needed otherwise.
      */
+    lc_statsBegin(&start);
     lc_displayEntry(__func__, ino, 0, NULL);
-    fuse_reply_err(req, 0);
-    lc_statsAdd(inode->i_fs, LC_FSYNC, 0, NULL);
+    fs = lc_getLayerLocked(ino, false);
+    if (fs->fs_log && !fs->fs_frozen) {
+        inode = lc_getInode(fs, ino, (struct inode *)fi->fh, false, false);
+        if (unlikely(inode == NULL)) {
+            err = ENOENT;
+        } else if (S_ISREG(inode->i_mode)) {
+            checkpoint = !lc_logInode(getfs(), fs, inode);
+        } else {
+            lc_inodeUnlock(inode);
+        }
+    }
+
+    lc_statsAdd(fs, LC_FSYNC, err, &start);
+    lc_unlock(fs);
+
+    /* If the inode could not be logged, wait for a checkpoint instead */
+    if (checkpoint) {
+        lc_fsyncWait(req, ino);
+    } else {
+        fuse_reply_err(req, err);
+    }
 }
 
 /* Open a directory */
@@ -1247,6 +1453,11 @@ lc_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
     if (unlikely(err)) {
         fuse_reply_err(req, err);
     } else {
+#if defined(FUSE3) && (FUSE_VERSION >= FUSE_MAKE_VERSION(3, 5))
+
+        /* Let kernel cache entries of directories in frozen layers */
+        fi->cache_readdir = lc_cacheLong(fs, (struct inode *)fi->fh);
+#endif
         err = fuse_reply_open(req, fi);
         if (err) {
             lc_closeInode(fs, (struct inode *)fi->fh, fi, NULL);
@@ -1301,14 +1512,24 @@ lc_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
 static void
 lc_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
              struct fuse_file_info *fi) {
-    struct inode *inode = (struct inode *)fi->fh;
+    struct timeval start;
+    bool checkpoint;
+    struct fs *fs;
 
-    /* Fsync is disabled in this file system as layers are made persistent when
-     * needed.
+    /* Fsync is a no-op unless intent log is enabled for the layer.  Changes
+     * to directories are not logged, so wait for a checkpoint in that case.
      */
+    lc_statsBegin(&start);
     lc_displayEntry(__func__, ino, 0, NULL);
-    fuse_reply_err(req, 0);
-    lc_statsAdd(inode->i_fs, LC_FSYNCDIR, 0, NULL);
+    fs = lc_getLayerLocked(ino, false);
+    checkpoint = fs->fs_log && !fs->fs_frozen;
+    lc_statsAdd(fs, LC_FSYNCDIR, false, &start);
+    lc_unlock(fs);
+    if (checkpoint) {
+        lc_fsyncWait(req, ino);
+    } else {
+        fuse_reply_err(req, 0);
+    }
 }
 
 /* File system statfs */
@@ -1364,7 +1585,7 @@ lc_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size
 
     /* Check if the request is for finding changes made in a layer */
     if ((ino == gfs->gfs_layerRoot) &&
-        ((size == sizeof(uint64_t)) || (size == LC_BLOCK_SIZE)) &&
+        ((size == sizeof(uint64_t)) || (size >= LC_BLOCK_SIZE)) &&
         (lc_layerDiff(req, name, size) == 0)) {
         return;
     }
@@ -1376,9 +1597,10 @@ lc_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size
         return;
     }
 
-    /* Take care of the special inode when commit is in progress */
-    if ((lc_getInodeHandle(ino) == LC_COMMIT_TRIGGER_INODE) &&
-        lc_getFsHandle(ino)) {
+    /* Take care of the special inodes */
+    if ((ino == LC_STATS_INODE) || lc_exportInode(ino) ||
+        ((lc_getInodeHandle(ino) == LC_COMMIT_TRIGGER_INODE) &&
+         lc_getFsHandle(ino))) {
         fuse_reply_err(req, ENODATA);
         return;
     }
@@ -1397,7 +1619,8 @@ lc_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
     lc_displayEntry(__func__, ino, 0, NULL);
 
     /* If the file system does not have any extended attributes, return */
-    if (!gfs->gfs_xattr_enabled) {
+    if (!gfs->gfs_xattr_enabled || (ino == LC_STATS_INODE) ||
+        lc_exportInode(ino)) {
         //lc_reportError(__func__, __LINE__, ino, ENODATA);
         if (size == 0) {
             fuse_reply_xattr(req, 0);
@@ -1423,9 +1646,10 @@ lc_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
         return;
     }
 
-    /* Take care of the special inode when commit is in progress */
-    if ((lc_getInodeHandle(ino) == LC_COMMIT_TRIGGER_INODE) &&
-        lc_getFsHandle(ino)) {
+    /* Take care of the special inodes */
+    if ((ino == LC_STATS_INODE) || lc_exportInode(ino) ||
+        ((lc_getInodeHandle(ino) == LC_COMMIT_TRIGGER_INODE) &&
+         lc_getFsHandle(ino))) {
         fuse_reply_err(req, ENODATA);
         return;
     }
@@ -1492,7 +1716,9 @@ lc_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
     op = _IOC_NR(cmd);
 
     /* XXX For allowing graphdriver tests to run */
-    if (unlikely((op == LAYER_CREATE) && (gfs->gfs_layerRoot != ino))) {
+    if (unlikely(((op == LAYER_CREATE) || (op == LAYER_CREATE_BATCH) ||
+                  (op == LAYER_RECEIVE) || (op == LAYER_EXTRACT)) &&
+                 (gfs->gfs_layerRoot != ino))) {
         assert(gfs->gfs_layerRoot == ino);
         lc_setLayerRoot(gfs, ino);
     }
@@ -1526,6 +1752,48 @@ lc_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
         lc_createLayer(req, gfs, layer, parent, len, op == LAYER_CREATE_RW);
         break;
 
+    case LAYER_CREATE_BATCH:
+
+        /* Name of the parent is followed by names of the new layers */
+        len = _IOC_TYPE(cmd);
+        if ((len == 0) || ((size_t)len >= in_bufsz)) {
+            fuse_reply_err(req, EINVAL);
+            break;
+        }
+        name[len] = 0;
+        lc_createLayers(req, gfs, name, len, &name[len + 1],
+                        in_bufsz - len - 1, out_bufsz);
+        break;
+
+    case LAYER_RECEIVE:
+    case LAYER_EXTRACT:
+
+        /* Name of the layer is followed by the file with the stream or the
+         * archive.
+         */
+        len = _IOC_TYPE(cmd);
+        if (len) {
+            parent = name;
+            name[len] = 0;
+            layer = &name[len + 1];
+        } else {
+            parent = "";
+            layer = name;
+        }
+        if (((size_t)len >= in_bufsz) ||
+            ((layer + strlen(layer)) >= &name[in_bufsz])) {
+            fuse_reply_err(req, EINVAL);
+            break;
+        }
+        if (op == LAYER_RECEIVE) {
+            lc_receiveLayer(req, gfs, layer, parent, len,
+                            &layer[strlen(layer) + 1]);
+        } else {
+            lc_extractLayer(req, gfs, layer, parent, len,
+                            &layer[strlen(layer) + 1]);
+        }
+        break;
+
     case LAYER_REMOVE:
         lc_deleteLayer(req, gfs, name);
         break;
@@ -1535,6 +1803,8 @@ lc_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
     case LAYER_UMOUNT:
     case UMOUNT_ALL:
     case CLEAR_STAT:
+    case LAYER_LOG_ENABLE:
+    case LAYER_LOG_DISABLE:
         lc_layerIoctl(req, gfs, name, op);
         break;
 
@@ -1564,6 +1834,11 @@ lc_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
             break;
         }
 
+    case LAYER_HOT:
+        lc_hotDisplay(gfs);
+        fuse_reply_ioctl(req, 0, NULL, 0);
+        break;
+
     case DCACHE_FLUSH:
         gfs->gfs_pcleaningForced = true;
         pthread_cond_signal(&gfs->gfs_flusherCond);
@@ -1656,7 +1931,7 @@ lc_write_buf(fuse_req_t req, fuse_ino_t ino,
     }
 
     /* Make sure enough memory available before proceeding */
-    lc_waitMemory(gfs, true);
+    lc_waitMemory(gfs, true, pcount);
 
     /* Copy in the data before taking the lock */
     pcount = lc_copyPages(fs, off, size, dpages, bufv, dst);
@@ -1688,6 +1963,7 @@ lc_write_buf(fuse_req_t req, fuse_ino_t ino,
     lc_updateInodeTimes(inode, true, true);
     lc_markInodeDirty(inode, LC_INODE_EMAPDIRTY);
     lc_inodeUnlock(inode);
+    lc_hotAdd(gfs, fs->fs_gindex, inode->i_ino, size, true, 0);
 
 out:
 
@@ -1713,15 +1989,16 @@ out:
     lc_unlock(fs);
 }
 
-#ifdef LC_FALLOCATE_ENABLE
-/* Allocate requested space */
+/* Preallocate space, punch holes or zero out a range of a file */
 static void
 lc_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
              off_t offset, off_t length, struct fuse_file_info *fi) {
-    bool hole = mode & FALLOC_FL_PUNCH_HOLE;
-    uint64_t endoffset = offset + length;
+    bool punch = mode & FALLOC_FL_PUNCH_HOLE;
+    bool zero = mode & FALLOC_FL_ZERO_RANGE;
+    uint64_t endoffset = offset + length, pstart, pcount;
     struct timeval start;
     struct inode *inode;
+    size_t size;
     struct gfs *gfs;
     struct fs *fs;
     int err = 0;
@@ -1734,7 +2011,23 @@ lc_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
         err = EROFS;
         goto out;
     }
+
+    /* Punching a hole is supported only when size is not changed */
+    if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+                  FALLOC_FL_ZERO_RANGE)) ||
+        (punch && (zero || !(mode & FALLOC_FL_KEEP_SIZE)))) {
+        lc_reportError(__func__, __LINE__, ino, EOPNOTSUPP);
+        err = EOPNOTSUPP;
+        goto out;
+    }
     gfs = fs->fs_gfs;
+    pstart = offset / LC_BLOCK_SIZE;
+    pcount = ((endoffset + LC_BLOCK_SIZE - 1) / LC_BLOCK_SIZE) - pstart;
+    if (!punch && !lc_hasSpace(gfs, fs == lc_getGlobalFs(gfs), false)) {
+        lc_reportError(__func__, __LINE__, ino, ENOSPC);
+        err = ENOSPC;
+        goto out;
+    }
     inode = lc_getInode(fs, ino, (struct inode *)fi->fh, true, true);
     if (unlikely(inode == NULL)) {
         lc_reportError(__func__, __LINE__, ino, ENOENT);
@@ -1742,24 +2035,36 @@ lc_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
         goto out;
     }
     assert(S_ISREG(inode->i_mode));
-    if (hole) {
-        if (offset > inode->i_size) {
-            goto out;
-        }
-        if (endoffset < inode->i_size) {
-            lc_reportError(__func__, __LINE__, ino, EOPNOTSUPP);
-            err = EOPNOTSUPP;
-            goto out;
-        }
-        lc_truncateFile(inode, endoffset, false);
+    size = inode->i_size;
+
+    /* Block count of the inode is limited to 32 bits */
+    if (!punch && ((inode->i_dinode.di_blocks + pcount) > UINT32_MAX)) {
+        lc_inodeUnlock(inode);
+        lc_reportError(__func__, __LINE__, ino, EFBIG);
+        err = EFBIG;
+        goto out;
+    }
+
+    /* Free blocks in the range and zero out partial pages */
+    if (punch || zero) {
+        lc_zeroRange(inode, offset, endoffset);
     }
 
-    /* XXX Reserve blocks for this inode so that future writes will not
-     * encounter ENOSPC.
+    /* Reserve blocks for holes in the range, so that future writes will not
+     * encounter ENOSPC and the file could be placed contiguous on disk.
      */
-    if (!(mode & FALLOC_FL_KEEP_SIZE)) {
-        lc_updateInodeSize(gfs, inode, true, endoffset);
+    if (!punch) {
+        err = lc_emapPrealloc(gfs, fs, inode, pstart, pcount);
+        if (err) {
+            lc_reportError(__func__, __LINE__, ino, err);
+        } else if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+            lc_updateInodeSize(gfs, inode, true, endoffset);
+        }
     }
+    if (punch || zero || (inode->i_size != size)) {
+        lc_updateInodeTimes(inode, true, true);
+    }
+    lc_markInodeDirty(inode, LC_INODE_EMAPDIRTY);
     lc_inodeUnlock(inode);
 
 out:
@@ -1767,6 +2072,73 @@ out:
     lc_statsAdd(fs, LC_FALLOCATE, err, &start);
     lc_unlock(fs);
 }
+
+#ifdef LC_LSEEK_ENABLE
+/* Find next data or hole in a file */
+static void
+lc_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+         struct fuse_file_info *fi) {
+    struct timeval start;
+    struct inode *inode;
+    off_t noff, len;
+    struct fs *fs;
+    int err = 0;
+
+    lc_statsBegin(&start);
+    lc_displayEntry(__func__, ino, 0, NULL);
+
+    /* Other types of seek are handled in the kernel */
+    if ((whence != SEEK_DATA) && (whence != SEEK_HOLE)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    /* File exporting stats does not have any holes */
+    if (ino == LC_STATS_INODE) {
+        len = ((struct sbuf *)fi->fh)->sb_len;
+        if (off >= len) {
+            fuse_reply_err(req, ENXIO);
+        } else {
+            fuse_reply_lseek(req, (whence == SEEK_DATA) ? off : len);
+        }
+        return;
+    }
+
+    /* Tar streams of changes in layers can only be read sequentially */
+    if (lc_exportInode(ino)) {
+        fuse_reply_err(req, ENXIO);
+        return;
+    }
+    fs = lc_getLayerLocked(ino, false);
+    inode = lc_getInode(fs, ino, (struct inode *)fi->fh, false, false);
+    if (unlikely(inode == NULL)) {
+        lc_reportError(__func__, __LINE__, ino, ENOENT);
+        fuse_reply_err(req, ENOENT);
+        err = ENOENT;
+        goto out;
+    }
+    assert(S_ISREG(inode->i_mode));
+
+    /* Seeking at or beyond size of the file is not allowed */
+    if (off >= inode->i_size) {
+        lc_inodeUnlock(inode);
+        fuse_reply_err(req, ENXIO);
+        err = ENXIO;
+        goto out;
+    }
+    noff = lc_seekFile(fs->fs_gfs, inode, off, whence == SEEK_DATA);
+    lc_inodeUnlock(inode);
+    if (noff < 0) {
+        fuse_reply_err(req, ENXIO);
+        err = ENXIO;
+    } else {
+        fuse_reply_lseek(req, noff);
+    }
+
+out:
+    lc_statsAdd(fs, LC_LSEEK, err, &start);
+    lc_unlock(fs);
+}
 #endif
 
 #ifdef FUSE3
@@ -1809,6 +2181,11 @@ lc_init(void *userdata, struct fuse_conn_info *conn) {
 
     /* Let kernel take care of setuid business */
     conn->want &= ~FUSE_CAP_HANDLE_KILLPRIV;
+
+    /* Let kernel cache writes if enabled */
+    if (gfs->gfs_writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
 #else
 
     /* Need to support ioctls on directories */
@@ -1850,7 +2227,7 @@ struct fuse_lowlevel_ops lc_ll_oper = {
     .init       = lc_init,
     .destroy    = lc_destroy,
     .lookup     = lc_lookup,
-    //.forget     = lc_forget,
+    .forget     = lc_forget,
     .getattr    = lc_getattr,
     .setattr    = lc_setattr,
     .readlink   = lc_readlink,
@@ -1887,15 +2264,16 @@ struct fuse_lowlevel_ops lc_ll_oper = {
     .poll       = lc_poll,
 #endif
     .write_buf  = lc_write_buf,
+    .forget_multi = lc_forget_multi,
 #if 0
     .retrieve_reply = lc_retrieve_reply,
-    .forget_multi = lc_forget_multi,
     .flock      = lc_flock,
 #endif
-#ifdef LC_FALLOCATE_ENABLE
     .fallocate  = lc_fallocate,
-#endif
 #ifdef FUSE3
     .readdirplus = lc_readdirplus,
 #endif
+#ifdef LC_LSEEK_ENABLE
+    .lseek      = lc_lseek,
+#endif
 };
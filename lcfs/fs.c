@@ -14,9 +14,12 @@ lc_newLayer(struct gfs *gfs, bool rw) {
     pthread_mutex_init(&fs->fs_ilock, NULL);
 #endif
     pthread_mutex_init(&fs->fs_plock, NULL);
+    pthread_cond_init(&fs->fs_wcond, NULL);
     pthread_mutex_init(&fs->fs_dilock, NULL);
     pthread_mutex_init(&fs->fs_alock, NULL);
     pthread_mutex_init(&fs->fs_hlock, NULL);
+    pthread_mutex_init(&fs->fs_jlock, NULL);
+    pthread_mutex_init(&fs->fs_dlock, NULL);
     pthread_rwlock_init(&fs->fs_rwlock, NULL);
     __sync_add_and_fetch(&gfs->gfs_count, 1);
     return fs;
@@ -111,6 +114,7 @@ lc_freeLayer(struct fs *fs, bool remove) {
     struct gfs *gfs = fs->fs_gfs;
 
     assert(fs->fs_dpcount == 0);
+    assert(fs->fs_wpcount == 0);
     assert(fs->fs_dpages == NULL);
     assert(fs->fs_dpagesLast == NULL);
     assert(fs->fs_inodePagesCount == 0);
@@ -129,10 +133,13 @@ lc_freeLayer(struct fs *fs, bool remove) {
 
     lc_freeHlinks(fs);
     assert(fs->fs_hlinks == NULL);
+    lc_journalFree(fs);
+    lc_dedupFree(gfs, fs);
 
     lc_destroyPages(gfs, fs, remove);
     assert(fs->fs_bcache == NULL);
     lc_statsDeinit(fs);
+    lc_logDeinit(fs);
 #ifdef LC_MUTEX_DESTROY
 #ifndef LC_IC_LOCK
     pthread_mutex_destroy(&fs->fs_ilock);
@@ -141,6 +148,11 @@ lc_freeLayer(struct fs *fs, bool remove) {
     pthread_mutex_destroy(&fs->fs_plock);
     pthread_mutex_destroy(&fs->fs_alock);
     pthread_mutex_destroy(&fs->fs_hlock);
+    pthread_mutex_destroy(&fs->fs_jlock);
+    pthread_mutex_destroy(&fs->fs_dlock);
+#endif
+#ifdef LC_COND_DESTROY
+    pthread_cond_destroy(&fs->fs_wcond);
 #endif
 #ifdef LC_RWLOCK_DESTROY
     pthread_rwlock_destroy(&fs->fs_rwlock);
@@ -285,9 +297,12 @@ void
 lc_removeLayer(struct gfs *gfs, struct fs *fs, int gindex) {
     fs->fs_removed = true;
     assert(gfs->gfs_roots[gindex] == fs->fs_root);
+    assert(fs->fs_gindex == gindex);
+    lc_invalLayerInodes(gfs, fs);
     rcu_assign_pointer(gfs->gfs_fs[gindex], NULL);
     synchronize_rcu();
     gfs->gfs_roots[gindex] = 0;
+    lc_hotForgetLayer(gfs, gindex);
     lc_removeChild(fs);
     fs->fs_gindex = -1;
 }
@@ -323,6 +338,33 @@ lc_removeLayers(struct gfs *gfs, struct fs *fs, int gindex) {
     }
 }
 
+/* Check if changes in the layer, or in any parent layer removed along with
+ * it, are being exported.
+ */
+static bool
+lc_layerExported(struct fs *fs) {
+    struct fs *zfs;
+
+    if (fs->fs_exports) {
+        return true;
+    }
+
+    /* Walk the same layers lc_removeLayers removes along with the layer */
+    if ((fs->fs_super->sb_flags & LC_SUPER_RDWR) &&
+        !(fs->fs_super->sb_flags & LC_SUPER_INIT)) {
+        zfs = fs->fs_parent;
+    } else {
+        zfs = fs->fs_zfs;
+    }
+    while (zfs) {
+        if (zfs->fs_exports) {
+            return true;
+        }
+        zfs = zfs->fs_zfs;
+    }
+    return false;
+}
+
 /* Lock a layer exclusive for removal, after taking it off the global
  * list.
  */
@@ -346,6 +388,13 @@ lc_getLayerForRemoval(struct gfs *gfs, ino_t root, struct fs **fsp) {
         lc_reportError(__func__, __LINE__, root, EINVAL);
         return EINVAL;
     }
+
+    /* Layer cannot be removed while its changes are being exported */
+    if (lc_layerExported(fs)) {
+        pthread_mutex_unlock(&gfs->gfs_lock);
+        lc_reportError(__func__, __LINE__, root, EBUSY);
+        return EBUSY;
+    }
     if (fs->fs_child) {
 
         /* Return success if the layer inherited child layers after a layer was
@@ -401,19 +450,38 @@ lc_addChild(struct gfs *gfs, struct fs *pfs, struct fs *fs) {
     }
 }
 
-/* Add a file system to global list of file systems */
+/* Add a number of file systems with the same parent to global list of file
+ * systems, all or none of those.
+ */
 int
-lc_addLayer(struct gfs *gfs, struct fs *fs, struct fs *pfs, int *inval) {
-    struct fs *rfs = fs->fs_rfs;
-    int i;
+lc_addLayers(struct gfs *gfs, struct fs **fss, int count, struct fs *pfs,
+             int *inval) {
+    struct fs *rfs = fss[0]->fs_rfs, *fs;
+    int i, j;
 
-    /* Find a free slot and insert the new file system.
+    /* Find free slots and insert the new file systems.
      * Do not reuse an index in a tree as that would confuse the kernel which
      * might have cached inodes and directory entries.
      */
     pthread_mutex_lock(&gfs->gfs_lock);
-    for (i = rfs->fs_hgindex + 1; i < LC_LAYER_MAX; i++) {
+    for (i = rfs->fs_hgindex + 1, j = 0; (i < LC_LAYER_MAX) && (j < count);
+         i++) {
+        if (gfs->gfs_fs[i] == NULL) {
+            j++;
+        }
+    }
+    if (j < count) {
+        pthread_mutex_unlock(&gfs->gfs_lock);
+        lc_syslog(LOG_ERR,
+                  "Too many layers.  Retry after remount or deleting some.\n");
+        return EOVERFLOW;
+    }
+    *inval = (pfs && pfs->fs_child && pfs->fs_child->fs_single) ?
+             (pfs->fs_child->fs_child ? pfs->fs_child->fs_child->fs_gindex :
+              0) : 0;
+    for (i = rfs->fs_hgindex + 1, j = 0; j < count; i++) {
         if (gfs->gfs_fs[i] == NULL) {
+            fs = fss[j++];
             fs->fs_gindex = i;
             fs->fs_super->sb_index = i;
             gfs->gfs_fs[i] = fs;
@@ -424,25 +492,23 @@ lc_addLayer(struct gfs *gfs, struct fs *fs, struct fs *pfs, int *inval) {
             if (fs != rfs) {
                 rfs->fs_hgindex = i;
             }
-            break;
+
+            /* Add this file system to the layer list or root file systems
+             * list
+             */
+            lc_addChild(gfs, pfs, fs);
         }
     }
-    if (i >= LC_LAYER_MAX) {
-        pthread_mutex_unlock(&gfs->gfs_lock);
-        lc_syslog(LOG_ERR,
-                  "Too many layers.  Retry after remount or deleting some.\n");
-        return EOVERFLOW;
-    }
-    *inval = (pfs && pfs->fs_child && pfs->fs_child->fs_single) ?
-             (pfs->fs_child->fs_child ? pfs->fs_child->fs_child->fs_gindex :
-              0) : 0;
-
-    /* Add this file system to the layer list or root file systems list */
-    lc_addChild(gfs, pfs, fs);
     pthread_mutex_unlock(&gfs->gfs_lock);
     return 0;
 }
 
+/* Add a file system to global list of file systems */
+int
+lc_addLayer(struct gfs *gfs, struct fs *fs, struct fs *pfs, int *inval) {
+    return lc_addLayers(gfs, &fs, 1, pfs, inval);
+}
+
 /* Format a file system by initializing its super block */
 static void
 lc_format(struct gfs *gfs, struct fs *fs, bool ftypes, size_t size) {
@@ -468,14 +534,20 @@ lc_gfsInit(struct gfs *gfs) {
     memset(gfs->gfs_zPage, 0, LC_BLOCK_SIZE);
     memset(gfs->gfs_roots, 0, sizeof(ino_t) * LC_LAYER_MAX);
     gfs->gfs_syncInterval = LC_SYNC_INTERVAL;
+    gfs->gfs_writeRate = LC_WRITE_RATE_DEFAULT;
     pthread_cond_init(&gfs->gfs_mcond, NULL);
     pthread_cond_init(&gfs->gfs_flusherCond, NULL);
     pthread_cond_init(&gfs->gfs_cleanerCond, NULL);
+    pthread_cond_init(&gfs->gfs_reclaimCond, NULL);
+    pthread_cond_init(&gfs->gfs_checkpointCond, NULL);
     pthread_mutex_init(&gfs->gfs_lock, NULL);
     pthread_mutex_init(&gfs->gfs_alock, NULL);
     pthread_mutex_init(&gfs->gfs_clock, NULL);
     pthread_mutex_init(&gfs->gfs_flock, NULL);
     pthread_mutex_init(&gfs->gfs_slock, NULL);
+    pthread_mutex_init(&gfs->gfs_rlock, NULL);
+    lc_hotInit(gfs);
+    lc_dedupInit(gfs);
 }
 
 /* Free resources allocated for the global file system */
@@ -487,6 +559,8 @@ lc_gfsDeinit(struct gfs *gfs) {
     assert(gfs->gfs_dcount == 0);
     assert(gfs->gfs_extents == NULL);
     assert(gfs->gfs_fextents == NULL);
+    assert(gfs->gfs_reclaim == NULL);
+    assert(gfs->gfs_reclaimLast == NULL);
     if (gfs->gfs_fd) {
         err = fsync(gfs->gfs_fd);
         assert(err == 0);
@@ -497,10 +571,14 @@ lc_gfsDeinit(struct gfs *gfs) {
             LC_MEMTYPE_GFS);
     lc_free(NULL, gfs->gfs_roots, sizeof(ino_t) * LC_LAYER_MAX,
             LC_MEMTYPE_GFS);
+    lc_hotDeinit(gfs);
+    lc_dedupDeinit(gfs);
 #ifdef LC_COND_DESTROY
     pthread_cond_destroy(&gfs->gfs_mcond);
     pthread_cond_destroy(&gfs->gfs_flusherCond);
     pthread_cond_destroy(&gfs->gfs_cleanerCond);
+    pthread_cond_destroy(&gfs->gfs_reclaimCond);
+    pthread_cond_destroy(&gfs->gfs_checkpointCond);
 #endif
 #ifdef LC_MUTEX_DESTROY
     pthread_mutex_destroy(&gfs->gfs_lock);
@@ -508,6 +586,7 @@ lc_gfsDeinit(struct gfs *gfs) {
     pthread_mutex_destroy(&gfs->gfs_clock);
     pthread_mutex_destroy(&gfs->gfs_flock);
     pthread_mutex_destroy(&gfs->gfs_slock);
+    pthread_mutex_destroy(&gfs->gfs_rlock);
 #endif
 }
 
@@ -679,12 +758,28 @@ lc_mount(struct gfs *gfs, char *device, bool ftypes, size_t size,
             fs = gfs->gfs_fs[i];
             if (fs) {
                 lc_readExtents(gfs, fs);
+                if (i) {
+                    lc_readSharedExtents(gfs, fs);
+                }
                 lc_readInodes(gfs, fs);
                 if (i) {
                     fs->fs_locked = false;
                 }
             }
         }
+
+        /* Free layers removed before the last checkpoint if those were not
+         * reclaimed before the file system was shut down.
+         */
+        lc_reclaimRemovedLayers(gfs, lc_getGlobalFs(gfs));
+
+        /* Replay intent logs after parent layers are fully instantiated */
+        for (i = 1; i <= gfs->gfs_scount; i++) {
+            fs = gfs->gfs_fs[i];
+            if (fs) {
+                lc_logInit(gfs, fs);
+            }
+        }
         fs = lc_getGlobalFs(gfs);
         lc_setupSpecialInodes(gfs, fs);
         lc_cleanupAfterRestart(gfs, fs);
@@ -772,6 +867,7 @@ lc_syncAllLayers(struct gfs *gfs) {
         if (fs) {
             lc_lockExclusive(fs);
             assert(!fs->fs_removed);
+            lc_logCheckpoint(gfs, fs);
             lc_sync(gfs, fs, fs->fs_child == NULL);
             lc_processLayerBlocks(gfs, fs, true, false, false);
             lc_flushDirtyPages(gfs, fs);
@@ -810,16 +906,22 @@ lc_cleanupAfterRestart(struct gfs *gfs, struct fs *fs) {
     }
 }
 
-/* Commit changes in root layer and write out superblock */
-void
+/* Commit changes in root layer and write out superblock.  Returns true if
+ * the file system is checkpointed.
+ */
+bool
 lc_commitRoot(struct gfs *gfs, int count) {
     struct fs *fs = lc_getGlobalFs(gfs);
+    bool committed = false;
     int err;
 
-    /* Flush dirty pages with shared lock */
-    if (fs->fs_dpcount || fs->fs_pcount) {
+    /* Flush dirty pages and metadata of dirty inodes with shared lock */
+    if (fs->fs_dpcount || fs->fs_pcount || fs->fs_inodesDirty) {
         lc_lock(fs, false);
         lc_flushDirtyInodeList(fs, true);
+        if (fs->fs_inodesDirty) {
+            lc_syncInodesShared(gfs, fs);
+        }
         lc_flushDirtyPages(gfs, fs);
         lc_unlock(fs);
         err = fsync(gfs->gfs_fd);
@@ -829,9 +931,12 @@ lc_commitRoot(struct gfs *gfs, int count) {
     /* Lock the layer exclusive and flush everything and write out superblock
      */
     if (lc_tryLock(fs, true)) {
-        return;
+        return false;
     }
+
+    /* Removed layers not reclaimed yet are written out with the layers */
     if ((gfs->gfs_layerInProgress == 0) && (count == gfs->gfs_syncRequired)) {
+        lc_flushRemovedLayers(gfs);
         lc_allocateSuperBlocks(gfs, fs);
         lc_sync(gfs, fs, false);
         lc_processLayerBlocks(gfs, fs, false, false, true);
@@ -846,22 +951,31 @@ lc_commitRoot(struct gfs *gfs, int count) {
             err = fsync(gfs->gfs_fd);
             assert(err == 0);
         }
+        lc_logCheckpointDone(gfs);
         gfs->gfs_syncRequired -= count;
+        committed = true;
         lc_printf("file system committed to disk\n");
     }
     lc_unlock(fs);
+    return committed;
 }
 
 /* Commit the file system to a consistent state */
 void
 lc_commit(struct gfs *gfs) {
     int i, count, gindex;
+    uint64_t gen;
     struct fs *fs;
 
     if (gfs->gfs_layerInProgress || (gfs->gfs_syncRequired == 0)) {
         return;
     }
 
+    /* Changes made before this point are included in this checkpoint */
+    pthread_mutex_lock(&gfs->gfs_slock);
+    gen = ++gfs->gfs_commitGen;
+    pthread_mutex_unlock(&gfs->gfs_slock);
+
     /* Sync all layers */
     rcu_register_thread();
     rcu_read_lock();
@@ -869,15 +983,20 @@ lc_commit(struct gfs *gfs) {
     for (i = 1; i <= gfs->gfs_scount; i++) {
         fs = rcu_dereference(gfs->gfs_fs[i]);
         if ((fs == NULL) ||
-            (!fs->fs_frozen && fs->fs_mcount && (fs->fs_fextents == NULL)) ||
+            (!fs->fs_frozen && fs->fs_mcount && (fs->fs_fextents == NULL) &&
+             (fs->fs_log == NULL)) ||
             (!fs->fs_inodesDirty && !fs->fs_extentsDirty &&
-             (fs->fs_fextents == NULL))) {
+             (fs->fs_fextents == NULL) &&
+             ((fs->fs_log == NULL) || (fs->fs_log->l_used == 0)))) {
             continue;
         }
         gindex = fs->fs_gindex;
 
-        /* Flush dirty pages with shared lock first */
-        if (fs->fs_dpcount || fs->fs_pcount) {
+        /* Flush dirty pages and metadata of dirty inodes with shared lock
+         * first, so that the layer is locked exclusive for a short while.
+         */
+        if (fs->fs_dpcount || fs->fs_pcount ||
+            (fs->fs_inodesDirty && !fs->fs_frozen)) {
             if (lc_tryLock(fs, false)) {
                 rcu_read_unlock();
                 rcu_unregister_thread();
@@ -891,6 +1010,9 @@ lc_commit(struct gfs *gfs) {
             }
             assert(gindex == fs->fs_gindex);
             lc_flushDirtyInodeList(fs, true);
+            if (fs->fs_inodesDirty && !fs->fs_frozen) {
+                lc_syncInodesShared(gfs, fs);
+            }
             lc_flushDirtyPages(gfs, fs);
             lc_unlock(fs);
             rcu_read_lock();
@@ -913,6 +1035,7 @@ lc_commit(struct gfs *gfs) {
             rcu_unregister_thread();
             return;
         }
+        lc_logCheckpoint(gfs, fs);
         lc_sync(gfs, fs, false);
         lc_processLayerBlocks(gfs, fs, false, false, true);
         if (!fs->fs_frozen) {
@@ -943,8 +1066,45 @@ lc_commit(struct gfs *gfs) {
     if ((gfs->gfs_layerInProgress == 0) && (count == gfs->gfs_syncRequired)) {
 
         /* Sync everything from the root layer */
-        lc_commitRoot(gfs, count);
+        if (lc_commitRoot(gfs, count)) {
+            pthread_mutex_lock(&gfs->gfs_slock);
+            gfs->gfs_checkpointed = gen;
+            pthread_cond_broadcast(&gfs->gfs_checkpointCond);
+            pthread_mutex_unlock(&gfs->gfs_slock);
+        }
+    }
+}
+
+/* Wait for a checkpoint started after this call to complete.  Returns EIO if
+ * the file system could not be checkpointed in time.
+ */
+int
+lc_waitCheckpoint(struct gfs *gfs) {
+    struct timespec interval;
+    struct timeval now;
+    int i, err = EIO;
+    uint64_t gen;
+
+    pthread_mutex_lock(&gfs->gfs_slock);
+    gen = gfs->gfs_commitGen + 1;
+    for (i = 0; (i < LC_CHECKPOINT_WAIT) && !gfs->gfs_unmounting; i++) {
+
+        /* Syncer could skip a checkpoint when layers are busy, so keep
+         * waking it up.
+         */
+        lc_layerChanged(gfs, false, true);
+        gettimeofday(&now, NULL);
+        interval.tv_sec = now.tv_sec + 1;
+        interval.tv_nsec = now.tv_usec * 1000;
+        pthread_cond_timedwait(&gfs->gfs_checkpointCond, &gfs->gfs_slock,
+                               &interval);
+        if (gfs->gfs_checkpointed >= gen) {
+            err = 0;
+            break;
+        }
     }
+    pthread_mutex_unlock(&gfs->gfs_slock);
+    return err;
 }
 
 /* Commit file system periodically */
@@ -16,6 +16,18 @@ enum lc_mountId {
 /* Time in seconds syncer is woken to checkpoint file system */
 #define LC_SYNC_INTERVAL       60
 
+/* Time in seconds waited for a checkpoint requested by fsync */
+#define LC_CHECKPOINT_WAIT     30
+
+/* Time in microseconds reclaimer pauses between removed layers */
+#define LC_RECLAIM_DELAY       10000
+
+/* Minimum number of idle threads kept for serving fuse requests */
+#define LC_FUSE_IDLE_THREADS   10
+
+/* Number of blocks reserved for the intent log of a layer */
+#define LC_LOG_BLOCKS          2048
+
 /* Global file system */
 struct gfs {
 
@@ -52,6 +64,9 @@ struct gfs {
     /* Lock protecting global list of file system chain */
     pthread_mutex_t gfs_lock;
 
+    /* Lock protecting index of contents of files and shared extents */
+    pthread_mutex_t gfs_dlock;
+
     /* Lock used by flusher */
     pthread_mutex_t gfs_flock;
 
@@ -61,6 +76,9 @@ struct gfs {
     /* Lock used by syncer */
     pthread_mutex_t gfs_slock;
 
+    /* Lock protecting list of removed layers being reclaimed */
+    pthread_mutex_t gfs_rlock;
+
     /* Thread serving base mount */
     pthread_t gfs_mountThread;
 
@@ -110,6 +128,24 @@ struct gfs {
     /* Condition variable syncer thread is waiting on */
     pthread_cond_t gfs_syncerCond;
 
+    /* Condition variable reclaimer thread is waiting on */
+    pthread_cond_t gfs_reclaimCond;
+
+    /* Condition variable signalled when a checkpoint is completed */
+    pthread_cond_t gfs_checkpointCond;
+
+    /* Number of checkpoints started */
+    uint64_t gfs_commitGen;
+
+    /* Checkpoint last completed */
+    uint64_t gfs_checkpointed;
+
+    /* Removed layers waiting for their resources to be freed */
+    struct fs *gfs_reclaim;
+
+    /* Last layer in the queue of removed layers */
+    struct fs *gfs_reclaimLast;
+
     /* Count of pages in use */
     uint64_t gfs_pcount;
 
@@ -125,6 +161,28 @@ struct gfs {
     /* Number of writes */
     uint64_t gfs_writes;
 
+    /* Number of blocks written */
+    uint64_t gfs_wblocks;
+
+    /* Number of pages dirtied by writers */
+    uint64_t gfs_dirtied;
+
+    /* Pages dirtied per second, measured by flusher */
+    uint64_t gfs_dirtyRate;
+
+    /* Blocks written back per second, measured by flusher */
+    uint64_t gfs_writeRate;
+
+    /* Counts of pages dirtied and blocks written when rates last measured */
+    uint64_t gfs_rateDirtied;
+    uint64_t gfs_rateWritten;
+
+    /* Time rates were last measured in milliseconds */
+    uint64_t gfs_rateTime;
+
+    /* Number of times writers were throttled */
+    uint64_t gfs_throttled;
+
     /* Inodes cloned */
     uint64_t gfs_clones;
 
@@ -143,6 +201,24 @@ struct gfs {
     /* Pages reused */
     uint64_t gfs_preused;
 
+    /* Hot files and layers */
+    struct hot *gfs_hot;
+
+    /* Index of contents of files in frozen image layers */
+    struct dedup **gfs_dedup;
+
+    /* Layers with files using blocks allocated in other layers */
+    struct fs *gfs_dedupLayers;
+
+    /* Incremented whenever files are taken off of the index */
+    uint64_t gfs_dedupGen;
+
+    /* Number of files sharing blocks of other files */
+    uint64_t gfs_dedupFiles;
+
+    /* Number of blocks shared instead of writing those again */
+    uint64_t gfs_dedupBlocks;
+
     /* Sync interval in seconds */
     int gfs_syncInterval;
 
@@ -155,6 +231,12 @@ struct gfs {
     /* Layer from pages being purged */
     int gfs_cleanerIndex;
 
+    /* Count of removed layers not reclaimed yet */
+    int gfs_reclaimCount;
+
+    /* Number of removed layers reclaimed in the background */
+    uint64_t gfs_reclaimed;
+
     /* Number of mounts */
     uint8_t gfs_mcount;
 
@@ -164,6 +246,9 @@ struct gfs {
     /* Pages being purged */
     bool gfs_pcleaning;
 
+    /* Set when reclaimer is running */
+    bool gfs_reclaiming;
+
     /* Set when purging of pages forced */
     bool gfs_pcleaningForced;
 
@@ -178,10 +263,97 @@ struct gfs {
     /* Set if count of file types maintained */
     bool gfs_ftypes;
 
+    /* Set if kernel is allowed to cache writes */
+    bool gfs_writeback;
+
     /* Set if layers are swapped during commit */
     bool gfs_swapLayersForCommit;
+
+    /* Set if files in image layers share blocks with identical files */
+    bool gfs_dedupEnabled;
+
+    /* Number of idle threads kept for serving fuse requests */
+    unsigned int gfs_idleThreads;
 } __attribute__((packed));
 
+/* A transaction queued for writing to the intent log */
+struct ltrans {
+
+    /* Records and data blocks in the order those are written */
+    struct iovec *lt_iov;
+
+    /* Number of blocks in the transaction */
+    uint64_t lt_count;
+
+    /* Location of the transaction in the log area */
+    uint64_t lt_block;
+
+    /* Sequence number of the last record of the transaction */
+    uint64_t lt_seq;
+
+    /* Next transaction in the queue */
+    struct ltrans *lt_next;
+};
+
+/* Intent log of a read-write layer, making fsync durable between checkpoints
+ */
+struct lclog {
+
+    /* Lock protecting the log */
+    pthread_mutex_t l_lock;
+
+    /* Condition waited on for queued transactions to become durable */
+    pthread_cond_t l_cond;
+
+    /* Transactions queued for writing */
+    struct ltrans *l_pending;
+
+    /* Last transaction queued */
+    struct ltrans *l_pendingLast;
+
+    /* Sequence number of the last record queued */
+    uint64_t l_seq;
+
+    /* Sequence number for the next record */
+    uint64_t l_nextSeq;
+
+    /* Sequence number of the last record made durable */
+    uint64_t l_durable;
+
+    /* Next block in the log area to write */
+    uint64_t l_head;
+
+    /* Blocks in use since the start of the log */
+    uint64_t l_used;
+
+    /* Blocks released once the current checkpoint is on disk */
+    uint64_t l_checkpoint;
+
+    /* Last inode number allocated before the last checkpoint on disk */
+    uint64_t l_inode;
+
+    /* Last inode number allocated before the checkpoint in progress */
+    uint64_t l_cinode;
+
+    /* Log generation in the superblock written last */
+    uint64_t l_gen;
+
+    /* Number of group commits */
+    uint64_t l_commits;
+
+    /* Number of transactions logged */
+    uint64_t l_trans;
+
+    /* Number of blocks written to the log */
+    uint64_t l_blocks;
+
+    /* Set while a thread is writing out queued transactions */
+    bool l_writing;
+
+    /* Set once the log area is recorded in a checkpoint */
+    bool l_ready;
+};
+
 /* A file system structure created for each layer */
 struct fs {
 
@@ -232,6 +404,9 @@ struct fs {
     /* zombie layer to be removed along with */
     struct fs *fs_zfs;
 
+    /* Next removed layer waiting to be reclaimed */
+    struct fs *fs_rnext;
+
     /* Layer file system of this layer */
     struct fs *fs_child;
 
@@ -291,18 +466,65 @@ struct fs {
     /* Dirty page count */
     uint64_t fs_dpcount;
 
+    /* Count of dirty pages taken off of the list and being written */
+    uint64_t fs_wpcount;
+
     /* Lock protecting dirty page list */
     pthread_mutex_t fs_plock;
 
+    /* Condition waited on for pages being written to be written */
+    pthread_cond_t fs_wcond;
+
     /* Lock protecting extent lists */
     pthread_mutex_t fs_alock;
 
     /* Lock protecting hardlinks list */
     pthread_mutex_t fs_hlock;
 
+    /* Lock protecting journal of inodes */
+    pthread_mutex_t fs_jlock;
+
+    /* Lock serializing diffs of the layer */
+    pthread_mutex_t fs_dlock;
+
+    /* Inodes added to or modified in the layer, kept for layers created or
+     * not frozen when the file system is mounted.
+     */
+    ino_t *fs_journal;
+
+    /* Number of inodes in the journal */
+    uint64_t fs_jcount;
+
+    /* Size of the journal */
+    uint64_t fs_jsize;
+
+    /* Inodes tracked in the change list being built */
+    ino_t *fs_tracked;
+
+    /* Number of inodes tracked */
+    uint64_t fs_tcount;
+
+    /* Size of the table of tracked inodes */
+    uint64_t fs_tsize;
+
     /* Changes in this layer compared to parent */
     struct cdir *fs_changes;
 
+    /* Last batch of changes returned, kept until the next one is requested */
+    char *fs_diffBuf;
+
+    /* Size of the buffer of last batch of changes */
+    uint64_t fs_diffSize;
+
+    /* Cursor at the end of the last batch of changes returned */
+    uint64_t fs_diffCursor;
+
+    /* Root of the layer changes are compared against, 0 for parent layer */
+    ino_t fs_diffBase;
+
+    /* Number of tar streams of changes in the layer open */
+    uint32_t fs_exports;
+
     /* Unused extents reserved by a layer */
     struct extent *fs_extents;
 
@@ -312,6 +534,15 @@ struct fs {
     /* Extents freed in layer, including inherited from parent layer */
     struct extent *fs_fextents;
 
+    /* Extents allocated in other layers, shared by files in this layer */
+    struct extent *fs_dextents;
+
+    /* Files to be indexed once the layer is frozen */
+    struct dedup *fs_dpending;
+
+    /* Next layer in the list of layers sharing extents of other layers */
+    struct fs *fs_dnext;
+
 #ifdef DEBUG
 
     /* Extents used for inodes */
@@ -324,6 +555,9 @@ struct fs {
     /* Stats for this file system */
     struct stats *fs_stats;
 
+    /* Intent log, if enabled for the layer */
+    struct lclog *fs_log;
+
     /* Count of inodes */
     uint64_t fs_icount;
 
@@ -375,6 +609,9 @@ struct fs {
     /* Set if extents are dirty */
     bool fs_extentsDirty;
 
+    /* Set if list of extents shared from other layers is dirty */
+    bool fs_dedupDirty;
+
     /* Set if single read-write child of a read-only parent */
     bool fs_single;
 
@@ -396,6 +633,9 @@ struct fs {
     /* Set if hlinks shared with parent */
     bool fs_sharedHlinks;
 
+    /* Set if the journal overflowed and inode cache is scanned for changes */
+    bool fs_jfull;
+
     /* Set while a layer commit is in progress */
     bool fs_commitInProgress;
 
@@ -155,3 +155,236 @@ lc_freeHlinks(struct fs *fs) {
         lc_free(fs, tmp, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
     }
 }
+
+/* Check if a directory in a layer is the one visible in the given layer */
+static bool
+lc_hlinkVisibleDir(struct fs *fs, struct fs *pfs, struct inode *dir) {
+    ino_t ino = dir->i_ino;
+
+    /* Root directory of a parent layer is replaced by that of the layer */
+    if (pfs != fs) {
+        if (ino == pfs->fs_root) {
+            return false;
+        }
+    }
+
+    /* Directory is hidden if a newer layer has its own copy of it */
+    while (fs != pfs) {
+        if (lc_lookupInodeCache(fs, ino, -1)) {
+            return false;
+        }
+        fs = fs->fs_parent;
+    }
+    return !(dir->i_flags & LC_INODE_REMOVED);
+}
+
+/* Record links to inodes with multiple links from a directory.  Inodes
+ * flagged with multiple links are looked for, or those with many links when
+ * rebuilding records after remount.  Returns the number of links recorded.
+ */
+static uint64_t
+lc_hlinkScanDir(struct fs *fs, struct inode *dir, bool rebuild) {
+    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
+    int i, max = hashed ? LC_DIRCACHE_SIZE : 1;
+    struct hldata *hldata;
+    struct dirent *dirent;
+    struct inode *inode;
+    uint64_t count = 0;
+    ino_t parent;
+
+    parent = (dir->i_ino == fs->fs_root) ? LC_ROOT_INODE : dir->i_ino;
+    for (i = 0; i < max; i++) {
+        dirent = hashed ? dir->i_hdirent[i] : dir->i_dirent;
+        while (dirent) {
+            if (S_ISDIR(dirent->di_mode)) {
+                dirent = dirent->di_next;
+                continue;
+            }
+            inode = lc_lookupInodeCache(fs, dirent->di_ino, -1);
+            if (inode && (rebuild ? ((inode->i_nlink > 1) &&
+                                     !(inode->i_flags & LC_INODE_REMOVED)) :
+                                    (inode->i_flags & LC_INODE_MLINKS))) {
+                hldata = fs->fs_hlinks;
+                while (hldata && ((hldata->hl_ino != inode->i_ino) ||
+                                  (hldata->hl_parent != parent))) {
+                    hldata = hldata->hl_next;
+                }
+                if (hldata) {
+                    hldata->hl_nlink++;
+                } else {
+                    hldata = lc_malloc(fs, sizeof(struct hldata),
+                                       LC_MEMTYPE_HLDATA);
+                    hldata->hl_ino = inode->i_ino;
+                    hldata->hl_parent = parent;
+                    hldata->hl_nlink = 1;
+                    hldata->hl_next = fs->fs_hlinks;
+                    fs->fs_hlinks = hldata;
+                }
+                count++;
+            }
+            dirent = dirent->di_next;
+        }
+    }
+    return count;
+}
+
+/* Find links from directories visible in a layer, including those in its
+ * parent layers.  Scan stops once the specified number of links are found,
+ * so parent layers are not scanned when all links are in the layer.
+ */
+static uint64_t
+lc_hlinkScan(struct fs *fs, bool rebuild, uint64_t links) {
+    struct inode *inode;
+    uint64_t count = 0;
+    struct fs *pfs;
+    int i;
+
+    pfs = fs;
+    while (pfs) {
+        for (i = 0; i < pfs->fs_icacheSize; i++) {
+            inode = pfs->fs_icache[i].ic_head;
+            while (inode) {
+                if (S_ISDIR(inode->i_mode) &&
+                    lc_hlinkVisibleDir(fs, pfs, inode)) {
+
+                    /* Layer could be modified while records are rebuilt */
+                    if (rebuild && (pfs == fs)) {
+                        lc_inodeLock(inode, false);
+                        count += lc_hlinkScanDir(fs, inode, rebuild);
+                        lc_inodeUnlock(inode);
+                    } else {
+                        count += lc_hlinkScanDir(fs, inode, rebuild);
+                    }
+                    if (links && (count >= links)) {
+                        return count;
+                    }
+                }
+                inode = inode->i_cnext;
+            }
+        }
+        pfs = pfs->fs_parent;
+    }
+    return count;
+}
+
+/* Hardlinks are not tracked after remount.  Rebuild hardlink records for
+ * inodes with multiple links in a layer being diffed, by scanning directories
+ * visible in the layer.  Nothing is scanned unless files with multiple links
+ * are present in the layer.  Records should be freed with lc_freeHlinks()
+ * after the diff.  Returns an error if links of any file are missing.
+ */
+int
+lc_rebuildHlinks(struct fs *fs) {
+    uint64_t count = 0, links = 0, found;
+    struct hldata *hldata;
+    struct inode *inode;
+    uint32_t nlink;
+    int i;
+
+    assert(fs->fs_rfs->fs_restarted);
+    assert(fs->fs_hlinks == NULL);
+
+    /* Count links of inodes with multiple links in this layer */
+    for (i = 0; i < fs->fs_icacheSize; i++) {
+        inode = fs->fs_icache[i].ic_head;
+        while (inode) {
+            if (!S_ISDIR(inode->i_mode) && (inode->i_nlink > 1) &&
+                !(inode->i_flags & LC_INODE_REMOVED)) {
+                links += inode->i_nlink;
+                count++;
+            }
+            inode = inode->i_cnext;
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+    fs->fs_sharedHlinks = false;
+
+    /* Find links from directories in this layer and its parent layers */
+    found = lc_hlinkScan(fs, true, links);
+
+    /* Every link of an inode should be accounted for */
+    for (i = 0; (i < fs->fs_icacheSize) && (found == links); i++) {
+        inode = fs->fs_icache[i].ic_head;
+        while (inode) {
+            if (!S_ISDIR(inode->i_mode) && (inode->i_nlink > 1) &&
+                !(inode->i_flags & LC_INODE_REMOVED)) {
+                nlink = 0;
+                hldata = fs->fs_hlinks;
+                while (hldata) {
+                    if (hldata->hl_ino == inode->i_ino) {
+                        nlink += hldata->hl_nlink;
+                    }
+                    hldata = hldata->hl_next;
+                }
+                if (nlink != inode->i_nlink) {
+                    found = 0;
+                    break;
+                }
+            }
+            inode = inode->i_cnext;
+        }
+    }
+    if (found != links) {
+        lc_syslog(LOG_ERR, "Links of files in layer %d inconsistent, "
+                  "%ld of %ld links found\n", fs->fs_gindex, found, links);
+        lc_freeHlinks(fs);
+        return EIO;
+    }
+    lc_printf("Rebuilt hardlinks of %ld inodes in layer %d\n",
+              count, fs->fs_gindex);
+    return 0;
+}
+
+/* Build hardlink records for inodes with multiple links in a layer received
+ * from a stream.  Records inherited from the parent layer are kept for inodes
+ * not modified in the layer.
+ */
+void
+lc_receiveHlinks(struct fs *fs) {
+    struct hldata *hldata, **prev;
+    struct inode *inode;
+    uint64_t count = 0;
+    int i;
+
+    if (fs->fs_gfs->gfs_swapLayersForCommit || fs->fs_rfs->fs_restarted) {
+        return;
+    }
+
+    /* Mark inodes with multiple links in this layer */
+    for (i = 0; i < fs->fs_icacheSize; i++) {
+        inode = fs->fs_icache[i].ic_head;
+        while (inode) {
+            if (!S_ISDIR(inode->i_mode) &&
+                ((inode->i_nlink > 1) || (inode->i_flags & LC_INODE_MLINKS))) {
+                inode->i_flags |= LC_INODE_MLINKS;
+                count++;
+            }
+            inode = inode->i_cnext;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&fs->fs_hlock);
+    if (fs->fs_sharedHlinks) {
+        lc_copyHlinks(fs);
+    }
+
+    /* Records of inodes in this layer are created again */
+    prev = &fs->fs_hlinks;
+    hldata = fs->fs_hlinks;
+    while (hldata) {
+        if (lc_lookupInodeCache(fs, hldata->hl_ino, -1)) {
+            *prev = hldata->hl_next;
+            lc_free(fs, hldata, sizeof(struct hldata), LC_MEMTYPE_HLDATA);
+            hldata = *prev;
+        } else {
+            prev = &hldata->hl_next;
+            hldata = hldata->hl_next;
+        }
+    }
+    lc_hlinkScan(fs, false, 0);
+    pthread_mutex_unlock(&fs->fs_hlock);
+}
@@ -0,0 +1,405 @@
+#include "includes.h"
+
+/* Accesses buffered by the thread before adding those to the sketch */
+static __thread struct haccess lc_hotBuffer[LC_HOT_BUFFER];
+
+/* Number of accesses buffered and number of buffer entries used */
+static __thread int lc_hotPending, lc_hotCount;
+
+/* Multipliers used for hashing keys in each row of the sketch */
+static const uint64_t lc_hotSeeds[LC_HOT_DEPTH] = {
+    0x9E3779B97F4A7C15ul, 0xC2B2AE3D27D4EB4Ful,
+    0x165667B19E3779F9ul, 0xD6E8FEB86659FD93ul,
+};
+
+/* Allocate structures for tracking hot files and layers */
+void
+lc_hotInit(struct gfs *gfs) {
+    struct hot *hot;
+
+    hot = lc_malloc(NULL, sizeof(struct hot), LC_MEMTYPE_GFS);
+    memset(hot, 0, sizeof(struct hot));
+    pthread_mutex_init(&hot->h_lock, NULL);
+    hot->h_decayed = time(NULL);
+    gfs->gfs_hot = hot;
+}
+
+/* Free structures used for tracking hot files and layers */
+void
+lc_hotDeinit(struct gfs *gfs) {
+    struct hot *hot = gfs->gfs_hot;
+
+    if (hot == NULL) {
+        return;
+    }
+#ifdef LC_MUTEX_DESTROY
+    pthread_mutex_destroy(&hot->h_lock);
+#endif
+    lc_free(NULL, hot, sizeof(struct hot), LC_MEMTYPE_GFS);
+    gfs->gfs_hot = NULL;
+}
+
+/* Find the counter of a key in a row of the sketch */
+static inline uint32_t
+lc_hotHash(uint64_t key, int row) {
+    return ((key ^ (key >> 32)) * lc_hotSeeds[row]) >> (64 - LC_HOT_SHIFT);
+}
+
+/* Add weight of accesses to the counters of a key, returning the new
+ * estimate.  Only counters below the new estimate are raised
+ * (conservative update), which keeps the estimate close to the real
+ * weight when keys collide.
+ */
+static uint64_t
+lc_hotSketch(struct hot *hot, uint64_t key, uint64_t weight) {
+    uint32_t idx[LC_HOT_DEPTH];
+    uint64_t score = -1;
+    int i;
+
+    for (i = 0; i < LC_HOT_DEPTH; i++) {
+        idx[i] = lc_hotHash(key, i);
+        if (hot->h_sketch[i][idx[i]] < score) {
+            score = hot->h_sketch[i][idx[i]];
+        }
+    }
+    score += weight;
+    for (i = 0; i < LC_HOT_DEPTH; i++) {
+        if (hot->h_sketch[i][idx[i]] < score) {
+            hot->h_sketch[i][idx[i]] = score;
+        }
+    }
+    return score;
+}
+
+/* Move an entry down the heap until it is colder than its children */
+static void
+lc_hotSiftDown(struct hheap *heap, int i) {
+    struct hentry entry = heap->hh_entry[i];
+    int child;
+
+    while ((child = (2 * i) + 1) < heap->hh_count) {
+        if (((child + 1) < heap->hh_count) &&
+            (heap->hh_entry[child + 1].he_score <
+             heap->hh_entry[child].he_score)) {
+            child++;
+        }
+        if (entry.he_score <= heap->hh_entry[child].he_score) {
+            break;
+        }
+        heap->hh_entry[i] = heap->hh_entry[child];
+        i = child;
+    }
+    heap->hh_entry[i] = entry;
+}
+
+/* Move an entry up the heap until it is hotter than its parent */
+static void
+lc_hotSiftUp(struct hheap *heap, int i) {
+    struct hentry entry = heap->hh_entry[i];
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (heap->hh_entry[parent].he_score <= entry.he_score) {
+            break;
+        }
+        heap->hh_entry[i] = heap->hh_entry[parent];
+        i = parent;
+    }
+    heap->hh_entry[i] = entry;
+}
+
+/* Account accesses to an entry, adding the entry to the heap if it is now
+ * hotter than the coldest one tracked.
+ */
+static void
+lc_hotUpdate(struct hheap *heap, uint64_t key, uint64_t score,
+             struct haccess *ha) {
+    struct hentry *entry;
+    int i;
+
+    for (i = 0; i < heap->hh_count; i++) {
+        entry = &heap->hh_entry[i];
+        if (entry->he_key == key) {
+            if (entry->he_score < score) {
+                entry->he_score = score;
+            }
+            entry->he_rbytes += ha->ha_rbytes;
+            entry->he_wbytes += ha->ha_wbytes;
+            entry->he_misses += ha->ha_misses;
+            lc_hotSiftDown(heap, i);
+            return;
+        }
+    }
+    if (heap->hh_count < LC_HOT_MAX) {
+        i = heap->hh_count++;
+    } else if (heap->hh_entry[0].he_score < score) {
+        i = 0;
+    } else {
+        return;
+    }
+    entry = &heap->hh_entry[i];
+    entry->he_key = key;
+    entry->he_score = score;
+    entry->he_rbytes = ha->ha_rbytes;
+    entry->he_wbytes = ha->ha_wbytes;
+    entry->he_misses = ha->ha_misses;
+    if (i) {
+        lc_hotSiftUp(heap, i);
+    } else {
+        lc_hotSiftDown(heap, i);
+    }
+}
+
+/* Halve counters once for every interval elapsed since those were last
+ * halved, so that files not accessed anymore cool down.  Halving keeps
+ * the order of entries in the heaps.
+ */
+static void
+lc_hotDecay(struct hot *hot, time_t now) {
+    struct hheap *heaps[] = {&hot->h_files, &hot->h_layers};
+    struct hentry *entry;
+    uint64_t shift;
+    int i, j;
+
+    if (now < (hot->h_decayed + LC_HOT_DECAY)) {
+        return;
+    }
+    shift = (now - hot->h_decayed) / LC_HOT_DECAY;
+    hot->h_decayed += shift * LC_HOT_DECAY;
+    if (shift >= 64) {
+        memset(hot->h_sketch, 0, sizeof(hot->h_sketch));
+        hot->h_files.hh_count = 0;
+        hot->h_layers.hh_count = 0;
+        return;
+    }
+    for (i = 0; i < LC_HOT_DEPTH; i++) {
+        for (j = 0; j < LC_HOT_WIDTH; j++) {
+            hot->h_sketch[i][j] >>= shift;
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < heaps[i]->hh_count; j++) {
+            entry = &heaps[i]->hh_entry[j];
+            entry->he_score >>= shift;
+            entry->he_rbytes >>= shift;
+            entry->he_wbytes >>= shift;
+            entry->he_misses >>= shift;
+        }
+    }
+}
+
+/* Add accesses buffered by the thread to the sketch */
+static void
+lc_hotFlush(struct gfs *gfs) {
+    struct hot *hot = gfs->gfs_hot;
+    uint64_t weight, score;
+    struct haccess *ha;
+    int i, gindex;
+
+    if (lc_hotCount == 0) {
+        return;
+    }
+    pthread_mutex_lock(&hot->h_lock);
+    lc_hotDecay(hot, time(NULL));
+    for (i = 0; i < lc_hotCount; i++) {
+        ha = &lc_hotBuffer[i];
+
+        /* Weigh accesses in blocks, with pages read from disk counted
+         * twice.
+         */
+        weight = ((ha->ha_rbytes + ha->ha_wbytes + LC_BLOCK_SIZE - 1) /
+                  LC_BLOCK_SIZE) + ha->ha_misses;
+        score = lc_hotSketch(hot, ha->ha_key, weight);
+        lc_hotUpdate(&hot->h_files, ha->ha_key, score, ha);
+        gindex = lc_getFsHandle(ha->ha_key);
+        score = lc_hotSketch(hot, lc_setHandle(gindex, 0), weight);
+        lc_hotUpdate(&hot->h_layers, gindex, score, ha);
+    }
+    pthread_mutex_unlock(&hot->h_lock);
+    lc_hotPending = 0;
+    lc_hotCount = 0;
+}
+
+/* Record bytes read or written to a file in a layer, along with pages which
+ * had to be read from disk.  Accesses are buffered in the thread and
+ * consecutive accesses to the same file are merged, so that the shared
+ * sketch is locked only once for every few accesses.
+ */
+void
+lc_hotAdd(struct gfs *gfs, int gindex, ino_t ino, uint64_t bytes,
+          bool write, uint64_t misses) {
+    uint64_t key = lc_setHandle(gindex, ino);
+    struct haccess *ha = NULL;
+
+    if (lc_hotCount) {
+        ha = &lc_hotBuffer[lc_hotCount - 1];
+        if (ha->ha_key != key) {
+            ha = NULL;
+        }
+    }
+    if (ha == NULL) {
+        assert(lc_hotCount < LC_HOT_BUFFER);
+        ha = &lc_hotBuffer[lc_hotCount++];
+        ha->ha_key = key;
+        ha->ha_rbytes = 0;
+        ha->ha_wbytes = 0;
+        ha->ha_misses = 0;
+    }
+    if (write) {
+        ha->ha_wbytes += bytes;
+    } else {
+        ha->ha_rbytes += bytes;
+    }
+    ha->ha_misses += misses;
+    if (++lc_hotPending >= LC_HOT_BUFFER) {
+        lc_hotFlush(gfs);
+    }
+}
+
+/* Remove entries of a layer from a heap */
+static void
+lc_hotPrune(struct hheap *heap, int gindex, bool file) {
+    struct hentry *entry;
+    int i = 0;
+
+    while (i < heap->hh_count) {
+        entry = &heap->hh_entry[i];
+        if ((file ? lc_getFsHandle(entry->he_key) : entry->he_key) ==
+            gindex) {
+            heap->hh_count--;
+            *entry = heap->hh_entry[heap->hh_count];
+        } else {
+            i++;
+        }
+    }
+    for (i = (heap->hh_count / 2) - 1; i >= 0; i--) {
+        lc_hotSiftDown(heap, i);
+    }
+}
+
+/* Stop tracking files of a layer being removed, as the index of the layer
+ * could be reused by a new layer.  Counters of the sketch are left to decay.
+ */
+void
+lc_hotForgetLayer(struct gfs *gfs, int gindex) {
+    struct hot *hot = gfs->gfs_hot;
+
+    pthread_mutex_lock(&hot->h_lock);
+    lc_hotPrune(&hot->h_files, gindex, true);
+    lc_hotPrune(&hot->h_layers, gindex, false);
+    pthread_mutex_unlock(&hot->h_lock);
+}
+
+/* Compare entries for sorting those hottest first */
+static int
+lc_hotCompare(const void *a, const void *b) {
+    const struct hentry *ea = a, *eb = b;
+
+    if (ea->he_score == eb->he_score) {
+        return 0;
+    }
+    return (ea->he_score < eb->he_score) ? 1 : -1;
+}
+
+/* Take a copy of hot files and layers, sorted hottest first */
+static void
+lc_hotSnapshot(struct gfs *gfs, struct hheap *files, struct hheap *layers) {
+    struct hot *hot = gfs->gfs_hot;
+
+    lc_hotFlush(gfs);
+    pthread_mutex_lock(&hot->h_lock);
+    lc_hotDecay(hot, time(NULL));
+    memcpy(files, &hot->h_files, sizeof(struct hheap));
+    memcpy(layers, &hot->h_layers, sizeof(struct hheap));
+    pthread_mutex_unlock(&hot->h_lock);
+    qsort(files->hh_entry, files->hh_count, sizeof(struct hentry),
+          lc_hotCompare);
+    qsort(layers->hh_entry, layers->hh_count, sizeof(struct hentry),
+          lc_hotCompare);
+}
+
+/* Display hot files and layers */
+void
+lc_hotDisplay(struct gfs *gfs) {
+    struct hheap files, layers;
+    struct hentry *entry;
+    int i;
+
+    lc_hotSnapshot(gfs, &files, &layers);
+    lc_syslog(LOG_INFO, "Hot layers\n");
+    for (i = 0; i < layers.hh_count; i++) {
+        entry = &layers.hh_entry[i];
+        if (entry->he_score) {
+            lc_syslog(LOG_INFO, "\tlayer %ld score %ld read %ld bytes "
+                      "written %ld bytes missed %ld pages\n",
+                      entry->he_key, entry->he_score, entry->he_rbytes,
+                      entry->he_wbytes, entry->he_misses);
+        }
+    }
+    lc_syslog(LOG_INFO, "Hot files\n");
+    for (i = 0; i < files.hh_count; i++) {
+        entry = &files.hh_entry[i];
+        if (entry->he_score) {
+            lc_syslog(LOG_INFO, "\tlayer %ld inode %ld score %ld read %ld "
+                      "bytes written %ld bytes missed %ld pages\n",
+                      lc_getFsHandle(entry->he_key),
+                      entry->he_key & LC_FH_INODE, entry->he_score,
+                      entry->he_rbytes, entry->he_wbytes, entry->he_misses);
+        }
+    }
+}
+
+/* Export samples of a metric of hot files or layers */
+static void
+lc_hotExportMetric(struct fs *rfs, struct sbuf *sb, struct hheap *heap,
+                   bool file, const char *name, const char *help,
+                   int field) {
+    struct hentry *entry;
+    uint64_t value;
+    int i;
+
+    lc_statsPrintf(rfs, sb, "# HELP %s %s\n# TYPE %s gauge\n",
+                   name, help, name);
+    for (i = 0; i < heap->hh_count; i++) {
+        entry = &heap->hh_entry[i];
+        if (entry->he_score == 0) {
+            continue;
+        }
+        value = (field == 0) ? entry->he_score :
+                (field == 1) ? entry->he_rbytes :
+                (field == 2) ? entry->he_wbytes : entry->he_misses;
+        if (file) {
+            lc_statsPrintf(rfs, sb, "%s{layer=\"%ld\",inode=\"%ld\"} %lu\n",
+                           name, lc_getFsHandle(entry->he_key),
+                           entry->he_key & LC_FH_INODE, value);
+        } else {
+            lc_statsPrintf(rfs, sb, "%s{layer=\"%ld\"} %lu\n",
+                           name, entry->he_key, value);
+        }
+    }
+}
+
+/* Export hot files and layers */
+void
+lc_hotExport(struct gfs *gfs, struct fs *rfs, struct sbuf *sb) {
+    static const char *metrics[][2] = {
+        {"score", "Estimated blocks accessed, decayed over time."},
+        {"read_bytes", "Bytes read, decayed over time."},
+        {"write_bytes", "Bytes written, decayed over time."},
+        {"misses", "Pages read from disk, decayed over time."},
+    };
+    struct hheap files, layers;
+    char name[64];
+    int i;
+
+    lc_hotSnapshot(gfs, &files, &layers);
+    for (i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "lcfs_hot_layer_%s", metrics[i][0]);
+        lc_hotExportMetric(rfs, sb, &layers, false, name,
+                           metrics[i][1], i);
+        snprintf(name, sizeof(name), "lcfs_hot_file_%s", metrics[i][0]);
+        lc_hotExportMetric(rfs, sb, &files, true, name,
+                           metrics[i][1], i);
+    }
+}
@@ -3,7 +3,11 @@
 
 #define FUSE3
 #ifdef FUSE3
+
+/* Makefile selects API version 32 when libfuse 3.2 or newer is installed */
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 30
+#endif
 #else
 #define FUSE_USE_VERSION 29
 #endif
@@ -16,7 +20,13 @@
 //#define DEBUG
 
 #include <fuse_lowlevel.h>
+
+/* lseek(2) with SEEK_DATA/SEEK_HOLE requires libfuse 3.8 or later */
+#if defined(FUSE3) && (FUSE_MAJOR_VERSION == 3) && (FUSE_MINOR_VERSION >= 8)
+#define LC_LSEEK_ENABLE
+#endif
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <stdbool.h>
@@ -73,11 +83,16 @@ uint64_t lc_memoryInit(uint64_t limit);
 void *lc_malloc(struct fs *fs, size_t size, enum lc_memTypes type);
 void lc_mallocBlockAligned(struct fs *fs, void **memptr,
                            enum lc_memTypes type);
+void lc_mallocAligned(struct fs *fs, void **memptr, size_t size,
+                      enum lc_memTypes type);
 void lc_free(struct fs *fs, void *ptr, size_t size, enum lc_memTypes type);
 void lc_memMove(struct fs *fs, struct fs *to, size_t size,
                 enum lc_memTypes type);
 bool lc_checkMemoryAvailable(bool flush);
-void lc_waitMemory(struct gfs *gfs, bool wait);
+uint64_t lc_dirtyBackground(void);
+const char *lc_memTypeName(enum lc_memTypes type);
+void lc_memStatsExport(struct fs *rfs, struct sbuf *sb);
+void lc_waitMemory(struct gfs *gfs, bool wait, uint64_t pcount);
 void lc_memUpdateTotal(struct fs *fs, size_t size);
 void lc_memTransferCount(struct fs *fs, struct fs *rfs, uint64_t count,
                          enum lc_memTypes type);
@@ -93,6 +108,7 @@ void lc_readBlocks(struct gfs *gfs, struct fs *fs, struct iovec *iov,
 void lc_writeBlock(struct gfs *gfs, struct fs *fs, void *buf, off_t block);
 void lc_writeBlocks(struct gfs *gfs, struct fs *fs,
                     struct iovec *iov, int iovcnt, off_t block);
+uint32_t lc_checksum(char *buf);
 void lc_updateCRC(void *buf, uint32_t *crc);
 void lc_verifyBlock(void *buf, uint32_t *crc);
 
@@ -119,6 +135,9 @@ void lc_processLayerBlocks(struct gfs *gfs, struct fs *fs, bool unmount,
 uint64_t lc_blockAlloc(struct fs *fs, uint64_t count, bool meta, bool reserve);
 uint64_t lc_blockAllocExact(struct fs *fs, uint64_t count,
                             bool meta, bool reserve);
+uint64_t lc_blockClaim(struct gfs *gfs, struct fs *fs, uint64_t block,
+                       uint64_t count);
+bool lc_blockRangeFree(struct gfs *gfs, uint64_t block, uint64_t count);
 void lc_blockFree(struct gfs *gfs, struct fs *fs, uint64_t block,
                   uint64_t count, bool layer, bool reuse);
 void lc_addFreedExtents(struct fs *fs, struct extent *extent, bool empty);
@@ -131,6 +150,7 @@ uint64_t lc_blockFreeExtents(struct gfs *gfs, struct fs *fs,
 void lc_replaceFreedExtents(struct fs *fs, struct extent **extents,
                             uint64_t block, uint64_t count);
 void lc_readExtents(struct gfs *gfs, struct fs *fs);
+void lc_readSharedExtents(struct gfs *gfs, struct fs *fs);
 void lc_grow(struct gfs *gfs);
 void lc_displayAllocStats(struct fs *fs);
 
@@ -144,6 +164,8 @@ void lc_allocateSuperBlocks(struct gfs *gfs, struct fs *rfs);
 struct fs *lc_getLayerLocked(ino_t ino, bool exclusive);
 uint64_t lc_getLayerForRemoval(struct gfs *gfs, ino_t root, struct fs **fsp);
 int lc_getIndex(struct fs *nfs, ino_t parent, ino_t ino);
+int lc_addLayers(struct gfs *gfs, struct fs **fss, int count, struct fs *pfs,
+                 int *inval);
 int lc_addLayer(struct gfs *gfs, struct fs *fs, struct fs *pfs, int *inval);
 void lc_removeLayer(struct gfs *gfs, struct fs *fs, int gindex);
 void lc_addChild(struct gfs *gfs, struct fs *pfs, struct fs *fs);
@@ -161,7 +183,8 @@ void lc_releaseInodeBlock(struct gfs *gfs, struct fs *fs);
 void lc_flushInodeBlocks(struct gfs *gfs, struct fs *fs);
 void lc_invalidateInodeBlocks(struct gfs *gfs, struct fs *fs);
 void *lc_syncer(void *data);
-void lc_commitRoot(struct gfs *gfs, int count);
+bool lc_commitRoot(struct gfs *gfs, int count);
+int lc_waitCheckpoint(struct gfs *gfs);
 void lc_unmount(struct gfs *gfs);
 struct fs *lc_newLayer(struct gfs *gfs, bool rw);
 void lc_destroyLayer(struct fs *fs, bool remove);
@@ -170,6 +193,8 @@ void lc_icache_init(struct fs *fs, size_t size);
 void lc_icache_deinit(struct icache *icache);
 void lc_copyStat(struct stat *st, struct inode *inode);
 void lc_copyFakeStat(struct stat *st);
+void lc_statsFileStat(struct stat *st);
+void lc_exportFileStat(struct stat *st, ino_t ino);
 ino_t lc_inodeAlloc(struct fs *fs);
 void lc_updateFtypeStats(struct fs *fs, mode_t mode, bool incr);
 void lc_displayFtypeStats(struct fs *fs);
@@ -181,16 +206,26 @@ struct inode *lc_getInode(struct fs *fs, ino_t ino, struct inode *handle,
 struct inode *lc_inodeInit(struct fs *fs, mode_t mode,
                             uid_t uid, gid_t gid, dev_t rdev, ino_t parent,
                             const char *target);
+struct inode *lc_inodeReceive(struct fs *fs, struct dinode *dinode,
+                              ino_t parent, const char *target);
 void lc_hideInode(struct fs *fs, ino_t ino, struct inode *inode);
 void lc_rootInit(struct fs *fs, ino_t root);
 void lc_cloneRootDir(struct inode *pdir, struct inode *dir);
 void lc_setLayerRoot(struct gfs *gfs, ino_t ino);
 void lc_updateInodeTimes(struct inode *inode, bool mtime, bool ctime);
+void lc_syncInodesShared(struct gfs *gfs, struct fs *fs);
 void lc_syncInodes(struct gfs *gfs, struct fs *fs, bool unmount);
 void lc_inodeLock(struct inode *inode, bool exclusive);
 void lc_inodeUnlock(struct inode *inode);
 void lc_invalidateInodePages(struct gfs *gfs, struct fs *fs);
 void lc_invalidateLayerPages(struct gfs *gfs, struct fs *fs);
+void lc_flushKernelPages(struct gfs *gfs, struct fs *fs);
+void lc_invalLayerInodes(struct gfs *gfs, struct fs *fs);
+struct inode *lc_lookupInodeChain(struct fs *fs, ino_t ino);
+void lc_getInodesBatch(struct fs *fs, ino_t *inos, struct inode **inodes,
+                       int count);
+void lc_forgetInodes(struct gfs *gfs, struct fuse_forget_data *forgets,
+                     size_t count);
 void lc_moveInodes(struct fs *fs, struct fs *cfs);
 void lc_moveRootInode(struct gfs *gfs, struct fs *cfs, struct fs *fs);
 void lc_cloneInodes(struct gfs *gfs, struct fs *fs, struct fs *pfs);
@@ -198,6 +233,7 @@ void lc_switchInodeParent(struct fs *fs, ino_t root);
 void lc_swapRootInode(struct fs *fs, struct fs *cfs);
 void lc_freezeLayer(struct gfs *gfs, struct fs *fs);
 
+struct dirent *lc_dirFindEntry(struct inode *dir, const char *name, int len);
 ino_t lc_dirLookup(struct fs *fs, struct inode *dir, const char *name);
 struct dirent *lc_getDirent(struct fs *fs, ino_t parent, ino_t ino, int *hash,
                             struct dirent *sdirent);
@@ -219,6 +255,11 @@ void  lc_dirConvertHashed(struct fs *fs, struct inode *dir);
 void lc_dirFreeHash(struct fs *fs, struct inode *dir);
 void lc_dirFree(struct inode *dir);
 
+struct extent *lc_inodeNextUnwritten(struct inode *inode, uint64_t page);
+void lc_freeUnwritten(struct fs *fs, struct inode *inode, uint64_t page);
+void lc_copyUnwritten(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                      struct inode *parent);
+void lc_inodeEmapConvert(struct fs *fs, struct inode *inode, uint64_t page);
 uint64_t lc_inodeEmapLookup(struct gfs *gfs, struct inode *inode,
                             uint64_t page, struct extent **extents);
 void lc_copyEmap(struct gfs *gfs, struct fs *fs, struct inode *inode);
@@ -226,6 +267,14 @@ void lc_expandEmap(struct gfs *gfs, struct fs *fs, struct inode *inode);
 void lc_inodeEmapUpdate(struct gfs *gfs, struct fs *fs, struct inode *inode,
                         uint64_t pstart, uint64_t bstart, uint64_t pcount,
                         struct extent **extents);
+int lc_emapPrealloc(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                    uint64_t pstart, uint64_t pcount);
+void lc_emapPunch(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                  uint64_t pstart, uint64_t pcount);
+bool lc_emapReplayValid(struct gfs *gfs, struct inode *inode, uint64_t pstart,
+                        uint64_t bstart, uint64_t pcount);
+void lc_emapReplay(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                   uint64_t pstart, uint64_t bstart, uint64_t pcount);
 void lc_emapFlush(struct gfs *gfs, struct fs *fs, struct inode *inode);
 void lc_emapRead(struct gfs *gfs, struct fs *fs, struct inode *inode,
                  void *buf);
@@ -276,8 +325,17 @@ int lc_readFile(fuse_req_t req, struct fs *fs, struct inode *inode,
                 struct page **pages, char **dbuf, struct fuse_bufvec *bufv);
 void lc_flushPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
                    bool release, bool unlock);
+void lc_readFileData(struct fs *fs, struct inode *inode, off_t off,
+                     size_t size, char *buf);
+void lc_writeExtentPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                         uint64_t pg, struct dpage *dpages, uint64_t pcount);
 void lc_truncateFile(struct inode *inode, off_t size, bool remove);
+void lc_zeroRange(struct inode *inode, off_t off, off_t end);
+off_t lc_seekFile(struct gfs *gfs, struct inode *inode, off_t off, bool data);
+uint64_t lc_getDirtyPages(struct inode *inode, uint64_t *pages,
+                          struct dpage **dpages, uint64_t max);
 void lc_flushDirtyPages(struct gfs *gfs, struct fs *fs);
+void lc_waitDirtyPages(struct fs *fs);
 void lc_addDirtyInode(struct fs *fs, struct inode *inode);
 void lc_flushDirtyInodeList(struct fs *fs, bool all);
 void lc_invalidateDirtyPages(struct gfs *gfs, struct fs *fs);
@@ -290,6 +348,8 @@ void lc_freePages(struct fs *fs, struct dpage *dpages, uint64_t pcount);
 int lc_removeInode(struct fs *fs, struct inode *dir, ino_t ino, bool rmdir,
                    void **fsp);
 void lc_epInit(struct fuse_entry_param *ep);
+void lc_epTimeout(struct fuse_entry_param *ep, struct fs *dfs,
+                  struct inode *dir, struct fs *fs, struct inode *inode);
 
 void lc_xattrAdd(fuse_req_t req, ino_t ino, const char *name,
                   const char *value, size_t size, int flags);
@@ -301,15 +361,27 @@ void lc_xattrFlush(struct gfs *gfs, struct fs *fs, struct inode *inode);
 void lc_xattrRead(struct gfs *gfs, struct fs *fs, struct inode *inode,
                   void *buf);
 void lc_xattrFree(struct inode *inode);
+void lc_xattrReceive(struct inode *inode, const char *name, int len,
+                     const char *value, size_t size);
 
 ino_t lc_getRootIno(struct fs *fs, const char *name, struct inode *pdir,
                     bool err);
 void lc_linkParent(struct fs *fs, struct fs *pfs);
-void lc_createLayer(fuse_req_t req, struct gfs *gfs, const char *name,
-                    const char *parent, size_t size, bool rw);
+int lc_createLayer(fuse_req_t req, struct gfs *gfs, const char *name,
+                   const char *parent, size_t size, bool rw);
 void lc_deleteLayer(fuse_req_t req, struct gfs *gfs, const char *name);
+void *lc_reclaimer(void *data);
+void lc_flushRemovedLayers(struct gfs *gfs);
+void lc_reclaimRemovedLayers(struct gfs *gfs, struct fs *rfs);
 int lc_removeRoot(struct fs *rfs, struct inode *dir, ino_t ino, bool rmdir,
                   void **fsp);
+void lc_createLayers(fuse_req_t req, struct gfs *gfs, const char *parent,
+                     size_t size, const char *names, size_t nsize,
+                     size_t osize);
+void lc_receiveLayer(fuse_req_t req, struct gfs *gfs, const char *name,
+                     const char *parent, size_t size, const char *path);
+void lc_extractLayer(fuse_req_t req, struct gfs *gfs, const char *name,
+                     const char *parent, size_t size, const char *path);
 void lc_layerIoctl(fuse_req_t req, struct gfs *gfs, const char *name,
                    enum ioctl_cmd cmd);
 void lc_commitLayer(fuse_req_t req, struct fs *fs, ino_t ino, const char *name,
@@ -318,11 +390,31 @@ void lc_commitLayer(fuse_req_t req, struct fs *fs, ino_t ino, const char *name,
 void lc_addHlink(struct fs *fs, struct inode *inode, ino_t parent);
 void lc_removeHlink(struct fs *fs, struct inode *inode, ino_t parent);
 void lc_freeHlinks(struct fs *fs);
+int lc_rebuildHlinks(struct fs *fs);
+void lc_receiveHlinks(struct fs *fs);
 
+void lc_journalAdd(struct fs *fs, struct inode *inode);
+void lc_journalFree(struct fs *fs);
 void lc_freeChangeList(struct fs *fs);
+int lc_buildChangeList(struct fs *fs);
 
 int lc_layerDiff(fuse_req_t req, const char *name, size_t size);
 
+struct export *lc_exportOpen(struct gfs *gfs, ino_t ino, int *errp);
+void lc_exportRead(fuse_req_t req, struct export *ex, size_t size, off_t off);
+void lc_exportRelease(struct gfs *gfs, struct export *ex);
+ino_t lc_exportLookup(struct fs *rfs, const char *name);
+
+void lc_sendFill(struct fs *fs, struct export *ex);
+void lc_sendInodes(struct fs *fs, struct export *ex);
+void lc_sendFree(struct fs *fs, struct export *ex);
+int lc_receiveOpen(struct gfs *gfs, const char *path, bool base,
+                   struct receive **rcp);
+void lc_receiveClose(struct gfs *gfs, struct receive *rc);
+int lc_receiveInodes(struct fs *fs, struct receive *rc);
+
+int lc_extract(struct fs *fs, const char *path);
+
 void lc_statsEnable();
 void lc_statsNew(struct fs *fs);
 void lc_statsBegin(struct timeval *start);
@@ -333,6 +425,38 @@ void lc_displayStats(struct fs *fs);
 void lc_displayStatsAll(struct gfs *gfs);
 void lc_displayGlobalStats(struct gfs *gfs);
 void lc_statsDeinit(struct fs *fs);
+void lc_statsPrintf(struct fs *fs, struct sbuf *sb, const char *fmt, ...);
+struct sbuf *lc_statsExport(struct gfs *gfs);
+void lc_statsExportFree(struct gfs *gfs, struct sbuf *sb);
+
+void lc_hotInit(struct gfs *gfs);
+void lc_hotDeinit(struct gfs *gfs);
+void lc_hotAdd(struct gfs *gfs, int gindex, ino_t ino, uint64_t bytes,
+               bool write, uint64_t misses);
+void lc_hotForgetLayer(struct gfs *gfs, int gindex);
+void lc_hotDisplay(struct gfs *gfs);
+void lc_hotExport(struct gfs *gfs, struct fs *rfs, struct sbuf *sb);
+
+void lc_dedupInit(struct gfs *gfs);
+void lc_dedupDeinit(struct gfs *gfs);
+bool lc_dedupLayer(struct gfs *gfs, struct fs *fs);
+uint64_t lc_dedupHash(uint64_t hash, const char *data, size_t size);
+uint64_t lc_dedupLookup(struct gfs *gfs, uint64_t hash, uint64_t size,
+                        uint64_t *count, uint64_t *gen);
+bool lc_dedupShare(struct gfs *gfs, struct fs *fs, uint64_t block,
+                   uint64_t count, uint64_t gen);
+void lc_dedupAdd(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                 uint64_t hash);
+void lc_dedupPublish(struct gfs *gfs, struct fs *fs);
+void lc_dedupFree(struct gfs *gfs, struct fs *fs);
+void lc_dedupRelease(struct gfs *gfs, struct fs *fs);
+
+bool lc_logInode(struct gfs *gfs, struct fs *fs, struct inode *inode);
+void lc_logDeinit(struct fs *fs);
+int lc_logEnable(struct gfs *gfs, struct fs *fs, bool enable);
+void lc_logCheckpoint(struct gfs *gfs, struct fs *fs);
+void lc_logCheckpointDone(struct gfs *gfs);
+void lc_logInit(struct gfs *gfs, struct fs *fs);
 
 #ifdef DEBUG
 void lc_validate(struct gfs *gfs);
@@ -68,6 +68,22 @@ lc_copyFakeStat(struct stat *st) {
     st->st_ctim = tv;
 }
 
+/* Copy attributes of the virtual file exporting stats */
+void
+lc_statsFileStat(struct stat *st) {
+    lc_copyFakeStat(st);
+    st->st_ino = LC_STATS_INODE;
+    st->st_mode = S_IFREG | 0444;
+}
+
+/* Fill up attributes of a file exporting changes in a layer */
+void
+lc_exportFileStat(struct stat *st, ino_t ino) {
+    lc_copyFakeStat(st);
+    st->st_ino = ino;
+    st->st_mode = S_IFREG | 0400;
+}
+
 /* Initialize a disk inode */
 static void
 lc_dinodeInit(struct inode *inode, ino_t ino, mode_t mode,
@@ -118,6 +134,7 @@ lc_newInode(struct fs *fs, uint64_t len, bool reg, bool new,
     inode->i_cnext = NULL;
     inode->i_emapDirExtents = NULL;
     inode->i_xattrData = NULL;
+    inode->i_nlookup = 0;
     inode->i_ocount = 0;
     inode->i_flags = block ? LC_INODE_DISK : 0;
     inode->i_page = NULL;
@@ -185,6 +202,7 @@ lc_freeInode(struct inode *inode) {
         lc_truncateFile(inode, 0, false);
         assert(inode->i_page == NULL);
         assert(lc_inodeGetEmap(inode) == NULL);
+        assert(lc_inodeGetUnwritten(inode) == NULL);
         assert(lc_inodeGetPageCount(inode) == 0);
         assert(lc_inodeGetDirtyPageCount(inode) == 0);
         size += sizeof(struct rdata);
@@ -264,6 +282,9 @@ lc_addInode(struct fs *fs, struct inode *inode, int hash, bool lock,
     assert(lc_lookupInodeCache(fs, ino, hash) == NULL);
 #endif
 
+    /* Inodes moved from another layer are recorded in the journal again */
+    inode->i_flags &= ~LC_INODE_JOURNAL;
+
     /* Add the inode to the hash list */
     inode->i_cnext = fs->fs_icache[hash].ic_head;
     fs->fs_icache[hash].ic_head = inode;
@@ -281,6 +302,13 @@ lc_addInode(struct fs *fs, struct inode *inode, int hash, bool lock,
         pthread_mutex_unlock(&fs->fs_ilock);
 #endif
     }
+
+    /* Inodes of layers which could be diffed are recorded in the journal,
+     * including those read from disk, which rebuilds the journal on mount.
+     */
+    if (fs->fs_parent) {
+        lc_journalAdd(fs, inode);
+    }
     return inode;
 }
 
@@ -920,6 +948,55 @@ lc_freezeLayer(struct gfs *gfs, struct fs *fs) {
     }
 }
 
+/* Flush dirty pages, emap, directory entries and extended attributes of dirty
+ * inodes while holding the layer shared, so that operations on the layer could
+ * continue.  Inodes themselves are written out later by lc_syncInodes() with
+ * the layer locked exclusive, which then needs to flush metadata of inodes
+ * modified after this only.  Inodes locked by other threads are skipped.
+ */
+void
+lc_syncInodesShared(struct gfs *gfs, struct fs *fs) {
+    uint32_t flags = LC_INODE_EMAPDIRTY | LC_INODE_DIRDIRTY |
+                     LC_INODE_XATTRDIRTY;
+    uint64_t count = 0, icount = 0;
+    struct inode *inode;
+    int i;
+
+    for (i = 0; (i < fs->fs_icacheSize) && (icount < fs->fs_icount) &&
+                !fs->fs_removed; i++) {
+        inode = fs->fs_icache[i].ic_head;
+        while (inode && !fs->fs_removed) {
+            icount++;
+            if (!(inode->i_flags & flags) ||
+                (inode->i_flags & (LC_INODE_REMOVED | LC_INODE_TMP)) ||
+                pthread_rwlock_trywrlock(inode->i_rwlock)) {
+                inode = inode->i_cnext;
+                continue;
+            }
+            if (!(inode->i_flags & LC_INODE_REMOVED)) {
+                if (count == 0) {
+                    lc_markSuperDirty(fs);
+                }
+                if (inode->i_flags & LC_INODE_XATTRDIRTY) {
+                    lc_xattrFlush(gfs, fs, inode);
+                }
+                if (inode->i_flags & LC_INODE_EMAPDIRTY) {
+                    lc_emapFlush(gfs, fs, inode);
+                } else if (inode->i_flags & LC_INODE_DIRDIRTY) {
+                    lc_dirFlush(gfs, fs, inode);
+                }
+                count++;
+            }
+            pthread_rwlock_unlock(inode->i_rwlock);
+            inode = inode->i_cnext;
+        }
+    }
+    if (count) {
+        lc_printf("Flushed metadata of %ld inodes of fs %d in background\n",
+                  count, fs->fs_gindex);
+    }
+}
+
 /* Sync all dirty inodes */
 void
 lc_syncInodes(struct gfs *gfs, struct fs *fs, bool unmount) {
@@ -1023,7 +1100,8 @@ lc_invalidateLayerPages(struct gfs *gfs, struct fs *fs) {
          i++) {
         inode = fs->fs_icache[i].ic_head;
         while (inode && !fs->fs_removed) {
-            if (S_ISREG(inode->i_mode) && !inode->i_private && inode->i_size) {
+            if (S_ISREG(inode->i_mode) && !inode->i_private &&
+                inode->i_size && lc_inodeReferenced(inode)) {
                 lc_invalInodePages(gfs, inode->i_ino);
             }
             count++;
@@ -1032,6 +1110,124 @@ lc_invalidateLayerPages(struct gfs *gfs, struct fs *fs) {
     }
 }
 
+/* Have kernel write back pages cached for files open in a read-write layer,
+ * when writes are cached in kernel.  Pages are written back when files are
+ * closed, so only files open currently need to be looked at.
+ */
+void
+lc_flushKernelPages(struct gfs *gfs, struct fs *fs) {
+    uint64_t i, count = 0;
+    struct inode *inode;
+
+    if (!gfs->gfs_writeback || fs->fs_frozen) {
+        return;
+    }
+    for (i = 0;
+         (i < fs->fs_icacheSize) && (count < fs->fs_icount) && !fs->fs_removed;
+         i++) {
+        inode = fs->fs_icache[i].ic_head;
+        while (inode && !fs->fs_removed) {
+            if (S_ISREG(inode->i_mode) && inode->i_ocount &&
+                !(inode->i_flags & LC_INODE_REMOVED)) {
+                lc_invalInodePages(gfs, lc_setHandle(fs->fs_gindex,
+                                                     inode->i_ino));
+            }
+            count++;
+            inode = inode->i_cnext;
+        }
+    }
+}
+
+/* Kernel may cache inodes of frozen layers for long, so have kernel drop
+ * those before the layer is taken off the list of layers and its index
+ * reused.  Root directory is taken care by the caller.
+ */
+void
+lc_invalLayerInodes(struct gfs *gfs, struct fs *fs) {
+    uint64_t i, count = 0;
+    struct inode *inode;
+
+    if (!fs->fs_frozen || (fs->fs_icache == NULL)) {
+        return;
+    }
+    for (i = 0; (i < fs->fs_icacheSize) && (count < fs->fs_icount); i++) {
+        inode = fs->fs_icache[i].ic_head;
+        while (inode) {
+            if ((inode != fs->fs_rootInode) && lc_inodeReferenced(inode)) {
+                lc_invalInodePages(gfs, lc_setHandle(fs->fs_gindex,
+                                                     inode->i_ino));
+            }
+            count++;
+            inode = inode->i_cnext;
+        }
+    }
+}
+
+/* Find an inode cached in the layer or in its parents, without locking the
+ * inode or reading it from disk.
+ */
+struct inode *
+lc_lookupInodeChain(struct fs *fs, ino_t ino) {
+    struct inode *inode;
+
+    while (fs) {
+        inode = lc_lookupInode(fs, ino, -1);
+        if (inode) {
+            return inode;
+        }
+        fs = fs->fs_parent;
+    }
+    return NULL;
+}
+
+/* Drop references kernel had on a batch of inodes.  Layers are locked shared
+ * once for every run of inodes from the same layer.  Layers locked exclusive
+ * are skipped instead of waiting, as those are being removed or committed,
+ * which leaves counts higher than needed, but never lower.
+ */
+void
+lc_forgetInodes(struct gfs *gfs, struct fuse_forget_data *forgets,
+                size_t count) {
+    int gindex, last = -1;
+    struct inode *inode;
+    struct fs *fs = NULL;
+    size_t i;
+
+    rcu_register_thread();
+    rcu_read_lock();
+    for (i = 0; i < count; i++) {
+        gindex = lc_getFsHandle(forgets[i].ino);
+        if (gindex != last) {
+            if (fs) {
+                lc_unlock(fs);
+            }
+            last = gindex;
+            fs = rcu_dereference(gfs->gfs_fs[gindex]);
+            if (fs && lc_tryLock(fs, false)) {
+                fs = NULL;
+            }
+
+            /* Layer could have been committed while looking it up */
+            if (fs && (fs->fs_removed || (fs->fs_gindex != gindex))) {
+                lc_unlock(fs);
+                fs = NULL;
+            }
+        }
+        if (fs == NULL) {
+            continue;
+        }
+        inode = lc_lookupInodeChain(fs, lc_getInodeHandle(forgets[i].ino));
+        if (inode) {
+            lc_inodeForget(inode, forgets[i].nlookup);
+        }
+    }
+    if (fs) {
+        lc_unlock(fs);
+    }
+    rcu_read_unlock();
+    rcu_unregister_thread();
+}
+
 /* Destroy inodes belong to a file system */
 void
 lc_destroyInodes(struct fs *fs, bool remove) {
@@ -1114,6 +1310,9 @@ lc_cloneInode(struct fs *fs, struct inode *parent, ino_t ino, int hash,
      */
     new = lc_newInode(fs, 0, reg, false, true, false);
     memcpy(&new->i_dinode, &parent->i_dinode, sizeof(struct dinode));
+
+    /* Kernel may have looked up the inode through this layer */
+    new->i_nlookup = parent->i_nlookup;
     lc_inodeLock(new, true);
     inode = lc_addInode(fs, new, hash, true, new, last);
     if (inode != new) {
@@ -1136,6 +1335,9 @@ lc_cloneInode(struct fs *fs, struct inode *parent, ino_t ino, int hash,
                 inode->i_flags |= LC_INODE_SHARED;
                 flags |= LC_INODE_EMAPDIRTY;
             }
+            if (lc_inodeGetUnwritten(parent)) {
+                lc_copyUnwritten(fs->fs_gfs, fs, inode, parent);
+            }
             flags |= LC_INODE_NOTRUNC;
         } else {
             assert(inode->i_emapDirBlock == LC_INVALID_BLOCK);
@@ -1230,6 +1432,37 @@ lc_getInodeParent(struct fs *fs, ino_t inum, int fhash, struct inode *last,
     return inode;
 }
 
+/* Find inodes for a batch of directory entries in the layer or in its
+ * parents, looking up every layer in the chain once for the whole batch
+ * instead of walking the chain for every entry.  Entries not found are left
+ * NULL.
+ */
+void
+lc_getInodesBatch(struct fs *fs, ino_t *inos, struct inode **inodes,
+                  int count) {
+    struct fs *pfs = fs->fs_parent;
+    int i, remain = 0;
+
+    lc_lockOwned(&fs->fs_rwlock, false);
+    for (i = 0; i < count; i++) {
+        inodes[i] = lc_lookupInode(fs, inos[i], -1);
+        if (inodes[i] == NULL) {
+            remain++;
+        }
+    }
+    while (pfs && remain) {
+        for (i = 0; i < count; i++) {
+            if (inodes[i] == NULL) {
+                inodes[i] = lc_lookupInodeCache(pfs, inos[i], -1);
+                if (inodes[i]) {
+                    remain--;
+                }
+            }
+        }
+        pfs = pfs->fs_parent;
+    }
+}
+
 /* Mark an inode as hidden */
 void
 lc_hideInode(struct fs *fs, ino_t ino, struct inode *inode) {
@@ -1362,6 +1595,31 @@ lc_inodeInit(struct fs *fs, mode_t mode, uid_t uid, gid_t gid,
     return inode;
 }
 
+/* Initialize an inode received in a stream of a layer, keeping the inode
+ * number the inode had in the layer sent.
+ */
+struct inode *
+lc_inodeReceive(struct fs *fs, struct dinode *dinode, ino_t parent,
+                const char *target) {
+    int len = (target != NULL) ? dinode->di_size : 0;
+    mode_t mode = dinode->di_mode;
+    struct inode *inode;
+
+    assert(dinode->di_ino <= fs->fs_gfs->gfs_super->sb_ninode);
+    inode = lc_newInode(fs, len, S_ISREG(mode), true, true, false);
+    if (len) {
+        inode->i_target = (((char *)inode) + sizeof(struct inode));
+        memcpy(inode->i_target, target, len);
+        inode->i_target[len] = 0;
+    }
+    lc_dinodeInit(inode, dinode->di_ino, mode, dinode->di_uid, dinode->di_gid,
+                  dinode->di_rdev, len, parent);
+    lc_updateFtypeStats(fs, mode, true);
+    lc_addInode(fs, inode, -1, true, NULL, NULL);
+    lc_inodeLock(inode, true);
+    return inode;
+}
+
 /* Move inodes from one layer to another */
 void
 lc_moveInodes(struct fs *fs, struct fs *cfs) {
@@ -51,6 +51,9 @@ struct icache {
 /* Portion of the readdir offset storing index in the list */
 #define LC_DIRHASH_INDEX 0x00000000FFFFFFFFul
 
+/* Number of entries readdirplus resolves inodes for at a time */
+#define LC_DIRENT_BATCH  64
+
 /* Directory entry */
 struct dirent {
 
@@ -79,6 +82,9 @@ struct rdata {
     /* Extent map */
     struct extent *rd_emap;
 
+    /* Preallocated extents not written yet */
+    struct extent *rd_unwritten;
+
     /* Next entry in the dirty list */
     struct inode *rd_dnext;
 
@@ -97,7 +103,7 @@ struct rdata {
     /* Count of dirty pages */
     uint32_t rd_dpcount;
 } __attribute__((packed));
-static_assert(sizeof(struct rdata) == 40, "rdata size != 40");
+static_assert(sizeof(struct rdata) == 48, "rdata size != 48");
 
 /* Data tracked for hard links */
 struct hldata {
@@ -154,15 +160,30 @@ struct ixattr {
 #define LC_INODE_HASHED         0x0080  /* Hashed directory */
 #define LC_INODE_DHASHED        0x0080  /* Dirty pages in a hash table */
 #define LC_INODE_NOTRUNC        0x0100  /* Do not truncate this file */
-#define LC_INODE_CTRACKED       0x0200  /* Inode in the change list */
+#define LC_INODE_JOURNAL        0x0200  /* Inode recorded in the journal */
 #define LC_INODE_MLINKS         0x0400  /* Linked from many directories */
 #define LC_INODE_SYMLINK        0x0800  /* Free symbolic link target */
 #define LC_INODE_DISK           0x1000  /* Inode flushed to disk */
 #define LC_INODE_HIDDEN         0x2000  /* Inode is hidden from child layers */
+#define LC_INODE_LINKED         0x4000  /* Directory received is reachable */
 
 /* Fake inode number used to trigger layer commit operation */
 #define LC_COMMIT_TRIGGER_INODE     LC_ROOT_INODE
 
+/* Fake inode number of the file exporting stats.  Kernel addresses the root
+ * directory as FUSE_ROOT_ID, so this is not used otherwise in the base layer.
+ */
+#define LC_STATS_INODE              LC_ROOT_INODE
+
+/* Fake inode numbers of the files exporting changes in a layer as a tar
+ * stream, combined with the index of the layer.
+ */
+#define LC_EXPORT_INODE             LC_FH_INODE
+#define LC_EXPORT_GZIP_INODE        (LC_FH_INODE - 1)
+
+/* Fake inode number of the file streaming a layer in native format */
+#define LC_SEND_INODE               (LC_FH_INODE - 2)
+
 /* Number of inode pages which can be freed if inodes are re-written */
 #define LC_INODE_RELOCATE_PCOUNT    10
 
@@ -205,6 +226,9 @@ struct inode {
         char *i_target;
     };
 
+    /* Number of references kernel has on the inode */
+    uint64_t i_nlookup;
+
     /* Open count */
     uint32_t i_ocount;
 
@@ -216,7 +240,7 @@ struct inode {
     char opaque[DARWIN_INODE_SIZE];
 #endif
 }  __attribute__((packed));
-static_assert(sizeof(struct inode) == 160, "inode size != 160");
+static_assert(sizeof(struct inode) == 168, "inode size != 168");
 static_assert((sizeof(struct inode) % sizeof(void *)) == 0,
               "Inode size is not aligned");
 
@@ -264,6 +288,22 @@ lc_inodeSetEmap(struct inode *inode, struct extent *extent) {
     rdata->rd_emap = extent;
 }
 
+/* Return the first preallocated extent which is not written yet */
+static inline struct extent *
+lc_inodeGetUnwritten(struct inode *inode) {
+    struct rdata *rdata = lc_inodeGetRegData(inode);
+
+    return rdata->rd_unwritten;
+}
+
+/* Return the address in inode storing unwritten extent list */
+static inline struct extent **
+lc_inodeGetUnwrittenPtr(struct inode *inode) {
+    struct rdata *rdata = lc_inodeGetRegData(inode);
+
+    return &rdata->rd_unwritten;
+}
+
 /* Return the size of inode page array */
 static inline uint32_t
 lc_inodeGetPageCount(struct inode *inode) {
@@ -369,6 +409,8 @@ lc_inodeSetLastPage(struct inode *inode, uint64_t page) {
     rdata->rd_lpage = page;
 }
 
+void lc_journalAdd(struct fs *fs, struct inode *inode);
+
 /* Mark inode dirty for flushing to disk */
 static inline void
 lc_markInodeDirty(struct inode *inode, uint32_t flags) {
@@ -379,10 +421,40 @@ lc_markInodeDirty(struct inode *inode, uint32_t flags) {
     if (flags & LC_INODE_EMAPDIRTY) {
         inode->i_flags &= ~LC_INODE_NOTRUNC;
     }
+
+    /* Record the modified inode in the journal of the layer */
+    if (!(inode->i_flags & LC_INODE_JOURNAL) && inode->i_fs->fs_parent) {
+        lc_journalAdd(inode->i_fs, inode);
+    }
     inode->i_flags |= flags | LC_INODE_DIRTY;
     lc_markInodesDirty(inode->i_fs);
 }
 
+/* Take a reference on an inode for an entry returned to kernel */
+static inline void
+lc_inodeRef(struct inode *inode) {
+    __sync_add_and_fetch(&inode->i_nlookup, 1);
+}
+
+/* Drop references kernel had on an inode.  Counts are not moved to copies
+ * made in child layers, so do not let those go below zero.
+ */
+static inline void
+lc_inodeForget(struct inode *inode, uint64_t nlookup) {
+    uint64_t count, new;
+
+    do {
+        count = inode->i_nlookup;
+        new = (count > nlookup) ? (count - nlookup) : 0;
+    } while (!__sync_bool_compare_and_swap(&inode->i_nlookup, count, new));
+}
+
+/* Check if kernel may have the inode cached */
+static inline bool
+lc_inodeReferenced(struct inode *inode) {
+    return inode->i_nlookup || inode->i_ocount;
+}
+
 /* Check an inode is dirty or not */
 static inline bool
 lc_inodeDirty(struct inode *inode) {
@@ -420,6 +492,15 @@ lc_icache_size(struct fs *fs) {
     return icsize;
 }
 
+/* Check if the inode is a fake one for exporting changes in a layer */
+static inline bool
+lc_exportInode(ino_t ino) {
+    ino_t inum = lc_getInodeHandle(ino);
+
+    return (inum == LC_EXPORT_INODE) || (inum == LC_EXPORT_GZIP_INODE) ||
+           (inum == LC_SEND_INODE);
+}
+
 /* Invalidate pages of an inode in kernel page cache */
 static inline void
 lc_invalInodePages(struct gfs *gfs, ino_t ino) {
@@ -37,6 +37,7 @@ lc_writeBlock(struct gfs *gfs, struct fs *fs, void *buf, off_t block) {
     count = pwrite(gfs->gfs_fd, buf, LC_BLOCK_SIZE, block * LC_BLOCK_SIZE);
     assert(count == LC_BLOCK_SIZE);
     __sync_add_and_fetch(&gfs->gfs_writes, 1);
+    __sync_add_and_fetch(&gfs->gfs_wblocks, 1);
     __sync_add_and_fetch(&fs->fs_writes, 1);
 }
 
@@ -54,6 +55,7 @@ lc_writeBlocks(struct gfs *gfs, struct fs *fs,
     count = lc_pwritev(gfs->gfs_fd, iov, iovcnt, block * LC_BLOCK_SIZE);
     assert(count == (iovcnt * LC_BLOCK_SIZE));
     __sync_add_and_fetch(&gfs->gfs_writes, 1);
+    __sync_add_and_fetch(&gfs->gfs_wblocks, iovcnt);
     __sync_add_and_fetch(&fs->fs_writes, 1);
 }
 
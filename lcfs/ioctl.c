@@ -28,6 +28,36 @@ usage(char *pgm, char *name) {
         fprintf(stderr, "\t mnt              - mount point\n");
         fprintf(stderr, "\t [enable|disable] - enable/disable profiling\n");
 #endif
+    } else if (strcmp(name, "log") == 0) {
+        fprintf(stderr, "usage: %s %s <mnt> <id> [enable|disable]\n",
+                pgm, name);
+        fprintf(stderr, "\t mnt              - mount point\n");
+        fprintf(stderr, "\t id               - layer name\n");
+        fprintf(stderr, "\t [enable|disable] - enable/disable intent log\n");
+    } else if (strcmp(name, "receive") == 0) {
+        fprintf(stderr, "usage: %s %s <mnt> <id> <file> [parent]\n",
+                pgm, name);
+        fprintf(stderr, "\t mnt    - mount point\n");
+        fprintf(stderr, "\t id     - name of the new layer\n");
+        fprintf(stderr, "\t file   - file with the stream of the layer\n");
+        fprintf(stderr, "\t parent - parent layer (optional)\n");
+    } else if (strcmp(name, "extract") == 0) {
+        fprintf(stderr, "usage: %s %s <mnt> <id> <file> [parent]\n",
+                pgm, name);
+        fprintf(stderr, "\t mnt    - mount point\n");
+        fprintf(stderr, "\t id     - name of the new layer\n");
+        fprintf(stderr, "\t file   - tar archive with files of the layer\n");
+        fprintf(stderr, "\t parent - parent layer (optional)\n");
+    } else if (strcmp(name, "create") == 0) {
+        fprintf(stderr, "usage: %s %s <mnt> <parent> <id> [id...]\n",
+                pgm, name);
+        fprintf(stderr, "\t mnt    - mount point\n");
+        fprintf(stderr, "\t parent - parent layer\n");
+        fprintf(stderr, "\t id     - names of the new layers\n");
+    } else if (strcmp(name, "remove") == 0) {
+        fprintf(stderr, "usage: %s %s <mnt> <id> [id...]\n", pgm, name);
+        fprintf(stderr, "\t mnt    - mount point\n");
+        fprintf(stderr, "\t id     - names of the layers\n");
     } else if (strcmp(name, "verbose") == 0) {
         fprintf(stderr, "usage: %s %s <mnt> [enable|disable]\n", pgm, name);
         fprintf(stderr, "\t mnt              - mount point\n");
@@ -44,12 +74,14 @@ usage(char *pgm, char *name) {
  */
 int
 ioctl_main(char *pgm, int argc, char *argv[]) {
-    char name[LAYER_NAME_MAX + 1], *dir, op;
-    int fd, err, len, value;
+    char name[LAYER_NAME_MAX + 1], *dir, *buf, *path, op;
+    int fd, err, len, plen, value, i;
     enum ioctl_cmd cmd;
     struct stat st;
 
-    if ((argc != 2) && (argc != 3) && (argc != 4)) {
+    if ((argc < 2) ||
+        ((argc > 5) && strcmp(argv[0], "create") &&
+         strcmp(argv[0], "remove"))) {
         usage(pgm, argv[0]);
     }
     if (stat(argv[1], &st)) {
@@ -85,6 +117,108 @@ ioctl_main(char *pgm, int argc, char *argv[]) {
         name[len] = 0;
         cmd = (argc == 3) ? LAYER_STAT : CLEAR_STAT;
         err = ioctl(fd, _IOW(0, cmd, name), name);
+    } else if (strcmp(argv[0], "log") == 0) {
+        if (argc != 4) {
+            close(fd);
+            usage(pgm, argv[0]);
+        }
+        if (strcmp(argv[3], "enable") == 0) {
+            cmd = LAYER_LOG_ENABLE;
+        } else if (strcmp(argv[3], "disable") == 0) {
+            cmd = LAYER_LOG_DISABLE;
+        } else {
+            close(fd);
+            usage(pgm, argv[0]);
+        }
+        len = strlen(argv[2]);
+        assert(len < LAYER_NAME_MAX);
+        memcpy(name, argv[2], len);
+        name[len] = 0;
+        err = ioctl(fd, _IOW(0, cmd, name), name);
+    } else if ((strcmp(argv[0], "receive") == 0) ||
+               (strcmp(argv[0], "extract") == 0)) {
+        if ((argc != 4) && (argc != 5)) {
+            close(fd);
+            usage(pgm, argv[0]);
+        }
+
+        /* Daemon reads the stream or the archive from the file */
+        path = realpath(argv[3], NULL);
+        if (path == NULL) {
+            perror("realpath");
+            close(fd);
+            exit(errno);
+        }
+        plen = (argc == 5) ? strlen(argv[4]) : 0;
+        len = strlen(argv[2]);
+        assert(len < LAYER_NAME_MAX);
+        assert(plen < LAYER_NAME_MAX);
+
+        /* Buffer has the parent, layer and file names separated by nulls */
+        value = (plen ? plen + 1 : 0) + len + strlen(path) + 2;
+        buf = alloca(value);
+        memset(buf, 0, value);
+        if (plen) {
+            memcpy(buf, argv[4], plen);
+        }
+        memcpy(&buf[plen ? plen + 1 : 0], argv[2], len);
+        strcpy(&buf[(plen ? plen + 1 : 0) + len + 1], path);
+        free(path);
+
+        /* Length of the parent name is passed in the type field */
+        cmd = (strcmp(argv[0], "receive") == 0) ? LAYER_RECEIVE :
+                                                  LAYER_EXTRACT;
+        err = ioctl(fd, _IOC(_IOC_WRITE, plen, cmd, value), buf);
+    } else if (strcmp(argv[0], "create") == 0) {
+        if ((argc < 4) || ((argc - 3) > LC_LAYER_BATCH_MAX)) {
+            close(fd);
+            usage(pgm, argv[0]);
+        }
+        plen = strlen(argv[2]);
+        assert(plen < LAYER_NAME_MAX);
+
+        /* Buffer has the parent and layer names separated by nulls, and
+         * should be large enough for the handles returned for the layers.
+         */
+        len = plen + 1;
+        for (i = 3; i < argc; i++) {
+            assert(strlen(argv[i]) < LAYER_NAME_MAX);
+            len += strlen(argv[i]) + 1;
+        }
+        value = (argc - 3) * sizeof(ino_t);
+        if (value < len) {
+            value = len;
+        }
+        if (value > _IOC_SIZEMASK) {
+            close(fd);
+            usage(pgm, argv[0]);
+        }
+        buf = alloca(value);
+        memset(buf, 0, value);
+        memcpy(buf, argv[2], plen);
+        for (i = 3, len = plen + 1; i < argc; i++) {
+            strcpy(&buf[len], argv[i]);
+            len += strlen(argv[i]) + 1;
+        }
+
+        /* Length of the parent name is passed in the type field */
+        err = ioctl(fd, _IOC(_IOC_READ | _IOC_WRITE, plen, LAYER_CREATE_BATCH,
+                             value), buf);
+    } else if (strcmp(argv[0], "remove") == 0) {
+        if (argc < 3) {
+            close(fd);
+            usage(pgm, argv[0]);
+        }
+
+        /* Layers are removed one at a time, in the order specified */
+        err = 0;
+        for (i = 2; (i < argc) && (err == 0); i++) {
+            len = strlen(argv[i]);
+            assert(len < LAYER_NAME_MAX);
+            memcpy(name, argv[i], len);
+            name[len] = 0;
+            err = ioctl(fd, _IOW(0, LAYER_REMOVE, name), name);
+        }
     } else if (strcmp(argv[0], "flush") == 0) {
         if (argc != 2) {
             close(fd);
@@ -103,6 +237,12 @@ ioctl_main(char *pgm, int argc, char *argv[]) {
             usage(pgm, argv[0]);
         }
         err = ioctl(fd, _IO(0, LCFS_COMMIT), 0);
+    } else if (strcmp(argv[0], "hot") == 0) {
+        if (argc != 2) {
+            close(fd);
+            usage(pgm, argv[0]);
+        }
+        err = ioctl(fd, _IO(0, LAYER_HOT), 0);
     } else if ((strcmp(argv[0], "verbose") == 0)
 #ifndef __MUSL__
                || (strcmp(argv[0], "profile") == 0)
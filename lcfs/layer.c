@@ -31,7 +31,8 @@ lc_linkParent(struct fs *fs, struct fs *pfs) {
     fs->fs_parent = pfs;
     fs->fs_bcache = pfs->fs_bcache;
     fs->fs_rfs = pfs->fs_rfs;
-    if (pfs->fs_hlinks) {
+    /* Records rebuilt for a diff after remount are not shared */
+    if (pfs->fs_hlinks && !pfs->fs_rfs->fs_restarted) {
         fs->fs_hlinks = pfs->fs_hlinks;
         fs->fs_sharedHlinks = true;
     }
@@ -55,8 +56,34 @@ lc_invalidateFirstLayer(struct gfs *gfs, struct fs *pfs, int gindex) {
     rcu_unregister_thread();
 }
 
-/* Create a new layer */
-void
+/* Set up in-memory structures of a new layer locked exclusive */
+static void
+lc_initLayer(struct fs *fs, struct fs *pfs, size_t icsize, const char *name) {
+
+    /* Allocate inode cache */
+    lc_icache_init(fs, icsize);
+
+    /* Initialize the root inode */
+    lc_rootInit(fs, fs->fs_root);
+
+    if (pfs == NULL) {
+
+        /* Allocate block cache for a base layer */
+        lc_bcacheInit(fs, LC_PCACHE_SIZE, LC_PCLOCK_COUNT);
+    } else {
+
+        /* Copy the parent root directory */
+        lc_cloneRootDir(pfs->fs_rootInode, fs->fs_rootInode);
+    }
+
+    /* Allocate stat structure if enabled */
+    lc_statsNew(fs);
+    lc_printf("Created fs with parent %ld root %ld index %d name %s\n",
+              pfs ? pfs->fs_root : -1, fs->fs_root, fs->fs_gindex, name);
+}
+
+/* Create a new layer.  Request is completed unless called without one */
+int
 lc_createLayer(fuse_req_t req, struct gfs *gfs, const char *name,
                const char *parent, size_t size, bool rw) {
     struct fs *fs = NULL, *pfs = NULL, *rfs = NULL;
@@ -161,31 +188,14 @@ lc_createLayer(fuse_req_t req, struct gfs *gfs, const char *name,
     /* Respond now and complete the work. Operations in the layer will wait for
      * the lock on the layer.
      */
-    fuse_reply_ioctl(req, 0, NULL, 0);
-
-    /* Allocate inode cache */
-    lc_icache_init(fs, icsize);
-
-    /* Initialize the root inode */
-    lc_rootInit(fs, fs->fs_root);
-
-    if (base) {
-
-        /* Allocate block cache for a base layer */
-        lc_bcacheInit(fs, LC_PCACHE_SIZE, LC_PCLOCK_COUNT);
-    } else {
-
-        /* Copy the parent root directory */
-        lc_cloneRootDir(pfs->fs_rootInode, fs->fs_rootInode);
+    if (req) {
+        fuse_reply_ioctl(req, 0, NULL, 0);
     }
 
-    /* Allocate stat structure if enabled */
-    lc_statsNew(fs);
-    lc_printf("Created fs with parent %ld root %ld index %d name %s\n",
-              pfs ? pfs->fs_root : -1, root, fs->fs_gindex, name);
+    lc_initLayer(fs, pfs, icsize, name);
 
 out:
-    if (unlikely(err)) {
+    if (unlikely(err) && req) {
         fuse_reply_err(req, err);
     }
     lc_statsAdd(rfs, LC_LAYER_CREATE, err, &start);
@@ -209,6 +219,153 @@ out:
         lc_unlock(pfs);
     }
     lc_unlock(rfs);
+    return err;
+}
+
+/* Create a number of read-write layers on the same parent layer in one
+ * request.  Names of the layers are separated by nulls in the buffer, and
+ * handles of root directories of the new layers are returned in the same
+ * order.  Either all layers are created or none.
+ */
+void
+lc_createLayers(fuse_req_t req, struct gfs *gfs, const char *parent,
+                size_t size, const char *names, size_t nsize, size_t osize) {
+    struct fs *pfs = NULL, *rfs, **fss = NULL;
+    int err = 0, inval, i, count = 0;
+    const char **namev = NULL;
+    ino_t root, pinum, *handles;
+    struct timeval start;
+    struct inode *pdir;
+    void *super;
+    size_t off;
+    bool init;
+
+    lc_statsBegin(&start);
+
+    /* Count names in the buffer */
+    for (off = 0; off < nsize; off += strlen(&names[off]) + 1) {
+        if (names[off]) {
+            count++;
+        }
+    }
+    if ((size == 0) || (count == 0) || (count > LC_LAYER_BATCH_MAX) ||
+        ((count * sizeof(ino_t)) > osize)) {
+        lc_reportError(__func__, __LINE__, gfs->gfs_layerRoot, EINVAL);
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+    rfs = lc_getLayerLocked(LC_ROOT_INODE, false);
+    namev = lc_malloc(rfs, count * sizeof(char *), LC_MEMTYPE_GFS);
+    fss = lc_malloc(rfs, count * sizeof(struct fs *), LC_MEMTYPE_GFS);
+    for (off = 0, i = 0; off < nsize; off += strlen(&names[off]) + 1) {
+        if (names[off]) {
+            namev[i++] = &names[off];
+        }
+    }
+
+    /* Do not allow new layers when low on space */
+    if (!lc_hasSpace(gfs, false, true)) {
+        err = ENOSPC;
+        lc_reportError(__func__, __LINE__, gfs->gfs_layerRoot, err);
+        goto out;
+    }
+
+    /* Find parent root inode and add root directories of all layers with a
+     * range of inode numbers allocated at once.
+     */
+    pdir = gfs->gfs_layerRootInode;
+    lc_inodeLock(pdir, true);
+    pinum = lc_getRootIno(rfs, parent, pdir, true);
+    if (pinum == LC_INVALID_INODE) {
+        lc_inodeUnlock(pdir);
+        err = ENOENT;
+        goto out;
+    }
+    root = __sync_add_and_fetch(&gfs->gfs_super->sb_ninode, count) - count;
+    for (i = 0; i < count; i++) {
+
+        /* Names should be unique, including those in the same request */
+        if (lc_dirLookup(rfs, pdir, namev[i]) != LC_INVALID_INODE) {
+            while (i > 0) {
+                lc_dirRemove(pdir, namev[--i]);
+            }
+            lc_inodeUnlock(pdir);
+            err = EEXIST;
+            goto out;
+        }
+        lc_dirAdd(pdir, root + i + 1, S_IFDIR, namev[i], strlen(namev[i]));
+    }
+    pdir->i_nlink += count;
+    lc_markInodeDirty(pdir, LC_INODE_DIRDIRTY);
+    lc_inodeUnlock(pdir);
+
+    /* Initialize the new layers */
+    pfs = lc_getLayerLocked(pinum, false);
+    assert(pfs->fs_frozen);
+    assert(pfs->fs_pcount == 0);
+    assert(pfs->fs_root == lc_getInodeHandle(pinum));
+    for (i = 0; i < count; i++) {
+        init = (strstr(namev[i], "-init") != NULL);
+        fss[i] = lc_newLayer(gfs, true);
+        lc_lock(fss[i], true);
+        lc_mallocBlockAligned(fss[i], (void **)&super, LC_MEMTYPE_BLOCK);
+        lc_superInit(super, root + i + 1, 0, LC_SUPER_DIRTY | LC_SUPER_RDWR |
+                     (init ? LC_SUPER_INIT : 0), false);
+        fss[i]->fs_super = super;
+        fss[i]->fs_root = root + i + 1;
+        lc_linkParent(fss[i], pfs);
+    }
+
+    /* Add all layers to global list of file systems at once */
+    err = lc_addLayers(gfs, fss, count, pfs, &inval);
+    if (unlikely(err)) {
+        lc_inodeLock(pdir, true);
+        for (i = 0; i < count; i++) {
+            lc_dirRemove(pdir, namev[i]);
+        }
+        pdir->i_nlink -= count;
+        lc_inodeUnlock(pdir);
+        goto out;
+    }
+    handles = alloca(count * sizeof(ino_t));
+    for (i = 0; i < count; i++) {
+        if (fss[i]->fs_super->sb_flags & LC_SUPER_INIT) {
+            __sync_add_and_fetch(&gfs->gfs_layerInProgress, 1);
+        }
+        handles[i] = lc_setHandle(fss[i]->fs_gindex, fss[i]->fs_root);
+    }
+    lc_layerChanged(gfs, true, false);
+
+    /* Respond now and complete the work. Operations in the layers will wait
+     * for the locks on the layers.
+     */
+    fuse_reply_ioctl(req, 0, handles, count * sizeof(ino_t));
+    for (i = 0; i < count; i++) {
+        lc_initLayer(fss[i], pfs,
+                     (fss[i]->fs_super->sb_flags & LC_SUPER_INIT) ?
+                     LC_ICACHE_SIZE_MIN : LC_ICACHE_SIZE, namev[i]);
+        lc_unlockExclusive(fss[i]);
+    }
+
+out:
+    if (unlikely(err)) {
+        fuse_reply_err(req, err);
+        for (i = 0; pfs && (i < count); i++) {
+            fss[i]->fs_removed = true;
+            lc_unlock(fss[i]);
+            lc_destroyLayer(fss[i], true);
+        }
+    }
+    lc_statsAdd(rfs, LC_LAYER_CREATE, err, &start);
+    if (pfs) {
+        if (!err && inval) {
+            lc_invalidateFirstLayer(gfs, pfs, inval);
+        }
+        lc_unlock(pfs);
+    }
+    lc_free(rfs, fss, count * sizeof(struct fs *), LC_MEMTYPE_GFS);
+    lc_free(rfs, namev, count * sizeof(char *), LC_MEMTYPE_GFS);
+    lc_unlock(rfs);
 }
 
 /* Check if a layer could be removed */
@@ -232,10 +389,17 @@ lc_releaseLayer(struct gfs *gfs, struct fs *fs, struct fs *rfs,
     lc_invalidateDirtyPages(gfs, fs);
     lc_invalidateInodePages(gfs, fs);
     lc_invalidateInodeBlocks(gfs, fs);
+
+    /* Layers sharing blocks allocated in this layer take those over */
+    lc_dedupRelease(gfs, fs);
     if (super->sb_extentCount) {
         lc_addSpaceExtent(gfs, rfs, extents, super->sb_extentBlock,
                           super->sb_extentCount, true);
     }
+    if (super->sb_dedupCount) {
+        lc_addSpaceExtent(gfs, rfs, extents, super->sb_dedupBlock,
+                          super->sb_dedupCount, true);
+    }
     if (fs->fs_sblock != LC_INVALID_BLOCK) {
         lc_addSpaceExtent(gfs, rfs, extents, fs->fs_sblock, 1, true);
     }
@@ -244,11 +408,212 @@ lc_releaseLayer(struct gfs *gfs, struct fs *fs, struct fs *rfs,
     lc_destroyLayer(fs, true);
 }
 
-/* Remove a layer */
+/* Free resources of a removed layer along with zombie parent layers removed
+ * with it.  Caller holds the root layer shared, so that the file system is not
+ * checkpointed while the layer is partially freed.
+ */
+static void
+lc_reclaimLayer(struct gfs *gfs, struct fs *fs, struct fs *rfs) {
+    struct extent *extents = NULL;
+    struct fs *zfs;
+
+    /* Destroy pages */
+    zfs = fs;
+    lc_lockExclusive(zfs);
+    while (true) {
+        lc_invalidateDirtyPages(gfs, zfs);
+        lc_destroyPages(gfs, zfs, true);
+        zfs = zfs->fs_zfs;
+        if (zfs == NULL) {
+            break;
+        }
+        lc_lockExclusive(zfs);
+    }
+
+retry:
+    zfs = fs->fs_zfs;
+    lc_releaseLayer(gfs, fs, rfs, &extents);
+    if (zfs) {
+
+        /* Remove zombie parent layer */
+        fs = zfs;
+        goto retry;
+    }
+    if (extents) {
+        lc_blockFreeExtents(gfs, rfs, extents,
+                            LC_EXTENT_EFREE | LC_EXTENT_LAYER);
+    }
+}
+
+/* Queue a removed layer for the reclaimer.  Returns false if the reclaimer is
+ * not running.
+ */
+static bool
+lc_queueReclaim(struct gfs *gfs, struct fs *fs) {
+    pthread_mutex_lock(&gfs->gfs_rlock);
+    if (!gfs->gfs_reclaiming) {
+        pthread_mutex_unlock(&gfs->gfs_rlock);
+        return false;
+    }
+
+    /* Layers are reclaimed in the order those were removed, so that a base
+     * layer is not freed before pages of layers in its tree are destroyed.
+     */
+    assert(fs->fs_rnext == NULL);
+    if (gfs->gfs_reclaimLast) {
+        gfs->gfs_reclaimLast->fs_rnext = fs;
+    } else {
+        assert(gfs->gfs_reclaim == NULL);
+        gfs->gfs_reclaim = fs;
+    }
+    gfs->gfs_reclaimLast = fs;
+    __sync_add_and_fetch(&gfs->gfs_reclaimCount, 1);
+    pthread_cond_signal(&gfs->gfs_reclaimCond);
+    pthread_mutex_unlock(&gfs->gfs_rlock);
+    return true;
+}
+
+/* Background thread freeing resources of removed layers */
+void *
+lc_reclaimer(void *data) {
+    struct gfs *gfs = (struct gfs *)data;
+    struct fs *rfs = lc_getGlobalFs(gfs), *fs;
+
+    pthread_mutex_lock(&gfs->gfs_rlock);
+    gfs->gfs_reclaiming = true;
+    while (true) {
+        if (gfs->gfs_reclaim == NULL) {
+
+            /* Exit only after all removed layers are reclaimed */
+            if (gfs->gfs_unmounting) {
+                break;
+            }
+            pthread_cond_wait(&gfs->gfs_reclaimCond, &gfs->gfs_rlock);
+            continue;
+        }
+        pthread_mutex_unlock(&gfs->gfs_rlock);
+
+        /* Take the layer off the queue with the root layer locked, so that a
+         * checkpoint finds the layer either queued or reclaimed.
+         */
+        lc_lock(rfs, false);
+        pthread_mutex_lock(&gfs->gfs_rlock);
+        fs = gfs->gfs_reclaim;
+        gfs->gfs_reclaim = fs->fs_rnext;
+        if (gfs->gfs_reclaim == NULL) {
+            gfs->gfs_reclaimLast = NULL;
+        }
+        fs->fs_rnext = NULL;
+        pthread_mutex_unlock(&gfs->gfs_rlock);
+        lc_printf("Reclaiming fs with root %ld\n", fs->fs_root);
+        lc_reclaimLayer(gfs, fs, rfs);
+        gfs->gfs_reclaimed++;
+        assert(gfs->gfs_reclaimCount > 0);
+        __sync_sub_and_fetch(&gfs->gfs_reclaimCount, 1);
+
+        /* Freed blocks are made available after the next checkpoint */
+        lc_markSuperDirty(rfs);
+        lc_layerChanged(gfs, false, false);
+        lc_unlock(rfs);
+
+        /* Let other threads run when many layers are removed together */
+        if (gfs->gfs_reclaim && !gfs->gfs_unmounting) {
+            usleep(LC_RECLAIM_DELAY);
+        }
+        pthread_mutex_lock(&gfs->gfs_rlock);
+    }
+    gfs->gfs_reclaiming = false;
+    pthread_mutex_unlock(&gfs->gfs_rlock);
+    return NULL;
+}
+
+/* Write out lists of blocks allocated in removed layers waiting to be
+ * reclaimed, before the superblocks of those are written.  Called with the
+ * root layer locked exclusive.
+ */
 void
-lc_deleteLayer(fuse_req_t req, struct gfs *gfs, const char *name) {
-    struct fs *fs = NULL, *rfs, *bfs = NULL, *zfs;
+lc_flushRemovedLayers(struct gfs *gfs) {
+    struct fs *rfs = lc_getGlobalFs(gfs), *fs, *zfs;
+    struct super *super;
+
+    for (fs = gfs->gfs_reclaim; fs; fs = fs->fs_rnext) {
+        for (zfs = fs; zfs; zfs = zfs->fs_zfs) {
+
+            /* Inodes of a removed layer are not written anymore */
+            zfs->fs_inodesDirty = false;
+            lc_processLayerBlocks(gfs, zfs, false, false, true);
+
+            /* List on disk is stale if all blocks in it were freed */
+            super = zfs->fs_super;
+            if ((zfs->fs_aextents == NULL) && super->sb_extentCount) {
+                lc_addFreedBlocks(rfs, super->sb_extentBlock,
+                                  super->sb_extentCount);
+                super->sb_extentBlock = LC_INVALID_BLOCK;
+                super->sb_extentCount = 0;
+            }
+        }
+    }
+}
+
+/* Free blocks of layers removed before the file system was checkpointed last,
+ * but not reclaimed before the file system was shut down.  Blocks are freed
+ * using lists of blocks written out for those layers.
+ */
+void
+lc_reclaimRemovedLayers(struct gfs *gfs, struct fs *rfs) {
+    uint64_t block = gfs->gfs_super->sb_reclaimLayer;
     struct extent *extents = NULL;
+    struct super *super;
+    struct fs *fs;
+
+    while (block) {
+        fs = lc_newLayer(gfs, false);
+        lc_statsNew(fs);
+        fs->fs_sblock = block;
+        fs->fs_removed = true;
+        fs->fs_gindex = -1;
+        lc_superRead(gfs, fs, block);
+        super = fs->fs_super;
+        assert(lc_superValid(super));
+        assert(super->sb_flags & LC_SUPER_REMOVED);
+        lc_printf("Reclaiming removed fs with root %ld block %ld\n",
+                  super->sb_root, block);
+        if (super->sb_extentBlock != LC_INVALID_BLOCK) {
+            lc_readExtents(gfs, fs);
+        }
+
+        /* Layers sharing blocks allocated in this layer take those over */
+        lc_dedupRelease(gfs, fs);
+        if (super->sb_extentCount) {
+            lc_addSpaceExtent(gfs, rfs, &extents, super->sb_extentBlock,
+                              super->sb_extentCount, true);
+        }
+        if (super->sb_dedupCount) {
+            lc_addSpaceExtent(gfs, rfs, &extents, super->sb_dedupBlock,
+                              super->sb_dedupCount, true);
+        }
+        lc_addSpaceExtent(gfs, rfs, &extents, block, 1, true);
+        lc_processLayerBlocks(gfs, fs, false, true, false);
+        block = super->sb_nextLayer;
+        lc_destroyLayer(fs, true);
+        gfs->gfs_reclaimed++;
+    }
+    if (extents) {
+        lc_blockFreeExtents(gfs, rfs, extents,
+                            LC_EXTENT_EFREE | LC_EXTENT_LAYER);
+        gfs->gfs_super->sb_reclaimLayer = 0;
+        lc_markSuperDirty(rfs);
+        lc_layerChanged(gfs, false, false);
+    }
+}
+
+/* Remove a layer.  Request is completed unless called without one.  Layer is
+ * taken off of the tree before replying and its resources are freed by the
+ * reclaimer later.
+ */
+void
+lc_deleteLayer(fuse_req_t req, struct gfs *gfs, const char *name) {
+    struct fs *fs = NULL, *rfs, *bfs = NULL;
     struct inode *pdir = NULL;
     struct timeval start;
     int err = 0;
@@ -264,7 +629,9 @@ lc_deleteLayer(fuse_req_t req, struct gfs *gfs, const char *name) {
     err = lc_dirRemoveName(rfs, pdir, name, true, (void **)&fs, true);
     if (unlikely(err)) {
         lc_inodeUnlock(pdir);
-        fuse_reply_err(req, err);
+        if (req) {
+            fuse_reply_err(req, err);
+        }
         lc_reportError(__func__, __LINE__, pdir->i_ino, err);
         goto out;
     }
@@ -272,13 +639,15 @@ lc_deleteLayer(fuse_req_t req, struct gfs *gfs, const char *name) {
     if (fs && fs->fs_parent) {
 
         /* Have the base layer locked so that that will not be deleted before
-         * this layer is freed.
+         * this layer is queued for reclaim.
          */
         bfs = fs->fs_rfs;
         lc_lock(bfs, false);
     }
     lc_inodeUnlock(pdir);
-    fuse_reply_ioctl(req, 0, NULL, 0);
+    if (req) {
+        fuse_reply_ioctl(req, 0, NULL, 0);
+    }
     lc_layerChanged(gfs, true, false);
 
     /* This could happen when a layer is made a zombie layer, which will be
@@ -292,31 +661,6 @@ lc_deleteLayer(fuse_req_t req, struct gfs *gfs, const char *name) {
     lc_printf("Removing fs with parent %ld root %ld name %s\n",
                fs->fs_parent ? fs->fs_parent->fs_root : - 1, root, name);
 
-    /* Destroy pages and unlock base layer */
-    zfs = fs;
-    while (true) {
-        lc_invalidateDirtyPages(gfs, zfs);
-        lc_destroyPages(gfs, zfs, true);
-        zfs = zfs->fs_zfs;
-        if (zfs == NULL) {
-            break;
-        }
-        lc_lockExclusive(zfs);
-    }
-    if (bfs) {
-        lc_unlock(bfs);
-    }
-
-retry:
-    zfs = fs->fs_zfs;
-    lc_releaseLayer(gfs, fs, rfs, &extents);
-    if (zfs) {
-
-        /* Remove zombie parent layer */
-        fs = zfs;
-        goto retry;
-    }
-
     /* Notify VFS about removal of a directory */
     fuse_lowlevel_notify_delete(
 #ifdef FUSE3
@@ -325,9 +669,16 @@ retry:
                                 gfs->gfs_ch[LC_LAYER_MOUNT],
 #endif
                                 gfs->gfs_layerRoot, root, name, strlen(name));
-    if (extents) {
-        lc_blockFreeExtents(gfs, rfs, extents,
-                            LC_EXTENT_EFREE | LC_EXTENT_LAYER);
+
+    /* Operations on the layer are drained and the layer cannot be looked up
+     * anymore, so free its resources in the background.
+     */
+    lc_unlockExclusive(fs);
+    if (!lc_queueReclaim(gfs, fs)) {
+        lc_reclaimLayer(gfs, fs, rfs);
+    }
+    if (bfs) {
+        lc_unlock(bfs);
     }
 
 out:
@@ -335,9 +686,12 @@ out:
     lc_unlock(rfs);
 }
 
-/* Unmount a layer */
+/* Unmount a layer.  A layer frozen with lastInode set keeps that as the last
+ * inode in the layer instead of the last inode allocated.
+ */
 static void
-lc_umountLayer(fuse_req_t req, struct gfs *gfs, ino_t root) {
+lc_umountLayer(fuse_req_t req, struct gfs *gfs, ino_t root,
+               uint64_t lastInode) {
     struct fs *fs = lc_getLayerLocked(root, false);
     int gindex, mcount;
 
@@ -350,6 +704,9 @@ lc_umountLayer(fuse_req_t req, struct gfs *gfs, ino_t root) {
     if (!fs->fs_frozen && (fs->fs_readOnly ||
                            (fs->fs_super->sb_flags & LC_SUPER_INIT))) {
         gindex = fs->fs_gindex;
+
+        /* Get data cached in kernel before freezing the layer */
+        lc_flushKernelPages(gfs, fs);
         lc_unlock(fs);
 
         /* Allocate blocks for all dirty pages.  This must have been started by
@@ -365,7 +722,8 @@ lc_umountLayer(fuse_req_t req, struct gfs *gfs, ino_t root) {
         lc_freezeLayer(gfs, fs);
 
         /* Mark the layer as immutable */
-        fs->fs_super->sb_lastInode = gfs->gfs_super->sb_ninode;
+        fs->fs_super->sb_lastInode = lastInode ? lastInode :
+                                     gfs->gfs_super->sb_ninode;
         fs->fs_frozen = true;
         fs->fs_commitInProgress = false;
         lc_markSuperDirty(fs);
@@ -383,6 +741,9 @@ lc_umountLayer(fuse_req_t req, struct gfs *gfs, ino_t root) {
             if (!fs->fs_removed) {
                 lc_flushDirtyPages(gfs, fs);
                 lc_processHiddenInodes(gfs, fs);
+
+                /* Files written to disk could be shared with other layers */
+                lc_dedupPublish(gfs, fs);
             }
             lc_unlock(fs);
         } else {
@@ -400,6 +761,138 @@ lc_umountLayer(fuse_req_t req, struct gfs *gfs, ino_t root) {
     }
 }
 
+/* Receive a layer from a stream in a file.  The layer is created as a child
+ * of the named parent layer, which should be the one the layer sent was
+ * created on, or a copy of that received earlier, and frozen after the stream
+ * is received.
+ */
+void
+lc_receiveLayer(fuse_req_t req, struct gfs *gfs, const char *name,
+                const char *parent, size_t size, const char *path) {
+    struct receive *rc = NULL;
+    struct fs *fs, *rfs;
+    uint64_t ninode, lastInode;
+    ino_t root, pinum;
+    int err;
+
+    err = lc_receiveOpen(gfs, path, size == 0, &rc);
+    if (unlikely(err)) {
+        goto out;
+    }
+
+    /* Validate the layer and the parent layer */
+    rfs = lc_getLayerLocked(LC_ROOT_INODE, false);
+    if (lc_getRootIno(rfs, name, NULL, false) != LC_INVALID_INODE) {
+        err = EEXIST;
+    } else if (size) {
+        pinum = lc_getRootIno(rfs, parent, NULL, true);
+        if (pinum == LC_INVALID_INODE) {
+            err = ENOENT;
+        } else {
+            fs = lc_getLayerLocked(pinum, false);
+            if (fs->fs_removed || !fs->fs_frozen || !fs->fs_readOnly ||
+                (fs->fs_super->sb_layerId == 0) ||
+                (fs->fs_super->sb_layerId != rc->rc_layer.sl_pid) ||
+                (fs->fs_super->sb_lastInode !=
+                 rc->rc_layer.sl_plastInode)) {
+                err = EINVAL;
+            }
+            lc_unlock(fs);
+        }
+    }
+    lc_unlock(rfs);
+    if (unlikely(err)) {
+        goto out;
+    }
+
+    /* Inodes are received with the numbers those had in the layer sent */
+    do {
+        ninode = gfs->gfs_super->sb_ninode;
+        if (ninode >= rc->rc_layer.sl_ninode) {
+            break;
+        }
+    } while (!__sync_bool_compare_and_swap(&gfs->gfs_super->sb_ninode,
+                                           ninode, rc->rc_layer.sl_ninode));
+    lc_markSuperDirty(lc_getGlobalFs(gfs));
+    err = lc_createLayer(NULL, gfs, name, parent, size, false);
+    if (unlikely(err)) {
+        goto out;
+    }
+    rfs = lc_getLayerLocked(LC_ROOT_INODE, false);
+    root = lc_getRootIno(rfs, name, NULL, true);
+    lc_unlock(rfs);
+    assert(root != LC_INVALID_INODE);
+    fs = lc_getLayerLocked(root, false);
+
+    /* Layer keeps its identity, so that its child layers could be received */
+    fs->fs_super->sb_layerId = rc->rc_layer.sl_id;
+    lc_markSuperDirty(fs);
+    err = lc_receiveInodes(fs, rc);
+    if (unlikely(err)) {
+        lc_unlock(fs);
+        assert(gfs->gfs_layerInProgress > 0);
+        __sync_sub_and_fetch(&gfs->gfs_layerInProgress, 1);
+        lc_deleteLayer(NULL, gfs, name);
+        goto out;
+    }
+    __sync_add_and_fetch(&fs->fs_mcount, 1);
+    lc_unlock(fs);
+    lastInode = rc->rc_layer.sl_lastInode;
+    lc_receiveClose(gfs, rc);
+
+    /* Freeze the layer as if it was created locally */
+    lc_umountLayer(req, gfs, root, lastInode);
+    return;
+
+out:
+    if (rc) {
+        lc_receiveClose(gfs, rc);
+    }
+    lc_reportError(__func__, __LINE__, 0, err);
+    fuse_reply_err(req, err);
+}
+
+/* Create a layer from a tar archive in a file, as a child of the named
+ * parent layer.  Whiteouts in the archive remove files of the parent layer.
+ * The layer is frozen after the whole archive is extracted, or removed if
+ * the archive could not be extracted.
+ */
+void
+lc_extractLayer(fuse_req_t req, struct gfs *gfs, const char *name,
+                const char *parent, size_t size, const char *path) {
+    struct fs *fs, *rfs;
+    ino_t root;
+    int err;
+
+    err = lc_createLayer(NULL, gfs, name, parent, size, false);
+    if (unlikely(err)) {
+        goto out;
+    }
+    rfs = lc_getLayerLocked(LC_ROOT_INODE, false);
+    root = lc_getRootIno(rfs, name, NULL, true);
+    lc_unlock(rfs);
+    assert(root != LC_INVALID_INODE);
+    fs = lc_getLayerLocked(root, false);
+    err = lc_extract(fs, path);
+    if (unlikely(err)) {
+        lc_unlock(fs);
+        assert(gfs->gfs_layerInProgress > 0);
+        __sync_sub_and_fetch(&gfs->gfs_layerInProgress, 1);
+        lc_deleteLayer(NULL, gfs, name);
+        goto out;
+    }
+    __sync_add_and_fetch(&fs->fs_mcount, 1);
+    lc_unlock(fs);
+
+    /* Freeze the layer as if it was populated through the mount point */
+    lc_umountLayer(req, gfs, root, 0);
+    return;
+
+out:
+    lc_reportError(__func__, __LINE__, 0, err);
+    fuse_reply_err(req, err);
+}
+
 /* Mount, unmount, stat a layer */
 void
 lc_layerIoctl(fuse_req_t req, struct gfs *gfs, const char *name,
@@ -467,7 +960,7 @@ lc_layerIoctl(fuse_req_t req, struct gfs *gfs, const char *name,
 
         /* Unmount a layer */
         if (likely(err == 0)) {
-            lc_umountLayer(req, gfs, root);
+            lc_umountLayer(req, gfs, root, 0);
         }
         lc_statsAdd(rfs, LC_UMOUNT, err, &start);
         break;
@@ -494,6 +987,21 @@ lc_layerIoctl(fuse_req_t req, struct gfs *gfs, const char *name,
         }
         break;
 
+    case LAYER_LOG_ENABLE:
+    case LAYER_LOG_DISABLE:
+
+        /* Enable/disable intent log used for syncing files in a layer */
+        if (likely(err == 0)) {
+            fs = lc_getLayerLocked(root, true);
+            err = fs->fs_removed ? ENOENT :
+                  lc_logEnable(gfs, fs, cmd == LAYER_LOG_ENABLE);
+            if (likely(err == 0)) {
+                fuse_reply_ioctl(req, 0, NULL, 0);
+            }
+            lc_unlock(fs);
+        }
+        break;
+
     default:
         err = EINVAL;
     }
@@ -523,6 +1031,9 @@ lc_commitLayer(fuse_req_t req, struct fs *fs, ino_t ino, const char *layer,
     lc_epInit(&e);
     e.attr_timeout = 0;
     e.entry_timeout = 0;
+
+    /* Get data cached in kernel before the layer is committed */
+    lc_flushKernelPages(gfs, fs);
     rfs = lc_getLayerLocked(LC_ROOT_INODE, false);
     root = lc_getRootIno(rfs, layer + strlen(LC_COMMIT_TRIGGER_PREFIX),
                          NULL, true);
@@ -651,6 +1162,11 @@ lc_commitLayer(fuse_req_t req, struct fs *fs, ino_t ino, const char *layer,
     lc_unlock(fs);
     lc_unlock(pfs);
     lc_unlock(cfs);
+
+    /* Root directory of the parent layer is rebuilt, so let kernel forget
+     * what it cached about that.
+     */
+    lc_invalInodePages(gfs, lc_setHandle(pfs->fs_gindex, pfs->fs_root));
     if (tfs) {
         lc_lockExclusive(tfs);
         lc_invalidateDirtyPages(gfs, tfs);
@@ -58,6 +58,12 @@
 /* Magic number stored in extended attribute blocks */
 #define LC_XATTR_MAGIC 0xBDEF4389
 
+/* Magic number stored in intent log blocks */
+#define LC_LOG_MAGIC   0x3C91D5A7
+
+/* Magic number stored in blocks of a stream of a layer */
+#define LC_SEND_MAGIC  0x5E9D1C47
+
 /* Superblock Flags */
 #define LC_SUPER_DIRTY     0x00000001  /* Layer is dirty */
 #define LC_SUPER_RDWR      0x00000002  /* Layer is readwrite */
@@ -66,6 +72,7 @@
 #define LC_SUPER_ZOMBIE    0x00000010  /* Removed layer */
 #define LC_SUPER_FSTATS    0x00000020  /* Tracking count of file types */
 #define LC_SUPER_SWAP      0x00000040  /* Layers being swapped for commit */
+#define LC_SUPER_REMOVED   0x00000080  /* Removed layer not reclaimed yet */
 
 /* Directory name in which layers are created */
 #define LC_LAYER_ROOT_DIR   "lcfs"
@@ -179,8 +186,39 @@ struct super {
     /* pcache limit */
     uint32_t sb_pcache;
 
+    /* Following fields are maintained only for read-write layers */
+
+    /* Start block of intent log area, 0 if log is not enabled */
+    uint64_t sb_logBlock;
+
+    /* Sequence number of last record made obsolete by a checkpoint */
+    uint64_t sb_logSeq;
+
+    /* Offset of the first record after last checkpoint in the log area */
+    uint32_t sb_logStart;
+
+    /* Number of blocks in the log area */
+    uint32_t sb_logCount;
+
+    /* First block of the list of extents shared from other layers */
+    uint64_t sb_dedupBlock;
+
+    /* Number of blocks used for that list, 0 if the layer has none */
+    uint64_t sb_dedupCount;
+
+    /* Number of checkpoints which moved the start of the intent log */
+    uint64_t sb_logGen;
+
+    /* Identity of the layer, kept when the layer is sent and received */
+    uint64_t sb_layerId;
+
+    /* First removed layer waiting to be reclaimed, in the global superblock.
+     * Removed layers are chained through sb_nextLayer.
+     */
+    uint64_t sb_reclaimLayer;
+
     /* Padding for filling up a block */
-    uint8_t  sb_pad[LC_BLOCK_SIZE - 216];
+    uint8_t  sb_pad[LC_BLOCK_SIZE - 280];
 } __attribute__((packed));
 static_assert(sizeof(struct super) == LC_BLOCK_SIZE, "superblock size != LC_BLOCK_SIZE");
 
@@ -331,6 +369,9 @@ struct emap {
 } __attribute__((packed));
 static_assert(sizeof(struct emap) == 20, "emap size != 20");
 
+/* Flag in e_count for preallocated blocks not written yet */
+#define LC_EMAP_UNWRITTEN 0x80000000
+
 /* Number of emap entries in a block */
 #define LC_EMAP_BLOCK (LC_BLOCK_SIZE / sizeof(struct emap))
 
@@ -413,4 +454,214 @@ struct xblock {
 } __attribute__((packed));
 static_assert(sizeof(struct xblock) == 16, "xblock size != 16");
 
+/* Entry in an intent log record, either a logged page or an emap extent */
+struct dlogEntry {
+    /* Page of the file, or starting page of an extent */
+    uint64_t le_page;
+
+    /* Starting block of an extent, or checksum of a logged page */
+    uint64_t le_block;
+
+    /* Count of blocks in an extent, 0 for a logged page */
+    uint32_t le_count;
+
+    /* Offset at which valid data starts in a logged page */
+    uint16_t le_poffset;
+
+    /* Size of valid data in a logged page */
+    uint16_t le_psize;
+} __attribute__((packed));
+static_assert(sizeof(struct dlogEntry) == 24, "dlogEntry size != 24");
+
+/* Size of the fixed portion of an intent log record */
+#define LC_LOG_HEADER   (48 + sizeof(struct dinode))
+
+/* Number of entries in an intent log record */
+#define LC_LOG_ENTRIES  ((LC_BLOCK_SIZE - LC_LOG_HEADER) / \
+                         sizeof(struct dlogEntry))
+
+/* Flag set on all records of a transaction except the last one */
+#define LC_LOG_CONT     0x00000001
+
+/* Intent log record.  Data of pages logged in the record follow the record in
+ * the order those pages appear in the entry list.
+ */
+struct dlogBlock {
+    /* Magic number */
+    uint32_t lb_magic;
+
+    /* Checksum */
+    uint32_t lb_crc;
+
+    /* Sequence number of this record */
+    uint64_t lb_seq;
+
+    /* Sequence number of the record preceding this one */
+    uint64_t lb_prev;
+
+    /* Inode number */
+    uint64_t lb_ino;
+
+    /* Log generation (sb_logGen) at the time of logging */
+    uint64_t lb_gen;
+
+    /* Flags */
+    uint32_t lb_flags;
+
+    /* Number of entries in the record */
+    uint32_t lb_count;
+
+    /* Inode at the time of logging */
+    struct dinode lb_dinode;
+
+    /* Pages and extents logged */
+    struct dlogEntry lb_entries[LC_LOG_ENTRIES];
+
+    /* Padding for filling up a block */
+    uint8_t lb_pad[LC_BLOCK_SIZE - LC_LOG_HEADER -
+                   (LC_LOG_ENTRIES * sizeof(struct dlogEntry))];
+} __attribute__((packed));
+static_assert(sizeof(struct dlogBlock) == LC_BLOCK_SIZE, "dlogBlock size != LC_BLOCK_SIZE");
+
+/* Version of the format of a stream of a layer */
+#define LC_SEND_VERSION     2
+
+/* Types of blocks in a stream of a layer.  A stream starts with a layer
+ * block, followed by blocks of inode records, each regular file record
+ * followed by data blocks carrying its data, and ends with an end block.
+ */
+#define LC_SEND_LAYER       1
+#define LC_SEND_INODES      2
+#define LC_SEND_DATA        3
+#define LC_SEND_END         4
+
+/* Header of every block in a stream of a layer, except pages of data.
+ * Checksum is calculated over the whole block with the checksum field zeroed.
+ */
+struct sheader {
+    /* Magic number */
+    uint32_t sh_magic;
+
+    /* CRC */
+    uint32_t sh_crc;
+
+    /* Type of the block */
+    uint32_t sh_type;
+
+    /* Size of the payload following the header */
+    uint32_t sh_size;
+
+    /* Sequence number of the block in the stream */
+    uint64_t sh_seq;
+} __attribute__((packed));
+static_assert(sizeof(struct sheader) == 24, "sheader size != 24");
+
+/* Size of the payload of a block of a stream */
+#define LC_SEND_PAYLOAD     (LC_BLOCK_SIZE - sizeof(struct sheader))
+
+/* Set in sl_flags for a stream of a base layer */
+#define LC_SEND_BASE        0x00000001
+
+/* Payload of the first block in a stream of a layer */
+struct slayer {
+    /* Version of the stream format */
+    uint32_t sl_version;
+
+    /* Flags */
+    uint32_t sl_flags;
+
+    /* Root inode of the layer */
+    uint64_t sl_root;
+
+    /* Last inode number in use when the layer was frozen */
+    uint64_t sl_lastInode;
+
+    /* Last inode number in use when the parent layer was frozen */
+    uint64_t sl_plastInode;
+
+    /* Highest inode number allocated in the file system */
+    uint64_t sl_ninode;
+
+    /* Number of inode records in the stream */
+    uint64_t sl_icount;
+
+    /* Identity of the layer */
+    uint64_t sl_id;
+
+    /* Identity of the parent layer, which the layer is received on */
+    uint64_t sl_pid;
+} __attribute__((packed));
+static_assert(sizeof(struct slayer) == 64, "slayer size != 64");
+
+/* Set in sr_flags when data of the file is the same as in the parent layer */
+#define LC_SEND_SHARED      0x00000001
+
+/* Set in sr_flags when data blocks of the file follow the record */
+#define LC_SEND_FDATA       0x00000002
+
+/* Record of an inode in a stream of a layer.  Records are packed back to
+ * back in inode blocks and may span blocks.  Directory entries or target of a
+ * symbolic link follow the record, followed by extended attributes.
+ */
+struct srecord {
+    /* Inode */
+    struct dinode sr_dinode;
+
+    /* Flags */
+    uint32_t sr_flags;
+
+    /* Size of directory entries or target of a symbolic link */
+    uint32_t sr_dsize;
+
+    /* Size of extended attributes */
+    uint32_t sr_xsize;
+} __attribute__((packed));
+
+/* Directory entry in an inode record */
+struct sdirent {
+    /* Inode number */
+    uint64_t sd_ino;
+
+    /* File mode */
+    uint32_t sd_mode;
+
+    /* Length of the name */
+    uint16_t sd_len;
+
+    /* Name - Variable length */
+    char sd_name[0];
+} __attribute__((packed));
+static_assert(sizeof(struct sdirent) == 14, "sdirent size != 14");
+
+/* Extended attribute in an inode record */
+struct sxattr {
+    /* Length of the name */
+    uint16_t sx_len;
+
+    /* Size of the value */
+    uint32_t sx_size;
+
+    /* Name followed by the value - Variable length */
+    char sx_nameValue[0];
+} __attribute__((packed));
+static_assert(sizeof(struct sxattr) == 6, "sxattr size != 6");
+
+/* Maximum number of pages following a data block */
+#define LC_SEND_DATA_MAX    256
+
+/* Payload of a data block.  Pages of data follow the block, with checksums
+ * of those stored in the block.
+ */
+struct sdata {
+    /* First page of the file */
+    uint64_t sd_page;
+
+    /* Number of pages */
+    uint32_t sd_count;
+
+    /* Checksums of pages */
+    uint32_t sd_crc[0];
+} __attribute__((packed));
+static_assert(sizeof(struct sdata) == 12, "sdata size != 12");
+
 #endif
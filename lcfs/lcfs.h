@@ -18,8 +18,22 @@ enum ioctl_cmd {
     LCFS_GROW = 113,                /* Grow file system */
     LCFS_PROFILE = 114,             /* Enable/disable profiling */
     LCFS_VERBOSE = 115,             /* Enable/disable verbose mode */
+    LAYER_LOG_ENABLE = 116,         /* Enable intent log for a layer */
+    LAYER_LOG_DISABLE = 117,        /* Disable intent log for a layer */
+    LAYER_HOT = 118,                /* Display hot files and layers */
+    LAYER_EXTRACT = 119,            /* Create a layer from a tar archive */
+    LAYER_RECEIVE = 120,            /* Receive a layer from a stream */
+    LAYER_CREATE_BATCH = 121,       /* Create read-write layers in bulk */
 };
 
+/* Maximum number of layers created with LAYER_CREATE_BATCH.  Buffer of the
+ * request carries the name of the parent layer, with its length in the type
+ * field of the command, followed by names of the new layers, all separated by
+ * nulls.  Handles of root directories of the new layers (64 bit each) are
+ * returned in the same buffer, which needs to be large enough for those.
+ */
+#define LC_LAYER_BATCH_MAX          256
+
 /* Prefix of fake file name used to trigger layer commit */
 #define LC_COMMIT_TRIGGER_PREFIX    ".lcfs-diff-"
 
@@ -36,4 +50,81 @@ struct pchange {
     char ch_path[0];
 } __attribute__((packed));
 
+/* Prefix of extended attribute name used for requesting a batch of changes
+ * in a layer along with attributes of changed files.  The prefix is followed
+ * by the cursor returned with the previous batch (0 for the first batch), a
+ * '.' and the name of the layer.  Requesting the same cursor again returns
+ * the same batch, so that a lost response could be retried.
+ */
+#define LC_DIFF_PREFIX              ".lcfs-diff2."
+
+/* Files in the root directory exporting changes in a layer against its parent
+ * layer as a tar stream, named with the prefix followed by the name of the
+ * layer and one of the suffixes.
+ */
+#define LC_EXPORT_PREFIX            ".lcfs-export-"
+#define LC_EXPORT_SUFFIX            ".tar"
+#define LC_EXPORT_GZIP_SUFFIX       ".tar.gz"
+
+/* Files in the root directory streaming a layer in native format, named with
+ * the prefix followed by the name of the layer.  The stream could be received
+ * as a new layer with LAYER_RECEIVE.
+ */
+#define LC_SEND_PREFIX              ".lcfs-send-"
+
+/* Maximum size of a batch of changes.  The kernel limits the size of a
+ * getxattr response to 64KB as of now.
+ */
+#define LC_DIFF_BATCH_MAX           (1024 * 1024)
+
+/* Set in ch_flags when the file has extended attributes */
+#define LC_CHANGE_XATTR             0x1
+
+/* Header of a batch of changes */
+struct pbatch {
+
+    /* Cursor for requesting the next batch */
+    uint64_t pb_cursor;
+
+    /* Number of records in the batch, 0 when all changes are returned */
+    uint32_t pb_count;
+
+    /* Size of records following the header */
+    uint32_t pb_size;
+} __attribute__((packed));
+
+/* Change returned in a batch, along with attributes of the file.  Records
+ * of directories carry complete path, while those of files following a
+ * directory carry names of those files in the directory.  Attributes are
+ * zeroes for removed files.
+ */
+struct pchange2 {
+
+    /* Length of path */
+    uint16_t ch_len;
+
+    /* Type of change */
+    uint8_t ch_type;
+
+    /* Flags */
+    uint8_t ch_flags;
+
+    /* Mode, owner and group of the file */
+    uint32_t ch_mode;
+    uint32_t ch_uid;
+    uint32_t ch_gid;
+
+    /* Size of the file */
+    uint64_t ch_size;
+
+    /* Modification and change times */
+    uint64_t ch_mtime;
+    uint32_t ch_mtimensec;
+    uint64_t ch_ctime;
+    uint32_t ch_ctimensec;
+
+    /* Path - Variable length */
+    char ch_path[0];
+} __attribute__((packed));
+
 #endif
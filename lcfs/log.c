@@ -0,0 +1,727 @@
+#include "includes.h"
+
+/* Allocate in-memory state for tracking the intent log of a layer */
+static struct lclog *
+lc_logAlloc(struct fs *fs) {
+    struct lclog *log = lc_malloc(fs, sizeof(struct lclog), LC_MEMTYPE_LOG);
+
+    memset(log, 0, sizeof(struct lclog));
+    pthread_mutex_init(&log->l_lock, NULL);
+    pthread_cond_init(&log->l_cond, NULL);
+    return log;
+}
+
+/* Free a transaction along with the blocks in it */
+static void
+lc_logFreeTrans(struct fs *fs, struct ltrans *trans) {
+    uint64_t i;
+
+    for (i = 0; i < trans->lt_count; i++) {
+        lc_free(fs, trans->lt_iov[i].iov_base, LC_BLOCK_SIZE, LC_MEMTYPE_LOG);
+    }
+    lc_free(fs, trans->lt_iov, trans->lt_count * sizeof(struct iovec),
+            LC_MEMTYPE_LOG);
+    lc_free(fs, trans, sizeof(struct ltrans), LC_MEMTYPE_LOG);
+}
+
+/* Add an emap extent to the entry list, leaving out pages which are
+ * preallocated, but not written yet.
+ */
+static uint64_t
+lc_logAddExtent(struct inode *inode, struct dlogEntry *entries,
+                uint64_t page, uint64_t block, uint64_t count) {
+    uint64_t end = page + count, ustart, uend, n = 0;
+    struct extent *unwritten;
+
+    while (page < end) {
+        unwritten = lc_inodeGetUnwritten(inode) ?
+                    lc_inodeNextUnwritten(inode, page) : NULL;
+        ustart = unwritten ? lc_getExtentStart(unwritten) : end;
+        if (ustart > end) {
+            ustart = end;
+        }
+        if (page < ustart) {
+            entries[n].le_page = page;
+            entries[n].le_block = block;
+            entries[n].le_count = ustart - page;
+            block += ustart - page;
+            page = ustart;
+            n++;
+        }
+        if (unwritten && (page < end)) {
+
+            /* Skip over unwritten pages */
+            uend = ustart + lc_getExtentCount(unwritten);
+            if (uend > end) {
+                uend = end;
+            }
+            block += uend - page;
+            page = uend;
+        }
+    }
+    return n;
+}
+
+/* Start a new record for the inode in the transaction */
+static struct dlogBlock *
+lc_logNewRecord(struct fs *fs, struct inode *inode, struct iovec *iov) {
+    struct dlogBlock *lblock;
+
+    lc_mallocBlockAligned(fs, (void **)&lblock, LC_MEMTYPE_LOG);
+    memset(lblock, 0, LC_BLOCK_SIZE);
+    lblock->lb_magic = LC_LOG_MAGIC;
+    lblock->lb_ino = inode->i_ino;
+    lblock->lb_gen = fs->fs_super->sb_logGen;
+    memcpy(&lblock->lb_dinode, &inode->i_dinode, sizeof(struct dinode));
+    iov->iov_base = lblock;
+    iov->iov_len = LC_BLOCK_SIZE;
+    return lblock;
+}
+
+/* Build a transaction with current emap, attributes and dirty pages of the
+ * inode.
+ */
+static struct ltrans *
+lc_logBuildTrans(struct fs *fs, struct inode *inode) {
+    uint64_t i, j, ecount = 0, pcount, count, records, index = 0, size;
+    struct extent *extent = lc_inodeGetEmap(inode);
+    struct dlogEntry *entries, *entry;
+    struct dlogBlock *lblock = NULL;
+    struct dpage **dpages;
+    struct ltrans *trans;
+    uint64_t *pages;
+    char *data;
+
+    /* Find the size of the emap, an extent is split around every unwritten
+     * extent in the middle of it.
+     */
+    if (inode->i_extentLength) {
+        ecount = 1;
+    } else {
+        while (extent) {
+            ecount++;
+            extent = extent->ex_next;
+        }
+    }
+    extent = lc_inodeGetUnwritten(inode);
+    while (extent) {
+        ecount++;
+        extent = extent->ex_next;
+    }
+    pcount = lc_inodeGetDirtyPageCount(inode);
+    size = ecount * sizeof(struct dlogEntry);
+    entries = size ? lc_malloc(fs, size, LC_MEMTYPE_LOG) : NULL;
+
+    /* Record the emap */
+    ecount = 0;
+    if (inode->i_extentLength) {
+        ecount = lc_logAddExtent(inode, entries, 0, inode->i_extentBlock,
+                                 inode->i_extentLength);
+    } else {
+        extent = lc_inodeGetEmap(inode);
+        while (extent) {
+            ecount += lc_logAddExtent(inode, &entries[ecount],
+                                      lc_getExtentStart(extent),
+                                      lc_getExtentBlock(extent),
+                                      lc_getExtentCount(extent));
+            extent = extent->ex_next;
+        }
+    }
+
+    /* Record dirty pages */
+    if (pcount) {
+        pages = lc_malloc(fs, pcount * sizeof(uint64_t), LC_MEMTYPE_LOG);
+        dpages = lc_malloc(fs, pcount * sizeof(struct dpage *),
+                           LC_MEMTYPE_LOG);
+        i = pcount;
+        pcount = lc_getDirtyPages(inode, pages, dpages, pcount);
+        assert(pcount == i);
+    } else {
+        pages = NULL;
+        dpages = NULL;
+    }
+    count = ecount + pcount;
+    records = count ? (count + LC_LOG_ENTRIES - 1) / LC_LOG_ENTRIES : 1;
+
+    /* Lay out records, each followed by data of pages logged in it */
+    trans = lc_malloc(fs, sizeof(struct ltrans), LC_MEMTYPE_LOG);
+    trans->lt_count = records + pcount;
+    trans->lt_iov = lc_malloc(fs, trans->lt_count * sizeof(struct iovec),
+                              LC_MEMTYPE_LOG);
+    trans->lt_block = 0;
+    trans->lt_seq = 0;
+    trans->lt_next = NULL;
+    for (i = 0, j = 0; i < count; i++) {
+        if ((i % LC_LOG_ENTRIES) == 0) {
+            lblock = lc_logNewRecord(fs, inode, &trans->lt_iov[index++]);
+            if ((count - i) > LC_LOG_ENTRIES) {
+                lblock->lb_flags = LC_LOG_CONT;
+            }
+        }
+        entry = &lblock->lb_entries[lblock->lb_count++];
+        if (i < ecount) {
+            memcpy(entry, &entries[i], sizeof(struct dlogEntry));
+            continue;
+        }
+
+        /* Copy the page, as it could change once inode lock is dropped */
+        lc_mallocBlockAligned(fs, (void **)&data, LC_MEMTYPE_LOG);
+        memcpy(data, dpages[j]->dp_data, LC_BLOCK_SIZE);
+        entry->le_page = pages[j];
+        entry->le_block = lc_checksum(data);
+        entry->le_count = 0;
+        entry->le_poffset = dpages[j]->dp_poffset;
+        entry->le_psize = dpages[j]->dp_psize;
+        trans->lt_iov[index].iov_base = data;
+        trans->lt_iov[index++].iov_len = LC_BLOCK_SIZE;
+        j++;
+    }
+
+    /* A record is needed even when the file has no blocks */
+    if (count == 0) {
+        lc_logNewRecord(fs, inode, &trans->lt_iov[index++]);
+    }
+    assert(index == trans->lt_count);
+    if (pages) {
+        lc_free(fs, pages, pcount * sizeof(uint64_t), LC_MEMTYPE_LOG);
+        lc_free(fs, dpages, pcount * sizeof(struct dpage *), LC_MEMTYPE_LOG);
+    }
+    if (entries) {
+        lc_free(fs, entries, size, LC_MEMTYPE_LOG);
+    }
+    return trans;
+}
+
+/* Return number of pages logged in a record */
+static uint64_t
+lc_logDataCount(struct dlogBlock *lblock) {
+    uint64_t i, count = 0;
+
+    for (i = 0; i < lblock->lb_count; i++) {
+        if (lblock->lb_entries[i].le_count == 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Find space for the transaction in the log and chain its records to the
+ * ones logged before.  Returns false if the log does not have enough space.
+ */
+static bool
+lc_logQueue(struct fs *fs, struct lclog *log, struct ltrans *trans) {
+    uint64_t count = fs->fs_super->sb_logCount, head = log->l_head, skip = 0;
+    struct dlogBlock *lblock;
+    uint64_t i = 0;
+
+    if (!log->l_ready || (trans->lt_count > count)) {
+        return false;
+    }
+
+    /* A transaction is not split across the end of the log area */
+    if ((head + trans->lt_count) > count) {
+        skip = count - head;
+        head = 0;
+    }
+    if ((log->l_used + skip + trans->lt_count) > count) {
+        return false;
+    }
+    log->l_used += skip + trans->lt_count;
+    trans->lt_block = head;
+    log->l_head = head + trans->lt_count;
+    if (log->l_head == count) {
+        log->l_head = 0;
+    }
+    while (i < trans->lt_count) {
+        lblock = trans->lt_iov[i].iov_base;
+        lblock->lb_prev = log->l_seq;
+        lblock->lb_seq = log->l_nextSeq++;
+        log->l_seq = lblock->lb_seq;
+        lc_updateCRC(lblock, &lblock->lb_crc);
+        i += lc_logDataCount(lblock) + 1;
+    }
+    trans->lt_seq = log->l_seq;
+    if (log->l_pendingLast) {
+        log->l_pendingLast->lt_next = trans;
+    } else {
+        log->l_pending = trans;
+    }
+    log->l_pendingLast = trans;
+    return true;
+}
+
+/* Write out queued transactions and make those durable.  Called with the log
+ * locked, which is dropped while issuing I/Os, so that transactions queued
+ * in the meantime are written together in the next round.
+ */
+static void
+lc_logWrite(struct gfs *gfs, struct fs *fs, struct lclog *log) {
+    uint64_t block = fs->fs_super->sb_logBlock, seq = 0, blocks, ntrans, i;
+    struct ltrans *trans, *next;
+    int err, count;
+
+    assert(!log->l_writing);
+    log->l_writing = true;
+    while (log->l_pending) {
+        trans = log->l_pending;
+        log->l_pending = NULL;
+        log->l_pendingLast = NULL;
+        pthread_mutex_unlock(&log->l_lock);
+
+        /* Emap may point to blocks with pages still queued for write or
+         * being written by other threads, which need to be on disk before the
+         * records pointing to those.
+         */
+        lc_flushDirtyPages(gfs, fs);
+        lc_waitDirtyPages(fs);
+        err = fsync(gfs->gfs_fd);
+        assert(err == 0);
+        blocks = 0;
+        ntrans = 0;
+        while (trans) {
+            for (i = 0; i < trans->lt_count; i += count) {
+                count = trans->lt_count - i;
+                if (count > LC_WRITE_CLUSTER_SIZE) {
+                    count = LC_WRITE_CLUSTER_SIZE;
+                }
+                lc_writeBlocks(gfs, fs, &trans->lt_iov[i], count,
+                               block + trans->lt_block + i);
+            }
+            blocks += trans->lt_count;
+            ntrans++;
+            seq = trans->lt_seq;
+            next = trans->lt_next;
+            lc_logFreeTrans(fs, trans);
+            trans = next;
+        }
+        err = fsync(gfs->gfs_fd);
+        assert(err == 0);
+        pthread_mutex_lock(&log->l_lock);
+        log->l_durable = seq;
+        log->l_commits++;
+        log->l_trans += ntrans;
+        log->l_blocks += blocks;
+        pthread_cond_broadcast(&log->l_cond);
+    }
+    log->l_writing = false;
+}
+
+/* Log current state of an inode being synced and wait for that to be on disk.
+ * Inode is unlocked after taking a copy of its state.  Returns false if the
+ * inode could not be logged, and a checkpoint is needed instead.
+ */
+bool
+lc_logInode(struct gfs *gfs, struct fs *fs, struct inode *inode) {
+    struct lclog *log = fs->fs_log;
+    struct ltrans *trans;
+    uint64_t seq;
+
+    assert(S_ISREG(inode->i_mode));
+
+    /* Nothing to log if the inode is not modified in this layer */
+    if (inode->i_fs != fs) {
+        lc_inodeUnlock(inode);
+        return true;
+    }
+
+    /* Creation of the inode and its directory entry are not logged, so those
+     * need to be made persistent by a checkpoint first.
+     */
+    if (inode->i_ino > log->l_inode) {
+        lc_inodeUnlock(inode);
+        return false;
+    }
+    trans = lc_logBuildTrans(fs, inode);
+    lc_inodeUnlock(inode);
+    pthread_mutex_lock(&log->l_lock);
+    if (!lc_logQueue(fs, log, trans)) {
+        pthread_mutex_unlock(&log->l_lock);
+        lc_logFreeTrans(fs, trans);
+        return false;
+    }
+
+    /* Write out the transaction unless another thread is doing that */
+    seq = trans->lt_seq;
+    while (log->l_durable < seq) {
+        if (log->l_writing) {
+            pthread_cond_wait(&log->l_cond, &log->l_lock);
+        } else {
+            lc_logWrite(gfs, fs, log);
+        }
+    }
+    pthread_mutex_unlock(&log->l_lock);
+
+    /* Checkpoint sooner if log is filling up */
+    lc_layerChanged(gfs, false,
+                    log->l_used > (fs->fs_super->sb_logCount / 2));
+    return true;
+}
+
+/* Free in-memory state of the intent log */
+void
+lc_logDeinit(struct fs *fs) {
+    struct lclog *log = fs->fs_log;
+
+    if (log == NULL) {
+        return;
+    }
+    assert(!log->l_writing);
+    assert(log->l_pending == NULL);
+    if (log->l_commits) {
+        lc_printf("Layer %d logged %ld transactions %ld blocks in %ld commits\n",
+                  fs->fs_gindex, log->l_trans, log->l_blocks,
+                  log->l_commits);
+    }
+#ifdef LC_COND_DESTROY
+    pthread_cond_destroy(&log->l_cond);
+#endif
+#ifdef LC_MUTEX_DESTROY
+    pthread_mutex_destroy(&log->l_lock);
+#endif
+    lc_free(fs, log, sizeof(struct lclog), LC_MEMTYPE_LOG);
+    fs->fs_log = NULL;
+}
+
+/* Stop logging and free the log area of the layer */
+static void
+lc_logRelease(struct fs *fs) {
+    struct super *super = fs->fs_super;
+
+    lc_addFreedBlocks(fs, super->sb_logBlock, super->sb_logCount);
+    super->sb_logBlock = 0;
+    super->sb_logCount = 0;
+    super->sb_logStart = 0;
+    super->sb_logSeq = 0;
+    super->sb_logGen = 0;
+    lc_markSuperDirty(fs);
+    lc_logDeinit(fs);
+}
+
+/* Enable or disable intent log of a layer locked exclusive */
+int
+lc_logEnable(struct gfs *gfs, struct fs *fs, bool enable) {
+    struct super *super = fs->fs_super;
+    uint64_t block;
+
+    if (!enable) {
+        if (fs->fs_log == NULL) {
+            return ENOENT;
+        }
+        lc_logRelease(fs);
+        lc_layerChanged(gfs, false, true);
+        return 0;
+    }
+    if (fs->fs_log) {
+        return EEXIST;
+    }
+    if (fs->fs_frozen || (fs == lc_getGlobalFs(gfs))) {
+        return EROFS;
+    }
+    block = lc_blockAlloc(fs, LC_LOG_BLOCKS, true, false);
+    if (block == LC_INVALID_BLOCK) {
+        return ENOSPC;
+    }
+    super->sb_logBlock = block;
+    super->sb_logCount = LC_LOG_BLOCKS;
+    super->sb_logStart = 0;
+    super->sb_logSeq = 0;
+    super->sb_logGen = 0;
+    fs->fs_log = lc_logAlloc(fs);
+    fs->fs_log->l_nextSeq = 1;
+    lc_markSuperDirty(fs);
+
+    /* Log is used only after a checkpoint records its location */
+    lc_layerChanged(gfs, false, true);
+    return 0;
+}
+
+/* Record current end of the log in the superblock, so that records logged so
+ * far are not replayed once the checkpoint in progress is on disk.  Called
+ * with the layer locked exclusive.
+ */
+void
+lc_logCheckpoint(struct gfs *gfs, struct fs *fs) {
+    struct super *super = fs->fs_super;
+    struct lclog *log = fs->fs_log;
+
+    if (log == NULL) {
+        return;
+    }
+
+    /* No more changes are expected after a layer is frozen */
+    if (fs->fs_frozen) {
+        lc_logRelease(fs);
+        return;
+    }
+    assert(!log->l_writing);
+    assert(log->l_pending == NULL);
+
+    /* Inodes created so far are written out in this checkpoint */
+    log->l_cinode = gfs->gfs_super->sb_ninode;
+    if (!log->l_ready || (super->sb_logSeq != log->l_seq)) {
+        super->sb_logSeq = log->l_seq;
+        super->sb_logStart = log->l_head;
+
+        /* Generation is advanced from the one on disk, so that checkpoints
+         * abandoned without writing the superblock do not skip one.
+         */
+        super->sb_logGen = log->l_gen + 1;
+        log->l_checkpoint = log->l_used;
+        lc_markSuperDirty(fs);
+    }
+}
+
+/* Release log space made obsolete by the checkpoint just written to disk */
+void
+lc_logCheckpointDone(struct gfs *gfs) {
+    struct lclog *log;
+    struct fs *fs;
+    int i;
+
+    for (i = 1; i <= gfs->gfs_scount; i++) {
+        fs = gfs->gfs_fs[i];
+
+        /* Skip layers with superblock not written in this checkpoint */
+        if ((fs == NULL) || (fs->fs_log == NULL) || fs->fs_dirty) {
+            continue;
+        }
+        log = fs->fs_log;
+        pthread_mutex_lock(&log->l_lock);
+        assert(log->l_used >= log->l_checkpoint);
+        log->l_used -= log->l_checkpoint;
+        log->l_checkpoint = 0;
+        log->l_inode = log->l_cinode;
+        log->l_gen = fs->fs_super->sb_logGen;
+        log->l_ready = true;
+        pthread_mutex_unlock(&log->l_lock);
+    }
+}
+
+/* Apply a transaction read from the log to the inode logged */
+static bool
+lc_logApply(struct gfs *gfs, struct fs *fs, char **bufs, uint64_t count) {
+    struct dlogBlock *lblock = (struct dlogBlock *)bufs[0];
+    struct dinode *dinode = &lblock->lb_dinode;
+    struct dlogEntry *entry;
+    struct inode *inode;
+    uint64_t i = 0, j;
+    struct dpage dpage;
+
+    inode = lc_getInode(fs, lblock->lb_ino, NULL, true, true);
+    if (inode == NULL) {
+        return false;
+    }
+    if (!S_ISREG(inode->i_mode) || (inode->i_fs != fs)) {
+        lc_inodeUnlock(inode);
+        return false;
+    }
+
+    /* Check blocks logged are not in use by others before claiming those */
+    while (i < count) {
+        lblock = (struct dlogBlock *)bufs[i];
+        for (j = 0; j < lblock->lb_count; j++) {
+            entry = &lblock->lb_entries[j];
+            if (entry->le_count &&
+                !lc_emapReplayValid(gfs, inode, entry->le_page,
+                                    entry->le_block, entry->le_count)) {
+                lc_syslog(LOG_ERR, "Layer %d inode %ld logged with blocks "
+                          "%ld-%ld in use\n", fs->fs_gindex, lblock->lb_ino,
+                          entry->le_block,
+                          entry->le_block + entry->le_count - 1);
+                lc_inodeUnlock(inode);
+                return false;
+            }
+        }
+        i += lc_logDataCount(lblock) + 1;
+    }
+    i = 0;
+    while (i < count) {
+        lblock = (struct dlogBlock *)bufs[i++];
+        for (j = 0; j < lblock->lb_count; j++) {
+            entry = &lblock->lb_entries[j];
+            if (entry->le_count) {
+
+                /* Blocks allocated after the checkpoint are free on disk */
+                lc_blockClaim(gfs, fs, entry->le_block, entry->le_count);
+                lc_emapReplay(gfs, fs, inode, entry->le_page,
+                              entry->le_block, entry->le_count);
+                continue;
+            }
+
+            /* Add the logged page as a dirty page */
+            lc_mallocBlockAligned(fs, (void **)&dpage.dp_data,
+                                  LC_MEMTYPE_DATA);
+            memcpy(dpage.dp_data, bufs[i++], LC_BLOCK_SIZE);
+            dpage.dp_poffset = entry->le_poffset;
+            dpage.dp_psize = entry->le_psize;
+            dpage.dp_pread = 0;
+            __sync_add_and_fetch(&fs->fs_pcount, 1);
+            __sync_add_and_fetch(&gfs->gfs_dcount, 1);
+            if (lc_addPages(inode, (entry->le_page * LC_BLOCK_SIZE) +
+                                   entry->le_poffset,
+                            entry->le_psize, &dpage, 1) == 0) {
+                __sync_fetch_and_sub(&fs->fs_pcount, 1);
+                __sync_fetch_and_sub(&gfs->gfs_dcount, 1);
+            }
+            lc_freePages(fs, &dpage, 1);
+        }
+    }
+
+    /* Restore attributes as of the time inode was logged */
+    if (dinode->di_size < inode->i_size) {
+        lc_truncateFile(inode, dinode->di_size, true);
+    }
+    inode->i_size = dinode->di_size;
+    inode->i_mode = dinode->di_mode;
+    inode->i_dinode.di_uid = dinode->di_uid;
+    inode->i_dinode.di_gid = dinode->di_gid;
+    inode->i_dinode.di_mtime = dinode->di_mtime;
+    inode->i_dinode.di_ctime = dinode->di_ctime;
+    lc_markInodeDirty(inode, LC_INODE_EMAPDIRTY);
+    lc_inodeUnlock(inode);
+    return true;
+}
+
+/* Read a transaction from the log and validate it.  Returns number of blocks
+ * in the transaction, 0 if a valid transaction is not found.
+ */
+static uint64_t
+lc_logReadTrans(struct gfs *gfs, struct fs *fs, uint64_t pos, uint64_t max,
+                uint64_t *seq, char **bufs) {
+    uint64_t block = fs->fs_super->sb_logBlock + pos, prev = *seq, n = 0, i;
+    uint64_t gen = fs->fs_super->sb_logGen;
+    struct dlogBlock *lblock;
+    uint32_t crc;
+
+    do {
+        if (n >= max) {
+            goto invalid;
+        }
+        lc_mallocBlockAligned(fs, (void **)&bufs[n], LC_MEMTYPE_LOG);
+        lc_readBlock(gfs, fs, block + n, bufs[n]);
+        lblock = (struct dlogBlock *)bufs[n++];
+        if ((lblock->lb_magic != LC_LOG_MAGIC) || (lblock->lb_prev != prev) ||
+            (lblock->lb_seq <= prev) || (lblock->lb_count > LC_LOG_ENTRIES)) {
+            goto invalid;
+        }
+
+        /* Records could be logged after the last checkpoint or while the
+         * checkpoint following that was in progress.
+         */
+        if ((lblock->lb_gen != gen) && (lblock->lb_gen != (gen + 1))) {
+            goto invalid;
+        }
+        crc = lblock->lb_crc;
+        lblock->lb_crc = 0;
+        if (lc_checksum((char *)lblock) != crc) {
+            goto invalid;
+        }
+        lblock->lb_crc = crc;
+        if ((n + lc_logDataCount(lblock)) > max) {
+            goto invalid;
+        }
+
+        /* Check data of every page logged is intact */
+        for (i = 0; i < lblock->lb_count; i++) {
+            if (lblock->lb_entries[i].le_count) {
+                continue;
+            }
+            lc_mallocBlockAligned(fs, (void **)&bufs[n], LC_MEMTYPE_LOG);
+            lc_readBlock(gfs, fs, block + n, bufs[n]);
+            if (lc_checksum(bufs[n++]) != lblock->lb_entries[i].le_block) {
+                goto invalid;
+            }
+        }
+        prev = lblock->lb_seq;
+    } while (lblock->lb_flags & LC_LOG_CONT);
+    *seq = prev;
+    return n;
+
+invalid:
+    for (i = 0; i < n; i++) {
+        lc_free(fs, bufs[i], LC_BLOCK_SIZE, LC_MEMTYPE_LOG);
+    }
+    return 0;
+}
+
+/* Replay transactions logged after the last checkpoint of the layer */
+static void
+lc_logReplay(struct gfs *gfs, struct fs *fs, struct lclog *log) {
+    uint64_t count = fs->fs_super->sb_logCount, pos = fs->fs_super->sb_logStart;
+    uint64_t seq = fs->fs_super->sb_logSeq, used = 0, head = pos, hused = 0;
+    uint64_t n, i, max, applied = 0, skipped = 0;
+    char **bufs;
+
+    assert(pos < count);
+    bufs = lc_malloc(fs, count * sizeof(char *), LC_MEMTYPE_LOG);
+    while (used < count) {
+        max = count - pos;
+        if (max > (count - used)) {
+            max = count - used;
+        }
+        n = lc_logReadTrans(gfs, fs, pos, max, &seq, bufs);
+        if (n == 0) {
+
+            /* A transaction not fitting at the end is placed at the start */
+            if (pos == 0) {
+                break;
+            }
+            used += count - pos;
+            pos = 0;
+            continue;
+        }
+        if (lc_logApply(gfs, fs, bufs, n)) {
+            applied++;
+        } else {
+            skipped++;
+        }
+        for (i = 0; i < n; i++) {
+            lc_free(fs, bufs[i], LC_BLOCK_SIZE, LC_MEMTYPE_LOG);
+        }
+        used += n;
+        pos += n;
+        if (pos == count) {
+            pos = 0;
+        }
+        head = pos;
+        hused = used;
+    }
+    lc_free(fs, bufs, count * sizeof(char *), LC_MEMTYPE_LOG);
+
+    /* Records are kept until the replayed changes are checkpointed.  New
+     * records start with a sequence number which cannot be found in any stale
+     * record left in the log.
+     */
+    log->l_head = head;
+    log->l_used = hused;
+    log->l_seq = seq;
+    log->l_durable = seq;
+    log->l_nextSeq = seq + count + 1;
+    log->l_inode = gfs->gfs_super->sb_ninode;
+    log->l_cinode = log->l_inode;
+    log->l_gen = fs->fs_super->sb_logGen;
+    log->l_ready = true;
+    if (applied || skipped) {
+        lc_syslog(LOG_INFO, "Layer %d replayed %ld transactions, "
+                  "skipped %ld from intent log\n",
+                  fs->fs_gindex, applied, skipped);
+        lc_markInodesDirty(fs);
+        lc_layerChanged(gfs, false, false);
+    }
+}
+
+/* Set up intent log of a layer while mounting and replay transactions logged
+ * after the last checkpoint.
+ */
+void
+lc_logInit(struct gfs *gfs, struct fs *fs) {
+    if (fs->fs_super->sb_logBlock == 0) {
+        return;
+    }
+    fs->fs_log = lc_logAlloc(fs);
+    if (fs->fs_frozen) {
+        lc_logRelease(fs);
+    } else {
+        lc_logReplay(gfs, fs, fs->fs_log);
+    }
+}
@@ -58,6 +58,13 @@ static const char *mrequests[] = {
     "SYMLINK",
     "RWLOCK",
     "STATS",
+    "LOG",
+    "EXTRACT",
+    "DIFF",
+    "EXPORT",
+    "JOURNAL",
+    "DEDUP",
+    "CTRACK",
 };
 
 /* Initialize limit based on available memory */
@@ -89,9 +96,53 @@ lc_checkMemoryAvailable(bool flush) {
                                    lc_mem.m_purgeMemory : lc_mem.m_dataMemory);
 }
 
-/* Wake up flusher and cleaner threads if too many data pages created */
+/* Number of dirty pages allowed before background writeback is started */
+uint64_t
+lc_dirtyBackground(void) {
+    return (lc_mem.m_purgeMemory * LC_DIRTY_BACKGROUND) /
+           (100 * LC_BLOCK_SIZE);
+}
+
+/* Pause a writer dirtying pages when too many dirty pages are present.  The
+ * rate writers are allowed to dirty pages drops from the rate pages are
+ * written back to zero, as dirty pages grow from the background limit towards
+ * the maximum memory allowed for data pages.
+ */
+static void
+lc_throttleWriter(struct gfs *gfs, uint64_t pcount) {
+    uint64_t dirty = gfs->gfs_dcount, background = lc_dirtyBackground();
+    uint64_t limit = lc_mem.m_dataMemory / LC_BLOCK_SIZE, rate, pause;
+
+    if (dirty <= background) {
+        return;
+    }
+
+    /* Get flusher going */
+    pthread_cond_signal(&gfs->gfs_flusherCond);
+    if ((dirty >= limit) || (limit <= background)) {
+        pause = LC_THROTTLE_MAX_PAUSE;
+    } else {
+        rate = (gfs->gfs_writeRate * (limit - dirty)) / (limit - background);
+        pause = rate ? (pcount * 1000000ul) / rate : LC_THROTTLE_MAX_PAUSE;
+        if (pause > LC_THROTTLE_MAX_PAUSE) {
+            pause = LC_THROTTLE_MAX_PAUSE;
+        }
+    }
+    if (pause >= LC_THROTTLE_MIN_PAUSE) {
+        __sync_add_and_fetch(&gfs->gfs_throttled, 1);
+        usleep(pause);
+    }
+}
+
+/* Wake up flusher and cleaner threads if too many data pages created.  Writers
+ * specify number of pages about to be dirtied.
+ */
 void
-lc_waitMemory(struct gfs *gfs, bool wait) {
+lc_waitMemory(struct gfs *gfs, bool wait, uint64_t pcount) {
+    if (pcount) {
+        __sync_add_and_fetch(&gfs->gfs_dirtied, pcount);
+        lc_throttleWriter(gfs, pcount);
+    }
     if (!lc_checkMemoryAvailable(false)) {
         lc_wakeupCleaner(gfs, wait);
     }
@@ -199,6 +250,16 @@ lc_mallocBlockAligned(struct fs *fs, void **memptr, enum lc_memTypes type) {
     lc_memStatsUpdate(fs, LC_BLOCK_SIZE, true, type);
 }
 
+/* Allocate memory aligned to cache line size */
+void
+lc_mallocAligned(struct fs *fs, void **memptr, size_t size,
+                 enum lc_memTypes type) {
+    int err = posix_memalign(memptr, LC_CACHELINE_SIZE, size);
+
+    assert(err == 0);
+    lc_memStatsUpdate(fs, size, true, type);
+}
+
 /* Release previously allocated memory */
 void
 lc_free(struct fs *fs, void *ptr, size_t size, enum lc_memTypes type) {
@@ -245,6 +306,34 @@ lc_displayGlobalMemStats() {
               lc_mem.m_totalMemory, lc_mem.m_purgeMemory / (1024 * 1024));
 }
 
+/* Return name of a memory type */
+const char *
+lc_memTypeName(enum lc_memTypes type) {
+    return mrequests[type];
+}
+
+/* Export global memory usage */
+void
+lc_memStatsExport(struct fs *rfs, struct sbuf *sb) {
+    lc_statsPrintf(rfs, sb,
+                   "# HELP lcfs_page_memory_bytes Memory used for pages.\n"
+                   "# TYPE lcfs_page_memory_bytes gauge\n"
+                   "lcfs_page_memory_bytes %lu\n"
+                   "# HELP lcfs_page_memory_limit_bytes Memory pages could "
+                   "use.\n"
+                   "# TYPE lcfs_page_memory_limit_bytes gauge\n"
+                   "lcfs_page_memory_limit_bytes %lu\n",
+                   lc_mem.m_totalMemory, lc_mem.m_dataMemory);
+    if (memStatsEnabled) {
+        lc_statsPrintf(rfs, sb,
+                       "# HELP lcfs_global_memory_bytes Memory allocated "
+                       "globally.\n"
+                       "# TYPE lcfs_global_memory_bytes gauge\n"
+                       "lcfs_global_memory_bytes %lu\n",
+                       lc_mem.m_globalMemory);
+    }
+}
+
 /* Display memory stats */
 void
 lc_displayMemStats(struct fs *fs) {
@@ -29,7 +29,14 @@ enum lc_memTypes {
     LC_MEMTYPE_SYMLINK = 23,        /* Symbolic link */
     LC_MEMTYPE_IRWLOCK = 24,        /* Inode lock */
     LC_MEMTYPE_STATS = 25,          /* Request stats */
-    LC_MEMTYPE_MAX = 26,
+    LC_MEMTYPE_LOG = 26,            /* Intent log */
+    LC_MEMTYPE_EXTRACT = 27,        /* Archive extraction */
+    LC_MEMTYPE_DIFF = 28,           /* Batches of layer changes */
+    LC_MEMTYPE_EXPORT = 29,         /* Tar streams of layer changes */
+    LC_MEMTYPE_JOURNAL = 30,        /* Journal of inodes in a layer */
+    LC_MEMTYPE_DEDUP = 31,          /* Index of contents of files */
+    LC_MEMTYPE_CTRACK = 32,         /* Inodes tracked while building a diff */
+    LC_MEMTYPE_MAX = 33,
 };
 
 #endif
@@ -106,6 +106,35 @@ lc_findDirtyPage(struct inode *inode, uint64_t pg) {
     return (pg < lc_inodeGetPageCount(inode)) ? &inode->i_page[pg] : NULL;
 }
 
+/* Shrink first and last page markers after some dirty pages are removed */
+static void
+lc_resetInodePageMarkers(struct inode *inode) {
+    uint64_t first = lc_inodeGetFirstPage(inode);
+    uint64_t last = lc_inodeGetLastPage(inode);
+    struct dpage *dpage;
+
+    if (lc_inodeGetDirtyPageCount(inode) == 0) {
+        lc_initInodePageMarkers(inode);
+        return;
+    }
+    while (first < last) {
+        dpage = lc_findDirtyPage(inode, first);
+        if (dpage && dpage->dp_data) {
+            break;
+        }
+        first++;
+    }
+    while (last > first) {
+        dpage = lc_findDirtyPage(inode, last);
+        if (dpage && dpage->dp_data) {
+            break;
+        }
+        last--;
+    }
+    lc_inodeSetFirstPage(inode, first);
+    lc_inodeSetLastPage(inode, last);
+}
+
 /* Flush dirty pages if the inode accumulated too many */
 bool
 lc_flushInodeDirtyPages(struct inode *inode, uint64_t page, bool unlock,
@@ -683,6 +712,51 @@ lc_mergePage(struct gfs *gfs, struct inode *inode, uint64_t pg,
     return 0;
 }
 
+/* Read data spliced to a pipe directly into pages, with a single system call
+ * for all the pages instead of one for each page.  Returns false if data is
+ * not in a pipe.
+ */
+static bool
+lc_readPipe(struct fuse_bufvec *bufv, struct fuse_bufvec *dst, size_t size) {
+    struct fuse_buf *buf = &bufv->buf[bufv->idx];
+    int iovcnt = dst->count, i;
+    struct iovec *iov;
+    ssize_t count;
+
+    if ((bufv->count != 1) || bufv->off || !(buf->flags & FUSE_BUF_IS_FD) ||
+        (buf->flags & FUSE_BUF_FD_SEEK)) {
+        return false;
+    }
+    iov = alloca(iovcnt * sizeof(struct iovec));
+    for (i = 0; i < iovcnt; i++) {
+        iov[i].iov_base = dst->buf[i].mem;
+        iov[i].iov_len = dst->buf[i].size;
+    }
+    while (size) {
+        count = readv(buf->fd, iov, (iovcnt < IOV_MAX) ? iovcnt : IOV_MAX);
+        if ((count < 0) && (errno == EINTR)) {
+            continue;
+        }
+        assert(count > 0);
+        assert(count <= size);
+        size -= count;
+
+        /* Skip over pages filled up */
+        while (count) {
+            if (count >= iov->iov_len) {
+                count -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            } else {
+                iov->iov_base = ((char *)iov->iov_base) + count;
+                iov->iov_len -= count;
+                count = 0;
+            }
+        }
+    }
+    return true;
+}
+
 /* Copy in provided data into page aligned buffers */
 uint64_t
 lc_copyPages(struct fs *fs, off_t off, size_t size, struct dpage *dpages,
@@ -717,8 +791,10 @@ lc_copyPages(struct fs *fs, off_t off, size_t size, struct dpage *dpages,
     }
 
     /* Read data from fuse */
-    wsize = fuse_buf_copy(dst, bufv, FUSE_BUF_SPLICE_MOVE);
-    assert(wsize == size);
+    if (!lc_readPipe(bufv, dst, size)) {
+        wsize = fuse_buf_copy(dst, bufv, FUSE_BUF_SPLICE_MOVE);
+        assert(wsize == size);
+    }
     return pcount;
 }
 
@@ -928,9 +1004,271 @@ lc_readFile(fuse_req_t req, struct fs *fs, struct inode *inode, off_t soffset,
         /* Consider all the pages read as missed in the cache */
         __sync_add_and_fetch(&gfs->gfs_pmissed, rcount);
     }
+    lc_hotAdd(gfs, fs->fs_gindex, ino, endoffset - soffset, false, rcount);
     return 0;
 }
 
+/* Copy data of a file into a buffer, starting at a page aligned offset.
+ * Pages not in the cache are read from disk in clusters.  Inode is locked by
+ * the caller.
+ */
+void
+lc_readFileData(struct fs *fs, struct inode *inode, off_t off, size_t size,
+                char *buf) {
+    struct page *pages[LC_READ_CLUSTER_SIZE], *rpages[LC_READ_CLUSTER_SIZE];
+    char *dst[LC_READ_CLUSTER_SIZE], *data;
+    uint64_t block, pg = off / LC_BLOCK_SIZE;
+    struct extent *extent = lc_inodeGetEmap(inode);
+    size_t psizes[LC_READ_CLUSTER_SIZE], psize;
+    uint32_t i, pcount = 0, rcount = 0;
+    struct gfs *gfs = fs->fs_gfs;
+    struct page *page;
+
+    assert(S_ISREG(inode->i_mode));
+    assert((off % LC_BLOCK_SIZE) == 0);
+    assert((off + size) <= inode->i_size);
+    while (size) {
+        psize = (size > LC_BLOCK_SIZE) ? LC_BLOCK_SIZE : size;
+
+        /* Copy dirty pages right away, queue up others for reading */
+        data = lc_getDirtyPage(gfs, inode, pg, &extent);
+        if (data) {
+            memcpy(buf, data, psize);
+        } else {
+            block = lc_inodeEmapLookup(gfs, inode, pg, &extent);
+            if (block == LC_PAGE_HOLE) {
+                memset(buf, 0, psize);
+            } else {
+                page = lc_getPageNewData(fs, block, NULL);
+                if (!page->p_dvalid) {
+                    rpages[rcount++] = page;
+                }
+                pages[pcount] = page;
+                dst[pcount] = buf;
+                psizes[pcount] = psize;
+                pcount++;
+            }
+        }
+        buf += psize;
+        size -= psize;
+        pg++;
+
+        /* Read in pages queued up when a cluster is complete */
+        if (pcount && ((pcount == LC_READ_CLUSTER_SIZE) || (size == 0))) {
+            if (rcount) {
+                rcount = lc_readPages(gfs, fs, rpages, rcount);
+                __sync_add_and_fetch(&gfs->gfs_pmissed, rcount);
+            }
+            for (i = 0; i < pcount; i++) {
+                memcpy(dst[i], pages[i]->p_data, psizes[i]);
+            }
+            lc_releaseReadPages(gfs, fs, pages, pcount, false, true);
+            pcount = 0;
+            rcount = 0;
+        }
+    }
+}
+
+/* Write dirty pages of a file over blocks preallocated for those.  Those
+ * blocks are not shared with any other layer and read as zeroes until
+ * written, so writing to those in place is safe.
+ */
+static void
+lc_flushUnwrittenPages(struct gfs *gfs, struct fs *fs, struct inode *inode) {
+    uint64_t pg, last, block, tcount = 0, zcount = 0, count;
+    struct page *page, *tpage = NULL, *dpage = NULL;
+    struct page *first = NULL, *lpage = NULL;
+    struct extent *extent;
+    struct dpage *dp;
+    bool read, cache;
+    char *pdata;
+
+    assert(inode->i_private);
+    assert(!(inode->i_flags & LC_INODE_SHARED));
+    cache = (inode->i_ino == gfs->gfs_dbIno) ||
+            (inode->i_ino == gfs->gfs_pluginIno);
+    pg = lc_inodeGetFirstPage(inode);
+    last = lc_inodeGetLastPage(inode);
+    while (pg <= last) {
+        extent = lc_inodeNextUnwritten(inode, pg);
+        if ((extent == NULL) || (lc_getExtentStart(extent) > last)) {
+            break;
+        }
+        if (pg < lc_getExtentStart(extent)) {
+            pg = lc_getExtentStart(extent);
+        }
+        block = lc_getExtentBlock(extent) + (pg - lc_getExtentStart(extent));
+        dp = lc_findDirtyPage(inode, pg);
+        if ((dp == NULL) || (dp->dp_data == NULL)) {
+            pg++;
+            continue;
+        }
+        pdata = lc_removeDirtyPage(gfs, inode, pg, false, &read);
+        assert((inode->i_extentLength == 0) ||
+               ((inode->i_extentBlock + pg) == block));
+        lc_inodeEmapConvert(fs, inode, pg);
+        tcount++;
+        if (pdata == gfs->gfs_zPage) {
+
+            /* Block reads as zeroes already */
+            zcount++;
+            pg++;
+            continue;
+        }
+        page = lc_getPageNew(gfs, fs, block, pdata);
+        if (read) {
+            page->p_hitCount++;
+        }
+        if (cache) {
+            page->p_cache = 1;
+        } else {
+            if (lpage) {
+                lpage->p_fnext = page;
+                page->p_fprev = lpage;
+            } else {
+                first = page;
+            }
+            lpage = page;
+        }
+        if (tpage == NULL) {
+            tpage = page;
+        } else {
+            dpage->p_dnext = page;
+        }
+        dpage = page;
+        pg++;
+    }
+    if (tcount == 0) {
+        return;
+    }
+    lc_resetInodePageMarkers(inode);
+    if (first) {
+        lc_insertPagesToFreeList(fs->fs_bcache, first, lpage);
+    }
+    if (tcount > zcount) {
+        lc_memTransferCount(fs, fs->fs_rfs, tcount - zcount, LC_MEMTYPE_DATA);
+        lc_addPageForWriteBack(gfs, fs, tpage, dpage, tcount - zcount);
+    }
+    count = __sync_fetch_and_sub(&fs->fs_pcount, tcount);
+    assert(count >= tcount);
+    count = __sync_fetch_and_sub(&gfs->gfs_dcount, tcount);
+    assert(count >= tcount);
+}
+
+/* Write pages of a file straight to blocks in the direct extent of the file
+ * preallocated for those, without adding those to the dirty pages of the
+ * file.  Each page needs to be complete, and pages full of zeroes are left
+ * unwritten as those read as zeroes already.  Data of pages written is taken
+ * over from the caller.
+ */
+void
+lc_writeExtentPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
+                    uint64_t pg, struct dpage *dpages, uint64_t pcount) {
+    struct page *page, *tpage = NULL, *dpage = NULL, *first = NULL;
+    struct page *lpage = NULL;
+    uint64_t i, count = 0;
+    char *pdata;
+
+    assert(S_ISREG(inode->i_mode));
+    assert(!(inode->i_flags & LC_INODE_SHARED));
+    assert((pg + pcount) <= inode->i_extentLength);
+    for (i = 0; i < pcount; i++, pg++) {
+        assert(dpages[i].dp_poffset == 0);
+        pdata = dpages[i].dp_data;
+        if (!memcmp(pdata, gfs->gfs_zPage, LC_BLOCK_SIZE)) {
+            continue;
+        }
+        lc_inodeEmapConvert(fs, inode, pg);
+        page = lc_getPageNew(gfs, fs, inode->i_extentBlock + pg, pdata);
+        dpages[i].dp_data = NULL;
+        if (lpage) {
+            lpage->p_fnext = page;
+            page->p_fprev = lpage;
+        } else {
+            first = page;
+        }
+        lpage = page;
+        if (tpage == NULL) {
+            tpage = page;
+        } else {
+            dpage->p_dnext = page;
+        }
+        dpage = page;
+        count++;
+    }
+    if (count) {
+        lc_insertPagesToFreeList(fs->fs_bcache, first, lpage);
+        lc_memTransferCount(fs, fs->fs_rfs, count, LC_MEMTYPE_DATA);
+        lc_addPageForWriteBack(gfs, fs, tpage, dpage, count);
+    }
+}
+
+/* Find hash of contents of a file, if all pages of the file are dirty */
+static bool
+lc_hashPages(struct inode *inode, uint64_t pcount, uint64_t *hashp) {
+    uint64_t i, hash = 0;
+    struct dpage *dpage;
+    size_t psize;
+
+    for (i = 0; i < pcount; i++) {
+        dpage = lc_findDirtyPage(inode, i);
+        psize = inode->i_size - (i * LC_BLOCK_SIZE);
+        if (psize > LC_BLOCK_SIZE) {
+            psize = LC_BLOCK_SIZE;
+        }
+        if ((dpage == NULL) || (dpage->dp_data == NULL) ||
+            dpage->dp_poffset || (dpage->dp_psize < psize)) {
+            return false;
+        }
+        hash = lc_dedupHash(hash, dpage->dp_data, psize);
+    }
+    *hashp = hash;
+    return true;
+}
+
+/* Release dirty pages of a file if an identical file exists in a frozen
+ * layer and let the file share blocks of that file.
+ */
+static bool
+lc_dedupPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
+              uint64_t pcount, uint64_t hash) {
+    uint64_t block, count = 0, gen, i;
+    struct dpage *dpage;
+    bool match = true;
+    size_t psize;
+    char *buf;
+
+    block = lc_dedupLookup(gfs, hash, inode->i_size, &count, &gen);
+    if ((block == LC_INVALID_BLOCK) || (count != pcount)) {
+        return false;
+    }
+
+    /* Compare contents, as different files could have the same hash */
+    lc_mallocBlockAligned(fs, (void **)&buf, LC_MEMTYPE_BLOCK);
+    for (i = 0; (i < pcount) && match; i++) {
+        dpage = lc_findDirtyPage(inode, i);
+        psize = inode->i_size - (i * LC_BLOCK_SIZE);
+        if (psize > LC_BLOCK_SIZE) {
+            psize = LC_BLOCK_SIZE;
+        }
+        lc_readBlock(gfs, fs, block + i, buf);
+        match = (memcmp(dpage->dp_data, buf, psize) == 0);
+    }
+    lc_free(fs, buf, LC_BLOCK_SIZE, LC_MEMTYPE_BLOCK);
+    if (!match || !lc_dedupShare(gfs, fs, block, count, gen)) {
+        return false;
+    }
+
+    /* Drop the pages and point the file to the shared extent */
+    for (i = 0; i < pcount; i++) {
+        lc_removeDirtyPage(gfs, inode, i, true, NULL);
+    }
+    inode->i_extentBlock = block;
+    inode->i_extentLength = count;
+    inode->i_dinode.di_blocks = count;
+    return true;
+}
+
 /* Flush dirty pages of an inode */
 void
 lc_flushPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
@@ -943,7 +1281,8 @@ lc_flushPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
     struct extent *extents = NULL, *extent, *tmp;
     struct lbcache *lbcache = fs->fs_bcache;
     struct page *first = NULL, *last = NULL;
-    bool single, read, cache;
+    bool single, read, cache, hashed = false;
+    uint64_t hash = 0;
     char *pdata;
     int64_t i;
 
@@ -955,6 +1294,14 @@ lc_flushPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
     if ((lc_inodeGetDirtyPageCount(inode) == 0) || (inode->i_size == 0)) {
         goto out;
     }
+
+    /* Write pages to blocks preallocated for those first */
+    if (lc_inodeGetUnwritten(inode) && inode->i_private) {
+        lc_flushUnwrittenPages(gfs, fs, inode);
+        if (lc_inodeGetDirtyPageCount(inode) == 0) {
+            goto out;
+        }
+    }
     assert((inode->i_dinode.di_blocks == 0) ||
            (inode->i_extentLength == inode->i_dinode.di_blocks) ||
            lc_inodeGetEmap(inode));
@@ -972,6 +1319,19 @@ lc_flushPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
     assert(start <= end);
     assert(bcount <= (end - start + 1));
 
+    /* If a new file in an image layer is flushed whole, check if the file
+     * could share blocks of an identical file in another layer.
+     */
+    if ((start == 0) && (inode->i_dinode.di_blocks == 0) &&
+        ((bcount * LC_BLOCK_SIZE) >= inode->i_size) &&
+        lc_dedupLayer(gfs, fs)) {
+        hashed = lc_hashPages(inode, bcount, &hash);
+        if (hashed && lc_dedupPages(gfs, fs, inode, bcount, hash)) {
+            fcount = bcount;
+            goto out;
+        }
+    }
+
     /* Allocate blocks.  If a single extent cannot be allocated, allocate
      * smaller chunks.
      */
@@ -1140,6 +1500,7 @@ lc_flushPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
             if (inode->i_extentBlock != eblock) {
                 lc_addFreedBlocks(fs, inode->i_extentBlock,
                                   inode->i_extentLength);
+                lc_freeUnwritten(fs, inode, 0);
             }
         } else if (lc_inodeGetEmap(inode)) {
 
@@ -1155,10 +1516,16 @@ lc_flushPages(struct gfs *gfs, struct fs *fs, struct inode *inode,
                 lc_free(fs, tmp, sizeof(struct extent), LC_MEMTYPE_EXTENT);
             }
             lc_inodeSetEmap(inode, NULL);
+            lc_freeUnwritten(fs, inode, 0);
         }
         inode->i_extentBlock = eblock;
         inode->i_extentLength = elength;
         inode->i_dinode.di_blocks = dblocks;
+
+        /* Index the file once the layer is frozen */
+        if (hashed) {
+            lc_dedupAdd(gfs, fs, inode, hash);
+        }
     }
     assert(bcount == (tcount + fcount));
     assert(lc_inodeGetDirtyPageCount(inode) == 0);
@@ -1411,6 +1778,7 @@ lc_truncateFile(struct inode *inode, off_t size, bool remove) {
                 inode->i_private = 1;
             }
             lc_inodeSetEmap(inode, NULL);
+            lc_freeUnwritten(fs, inode, 0);
             lc_invalidatePages(gfs, fs, inode, size);
             return;
         }
@@ -1428,3 +1796,193 @@ lc_truncateFile(struct inode *inode, off_t size, bool remove) {
     }
     lc_invalidatePages(gfs, fs, inode, size);
 }
+
+/* Zero out part of a page by adding a dirty page of zeroes */
+static void
+lc_zeroPartialPage(struct inode *inode, off_t off, size_t size) {
+    struct fs *fs = inode->i_fs;
+    struct gfs *gfs = fs->fs_gfs;
+    struct dpage dpage;
+    uint64_t added;
+
+    assert(((off % LC_BLOCK_SIZE) + size) <= LC_BLOCK_SIZE);
+    lc_mallocBlockAligned(fs, (void **)&dpage.dp_data, LC_MEMTYPE_DATA);
+    memset(dpage.dp_data, 0, LC_BLOCK_SIZE);
+    dpage.dp_poffset = off % LC_BLOCK_SIZE;
+    dpage.dp_psize = size;
+    dpage.dp_pread = 0;
+    added = lc_addPages(inode, off, size, &dpage, 1);
+    if (added) {
+        __sync_add_and_fetch(&fs->fs_pcount, added);
+        __sync_add_and_fetch(&gfs->gfs_dcount, added);
+    }
+    lc_freePages(fs, &dpage, 1);
+}
+
+/* Zero out the specified range of a file.  Blocks of whole pages within the
+ * range are freed and partial pages at either end are zeroed out.
+ */
+void
+lc_zeroRange(struct inode *inode, off_t off, off_t end) {
+    uint64_t spg = (off + LC_BLOCK_SIZE - 1) / LC_BLOCK_SIZE;
+    uint64_t epg = end / LC_BLOCK_SIZE, first, last, pg, freed = 0, count;
+    off_t zend = (end < inode->i_size) ? end : inode->i_size;
+    struct fs *fs = inode->i_fs;
+    struct gfs *gfs = fs->fs_gfs;
+    struct dpage *dpage;
+    off_t poff;
+
+    assert(S_ISREG(inode->i_mode));
+    assert(off < end);
+
+    /* Zero out partial pages at either end, within the size of the file */
+    if ((off % LC_BLOCK_SIZE) && (off < zend)) {
+        poff = (off - (off % LC_BLOCK_SIZE)) + LC_BLOCK_SIZE;
+        lc_zeroPartialPage(inode, off, ((poff < zend) ? poff : zend) - off);
+    }
+    poff = epg * LC_BLOCK_SIZE;
+    if ((end % LC_BLOCK_SIZE) && (epg >= spg) && (poff < zend)) {
+        lc_zeroPartialPage(inode, poff, zend - poff);
+    }
+    if (spg >= epg) {
+        return;
+    }
+
+    /* Drop dirty pages of whole pages in the range */
+    if (lc_inodeGetDirtyPageCount(inode)) {
+        first = lc_inodeGetFirstPage(inode);
+        last = lc_inodeGetLastPage(inode);
+        if (first < spg) {
+            first = spg;
+        }
+        if (last >= epg) {
+            last = epg - 1;
+        }
+        for (pg = first; pg <= last; pg++) {
+            dpage = lc_findDirtyPage(inode, pg);
+            if (dpage && dpage->dp_data) {
+                lc_removeDirtyPage(gfs, inode, pg, true, NULL);
+                freed++;
+            }
+        }
+        if (freed) {
+            lc_resetInodePageMarkers(inode);
+            count = __sync_fetch_and_sub(&fs->fs_pcount, freed);
+            assert(count >= freed);
+            count = __sync_fetch_and_sub(&gfs->gfs_dcount, freed);
+            assert(count >= freed);
+        }
+    }
+
+    /* Free blocks of those pages */
+    lc_emapPunch(gfs, fs, inode, spg, epg - spg);
+}
+
+/* Find the offset of the next data (or hole) in the file starting at the
+ * offset specified.  Dirty pages are consulted first, as those are not
+ * reflected in the emap yet.  Returns -1 if no data is found before eof.
+ */
+off_t
+lc_seekFile(struct gfs *gfs, struct inode *inode, off_t off, bool data) {
+    uint64_t pg = off / LC_BLOCK_SIZE, lpg, dfirst = 1, dlast = 0, next;
+    struct extent *extent = lc_inodeGetEmap(inode), *unwritten;
+    struct dpage *dpage;
+    bool mapped;
+
+    assert(S_ISREG(inode->i_mode));
+    assert(off < inode->i_size);
+    lpg = (inode->i_size + LC_BLOCK_SIZE - 1) / LC_BLOCK_SIZE;
+
+    /* Find the range of pages which may have dirty data */
+    if (inode->i_flags & LC_INODE_HASHED) {
+        if (lc_inodeGetDirtyPageCount(inode)) {
+            dfirst = lc_inodeGetFirstPage(inode);
+            dlast = lc_inodeGetLastPage(inode);
+        }
+    } else if (lc_inodeGetPageCount(inode)) {
+        dfirst = 0;
+        dlast = lc_inodeGetPageCount(inode) - 1;
+    }
+    while (pg < lpg) {
+        dpage = ((pg >= dfirst) && (pg <= dlast)) ?
+                lc_findDirtyPage(inode, pg) : NULL;
+        if (dpage && dpage->dp_data) {
+
+            /* A zero page written over a block makes a hole there */
+            if ((dpage->dp_data != gfs->gfs_zPage) == data) {
+                break;
+            }
+            pg++;
+            continue;
+        }
+        mapped = lc_inodeEmapLookup(gfs, inode, pg, &extent) != LC_PAGE_HOLE;
+        if (mapped == data) {
+            break;
+        }
+
+        /* Skip over rest of the extent or hole, but not beyond next page
+         * which could be dirty.
+         */
+        unwritten = lc_inodeGetUnwritten(inode) ?
+                    lc_inodeNextUnwritten(inode, pg) : NULL;
+        if (mapped) {
+            if (inode->i_extentLength && (pg < inode->i_extentLength)) {
+                next = inode->i_extentLength;
+            } else {
+                assert(extent);
+                next = lc_getExtentStart(extent) + lc_getExtentCount(extent);
+            }
+
+            /* Unwritten blocks are holes */
+            if (unwritten && (lc_getExtentStart(unwritten) < next)) {
+                next = lc_getExtentStart(unwritten);
+            }
+        } else if (unwritten && (lc_getExtentStart(unwritten) <= pg)) {
+            next = lc_getExtentStart(unwritten) +
+                   lc_getExtentCount(unwritten);
+        } else {
+            next = extent ? lc_getExtentStart(extent) : lpg;
+        }
+        if ((dfirst <= dlast) && (pg < dlast)) {
+            if (pg < dfirst) {
+                if (next > dfirst) {
+                    next = dfirst;
+                }
+            } else {
+                next = pg + 1;
+            }
+        }
+        pg = (next > pg) ? next : pg + 1;
+    }
+
+    /* End of the file is treated as a hole */
+    if (pg >= lpg) {
+        return data ? -1 : inode->i_size;
+    }
+    return (pg * LC_BLOCK_SIZE) > off ? (pg * LC_BLOCK_SIZE) : off;
+}
+
+/* Collect dirty pages of an inode in the order of page numbers.  Returns the
+ * number of pages collected.
+ */
+uint64_t
+lc_getDirtyPages(struct inode *inode, uint64_t *pages, struct dpage **dpages,
+                 uint64_t max) {
+    uint64_t pg, last, count = 0;
+    struct dpage *dpage;
+
+    if (lc_inodeGetDirtyPageCount(inode) == 0) {
+        return 0;
+    }
+    last = lc_inodeGetLastPage(inode);
+    for (pg = lc_inodeGetFirstPage(inode); (pg <= last) && (count < max);
+         pg++) {
+        dpage = lc_findDirtyPage(inode, pg);
+        if (dpage && dpage->dp_data) {
+            pages[count] = pg;
+            dpages[count] = dpage;
+            count++;
+        }
+    }
+    return count;
+}
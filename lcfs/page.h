@@ -61,6 +61,25 @@
 /* Time in seconds background flusher is woken up */
 #define LC_FLUSH_INTERVAL       20
 
+/* Minimum time in milliseconds between flusher runs when pages are dirtied
+ * faster than those are written back.
+ */
+#define LC_FLUSH_INTERVAL_MIN   100
+
+/* Percentage of memory for data pages which could be dirty before flusher
+ * starts writing back pages and writers are throttled.
+ */
+#define LC_DIRTY_BACKGROUND     50
+
+/* Writeback rate in blocks per second assumed before it is measured */
+#define LC_WRITE_RATE_DEFAULT   25600
+
+/* Maximum time in microseconds a writer is paused at a time when throttled */
+#define LC_THROTTLE_MAX_PAUSE   100000
+
+/* Minimum time in microseconds worth pausing a writer */
+#define LC_THROTTLE_MIN_PAUSE   1000
+
 /* Time in seconds background cleaner is woken up */
 #define LC_CLEAN_INTERVAL       60
 
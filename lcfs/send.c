@@ -0,0 +1,1106 @@
+#include "includes.h"
+
+/* Start a new block of a stream of a layer in the staging buffer */
+static struct sheader *
+lc_sendBlock(struct export *ex, uint32_t type) {
+    struct sheader *sh = (struct sheader *)&ex->ex_buf[ex->ex_blen];
+
+    assert((ex->ex_blen + LC_BLOCK_SIZE) <= LC_EXPORT_BUFSIZE);
+    memset(sh, 0, LC_BLOCK_SIZE);
+    sh->sh_magic = LC_SEND_MAGIC;
+    sh->sh_type = type;
+    sh->sh_seq = ex->ex_seq++;
+    ex->ex_blen += LC_BLOCK_SIZE;
+    return sh;
+}
+
+/* Complete the inode block being filled */
+static void
+lc_sendClose(struct export *ex) {
+    struct sheader *sh;
+
+    if (ex->ex_iopen) {
+        sh = (struct sheader *)&ex->ex_buf[ex->ex_iblock];
+        lc_updateCRC(sh, &sh->sh_crc);
+        ex->ex_iopen = false;
+    }
+}
+
+/* Add the first block of the stream describing the layer */
+static void
+lc_sendLayer(struct fs *fs, struct export *ex) {
+    struct sheader *sh = lc_sendBlock(ex, LC_SEND_LAYER);
+    struct slayer *sl = (struct slayer *)&sh[1];
+
+    sl->sl_version = LC_SEND_VERSION;
+    sl->sl_flags = fs->fs_parent ? 0 : LC_SEND_BASE;
+    sl->sl_root = fs->fs_root;
+    sl->sl_lastInode = fs->fs_super->sb_lastInode;
+    sl->sl_plastInode = fs->fs_parent ?
+                        fs->fs_parent->fs_super->sb_lastInode : 0;
+    sl->sl_ninode = fs->fs_gfs->gfs_super->sb_ninode;
+    sl->sl_icount = ex->ex_count;
+    sl->sl_id = fs->fs_super->sb_layerId;
+    sl->sl_pid = fs->fs_parent ? fs->fs_parent->fs_super->sb_layerId : 0;
+    sh->sh_size = sizeof(struct slayer);
+    lc_updateCRC(sh, &sh->sh_crc);
+}
+
+/* Check if data of a regular file is the same as that of the file in the
+ * parent layer, so that the receiver could share that from its parent layer.
+ */
+static bool
+lc_sendShared(struct fs *fs, struct inode *inode) {
+    struct inode *parent;
+
+    if ((fs->fs_parent == NULL) ||
+        (inode->i_ino > fs->fs_parent->fs_super->sb_lastInode)) {
+        return false;
+    }
+    parent = lc_lookupInodeChain(fs->fs_parent, inode->i_ino);
+    if ((parent == NULL) || !S_ISREG(parent->i_mode) ||
+        (parent->i_size != inode->i_size)) {
+        return false;
+    }
+    if (inode->i_size == 0) {
+        return true;
+    }
+    if (inode->i_flags & LC_INODE_SHARED) {
+        return lc_inodeGetEmap(inode) == lc_inodeGetEmap(parent);
+    }
+    return inode->i_extentLength &&
+           (inode->i_extentBlock == parent->i_extentBlock) &&
+           (inode->i_extentLength == parent->i_extentLength);
+}
+
+/* Serialize an inode into a record to be added to the stream */
+static void
+lc_sendRecord(struct fs *fs, struct export *ex, struct inode *inode) {
+    bool hashed = S_ISDIR(inode->i_mode) &&
+                  (inode->i_flags & LC_INODE_DHASHED);
+    int i, max = hashed ? LC_DIRCACHE_SIZE : 1;
+    struct fs *rfs = lc_getGlobalFs(fs->fs_gfs);
+    uint64_t dsize = 0, xsize = 0, size, len;
+    struct srecord *sr;
+    struct sdirent *sd;
+    struct dirent *dirent;
+    struct xattr *xattr;
+    struct sxattr *sx;
+    char *buf;
+
+    /* Find the size of the record */
+    if (S_ISDIR(inode->i_mode)) {
+        for (i = 0; i < max; i++) {
+            dirent = hashed ? inode->i_hdirent[i] : inode->i_dirent;
+            while (dirent) {
+                dsize += sizeof(struct sdirent) + dirent->di_size;
+                dirent = dirent->di_next;
+            }
+        }
+    } else if (S_ISLNK(inode->i_mode)) {
+        dsize = inode->i_size;
+    }
+    xattr = inode->i_xattrData ? inode->i_xattr : NULL;
+    while (xattr) {
+        xsize += sizeof(struct sxattr) + strlen(xattr->x_name) +
+                 xattr->x_size;
+        xattr = xattr->x_next;
+    }
+    size = sizeof(struct srecord) + dsize + xsize;
+    if (size > ex->ex_rsize) {
+        if (ex->ex_rec) {
+            lc_free(rfs, ex->ex_rec, ex->ex_rsize, LC_MEMTYPE_EXPORT);
+        }
+        ex->ex_rsize = (size + LC_BLOCK_SIZE - 1) & ~(LC_BLOCK_SIZE - 1);
+        ex->ex_rec = lc_malloc(rfs, ex->ex_rsize, LC_MEMTYPE_EXPORT);
+    }
+
+    /* Fill up the record */
+    sr = (struct srecord *)ex->ex_rec;
+    memcpy(&sr->sr_dinode, &inode->i_dinode, sizeof(struct dinode));
+    sr->sr_flags = 0;
+    sr->sr_dsize = dsize;
+    sr->sr_xsize = xsize;
+    buf = (char *)&sr[1];
+    if (S_ISDIR(inode->i_mode)) {
+        for (i = 0; i < max; i++) {
+            dirent = hashed ? inode->i_hdirent[i] : inode->i_dirent;
+            while (dirent) {
+                sd = (struct sdirent *)buf;
+                sd->sd_ino = dirent->di_ino;
+                sd->sd_mode = dirent->di_mode;
+                sd->sd_len = dirent->di_size;
+                memcpy(sd->sd_name, dirent->di_name, dirent->di_size);
+                buf += sizeof(struct sdirent) + dirent->di_size;
+                dirent = dirent->di_next;
+            }
+        }
+    } else if (S_ISLNK(inode->i_mode)) {
+        memcpy(buf, inode->i_target, dsize);
+        buf += dsize;
+    } else if (S_ISREG(inode->i_mode)) {
+        if (lc_sendShared(fs, inode)) {
+            sr->sr_flags |= LC_SEND_SHARED;
+        } else if (inode->i_size) {
+
+            /* Data of the file follows the record */
+            sr->sr_flags |= LC_SEND_FDATA;
+            ex->ex_ino = inode->i_ino;
+            ex->ex_fsize = inode->i_size;
+            ex->ex_foff = 0;
+            ex->ex_fend = (inode->i_size + LC_BLOCK_SIZE - 1) &
+                          ~((uint64_t)LC_BLOCK_SIZE - 1);
+            ex->ex_dcount = 0;
+            ex->ex_dnext = 0;
+        }
+    }
+    xattr = inode->i_xattrData ? inode->i_xattr : NULL;
+    while (xattr) {
+        sx = (struct sxattr *)buf;
+        len = strlen(xattr->x_name);
+        sx->sx_len = len;
+        sx->sx_size = xattr->x_size;
+        memcpy(sx->sx_nameValue, xattr->x_name, len);
+        if (xattr->x_size) {
+            memcpy(&sx->sx_nameValue[len], xattr->x_value, xattr->x_size);
+        }
+        buf += sizeof(struct sxattr) + len + xattr->x_size;
+        xattr = xattr->x_next;
+    }
+    assert((buf - ex->ex_rec) == size);
+    ex->ex_rlen = size;
+    ex->ex_roff = 0;
+}
+
+/* Add as much of the current record as possible to inode blocks.  Returns
+ * false if a new block is needed and the staging buffer is full.
+ */
+static bool
+lc_sendRecordBytes(struct export *ex) {
+    struct sheader *sh = NULL;
+    uint64_t count;
+
+    if (ex->ex_iopen) {
+        sh = (struct sheader *)&ex->ex_buf[ex->ex_iblock];
+        if (sh->sh_size == LC_SEND_PAYLOAD) {
+            lc_sendClose(ex);
+            sh = NULL;
+        }
+    }
+    if (sh == NULL) {
+        if ((ex->ex_blen + LC_BLOCK_SIZE) > LC_EXPORT_BUFSIZE) {
+            return false;
+        }
+        ex->ex_iblock = ex->ex_blen;
+        sh = lc_sendBlock(ex, LC_SEND_INODES);
+        ex->ex_iopen = true;
+    }
+    count = LC_SEND_PAYLOAD - sh->sh_size;
+    if (count > (ex->ex_rlen - ex->ex_roff)) {
+        count = ex->ex_rlen - ex->ex_roff;
+    }
+    memcpy(((char *)&sh[1]) + sh->sh_size, &ex->ex_rec[ex->ex_roff], count);
+    sh->sh_size += count;
+    ex->ex_roff += count;
+    return true;
+}
+
+/* Read the next chunk of pages of the file being added */
+static void
+lc_sendReadData(struct fs *fs, struct export *ex) {
+    uint64_t size = ex->ex_fend - ex->ex_foff, rsize = 0;
+    struct inode *inode;
+
+    if (size > (LC_SEND_DATA_MAX * LC_BLOCK_SIZE)) {
+        size = LC_SEND_DATA_MAX * LC_BLOCK_SIZE;
+    }
+    inode = lc_getInode(fs, ex->ex_ino, NULL, false, false);
+    if (inode) {
+        if (S_ISREG(inode->i_mode) && (ex->ex_foff < inode->i_size)) {
+            rsize = inode->i_size - ex->ex_foff;
+            if (rsize > size) {
+                rsize = size;
+            }
+            lc_readFileData(fs, inode, ex->ex_foff, rsize, ex->ex_data);
+        }
+        lc_inodeUnlock(inode);
+    }
+
+    /* Data past the end of the file is zeroes */
+    if (rsize < size) {
+        memset(&ex->ex_data[rsize], 0, size - rsize);
+    }
+    ex->ex_dpage = ex->ex_foff / LC_BLOCK_SIZE;
+    ex->ex_dcount = size / LC_BLOCK_SIZE;
+    ex->ex_dnext = 0;
+    ex->ex_foff += size;
+}
+
+/* Add a run of pages of the file being added, preceded by a data block.
+ * Pages of zeroes are skipped.  Returns false if the staging buffer is full.
+ */
+static bool
+lc_sendData(struct fs *fs, struct export *ex) {
+    uint64_t space, count = 0;
+    struct sheader *sh;
+    struct sdata *sd;
+    char *page;
+
+    if (ex->ex_dnext == ex->ex_dcount) {
+        lc_sendReadData(fs, ex);
+    }
+    while ((ex->ex_dnext < ex->ex_dcount) &&
+           !memcmp(&ex->ex_data[ex->ex_dnext * LC_BLOCK_SIZE],
+                   fs->fs_gfs->gfs_zPage, LC_BLOCK_SIZE)) {
+        ex->ex_dnext++;
+    }
+    if (ex->ex_dnext == ex->ex_dcount) {
+        return true;
+    }
+    space = (LC_EXPORT_BUFSIZE - ex->ex_blen) / LC_BLOCK_SIZE;
+    if (space < 2) {
+        return false;
+    }
+    while (((ex->ex_dnext + count) < ex->ex_dcount) &&
+           (count < (space - 1)) &&
+           memcmp(&ex->ex_data[(ex->ex_dnext + count) * LC_BLOCK_SIZE],
+                  fs->fs_gfs->gfs_zPage, LC_BLOCK_SIZE)) {
+        count++;
+    }
+    sh = lc_sendBlock(ex, LC_SEND_DATA);
+    sd = (struct sdata *)&sh[1];
+    sd->sd_page = ex->ex_dpage + ex->ex_dnext;
+    sd->sd_count = count;
+    sh->sh_size = sizeof(struct sdata) + (count * sizeof(uint32_t));
+    while (count) {
+        page = &ex->ex_buf[ex->ex_blen];
+        memcpy(page, &ex->ex_data[ex->ex_dnext * LC_BLOCK_SIZE],
+               LC_BLOCK_SIZE);
+        sd->sd_crc[sd->sd_count - count] = lc_checksum(page);
+        ex->ex_blen += LC_BLOCK_SIZE;
+        ex->ex_dnext++;
+        count--;
+    }
+    lc_updateCRC(sh, &sh->sh_crc);
+    return true;
+}
+
+/* Refill the staging buffer with the stream of a layer */
+void
+lc_sendFill(struct fs *fs, struct export *ex) {
+    struct inode *inode;
+    struct sheader *sh;
+
+    ex->ex_blen = 0;
+    ex->ex_boff = 0;
+    while (!ex->ex_eof) {
+
+        /* Stream starts with a block describing the layer */
+        if (ex->ex_seq == 0) {
+            lc_sendLayer(fs, ex);
+            continue;
+        }
+
+        /* Add rest of the current record */
+        if (ex->ex_roff < ex->ex_rlen) {
+            if (!lc_sendRecordBytes(ex)) {
+                break;
+            }
+            continue;
+        }
+
+        /* Data of a file follows the block with the record of the file */
+        if ((ex->ex_foff < ex->ex_fend) || (ex->ex_dnext < ex->ex_dcount)) {
+            lc_sendClose(ex);
+            if (!lc_sendData(fs, ex)) {
+                break;
+            }
+            continue;
+        }
+
+        /* Stream ends with an end block */
+        if (ex->ex_next == ex->ex_count) {
+            if ((ex->ex_blen + LC_BLOCK_SIZE) > LC_EXPORT_BUFSIZE) {
+                break;
+            }
+            lc_sendClose(ex);
+            sh = lc_sendBlock(ex, LC_SEND_END);
+            lc_updateCRC(sh, &sh->sh_crc);
+            ex->ex_eof = true;
+            break;
+        }
+        inode = lc_getInode(fs, ex->ex_inos[ex->ex_next++], NULL,
+                            false, false);
+        if (inode) {
+            lc_sendRecord(fs, ex, inode);
+            lc_inodeUnlock(inode);
+        }
+    }
+    lc_sendClose(ex);
+    assert(ex->ex_blen);
+}
+
+/* Find inodes of a layer to be added to a stream of the layer */
+void
+lc_sendInodes(struct fs *fs, struct export *ex) {
+    struct fs *rfs = lc_getGlobalFs(fs->fs_gfs);
+    struct inode *inode;
+    uint64_t i;
+
+    ex->ex_send = true;
+    ex->ex_inos = lc_malloc(rfs, fs->fs_icount * sizeof(ino_t),
+                            LC_MEMTYPE_EXPORT);
+    for (i = 0; i < fs->fs_icacheSize; i++) {
+        inode = fs->fs_icache[i].ic_head;
+        while (inode) {
+            if (!(inode->i_flags & LC_INODE_REMOVED)) {
+                assert(ex->ex_count < fs->fs_icount);
+                ex->ex_inos[ex->ex_count++] = inode->i_ino;
+            }
+            inode = inode->i_cnext;
+        }
+    }
+    ex->ex_data = lc_malloc(rfs, LC_SEND_DATA_MAX * LC_BLOCK_SIZE,
+                            LC_MEMTYPE_EXPORT);
+}
+
+/* Free resources of a stream of a layer */
+void
+lc_sendFree(struct fs *fs, struct export *ex) {
+    struct fs *rfs = lc_getGlobalFs(fs->fs_gfs);
+
+    lc_free(rfs, ex->ex_inos, ex->ex_fs->fs_icount * sizeof(ino_t),
+            LC_MEMTYPE_EXPORT);
+    if (ex->ex_rec) {
+        lc_free(rfs, ex->ex_rec, ex->ex_rsize, LC_MEMTYPE_EXPORT);
+    }
+    lc_free(rfs, ex->ex_data, LC_SEND_DATA_MAX * LC_BLOCK_SIZE,
+            LC_MEMTYPE_EXPORT);
+}
+
+/* Read from the stream into a list of buffers */
+static int
+lc_receiveRead(struct receive *rc, struct iovec *iov, int iovcnt) {
+    ssize_t count;
+
+    while (iovcnt) {
+        count = readv(rc->rc_fd, iov, iovcnt);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+
+        /* Stream ended prematurely */
+        if (count == 0) {
+            return EIO;
+        }
+        while (iovcnt && (count >= iov->iov_len)) {
+            count -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (count) {
+            iov->iov_base = ((char *)iov->iov_base) + count;
+            iov->iov_len -= count;
+        }
+    }
+    return 0;
+}
+
+/* Read the next block of the stream and validate it */
+static int
+lc_receiveBlock(struct receive *rc, struct sheader **shp) {
+    struct sheader *sh = (struct sheader *)rc->rc_block;
+    struct iovec iov;
+    uint32_t crc;
+    int err;
+
+    iov.iov_base = rc->rc_block;
+    iov.iov_len = LC_BLOCK_SIZE;
+    err = lc_receiveRead(rc, &iov, 1);
+    if (err) {
+        return err;
+    }
+    crc = sh->sh_crc;
+    sh->sh_crc = 0;
+    if ((sh->sh_magic != LC_SEND_MAGIC) ||
+        (lc_checksum(rc->rc_block) != crc) ||
+        (sh->sh_seq != rc->rc_seq) || (sh->sh_size > LC_SEND_PAYLOAD)) {
+        lc_syslog(LOG_ERR, "Invalid block %ld in stream\n", rc->rc_seq);
+        return EIO;
+    }
+    rc->rc_seq++;
+    *shp = sh;
+    return 0;
+}
+
+/* Open a stream of a layer and read the block describing the layer */
+int
+lc_receiveOpen(struct gfs *gfs, const char *path, bool base,
+               struct receive **rcp) {
+    struct fs *rfs = lc_getGlobalFs(gfs);
+    struct receive *rc;
+    struct sheader *sh;
+    int err;
+
+    rc = lc_malloc(rfs, sizeof(struct receive), LC_MEMTYPE_EXPORT);
+    memset(rc, 0, sizeof(struct receive));
+    rc->rc_block = lc_malloc(rfs, LC_BLOCK_SIZE, LC_MEMTYPE_EXPORT);
+    rc->rc_fd = open(path, O_RDONLY);
+    if (rc->rc_fd < 0) {
+        err = errno;
+        goto out;
+    }
+    err = lc_receiveBlock(rc, &sh);
+    if (err) {
+        goto out;
+    }
+    if ((sh->sh_type != LC_SEND_LAYER) ||
+        (sh->sh_size != sizeof(struct slayer))) {
+        err = EIO;
+        goto out;
+    }
+    memcpy(&rc->rc_layer, &sh[1], sizeof(struct slayer));
+
+    /* Base layers are received as base layers only */
+    if ((rc->rc_layer.sl_version != LC_SEND_VERSION) ||
+        (((rc->rc_layer.sl_flags & LC_SEND_BASE) != 0) != base)) {
+        err = EINVAL;
+    }
+
+out:
+    *rcp = rc;
+    return err;
+}
+
+/* Close a stream of a layer */
+void
+lc_receiveClose(struct gfs *gfs, struct receive *rc) {
+    struct fs *rfs = lc_getGlobalFs(gfs);
+
+    assert(rc->rc_inode == NULL);
+    if (rc->rc_fd >= 0) {
+        close(rc->rc_fd);
+    }
+    if (rc->rc_buf) {
+        lc_free(rfs, rc->rc_buf, rc->rc_bsize, LC_MEMTYPE_EXPORT);
+    }
+    lc_free(rfs, rc->rc_block, LC_BLOCK_SIZE, LC_MEMTYPE_EXPORT);
+    lc_free(rfs, rc, sizeof(struct receive), LC_MEMTYPE_EXPORT);
+}
+
+/* Finish receiving data of a regular file */
+static void
+lc_receiveDone(struct receive *rc) {
+    struct inode *inode = rc->rc_inode;
+    struct fs *fs = rc->rc_fs;
+
+    if (inode == NULL) {
+        return;
+    }
+    if (rc->rc_pcount) {
+        __sync_add_and_fetch(&fs->fs_pcount, rc->rc_pcount);
+        __sync_add_and_fetch(&fs->fs_gfs->gfs_dcount, rc->rc_pcount);
+    }
+    lc_markInodeDirty(inode, LC_INODE_EMAPDIRTY);
+    lc_inodeUnlock(inode);
+    rc->rc_inode = NULL;
+    rc->rc_pcount = 0;
+}
+
+/* Receive a run of pages of a regular file.  Pages within the extent
+ * reserved for the file are written to disk directly, while others are added
+ * to the file as dirty pages.
+ */
+static int
+lc_receiveData(struct receive *rc, struct sheader *sh) {
+    struct sdata *sd = (struct sdata *)&sh[1];
+    struct dpage dpages[LC_SEND_DATA_MAX];
+    struct iovec iov[LC_SEND_DATA_MAX];
+    struct inode *inode = rc->rc_inode;
+    struct fs *fs = rc->rc_fs;
+    uint64_t i, count, off, size, pages;
+    int err;
+
+    count = sd->sd_count;
+    pages = inode ? (inode->i_size + LC_BLOCK_SIZE - 1) / LC_BLOCK_SIZE : 0;
+    if ((inode == NULL) || (count == 0) || (count > LC_SEND_DATA_MAX) ||
+        (sh->sh_size != (sizeof(struct sdata) + (count * sizeof(uint32_t)))) ||
+        (sd->sd_page >= pages) || (count > (pages - sd->sd_page))) {
+        return EIO;
+    }
+    for (i = 0; i < count; i++) {
+        lc_mallocBlockAligned(fs, (void **)&dpages[i].dp_data,
+                              LC_MEMTYPE_DATA);
+        dpages[i].dp_poffset = 0;
+        dpages[i].dp_psize = LC_BLOCK_SIZE;
+        iov[i].iov_base = dpages[i].dp_data;
+        iov[i].iov_len = LC_BLOCK_SIZE;
+    }
+    err = lc_receiveRead(rc, iov, count);
+    for (i = 0; !err && (i < count); i++) {
+        if (lc_checksum(dpages[i].dp_data) != sd->sd_crc[i]) {
+            lc_syslog(LOG_ERR, "Invalid page %ld of inode %ld in stream\n",
+                      sd->sd_page + i, inode->i_ino);
+            err = EIO;
+        }
+    }
+    if (!err) {
+        if (rc->rc_reserved &&
+            ((sd->sd_page + count) <= inode->i_extentLength)) {
+            lc_writeExtentPages(fs->fs_gfs, fs, inode, sd->sd_page,
+                                dpages, count);
+        } else {
+
+            /* Last page of the file may be partial */
+            off = sd->sd_page * LC_BLOCK_SIZE;
+            size = count * LC_BLOCK_SIZE;
+            if ((off + size) > inode->i_size) {
+                size = inode->i_size - off;
+                dpages[count - 1].dp_psize = size -
+                                             ((count - 1) * LC_BLOCK_SIZE);
+            }
+            rc->rc_pcount += lc_addPages(inode, off, size, dpages, count);
+        }
+    }
+    lc_freePages(fs, dpages, count);
+    return err;
+}
+
+/* Add directory entries received to a directory.  Names should be valid
+ * names of files, so "." and ".." or names with a '/' or NUL are rejected.
+ */
+static int
+lc_receiveDirents(struct receive *rc, struct inode *dir, char *buf,
+                  uint32_t size) {
+    struct sdirent *sd;
+    uint32_t off = 0;
+
+    while (off < size) {
+        sd = (struct sdirent *)&buf[off];
+        if (((size - off) < sizeof(struct sdirent)) || (sd->sd_len == 0) ||
+            (sd->sd_len > LC_FILENAME_MAX) ||
+            ((size - off - sizeof(struct sdirent)) < sd->sd_len) ||
+            memchr(sd->sd_name, '/', sd->sd_len) ||
+            memchr(sd->sd_name, '\0', sd->sd_len) ||
+            ((sd->sd_name[0] == '.') &&
+             ((sd->sd_len == 1) ||
+              ((sd->sd_len == 2) && (sd->sd_name[1] == '.')))) ||
+            (sd->sd_ino <= LC_ROOT_INODE) ||
+            (sd->sd_ino == rc->rc_layer.sl_root) ||
+            (sd->sd_ino > rc->rc_layer.sl_ninode)) {
+            return EIO;
+        }
+        lc_dirAdd(dir, sd->sd_ino, sd->sd_mode, sd->sd_name, sd->sd_len);
+        off += sizeof(struct sdirent) + sd->sd_len;
+    }
+    return 0;
+}
+
+/* Replace extended attributes of an inode with those received */
+static int
+lc_receiveXattrs(struct inode *inode, char *buf, uint32_t size) {
+    struct sxattr *sx;
+    uint32_t off = 0;
+
+    /* Attributes cloned from the parent layer are replaced */
+    lc_xattrFree(inode);
+    inode->i_xattrBlock = LC_INVALID_BLOCK;
+    inode->i_flags &= ~LC_INODE_XATTRDIRTY;
+    while (off < size) {
+        sx = (struct sxattr *)&buf[off];
+        if (((size - off) < sizeof(struct sxattr)) || (sx->sx_len == 0) ||
+            (sx->sx_len >= LC_BLOCK_SIZE) || (sx->sx_size >= LC_BLOCK_SIZE) ||
+            ((size - off - sizeof(struct sxattr)) <
+             (sx->sx_len + sx->sx_size))) {
+            return EIO;
+        }
+        lc_xattrReceive(inode, sx->sx_nameValue, sx->sx_len,
+                        &sx->sx_nameValue[sx->sx_len], sx->sx_size);
+        off += sizeof(struct sxattr) + sx->sx_len + sx->sx_size;
+    }
+    return 0;
+}
+
+/* Find the inode a record is applied to, returning that locked.  Inodes
+ * modified in the layer are cloned from the parent layer, while others are
+ * created with the inode number in the stream.
+ */
+static int
+lc_receiveGetInode(struct receive *rc, struct srecord *sr,
+                   struct inode **inodep) {
+    struct dinode *dinode = &sr->sr_dinode;
+    struct slayer *sl = &rc->rc_layer;
+    ino_t ino = dinode->di_ino, parent;
+    struct fs *fs = rc->rc_fs;
+    struct inode *inode;
+
+    if (ino == sl->sl_root) {
+        if (!S_ISDIR(dinode->di_mode)) {
+            return EIO;
+        }
+        inode = fs->fs_rootInode;
+        lc_inodeLock(inode, true);
+    } else if (ino <= sl->sl_plastInode) {
+
+        /* Inode should be present in the parent layer */
+        inode = lc_lookupInodeCache(fs, ino, -1);
+        if (inode == NULL) {
+            inode = lc_lookupInodeChain(fs->fs_parent, ino);
+            if ((inode == NULL) || (inode == inode->i_fs->fs_rootInode) ||
+                (inode->i_flags & LC_INODE_REMOVED)) {
+                return EINVAL;
+            }
+        }
+        if ((inode->i_mode & S_IFMT) != (dinode->di_mode & S_IFMT)) {
+            return EINVAL;
+        }
+        inode = lc_getInode(fs, ino, NULL, true, true);
+        assert(inode->i_fs == fs);
+    } else {
+        if (lc_lookupInodeCache(fs, ino, -1) ||
+            (S_ISLNK(dinode->di_mode) &&
+             ((sr->sr_dsize == 0) || (sr->sr_dsize != dinode->di_size) ||
+              (sr->sr_dsize >= LC_BLOCK_SIZE)))) {
+            return EIO;
+        }
+        parent = (dinode->di_parent == sl->sl_root) ?
+                 fs->fs_root : dinode->di_parent;
+        inode = lc_inodeReceive(fs, dinode, parent,
+                                S_ISLNK(dinode->di_mode) ?
+                                (char *)&sr[1] : NULL);
+    }
+    *inodep = inode;
+    return 0;
+}
+
+/* Apply a record of an inode received */
+static int
+lc_receiveInode(struct receive *rc, struct srecord *sr) {
+    struct dinode *dinode = &sr->sr_dinode;
+    char *buf = (char *)&sr[1];
+    struct fs *fs = rc->rc_fs;
+    struct inode *inode;
+    uint32_t flags = 0;
+    uint64_t pcount;
+    int err;
+
+    if ((dinode->di_ino <= LC_ROOT_INODE) ||
+        (dinode->di_ino > rc->rc_layer.sl_ninode) ||
+        (dinode->di_nlink == 0) ||
+        ((sr->sr_flags & (LC_SEND_SHARED | LC_SEND_FDATA)) &&
+         !S_ISREG(dinode->di_mode))) {
+        return EIO;
+    }
+    err = lc_receiveGetInode(rc, sr, &inode);
+    if (err) {
+        return err;
+    }
+
+    /* Take attributes from the stream */
+    inode->i_mode = dinode->di_mode;
+    inode->i_dinode.di_uid = dinode->di_uid;
+    inode->i_dinode.di_gid = dinode->di_gid;
+    inode->i_dinode.di_rdev = dinode->di_rdev;
+    inode->i_nlink = dinode->di_nlink;
+    inode->i_dinode.di_mtime = dinode->di_mtime;
+    inode->i_dinode.di_ctime = dinode->di_ctime;
+    if (inode != fs->fs_rootInode) {
+        inode->i_parent = (dinode->di_parent == rc->rc_layer.sl_root) ?
+                          fs->fs_root : dinode->di_parent;
+    }
+    if (S_ISDIR(inode->i_mode)) {
+        lc_dirFree(inode);
+        inode->i_size = 0;
+        err = lc_receiveDirents(rc, inode, buf, sr->sr_dsize);
+        flags |= LC_INODE_DIRDIRTY;
+    } else if (S_ISREG(inode->i_mode)) {
+        if (sr->sr_flags & LC_SEND_SHARED) {
+
+            /* Data is shared with the parent layer */
+            if (inode->i_size != dinode->di_size) {
+                err = EINVAL;
+            }
+        } else {
+            lc_truncateFile(inode, 0, true);
+            inode->i_size = dinode->di_size;
+            if (sr->sr_flags & LC_SEND_FDATA) {
+
+                /* Reserve a contiguous extent for the whole file, which data
+                 * is written into as it is received.
+                 */
+                pcount = (inode->i_size + LC_BLOCK_SIZE - 1) / LC_BLOCK_SIZE;
+                rc->rc_reserved = lc_hasSpace(fs->fs_gfs,
+                                              fs == lc_getGlobalFs(fs->fs_gfs),
+                                              false) &&
+                                  !lc_emapPrealloc(fs->fs_gfs, fs, inode, 0,
+                                                   pcount);
+            }
+            flags |= LC_INODE_EMAPDIRTY;
+        }
+    }
+    if (!err && (sr->sr_xsize || inode->i_xattrData)) {
+        err = lc_receiveXattrs(inode, &buf[sr->sr_dsize], sr->sr_xsize);
+        if (sr->sr_xsize) {
+            flags |= LC_INODE_XATTRDIRTY;
+        }
+    }
+    lc_markInodeDirty(inode, flags);
+    rc->rc_icount++;
+
+    /* Keep the file locked while its data is received */
+    if (!err && (sr->sr_flags & LC_SEND_FDATA)) {
+        rc->rc_inode = inode;
+    } else {
+        lc_inodeUnlock(inode);
+    }
+    return err;
+}
+
+/* Apply inode records complete in the buffer */
+static int
+lc_receiveRecords(struct receive *rc, struct sheader *sh) {
+    struct fs *rfs = lc_getGlobalFs(rc->rc_fs->fs_gfs);
+    uint64_t size = rc->rc_blen + sh->sh_size;
+    struct srecord *sr;
+    char *buf;
+    int err;
+
+    /* Append the payload of the block to the buffer */
+    if (size > rc->rc_bsize) {
+        size = (size + LC_BLOCK_SIZE - 1) & ~((uint64_t)LC_BLOCK_SIZE - 1);
+        if (size < (2 * rc->rc_bsize)) {
+            size = 2 * rc->rc_bsize;
+        }
+        buf = lc_malloc(rfs, size, LC_MEMTYPE_EXPORT);
+        if (rc->rc_buf) {
+            memcpy(buf, rc->rc_buf, rc->rc_blen);
+            lc_free(rfs, rc->rc_buf, rc->rc_bsize, LC_MEMTYPE_EXPORT);
+        }
+        rc->rc_buf = buf;
+        rc->rc_bsize = size;
+    }
+    memcpy(&rc->rc_buf[rc->rc_blen], &sh[1], sh->sh_size);
+    rc->rc_blen += sh->sh_size;
+
+    /* Apply records and keep any partial record for the next block */
+    rc->rc_boff = 0;
+    while ((rc->rc_blen - rc->rc_boff) >= sizeof(struct srecord)) {
+        sr = (struct srecord *)&rc->rc_buf[rc->rc_boff];
+        size = sizeof(struct srecord) + (uint64_t)sr->sr_dsize + sr->sr_xsize;
+        if ((rc->rc_blen - rc->rc_boff) < size) {
+            break;
+        }
+        lc_receiveDone(rc);
+        err = lc_receiveInode(rc, sr);
+        if (err) {
+            return err;
+        }
+        rc->rc_boff += size;
+    }
+    rc->rc_blen -= rc->rc_boff;
+    memmove(rc->rc_buf, &rc->rc_buf[rc->rc_boff], rc->rc_blen);
+    rc->rc_boff = 0;
+    return 0;
+}
+
+/* Look up an inode received in the stream or present in the parent layer */
+static struct inode *
+lc_receiveLookup(struct receive *rc, ino_t ino) {
+    struct fs *fs = rc->rc_fs;
+    struct inode *inode;
+
+    inode = lc_lookupInodeCache(fs, ino, -1);
+    if ((inode == NULL) && fs->fs_parent &&
+        (ino <= rc->rc_layer.sl_plastInode)) {
+        inode = lc_lookupInodeChain(fs->fs_parent, ino);
+        if (inode && (inode == inode->i_fs->fs_rootInode)) {
+            inode = NULL;
+        }
+    }
+    return inode;
+}
+
+/* Return the parent directory a directory has in the layer received */
+static ino_t
+lc_receiveParent(struct fs *fs, struct inode *dir) {
+    return ((dir->i_fs != fs) && (dir->i_parent == dir->i_fs->fs_root)) ?
+           fs->fs_root : dir->i_parent;
+}
+
+/* Compare inode numbers */
+static int
+lc_receiveCompare(const void *a, const void *b) {
+    ino_t ino1 = *(const ino_t *)a, ino2 = *(const ino_t *)b;
+
+    return (ino1 < ino2) ? -1 : (ino1 > ino2);
+}
+
+/* Check that a directory received is reachable from the root directory of
+ * the layer, walking up parent directories, and mark directories received
+ * on the way as reachable.  Directories of the parent layer cannot form a
+ * cycle by themselves, so a walk passing more directories received than
+ * there are, is in a cycle.
+ */
+static int
+lc_receiveReachable(struct receive *rc, struct inode *dir, uint64_t count) {
+    struct fs *fs = rc->rc_fs;
+    struct inode *inode = dir;
+    uint64_t seen = 0;
+    ino_t ino;
+
+    while (!(inode->i_flags & LC_INODE_LINKED)) {
+        if ((inode->i_fs == fs) && (++seen > count)) {
+            lc_syslog(LOG_ERR, "Directory %ld is in a cycle in stream\n",
+                      dir->i_ino);
+            return EIO;
+        }
+        ino = lc_receiveParent(fs, inode);
+        if (ino == fs->fs_root) {
+            break;
+        }
+        inode = lc_receiveLookup(rc, ino);
+        if ((inode == NULL) || (inode->i_flags & LC_INODE_REMOVED) ||
+            !S_ISDIR(inode->i_mode)) {
+            lc_syslog(LOG_ERR, "Directory %ld has missing parent %ld in "
+                      "stream\n", dir->i_ino, ino);
+            return EIO;
+        }
+    }
+    for (inode = dir; !(inode->i_flags & LC_INODE_LINKED);) {
+        if (inode->i_fs == fs) {
+            inode->i_flags |= LC_INODE_LINKED;
+        }
+        ino = lc_receiveParent(fs, inode);
+        if (ino == fs->fs_root) {
+            break;
+        }
+        inode = lc_receiveLookup(rc, ino);
+    }
+    return 0;
+}
+
+/* Check if a directory is linked from the root directory of the layer
+ * received, through directories naming those as entries.  Entries of
+ * directories received are in the sorted array of directories linked, while
+ * directories not received have the entries of the parent layer.
+ */
+static bool
+lc_receiveLinked(struct receive *rc, ino_t *dirs, uint64_t count,
+                 struct inode *dir) {
+    struct fs *fs = rc->rc_fs;
+    struct inode *inode;
+    ino_t ino, key;
+
+    while (dir) {
+        ino = lc_receiveParent(fs, dir);
+        if (lc_lookupInodeCache(fs, ino, -1)) {
+            key = dir->i_ino;
+            if ((count == 0) ||
+                (bsearch(&key, dirs, count, sizeof(ino_t),
+                         lc_receiveCompare) == NULL)) {
+                return false;
+            }
+        } else if (dir->i_fs == fs) {
+
+            /* Directory not received still names a directory received only
+             * if that was not moved
+             */
+            inode = lc_lookupInodeChain(fs->fs_parent, dir->i_ino);
+            if ((inode == NULL) || (lc_receiveParent(fs, inode) != ino)) {
+                return false;
+            }
+        }
+        if (ino == fs->fs_root) {
+            return true;
+        }
+        dir = lc_receiveLookup(rc, ino);
+    }
+    return false;
+}
+
+/* Check that entries of directories received point at inodes received in
+ * the stream or present in the parent layer, with the same type.
+ * Directories should be linked just once, from the directory those name as
+ * parent, and should not form cycles.  A directory moved from a directory of
+ * the parent layer, should not be linked from that directory still.
+ */
+static int
+lc_receiveCheck(struct receive *rc) {
+    uint64_t count = 0, dcount = 0, size = 0, k;
+    struct fs *fs = rc->rc_fs;
+    struct inode *dir, *inode;
+    struct dirent *dirent;
+    int i, j, max, err = 0;
+    ino_t *dirs = NULL, parent;
+    void *buf;
+
+    for (i = 0; (i < fs->fs_icacheSize) && !err; i++) {
+        for (dir = fs->fs_icache[i].ic_head; dir && !err;
+             dir = dir->i_cnext) {
+            if (!S_ISDIR(dir->i_mode) || (dir->i_flags & LC_INODE_REMOVED)) {
+                continue;
+            }
+            if (dir != fs->fs_rootInode) {
+                count++;
+            }
+            max = (dir->i_flags & LC_INODE_DHASHED) ? LC_DIRCACHE_SIZE : 1;
+            for (j = 0; (j < max) && !err; j++) {
+                dirent = (dir->i_flags & LC_INODE_DHASHED) ?
+                         dir->i_hdirent[j] : dir->i_dirent;
+                for (; dirent; dirent = dirent->di_next) {
+                    inode = lc_receiveLookup(rc, dirent->di_ino);
+                    if ((inode == NULL) ||
+                        (inode->i_flags & LC_INODE_REMOVED) ||
+                        ((inode->i_mode & S_IFMT) !=
+                         (dirent->di_mode & S_IFMT))) {
+                        lc_syslog(LOG_ERR, "Entry %.*s of directory %ld "
+                                  "points at missing inode %ld in stream\n",
+                                  (int)dirent->di_size, dirent->di_name,
+                                  dir->i_ino, (ino_t)dirent->di_ino);
+                        err = EIO;
+                        break;
+                    }
+                    if (!S_ISDIR(inode->i_mode)) {
+                        continue;
+                    }
+                    if (lc_receiveParent(fs, inode) != dir->i_ino) {
+                        lc_syslog(LOG_ERR, "Entry %.*s of directory %ld "
+                                  "links directory %ld of directory %ld in "
+                                  "stream\n",
+                                  (int)dirent->di_size, dirent->di_name,
+                                  dir->i_ino, inode->i_ino,
+                                  lc_receiveParent(fs, inode));
+                        err = EIO;
+                        break;
+                    }
+
+                    /* Remember directories linked to find those linked
+                     * more than once
+                     */
+                    if (dcount == size) {
+                        size = size ? 2 * size : LC_BLOCK_SIZE / sizeof(ino_t);
+                        buf = lc_malloc(fs, size * sizeof(ino_t),
+                                        LC_MEMTYPE_EXPORT);
+                        if (dcount) {
+                            memcpy(buf, dirs, dcount * sizeof(ino_t));
+                            lc_free(fs, dirs, dcount * sizeof(ino_t),
+                                    LC_MEMTYPE_EXPORT);
+                        }
+                        dirs = buf;
+                    }
+                    dirs[dcount++] = inode->i_ino;
+                }
+            }
+        }
+    }
+    if (!err && dcount) {
+        qsort(dirs, dcount, sizeof(ino_t), lc_receiveCompare);
+        for (k = 1; k < dcount; k++) {
+            if (dirs[k] == dirs[k - 1]) {
+                lc_syslog(LOG_ERR, "Directory %ld linked more than once in "
+                          "stream\n", dirs[k]);
+                err = EIO;
+                break;
+            }
+        }
+    }
+
+    /* Check every directory received is reachable from the root */
+    for (i = 0; (i < fs->fs_icacheSize) && !err; i++) {
+        for (dir = fs->fs_icache[i].ic_head; dir && !err;
+             dir = dir->i_cnext) {
+            if (S_ISDIR(dir->i_mode) && (dir != fs->fs_rootInode) &&
+                !(dir->i_flags & LC_INODE_REMOVED)) {
+                err = lc_receiveReachable(rc, dir, count);
+            }
+        }
+    }
+
+    /* A directory moved from a directory not received is linked from that
+     * directory as well, unless that directory is not linked any more.
+     */
+    for (i = 0; (i < fs->fs_icacheSize) && !err && fs->fs_parent; i++) {
+        for (dir = fs->fs_icache[i].ic_head; dir && !err;
+             dir = dir->i_cnext) {
+            if (!S_ISDIR(dir->i_mode) || (dir == fs->fs_rootInode) ||
+                (dir->i_flags & LC_INODE_REMOVED) ||
+                (dir->i_ino > rc->rc_layer.sl_plastInode)) {
+                continue;
+            }
+            inode = lc_lookupInodeChain(fs->fs_parent, dir->i_ino);
+            if (inode == NULL) {
+                continue;
+            }
+            parent = lc_receiveParent(fs, inode);
+            if ((parent == dir->i_parent) ||
+                lc_lookupInodeCache(fs, parent, -1) ||
+                !lc_receiveLinked(rc, dirs, dcount, dir)) {
+                continue;
+            }
+            if (lc_receiveLinked(rc, dirs, dcount,
+                                 lc_receiveLookup(rc, parent))) {
+                lc_syslog(LOG_ERR, "Directory %ld linked from directory %ld "
+                          "not in stream\n", dir->i_ino, parent);
+                err = EIO;
+            }
+        }
+    }
+    if (size) {
+        lc_free(fs, dirs, size * sizeof(ino_t), LC_MEMTYPE_EXPORT);
+    }
+    for (i = 0; i < fs->fs_icacheSize; i++) {
+        for (dir = fs->fs_icache[i].ic_head; dir; dir = dir->i_cnext) {
+            dir->i_flags &= ~LC_INODE_LINKED;
+        }
+    }
+    return err;
+}
+
+/* Receive inodes of a layer from the stream into a new layer */
+int
+lc_receiveInodes(struct fs *fs, struct receive *rc) {
+    struct sheader *sh;
+    int err;
+
+    assert(!fs->fs_frozen && fs->fs_readOnly);
+    rc->rc_fs = fs;
+    for (;;) {
+        err = lc_receiveBlock(rc, &sh);
+        if (err) {
+            break;
+        }
+        if (sh->sh_type == LC_SEND_DATA) {
+            err = lc_receiveData(rc, sh);
+            if (err) {
+                break;
+            }
+            continue;
+        }
+        lc_receiveDone(rc);
+        if (sh->sh_type == LC_SEND_INODES) {
+            err = lc_receiveRecords(rc, sh);
+            if (err) {
+                break;
+            }
+        } else {
+            if ((sh->sh_type != LC_SEND_END) || rc->rc_blen ||
+                (rc->rc_icount != rc->rc_layer.sl_icount)) {
+                err = EIO;
+            }
+            break;
+        }
+    }
+    lc_receiveDone(rc);
+    if (!err) {
+        err = lc_receiveCheck(rc);
+    }
+    if (!err) {
+        lc_receiveHlinks(fs);
+    }
+    lc_printf("Received %ld inodes into layer %d, err %d\n",
+              rc->rc_icount, fs->fs_gindex, err);
+    return err;
+}
@@ -48,31 +48,28 @@ static const char *requests[] = {
     "STAT",
     "UMOUNT",
     "CLEANUP",
+    "LSEEK",
 };
 
-/* Allocate a new stats structure */
+/* Index of the set of counters used by this thread */
+static __thread int lc_statsStripe = -1;
+
+/* Number of threads which updated stats */
+static int lc_statsThreads;
+
+/* Allocate a new stats structure.  Sets of counters and histograms are
+ * allocated as those are used, so that layers not accessed by many threads
+ * do not pay for all of those.
+ */
 void
 lc_statsNew(struct fs *fs) {
     struct stats *stats;
-    struct timeval min;
-    enum lc_stats i;
 
     if (!stats_enabled) {
         return;
     }
-    gettimeofday(&min, NULL);
     stats = lc_malloc(fs, sizeof(struct stats), LC_MEMTYPE_STATS);
-    memset(&stats->s_count, 0, sizeof(uint64_t) * LC_REQUEST_MAX);
-    memset(&stats->s_err, 0, sizeof(uint64_t) * LC_REQUEST_MAX);
-    memset(&stats->s_max, 0, sizeof(struct timeval) * LC_REQUEST_MAX);
-    memset(&stats->s_total, 0, sizeof(struct timeval) * LC_REQUEST_MAX);
-    for (i = 0; i < LC_REQUEST_MAX; i++) {
-
-        /* Time is not tracked for certain requests */
-        stats->s_min[i] = ((i == LC_FLUSH) || (i == LC_FSYNCDIR) ||
-                           (i == LC_FSYNC)) ?  (struct timeval){0, 0} : min;
-    }
-    pthread_mutex_init(&stats->s_lock, NULL);
+    memset(stats, 0, sizeof(struct stats));
     fs->fs_stats = stats;
 }
 
@@ -84,53 +81,198 @@ lc_statsBegin(struct timeval *start) {
     }
 }
 
+/* Find the histogram bucket for the given latency */
+static int
+lc_statsBucket(uint64_t usec) {
+    int msb, bucket;
+
+    if (usec < 2) {
+        return usec;
+    }
+    msb = 63 - __builtin_clzl(usec);
+    bucket = (msb << 1) | ((usec >> (msb - 1)) & 1);
+    return (bucket < LC_STATS_BUCKETS) ? bucket : (LC_STATS_BUCKETS - 1);
+}
+
+/* Return the smallest latency tracked in a histogram bucket */
+static uint64_t
+lc_statsBucketStart(int bucket) {
+    if (bucket < 2) {
+        return bucket;
+    }
+    return (2ul | (bucket & 1)) << ((bucket >> 1) - 1);
+}
+
+/* Allocate the set of counters at the specified index */
+static struct sstats *
+lc_statsStripeAlloc(struct fs *fs, struct stats *stats, int index) {
+    struct sstats *sstats;
+    enum lc_stats i;
+
+    lc_mallocAligned(fs, (void **)&sstats, sizeof(struct sstats),
+                     LC_MEMTYPE_STATS);
+    memset(sstats, 0, sizeof(struct sstats));
+    for (i = 0; i < LC_REQUEST_MAX; i++) {
+        sstats->ss_req[i].rs_min = UINT64_MAX;
+    }
+
+    /* Another thread using the same set may have allocated it already */
+    if (!__sync_bool_compare_and_swap(&stats->s_stripe[index], NULL,
+                                      sstats)) {
+        lc_free(fs, sstats, sizeof(struct sstats), LC_MEMTYPE_STATS);
+    }
+    return stats->s_stripe[index];
+}
+
+/* Get counters of this thread for the request type */
+static inline struct rstats *
+lc_statsGet(struct fs *fs, struct stats *stats, enum lc_stats type) {
+    struct sstats *sstats;
+
+    if (unlikely(lc_statsStripe < 0)) {
+        lc_statsStripe = __sync_fetch_and_add(&lc_statsThreads, 1) %
+                         LC_STATS_STRIPES;
+    }
+    sstats = stats->s_stripe[lc_statsStripe];
+    if (unlikely(sstats == NULL)) {
+        sstats = lc_statsStripeAlloc(fs, stats, lc_statsStripe);
+    }
+    return &sstats->ss_req[type];
+}
+
+/* Get the latency histogram of a request type, allocating it if needed */
+static uint64_t *
+lc_statsHist(struct fs *fs, struct rstats *rstats) {
+    size_t size = LC_STATS_BUCKETS * sizeof(uint64_t);
+    uint64_t *hist = rstats->rs_hist;
+
+    if (unlikely(hist == NULL)) {
+        hist = lc_malloc(fs, size, LC_MEMTYPE_STATS);
+        memset(hist, 0, size);
+        if (!__sync_bool_compare_and_swap(&rstats->rs_hist, NULL, hist)) {
+            lc_free(fs, hist, size, LC_MEMTYPE_STATS);
+            hist = rstats->rs_hist;
+        }
+    }
+    return hist;
+}
+
 /* Update stats for the specified request type */
 void
 lc_statsAdd(struct fs *fs, enum lc_stats type, bool err,
              struct timeval *start) {
     struct stats *stats = fs->fs_stats;
     struct timeval stop, total;
+    struct rstats *rstats;
+    uint64_t usec, value;
 
     if (!stats_enabled) {
         return;
     }
+    rstats = lc_statsGet(fs, stats, type);
+    __sync_add_and_fetch(&rstats->rs_count, 1);
+    if (err) {
+        __sync_add_and_fetch(&rstats->rs_err, 1);
+    }
 
     /* Times are not tracked for certain type of operations */
     if (start == NULL) {
-        __sync_add_and_fetch(&stats->s_count[type], 1);
-        if (err) {
-            __sync_add_and_fetch(&stats->s_err[type], 1);
-        }
         return;
     }
 
     /* Calculate time taken to process this request and update stats */
     gettimeofday(&stop, NULL);
     timersub(&stop, start, &total);
-    pthread_mutex_lock(&stats->s_lock);
-
-    /* Increment total count */
-    stats->s_count[type]++;
-    if (err) {
-        stats->s_err[type]++;
+    usec = (total.tv_sec * 1000000ul) + total.tv_usec;
+    __sync_add_and_fetch(&rstats->rs_total, usec);
+    __sync_add_and_fetch(&lc_statsHist(fs, rstats)[lc_statsBucket(usec)], 1);
+    value = rstats->rs_max;
+    while ((usec > value) &&
+           !__sync_bool_compare_and_swap(&rstats->rs_max, value, usec)) {
+        value = rstats->rs_max;
     }
-    timeradd(&stats->s_total[type], &total, &stats->s_total[type]);
-    if (timercmp(&stats->s_max[type], &total, <)) {
-        stats->s_max[type] = total;
-    }
-    if (timercmp(&stats->s_min[type], &total, >)) {
-        stats->s_min[type] = total;
+    value = rstats->rs_min;
+    while ((usec < value) &&
+           !__sync_bool_compare_and_swap(&rstats->rs_min, value, usec)) {
+        value = rstats->rs_min;
     }
 
     /* Update layer access time */
     fs->fs_super->sb_atime = stop.tv_sec;
-    pthread_mutex_unlock(&stats->s_lock);
+}
+
+/* Merge counters of all threads for a request type, into the histogram
+ * provided.
+ */
+static void
+lc_statsMerge(struct stats *stats, enum lc_stats type, struct rstats *rstats,
+              uint64_t *hist) {
+    struct rstats *srstats;
+    int i, j;
+
+    memset(rstats, 0, sizeof(struct rstats));
+    memset(hist, 0, LC_STATS_BUCKETS * sizeof(uint64_t));
+    rstats->rs_min = UINT64_MAX;
+    rstats->rs_hist = hist;
+    for (i = 0; i < LC_STATS_STRIPES; i++) {
+        if (stats->s_stripe[i] == NULL) {
+            continue;
+        }
+        srstats = &stats->s_stripe[i]->ss_req[type];
+        rstats->rs_count += srstats->rs_count;
+        rstats->rs_err += srstats->rs_err;
+        rstats->rs_total += srstats->rs_total;
+        if (srstats->rs_max > rstats->rs_max) {
+            rstats->rs_max = srstats->rs_max;
+        }
+        if (srstats->rs_min < rstats->rs_min) {
+            rstats->rs_min = srstats->rs_min;
+        }
+        for (j = 0; srstats->rs_hist && (j < LC_STATS_BUCKETS); j++) {
+            hist[j] += srstats->rs_hist[j];
+        }
+    }
+    if (rstats->rs_min == UINT64_MAX) {
+        rstats->rs_min = 0;
+    }
+}
+
+/* Estimate latency at the given percentile (in tenths of a percent) from the
+ * histogram.
+ */
+static uint64_t
+lc_statsPercentile(struct rstats *rstats, int permille) {
+    uint64_t count = 0, target, timed = 0;
+    int i;
+
+    for (i = 0; i < LC_STATS_BUCKETS; i++) {
+        timed += rstats->rs_hist[i];
+    }
+    if (timed == 0) {
+        return 0;
+    }
+    target = ((timed * permille) + 999) / 1000;
+    for (i = 0; i < (LC_STATS_BUCKETS - 1); i++) {
+        count += rstats->rs_hist[i];
+        if (count >= target) {
+            break;
+        }
+    }
+
+    /* Report the upper bound of the bucket, within observed maximum */
+    if ((i == (LC_STATS_BUCKETS - 1)) ||
+        (lc_statsBucketStart(i + 1) > rstats->rs_max)) {
+        return rstats->rs_max;
+    }
+    return lc_statsBucketStart(i + 1);
 }
 
 /* Display stats of a file system */
 void
 lc_displayStats(struct fs *fs) {
+    uint64_t hist[LC_STATS_BUCKETS];
     struct stats *stats = fs->fs_stats;
+    struct rstats rstats;
     struct timeval now;
     enum lc_stats i;
 
@@ -149,17 +291,18 @@ lc_displayStats(struct fs *fs) {
         goto out;
     }
     lc_syslog(LOG_INFO,
-              "\tRequest:\tTotal\t\tFailed\tAverage\t\tMax\t\tMin\n\n");
+              "\tRequest:\tTotal\t\tFailed\tAverage\tMax\tMin\tp50\tp99"
+              "\tp99.9 (usecs)\n\n");
     for (i = 0; i < LC_REQUEST_MAX; i++) {
-        if (stats->s_count[i]) {
+        lc_statsMerge(stats, i, &rstats, hist);
+        if (rstats.rs_count) {
             lc_syslog(LOG_INFO,
-                      "%15s: %10ld\t%10ld\t%2lds.%06ldu\t%2lds.%06ldu\t"
-                      "%2lds.%06ldu\n",
-                      requests[i], stats->s_count[i], stats->s_err[i],
-                      stats->s_total[i].tv_sec / stats->s_count[i],
-                      stats->s_total[i].tv_usec / stats->s_count[i],
-                      stats->s_max[i].tv_sec, stats->s_max[i].tv_usec,
-                      stats->s_min[i].tv_sec, stats->s_min[i].tv_usec);
+                      "%15s: %10ld\t%10ld\t%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n",
+                      requests[i], rstats.rs_count, rstats.rs_err,
+                      rstats.rs_total / rstats.rs_count, rstats.rs_max,
+                      rstats.rs_min, lc_statsPercentile(&rstats, 500),
+                      lc_statsPercentile(&rstats, 990),
+                      lc_statsPercentile(&rstats, 999));
         }
     }
     lc_syslog(LOG_INFO, "\n\n");
@@ -217,9 +360,22 @@ lc_displayGlobalStats(struct gfs *gfs) {
         lc_syslog(LOG_INFO, "Total %ld reads %ld writes\n",
                gfs->gfs_reads, gfs->gfs_writes);
     }
+    if (gfs->gfs_throttled) {
+        lc_syslog(LOG_INFO, "Writers throttled %ld times, dirty rate %ld "
+                  "pages/s, writeback rate %ld blocks/s\n",
+                  gfs->gfs_throttled, gfs->gfs_dirtyRate, gfs->gfs_writeRate);
+    }
     if (gfs->gfs_clones) {
         lc_syslog(LOG_INFO, "%ld inodes cloned\n", gfs->gfs_clones);
     }
+    if (gfs->gfs_reclaimed || gfs->gfs_reclaimCount) {
+        lc_syslog(LOG_INFO, "%ld layers reclaimed, %d pending\n",
+                  gfs->gfs_reclaimed, gfs->gfs_reclaimCount);
+    }
+    if (gfs->gfs_dedupFiles) {
+        lc_syslog(LOG_INFO, "%ld files sharing %ld blocks of other files\n",
+                  gfs->gfs_dedupFiles, gfs->gfs_dedupBlocks);
+    }
     if (gfs->gfs_phit || gfs->gfs_pmissed || gfs->gfs_precycle ||
         gfs->gfs_preused || gfs->gfs_purged) {
         lc_syslog(LOG_INFO,
@@ -232,13 +388,332 @@ lc_displayGlobalStats(struct gfs *gfs) {
 /* Free resources associated with the stats of a file system */
 void
 lc_statsDeinit(struct fs *fs) {
+    struct stats *stats = fs->fs_stats;
+    struct sstats *sstats;
+    enum lc_stats j;
+    int i;
+
     if (stats_enabled) {
         lc_displayStats(fs);
-#ifdef LC_MUTEX_DESTROY
-        pthread_mutex_destroy(&fs->fs_stats->s_lock);
-#endif
-        lc_free(fs, fs->fs_stats, sizeof(struct stats), LC_MEMTYPE_STATS);
+        for (i = 0; stats && (i < LC_STATS_STRIPES); i++) {
+            sstats = stats->s_stripe[i];
+            if (sstats == NULL) {
+                continue;
+            }
+            for (j = 0; j < LC_REQUEST_MAX; j++) {
+                if (sstats->ss_req[j].rs_hist) {
+                    lc_free(fs, sstats->ss_req[j].rs_hist,
+                            LC_STATS_BUCKETS * sizeof(uint64_t),
+                            LC_MEMTYPE_STATS);
+                }
+            }
+            lc_free(fs, sstats, sizeof(struct sstats), LC_MEMTYPE_STATS);
+        }
+        if (stats) {
+            lc_free(fs, stats, sizeof(struct stats), LC_MEMTYPE_STATS);
+        }
     } else {
         assert(fs->fs_stats == NULL);
     }
 }
+
+/* Grow a buffer for exporting stats to hold the specified number of bytes
+ * more.
+ */
+static void
+lc_statsGrow(struct fs *fs, struct sbuf *sb, size_t len) {
+    size_t size = sb->sb_size ? sb->sb_size : LC_BLOCK_SIZE;
+    char *buf;
+
+    while (size < (sb->sb_len + len)) {
+        size *= 2;
+    }
+    if (size == sb->sb_size) {
+        return;
+    }
+    buf = lc_malloc(fs, size, LC_MEMTYPE_STATS);
+    if (sb->sb_buf) {
+        memcpy(buf, sb->sb_buf, sb->sb_len);
+        lc_free(fs, sb->sb_buf, sb->sb_size, LC_MEMTYPE_STATS);
+    }
+    sb->sb_buf = buf;
+    sb->sb_size = size;
+}
+
+/* Append formatted text to a buffer for exporting stats */
+void
+lc_statsPrintf(struct fs *fs, struct sbuf *sb, const char *fmt, ...) {
+    va_list args;
+    int len;
+
+    if (sb->sb_buf == NULL) {
+        lc_statsGrow(fs, sb, LC_BLOCK_SIZE);
+    }
+    while (true) {
+        va_start(args, fmt);
+        len = vsnprintf(&sb->sb_buf[sb->sb_len], sb->sb_size - sb->sb_len,
+                        fmt, args);
+        va_end(args);
+        assert(len >= 0);
+        if ((sb->sb_len + len) < sb->sb_size) {
+            sb->sb_len += len;
+            return;
+        }
+        lc_statsGrow(fs, sb, len + 1);
+    }
+}
+
+/* Metrics reported for every layer */
+enum lc_metrics {
+    LC_METRIC_INODES = 0,
+    LC_METRIC_PAGES = 1,
+    LC_METRIC_READS = 2,
+    LC_METRIC_WRITES = 3,
+    LC_METRIC_MEMORY = 4,
+    LC_METRIC_ALLOCS = 5,
+    LC_METRIC_REQUESTS = 6,
+    LC_METRIC_ERRORS = 7,
+    LC_METRIC_LATENCY = 8,
+    LC_METRIC_MAX = 9,
+};
+
+/* Names, types and descriptions of metrics reported for layers */
+static const char *metrics[][3] = {
+    {"lcfs_layer_inodes", "gauge", "Inodes cached in the layer."},
+    {"lcfs_layer_dirty_pages", "gauge", "Dirty pages in the layer."},
+    {"lcfs_layer_reads_total", "counter", "Blocks read for the layer."},
+    {"lcfs_layer_writes_total", "counter", "Blocks written for the layer."},
+    {"lcfs_layer_memory_bytes", "gauge", "Memory in use by the layer."},
+    {"lcfs_layer_allocations", "gauge",
+     "Allocations in use by the layer, by type."},
+    {"lcfs_requests_total", "counter", "Requests processed, by type."},
+    {"lcfs_request_errors_total", "counter", "Requests failed, by type."},
+    {"lcfs_request_duration_seconds", "histogram",
+     "Time taken to process requests, by type."},
+};
+
+/* Export request stats of a layer */
+static void
+lc_statsExportRequests(struct fs *rfs, struct fs *fs, struct sbuf *sb) {
+    struct sbuf *latency = &sb[LC_METRIC_LATENCY];
+    uint64_t hist[LC_STATS_BUCKETS];
+    uint64_t count;
+    struct rstats rstats;
+    enum lc_stats i;
+    int j;
+
+    for (i = 0; i < LC_REQUEST_MAX; i++) {
+        lc_statsMerge(fs->fs_stats, i, &rstats, hist);
+        if (rstats.rs_count == 0) {
+            continue;
+        }
+        lc_statsPrintf(rfs, &sb[LC_METRIC_REQUESTS],
+                       "%s{layer=\"%d\",op=\"%s\"} %lu\n",
+                       metrics[LC_METRIC_REQUESTS][0], fs->fs_gindex,
+                       requests[i], rstats.rs_count);
+        lc_statsPrintf(rfs, &sb[LC_METRIC_ERRORS],
+                       "%s{layer=\"%d\",op=\"%s\"} %lu\n",
+                       metrics[LC_METRIC_ERRORS][0], fs->fs_gindex,
+                       requests[i], rstats.rs_err);
+
+        /* Histogram buckets are cumulative */
+        count = 0;
+        for (j = 0; j < LC_STATS_BUCKETS; j++) {
+            count += rstats.rs_hist[j];
+        }
+        if (count == 0) {
+            continue;
+        }
+        count = 0;
+        for (j = 0; j < (LC_STATS_BUCKETS - 1); j++) {
+            count += rstats.rs_hist[j];
+            lc_statsPrintf(rfs, latency,
+                           "%s_bucket{layer=\"%d\",op=\"%s\",le=\"%.6f\"} "
+                           "%lu\n", metrics[LC_METRIC_LATENCY][0],
+                           fs->fs_gindex, requests[i],
+                           lc_statsBucketStart(j + 1) / 1000000.0, count);
+        }
+        count += rstats.rs_hist[j];
+        lc_statsPrintf(rfs, latency,
+                       "%s_bucket{layer=\"%d\",op=\"%s\",le=\"+Inf\"} %lu\n"
+                       "%s_sum{layer=\"%d\",op=\"%s\"} %.6f\n"
+                       "%s_count{layer=\"%d\",op=\"%s\"} %lu\n",
+                       metrics[LC_METRIC_LATENCY][0], fs->fs_gindex,
+                       requests[i], count,
+                       metrics[LC_METRIC_LATENCY][0], fs->fs_gindex,
+                       requests[i], rstats.rs_total / 1000000.0,
+                       metrics[LC_METRIC_LATENCY][0], fs->fs_gindex,
+                       requests[i], count);
+    }
+}
+
+/* Export stats of a layer, appending to buffers of each metric */
+static void
+lc_statsExportLayer(struct fs *rfs, struct fs *fs, struct sbuf *sb) {
+    enum lc_memTypes i;
+
+    lc_statsPrintf(rfs, &sb[LC_METRIC_INODES], "%s{layer=\"%d\"} %lu\n",
+                   metrics[LC_METRIC_INODES][0], fs->fs_gindex,
+                   fs->fs_icount);
+    lc_statsPrintf(rfs, &sb[LC_METRIC_PAGES], "%s{layer=\"%d\"} %lu\n",
+                   metrics[LC_METRIC_PAGES][0], fs->fs_gindex,
+                   fs->fs_pcount);
+    lc_statsPrintf(rfs, &sb[LC_METRIC_READS], "%s{layer=\"%d\"} %lu\n",
+                   metrics[LC_METRIC_READS][0], fs->fs_gindex,
+                   fs->fs_reads);
+    lc_statsPrintf(rfs, &sb[LC_METRIC_WRITES], "%s{layer=\"%d\"} %lu\n",
+                   metrics[LC_METRIC_WRITES][0], fs->fs_gindex,
+                   fs->fs_writes);
+
+    /* Memory stats are tracked only when enabled */
+    if (fs->fs_memory) {
+        lc_statsPrintf(rfs, &sb[LC_METRIC_MEMORY], "%s{layer=\"%d\"} %lu\n",
+                       metrics[LC_METRIC_MEMORY][0], fs->fs_gindex,
+                       fs->fs_memory);
+        for (i = LC_MEMTYPE_GFS + 1; i < LC_MEMTYPE_MAX; i++) {
+            if (fs->fs_malloc[i]) {
+                lc_statsPrintf(rfs, &sb[LC_METRIC_ALLOCS],
+                               "%s{layer=\"%d\",type=\"%s\"} %lu\n",
+                               metrics[LC_METRIC_ALLOCS][0], fs->fs_gindex,
+                               lc_memTypeName(i),
+                               fs->fs_malloc[i] - fs->fs_free[i]);
+            }
+        }
+    }
+
+    /* Request stats could be freed when cleared, which is done with the layer
+     * locked exclusive.
+     */
+    if (stats_enabled && !lc_tryLock(fs, false)) {
+        if (fs->fs_stats) {
+            lc_statsExportRequests(rfs, fs, sb);
+        }
+        lc_unlock(fs);
+    }
+}
+
+/* Export global stats */
+static void
+lc_statsExportGlobal(struct gfs *gfs, struct fs *rfs, struct sbuf *sb) {
+    uint64_t hit = gfs->gfs_phit, missed = gfs->gfs_pmissed;
+
+    lc_statsPrintf(rfs, sb,
+                   "# HELP lcfs_blocks Blocks in the device.\n"
+                   "# TYPE lcfs_blocks gauge\n"
+                   "lcfs_blocks %lu\n"
+                   "# HELP lcfs_blocks_used Blocks in use.\n"
+                   "# TYPE lcfs_blocks_used gauge\n"
+                   "lcfs_blocks_used %lu\n"
+                   "# HELP lcfs_layers Layers in use.\n"
+                   "# TYPE lcfs_layers gauge\n"
+                   "lcfs_layers %lu\n",
+                   gfs->gfs_super->sb_tblocks, gfs->gfs_super->sb_blocks,
+                   gfs->gfs_count);
+    lc_statsPrintf(rfs, sb,
+                   "# HELP lcfs_reads_total Blocks read.\n"
+                   "# TYPE lcfs_reads_total counter\n"
+                   "lcfs_reads_total %lu\n"
+                   "# HELP lcfs_writes_total Blocks written.\n"
+                   "# TYPE lcfs_writes_total counter\n"
+                   "lcfs_writes_total %lu\n"
+                   "# HELP lcfs_inodes_cloned_total Inodes copied up.\n"
+                   "# TYPE lcfs_inodes_cloned_total counter\n"
+                   "lcfs_inodes_cloned_total %lu\n",
+                   gfs->gfs_reads, gfs->gfs_writes, gfs->gfs_clones);
+    lc_statsPrintf(rfs, sb,
+                   "# HELP lcfs_page_hits_total Pages found in cache.\n"
+                   "# TYPE lcfs_page_hits_total counter\n"
+                   "lcfs_page_hits_total %lu\n"
+                   "# HELP lcfs_page_misses_total Pages not found in cache."
+                   "\n"
+                   "# TYPE lcfs_page_misses_total counter\n"
+                   "lcfs_page_misses_total %lu\n"
+                   "# HELP lcfs_page_hit_ratio Ratio of pages found in "
+                   "cache.\n"
+                   "# TYPE lcfs_page_hit_ratio gauge\n"
+                   "lcfs_page_hit_ratio %.6f\n",
+                   hit, missed,
+                   (hit + missed) ? ((double)hit / (hit + missed)) : 0.0);
+    lc_statsPrintf(rfs, sb,
+                   "# HELP lcfs_pages_recycled_total Pages recycled.\n"
+                   "# TYPE lcfs_pages_recycled_total counter\n"
+                   "lcfs_pages_recycled_total %lu\n"
+                   "# HELP lcfs_pages_reused_total Pages reused.\n"
+                   "# TYPE lcfs_pages_reused_total counter\n"
+                   "lcfs_pages_reused_total %lu\n"
+                   "# HELP lcfs_pages_purged_total Pages purged.\n"
+                   "# TYPE lcfs_pages_purged_total counter\n"
+                   "lcfs_pages_purged_total %lu\n",
+                   gfs->gfs_precycle, gfs->gfs_preused, gfs->gfs_purged);
+    lc_statsPrintf(rfs, sb,
+                   "# HELP lcfs_writers_throttled_total Writers throttled.\n"
+                   "# TYPE lcfs_writers_throttled_total counter\n"
+                   "lcfs_writers_throttled_total %lu\n"
+                   "# HELP lcfs_dirty_rate Pages dirtied per second.\n"
+                   "# TYPE lcfs_dirty_rate gauge\n"
+                   "lcfs_dirty_rate %lu\n"
+                   "# HELP lcfs_writeback_rate Blocks written per second.\n"
+                   "# TYPE lcfs_writeback_rate gauge\n"
+                   "lcfs_writeback_rate %lu\n",
+                   gfs->gfs_throttled, gfs->gfs_dirtyRate, gfs->gfs_writeRate);
+    lc_statsPrintf(rfs, sb,
+                   "# HELP lcfs_layers_reclaimed_total Removed layers freed in "
+                   "the background.\n"
+                   "# TYPE lcfs_layers_reclaimed_total counter\n"
+                   "lcfs_layers_reclaimed_total %lu\n"
+                   "# HELP lcfs_layers_reclaim_pending Removed layers not "
+                   "freed yet.\n"
+                   "# TYPE lcfs_layers_reclaim_pending gauge\n"
+                   "lcfs_layers_reclaim_pending %d\n",
+                   gfs->gfs_reclaimed, gfs->gfs_reclaimCount);
+}
+
+/* Render stats in Prometheus text format */
+struct sbuf *
+lc_statsExport(struct gfs *gfs) {
+    struct fs *rfs = lc_getGlobalFs(gfs), *fs;
+    struct sbuf *sb, msb[LC_METRIC_MAX];
+    int i;
+
+    sb = lc_malloc(rfs, sizeof(struct sbuf), LC_MEMTYPE_STATS);
+    memset(sb, 0, sizeof(struct sbuf));
+    memset(msb, 0, sizeof(msb));
+    lc_statsExportGlobal(gfs, rfs, sb);
+    lc_memStatsExport(rfs, sb);
+    lc_hotExport(gfs, rfs, sb);
+
+    /* Collect samples of each metric from all layers */
+    rcu_register_thread();
+    rcu_read_lock();
+    for (i = 0; i <= gfs->gfs_scount; i++) {
+        fs = rcu_dereference(gfs->gfs_fs[i]);
+        if (fs) {
+            lc_statsExportLayer(rfs, fs, msb);
+        }
+    }
+    rcu_read_unlock();
+    rcu_unregister_thread();
+
+    /* Samples of a metric need to be together */
+    for (i = 0; i < LC_METRIC_MAX; i++) {
+        if (msb[i].sb_len == 0) {
+            continue;
+        }
+        lc_statsPrintf(rfs, sb, "# HELP %s %s\n# TYPE %s %s\n%.*s",
+                       metrics[i][0], metrics[i][2], metrics[i][0],
+                       metrics[i][1], (int)msb[i].sb_len, msb[i].sb_buf);
+        lc_free(rfs, msb[i].sb_buf, msb[i].sb_size, LC_MEMTYPE_STATS);
+    }
+    return sb;
+}
+
+/* Free stats exported */
+void
+lc_statsExportFree(struct gfs *gfs, struct sbuf *sb) {
+    struct fs *rfs = lc_getGlobalFs(gfs);
+
+    if (sb->sb_buf) {
+        lc_free(rfs, sb->sb_buf, sb->sb_size, LC_MEMTYPE_STATS);
+    }
+    lc_free(rfs, sb, sizeof(struct sbuf), LC_MEMTYPE_STATS);
+}
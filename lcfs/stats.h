@@ -38,29 +38,151 @@ enum lc_stats {
     LC_STAT = 32,
     LC_UMOUNT = 33,
     LC_CLEANUP = 34,
-    LC_REQUEST_MAX = 35,
+    LC_LSEEK = 35,
+    LC_REQUEST_MAX = 36,
+};
+
+/* Size of a cache line */
+#define LC_CACHELINE_SIZE   64
+
+/* Number of sets of counters threads are spread over */
+#define LC_STATS_STRIPES    8
+
+/* Number of buckets in latency histograms.  Two buckets are used for every
+ * power of two microseconds, up to about a minute.
+ */
+#define LC_STATS_BUCKETS    54
+
+/* Stats for a type of request */
+struct rstats {
+
+    /* Count of requests processed */
+    uint64_t rs_count;
+
+    /* Count of requests failed */
+    uint64_t rs_err;
+
+    /* Total time taken in microseconds */
+    uint64_t rs_total;
+
+    /* Maximum time taken in microseconds */
+    uint64_t rs_max;
+
+    /* Minimum time taken in microseconds */
+    uint64_t rs_min;
+
+    /* Latency histogram, allocated when a request is timed first */
+    uint64_t *rs_hist;
+};
+
+/* Set of counters updated by a group of threads, kept on separate cache
+ * lines from other sets.  Allocated when a thread using the set updates
+ * stats of the layer first.
+ */
+struct sstats {
+    struct rstats ss_req[LC_REQUEST_MAX];
+} __attribute__((aligned(LC_CACHELINE_SIZE)));
+
+/* Name of the virtual file in the root directory exporting stats */
+#define LC_STATS_FILE       ".stats"
+
+/* Buffer stats are exported in */
+struct sbuf {
+
+    /* Text exported */
+    char *sb_buf;
+
+    /* Length of the text */
+    size_t sb_len;
+
+    /* Size of the buffer */
+    size_t sb_size;
 };
 
 /* Structure tracking stats */
 struct stats {
 
-    /* Lock protecting stats */
-    pthread_mutex_t s_lock;
+    /* Counters, merged when displayed */
+    struct sstats *s_stripe[LC_STATS_STRIPES];
+};
 
-    /* Count of each requests processed */
-    uint64_t s_count[LC_REQUEST_MAX];
 
-    /* Count of requests failed */
-    uint64_t s_err[LC_REQUEST_MAX];
+/* Rows in the sketch estimating how hot files and layers are, and the
+ * number of counters in each row.
+ */
+#define LC_HOT_DEPTH        4
+#define LC_HOT_SHIFT        12
+#define LC_HOT_WIDTH        (1 << LC_HOT_SHIFT)
+
+/* Number of hottest files and layers tracked */
+#define LC_HOT_MAX          32
+
+/* Number of accesses a thread buffers before adding those to the sketch */
+#define LC_HOT_BUFFER       64
+
+/* Interval in seconds after which hot counters are halved */
+#define LC_HOT_DECAY        60
+
+/* Accesses to a file buffered by a thread */
+struct haccess {
+
+    /* Layer index and inode number of the file */
+    uint64_t ha_key;
+
+    /* Bytes read */
+    uint64_t ha_rbytes;
+
+    /* Bytes written */
+    uint64_t ha_wbytes;
+
+    /* Pages read from disk */
+    uint64_t ha_misses;
+};
+
+/* A hot file or layer */
+struct hentry {
+
+    /* Layer index and inode number of a file, or index of a layer */
+    uint64_t he_key;
+
+    /* Estimated weight of accesses */
+    uint64_t he_score;
+
+    /* Bytes read since tracked */
+    uint64_t he_rbytes;
+
+    /* Bytes written since tracked */
+    uint64_t he_wbytes;
+
+    /* Pages read from disk since tracked */
+    uint64_t he_misses;
+};
+
+/* Heap of hottest entries, with the coldest one at the top */
+struct hheap {
+    struct hentry hh_entry[LC_HOT_MAX];
+
+    /* Number of entries in the heap */
+    int hh_count;
+};
+
+/* Tracking hot files and layers */
+struct hot {
+
+    /* Lock serializing updates */
+    pthread_mutex_t h_lock;
+
+    /* Count-min sketch of weights of accesses */
+    uint64_t h_sketch[LC_HOT_DEPTH][LC_HOT_WIDTH];
 
-    /* Maximum time taken by each request */
-    struct timeval s_max[LC_REQUEST_MAX];
+    /* Hottest files */
+    struct hheap h_files;
 
-    /* Minimum time taken by each request */
-    struct timeval s_min[LC_REQUEST_MAX];
+    /* Hottest layers */
+    struct hheap h_layers;
 
-    /* Total time taken by each request */
-    struct timeval s_total[LC_REQUEST_MAX];
+    /* Time counters were last halved */
+    time_t h_decayed;
 };
 
 #endif
@@ -1,5 +1,19 @@
 #include "includes.h"
 
+/* Generate an identity for a new layer, so that layers sent to other file
+ * systems could be matched with their parent layers there.
+ */
+static uint64_t
+lc_superLayerId(uint64_t root) {
+    struct timespec tv;
+    uint64_t id;
+
+    lc_gettime(&tv);
+    id = ((uint64_t)tv.tv_sec << 30) ^ (uint64_t)tv.tv_nsec ^
+         ((uint64_t)getpid() << 44) ^ (root << 52);
+    return id ? id : 1;
+}
+
 /* Initialize a superblock */
 void
 lc_superInit(struct super *super, uint64_t root, size_t size,
@@ -24,6 +38,8 @@ lc_superInit(struct super *super, uint64_t root, size_t size,
         super->sb_inodes = 1;
         super->sb_tblocks = size / LC_BLOCK_SIZE;
         super->sb_syncer = LC_SYNC_INTERVAL;
+    } else {
+        super->sb_layerId = lc_superLayerId(root);
     }
 }
 
@@ -76,13 +92,16 @@ lc_superWrite(struct gfs *gfs, struct fs *fs, struct fs *rfs) {
     fs->fs_dirty = false;
 }
 
-/* Allocate superblocks for layers as needed */
+/* Allocate superblocks for layers as needed.  Removed layers waiting to be
+ * reclaimed are linked from the global superblock, so that those could be
+ * reclaimed after a restart.
+ */
 void
 lc_allocateSuperBlocks(struct gfs *gfs, struct fs *rfs) {
+    uint64_t block, *next;
     time_t t = time(NULL);
+    struct fs *fs, *zfs;
     struct super *super;
-    uint64_t block;
-    struct fs *fs;
     int i, count;
 
     /* Check if superblock of any layers is dirty */
@@ -112,6 +131,27 @@ lc_allocateSuperBlocks(struct gfs *gfs, struct fs *rfs) {
             count--;
         }
     }
+
+    /* Removed layers are not modified while the root layer is locked
+     * exclusive, as the reclaimer holds that shared.
+     */
+    next = &gfs->gfs_super->sb_reclaimLayer;
+    for (fs = gfs->gfs_reclaim; fs; fs = fs->fs_rnext) {
+        for (zfs = fs; zfs; zfs = zfs->fs_zfs) {
+            if (zfs->fs_sblock != LC_INVALID_BLOCK) {
+                lc_addFreedBlocks(rfs, zfs->fs_sblock, 1);
+            }
+            zfs->fs_sblock = block++;
+            super = zfs->fs_super;
+            super->sb_flags |= LC_SUPER_REMOVED;
+            super->sb_childLayer = 0;
+            *next = zfs->fs_sblock;
+            next = &super->sb_nextLayer;
+            lc_markSuperDirty(zfs);
+            count--;
+        }
+    }
+    *next = 0;
     assert(count == 0);
 
     /* Link the newly allocated super blocks */
@@ -136,4 +176,9 @@ lc_allocateSuperBlocks(struct gfs *gfs, struct fs *rfs) {
             }
         }
     }
+    for (fs = gfs->gfs_reclaim; fs; fs = fs->fs_rnext) {
+        for (zfs = fs; zfs; zfs = zfs->fs_zfs) {
+            lc_superWrite(gfs, zfs, rfs);
+        }
+    }
 }
@@ -160,6 +160,116 @@ do
 done
 cd -
 
+#Extract tar archives as layers and compare with the files archived
+XDIR=/tmp/lcfs-extract
+rm -fr $XDIR $XDIR.tar.gz $XDIR.child $XDIR.child.tar $XDIR.*.lcfs
+mkdir -p $XDIR/dir/subdir $XDIR.child/dir
+cp /etc/passwd $XDIR/dir/passwd
+dd if=/dev/urandom of=$XDIR/file count=100 bs=4096
+dd if=/dev/urandom of=$XDIR/large count=5000 bs=4099
+dd if=/dev/urandom of=$XDIR/sparse count=1 bs=1000 seek=1000
+dd if=/dev/zero of=$XDIR/zero count=10 bs=4096
+ln $XDIR/file $XDIR/dir/subdir/link
+ln -s ../file $XDIR/dir/symlink
+mkfifo $XDIR/fifo
+echo original > $XDIR/recreate
+tar -C $XDIR -czf $XDIR.tar.gz .
+$LCFS extract $MNT extract-base $XDIR.tar.gz || exit 1
+diff -r $XDIR $MNT/lcfs/extract-base || exit 1
+test `stat -c %h $MNT/lcfs/extract-base/file` -eq 2 || exit 1
+
+touch $XDIR.child/dir/.wh.passwd
+echo hello > $XDIR.child/file
+echo recreated > $XDIR.child/recreate
+tar -C $XDIR.child -cf $XDIR.child.tar .
+$LCFS extract $MNT extract-child $XDIR.child.tar extract-base || exit 1
+test ! -e $MNT/lcfs/extract-child/dir/passwd || exit 1
+cmp $XDIR.child/file $MNT/lcfs/extract-child/file || exit 1
+cmp $XDIR/file $MNT/lcfs/extract-child/dir/subdir/link || exit 1
+cmp $XDIR/dir/passwd $MNT/lcfs/extract-base/dir/passwd || exit 1
+$TESTDIFF extract-child
+
+#A file removed and created again is reported modified, with attributes of
+#the new file
+$TESTDIFF -a extract-child | grep "^Type 0 .*Size 10 .*Path recreate$" || exit 1
+
+#A file not an archive should not leave a layer behind
+$LCFS extract $MNT extract-bad /etc/passwd extract-base && exit 1
+test ! -e $MNT/lcfs/extract-bad || exit 1
+
+#Layers sent and received again match the originals, and a child layer is
+#received only on a copy of the layer it was created on
+cat $MNT/.lcfs-send-extract-base > $XDIR.base.lcfs || exit 1
+cat $MNT/.lcfs-send-extract-child > $XDIR.child.lcfs || exit 1
+$LCFS receive $MNT receive-base $XDIR.base.lcfs || exit 1
+$LCFS receive $MNT receive-bad $XDIR.child.lcfs extract-child && exit 1
+test ! -e $MNT/lcfs/receive-bad || exit 1
+$LCFS receive $MNT receive-child $XDIR.child.lcfs receive-base || exit 1
+diff -r $MNT/lcfs/extract-base $MNT/lcfs/receive-base || exit 1
+diff -r $MNT/lcfs/extract-child $MNT/lcfs/receive-child || exit 1
+test `stat -c %h $MNT/lcfs/receive-child/dir/subdir/link` -eq 2 || exit 1
+
+#Changes against a grandparent layer merge changes of the layer in between.
+#A file added and removed again in between is not reported, and a directory
+#replaced in between reports entries of the old directory as removed.
+mkdir $XDIR.middle $XDIR.grand
+echo transient > $XDIR.middle/transient
+touch $XDIR.middle/.wh.dir
+tar -C $XDIR.middle -cf $XDIR.middle.tar .
+$LCFS extract $MNT diff-middle $XDIR.middle.tar extract-base || exit 1
+mkdir $XDIR.grand/dir
+echo new > $XDIR.grand/dir/new
+touch $XDIR.grand/.wh.transient
+tar -C $XDIR.grand -cf $XDIR.grand.tar .
+$LCFS extract $MNT diff-grand $XDIR.grand.tar diff-middle || exit 1
+$TESTDIFF -a extract-base/diff-grand > $XDIR.diff || exit 1
+cat $XDIR.diff
+grep "Path transient$" $XDIR.diff && exit 1
+grep "^Type 0 .*Path dir$" $XDIR.diff || exit 1
+grep "^Type 1 .*Path dir/new$" $XDIR.diff || exit 1
+grep "^Type 2 .*Path dir/passwd$" $XDIR.diff || exit 1
+grep "^Type 2 .*Path dir/subdir$" $XDIR.diff || exit 1
+grep "^Type 2 .*Path dir/symlink$" $XDIR.diff || exit 1
+rm -fr $XDIR.middle $XDIR.middle.tar $XDIR.grand $XDIR.grand.tar $XDIR.diff
+
+#Layers created in one request all show up, and none of them do when a name
+#is already taken or repeated
+$LCFS create $MNT extract-base batch-1 batch-2 batch-3 batch-4 || exit 1
+for i in 1 2 3 4
+do
+    diff -r $XDIR $MNT/lcfs/batch-$i || exit 1
+done
+$LCFS create $MNT extract-base batch-5 batch-2 batch-6 && exit 1
+test ! -e $MNT/lcfs/batch-5 || exit 1
+test ! -e $MNT/lcfs/batch-6 || exit 1
+$LCFS create $MNT extract-base batch-7 batch-7 && exit 1
+test ! -e $MNT/lcfs/batch-7 || exit 1
+$LCFS create $MNT batch-missing batch-8 && exit 1
+test ! -e $MNT/lcfs/batch-8 || exit 1
+echo hello > $MNT/lcfs/batch-1/file
+cmp $XDIR/file $MNT/lcfs/batch-2/file || exit 1
+
+#Layers could be removed and created while the reclaimer is busy freeing
+#layers removed before, and checkpoints are taken meanwhile
+LAYERS="reclaim-1-init reclaim-2-init reclaim-3-init reclaim-4-init"
+$LCFS create $MNT extract-base $LAYERS || exit 1
+for i in $LAYERS
+do
+    dd if=/dev/urandom of=$MNT/lcfs/$i/data count=2000 bs=4096 || exit 1
+done
+$LCFS remove $MNT $LAYERS || exit 1
+$LCFS create $MNT extract-base reclaim-5-init || exit 1
+$LCFS remove $MNT reclaim-5-init || exit 1
+$LCFS remove $MNT reclaim-5-init && exit 1
+$LCFS commit $MNT || exit 1
+for i in $LAYERS reclaim-5-init
+do
+    test ! -e $MNT/lcfs/$i || exit 1
+done
+diff -r $XDIR $MNT/lcfs/batch-3 || exit 1
+rm -fr $XDIR $XDIR.tar.gz $XDIR.child $XDIR.child.tar
+rm -f $XDIR.base.lcfs $XDIR.child.lcfs
+
 docker save -o $MNT/h.tar hello
 docker ps --all --format {{.ID}} | xargs docker rm
 docker rmi hello-world
@@ -190,16 +300,43 @@ set -x
 touch $MNT/tmp/file
 cd -
 
+#Unmount while removed layers are waiting to be reclaimed.  Space of those
+#layers is free after mounting again.
+USED=`df -k --output=used $MNT | tail -1`
+LAYERS="unmount-1-init unmount-2-init unmount-3-init unmount-4-init"
+$LCFS create $MNT extract-base $LAYERS || exit 1
+for i in $LAYERS
+do
+    dd if=/dev/urandom of=$MNT/lcfs/$i/data count=4000 bs=4096 || exit 1
+done
+$LCFS remove $MNT $LAYERS || exit 1
+
+#Changes made to a layer before unmounting are reported after mounting again
+echo remount > $MNT/lcfs/batch-4/dir/passwd
+ln $MNT/lcfs/batch-4/dir/passwd $MNT/lcfs/batch-4/link
+rm $MNT/lcfs/batch-4/zero
+
 umount -f $MNT/plugins/*/rootfs/lcfs
 umount -f $MNT $MNT2 2>/dev/null
 sleep 10
 
 $LCFS daemon $DEVICE $MNT $MNT2
 sleep 10
+$TESTDIFF -a batch-4 > /tmp/lcfs-remount.diff || exit 1
+cat /tmp/lcfs-remount.diff
+grep "^Type 0 .*Size 8 .*Path dir/passwd$" /tmp/lcfs-remount.diff || exit 1
+grep "^Type 1 .*Size 8 .*Path link$" /tmp/lcfs-remount.diff || exit 1
+grep "^Type 2 .*Path zero$" /tmp/lcfs-remount.diff || exit 1
+rm -f /tmp/lcfs-remount.diff
 cd $MNT
 ls -ltRi > /dev/null
 stat file
 stat dir
+for i in $LAYERS
+do
+    test ! -e $MNT/lcfs/$i || exit 1
+done
+test `df -k --output=used $MNT | tail -1` -lt $((USED + 8000)) || exit 1
 
 set +x
 for (( i = 0; i < 500; i += 2 ))
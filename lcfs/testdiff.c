@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/xattr.h>
 #include <assert.h>
 
@@ -10,6 +11,8 @@
 #else
 #define GETXATTR_SIZE sizeof(uint64_t)
 #endif
+#define LC_DIFF_PREFIX ".lcfs-diff2."
+#define LC_DIFF_SIZE (64 * 1024)
 
 struct pchange {
     uint16_t ch_len;
@@ -17,12 +20,72 @@ struct pchange {
     char ch_path[0];
 } __attribute__((packed));
 
+struct pbatch {
+    uint64_t pb_cursor;
+    uint32_t pb_count;
+    uint32_t pb_size;
+} __attribute__((packed));
+
+struct pchange2 {
+    uint16_t ch_len;
+    uint8_t ch_type;
+    uint8_t ch_flags;
+    uint32_t ch_mode;
+    uint32_t ch_uid;
+    uint32_t ch_gid;
+    uint64_t ch_size;
+    uint64_t ch_mtime;
+    uint32_t ch_mtimensec;
+    uint64_t ch_ctime;
+    uint32_t ch_ctimensec;
+    char ch_path[0];
+} __attribute__((packed));
+
+/* Display changes in batches along with attributes */
+static int
+diff2(char *layer) {
+    char buf[LC_DIFF_SIZE], name[512];
+    struct pchange2 *pchange;
+    struct pbatch *pbatch;
+    uint64_t cursor = 0;
+    size_t size, psize;
+    uint32_t i;
+
+    do {
+        snprintf(name, sizeof(name), "%s%lu.%s", LC_DIFF_PREFIX,
+                 cursor, layer);
+        size = getxattr("/lcfs/lcfs", name, buf, LC_DIFF_SIZE);
+        if (size == -1) {
+            perror("getxattr");
+            return 1;
+        }
+        assert(size >= sizeof(struct pbatch));
+        pbatch = (struct pbatch *)buf;
+        psize = sizeof(struct pbatch);
+        for (i = 0; i < pbatch->pb_count; i++) {
+            pchange = (struct pchange2 *)&buf[psize];
+            printf("Type %d Mode 0%o Uid %d Gid %d Size %ld Mtime %ld "
+                   "Xattr %d Len %d Path %.*s\n",
+                   pchange->ch_type, pchange->ch_mode, pchange->ch_uid,
+                   pchange->ch_gid, pchange->ch_size, pchange->ch_mtime,
+                   pchange->ch_flags & 0x1, pchange->ch_len,
+                   pchange->ch_len, pchange->ch_path);
+            psize += sizeof(struct pchange2) + pchange->ch_len;
+        }
+        cursor = pbatch->pb_cursor;
+    } while (pbatch->pb_count);
+    return 0;
+}
+
 int
 main(int argc, char *argv[]) {
     char buf[GETXATTR_SIZE];
     struct pchange *pchange;
     size_t size, psize;
 
+    if ((argc == 3) && !strcmp(argv[1], "-a")) {
+        return diff2(argv[2]);
+    }
     if (argc == 2) {
         do {
             size = getxattr("/lcfs/lcfs", argv[1], buf, GETXATTR_SIZE);
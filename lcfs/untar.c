@@ -1,182 +1,728 @@
 #include "includes.h"
+#include <archive.h>
+#include <archive_entry.h>
 
-/* Open a tar archive */
-static int
-lc_archive_open(struct archive *a, void *client_data) {
-    return ARCHIVE_OK;
-}
+/* Maximum number of pages of a file handed over in a batch */
+#define LC_EXTRACT_BATCH    32
+
+/* Maximum number of items queued for applying */
+#define LC_EXTRACT_QUEUE    64
+
+/* An entry of the archive or a batch of data of the last entry, queued by
+ * the thread reading the archive for the thread applying those.
+ */
+struct xitem {
+
+    /* Next item in the queue */
+    struct xitem *xi_next;
+
+    /* Path of the entry, NULL for a batch of data */
+    char *xi_path;
+
+    /* Target of a symbolic link or a hard link */
+    char *xi_symlink;
+    char *xi_hardlink;
+
+    /* Attributes of the entry */
+    mode_t xi_mode;
+    uid_t xi_uid;
+    gid_t xi_gid;
+    dev_t xi_rdev;
+
+    /* Modification time of the entry */
+    struct timespec xi_mtime;
+
+    /* Size of the file, or size of the data in the batch */
+    uint64_t xi_size;
+
+    /* Offset of the data in the file */
+    off_t xi_offset;
+
+    /* Number of pages in the batch */
+    uint64_t xi_pcount;
+
+    /* Pages of data */
+    struct dpage xi_dpages[LC_EXTRACT_BATCH];
+};
+
+/* Queue of items between the reader and applier of an archive */
+struct xqueue {
+
+    /* Lock protecting the queue */
+    pthread_mutex_t xq_lock;
+
+    /* Condition waited on when the queue is empty or full */
+    pthread_cond_t xq_cond;
+
+    /* Items queued */
+    struct xitem *xq_head, *xq_tail;
+
+    /* Number of items queued */
+    uint64_t xq_count;
+
+    /* File system entries are extracted into */
+    struct fs *xq_fs;
+
+    /* Archive being read */
+    struct archive *xq_archive;
+
+    /* Error reading or applying the archive */
+    int xq_err;
+
+    /* Set when the reader is done with the archive */
+    bool xq_done;
+};
 
-/* Read next page from the archive */
-static ssize_t
-lc_archive_read(struct archive *a, void *client_data, const void **buffer) {
-    struct inode *inode = (struct inode *)client_data;
-    uint64_t size, pg = lc_inodeGetFirstPage(inode);
-    uint64_t offset = (pg * LC_BLOCK_SIZE);
+static int lc_extractRemove(struct fs *fs, struct inode *dir,
+                            const char *name);
 
-    if (offset >= inode->i_size) {
-        return 0;
+/* Free an item */
+static void
+lc_extractFree(struct fs *fs, struct xitem *xi) {
+    if (xi->xi_path) {
+        lc_free(fs, xi->xi_path, strlen(xi->xi_path) + 1,
+                LC_MEMTYPE_EXTRACT);
+    }
+    if (xi->xi_symlink) {
+        lc_free(fs, xi->xi_symlink, strlen(xi->xi_symlink) + 1,
+                LC_MEMTYPE_EXTRACT);
     }
-    size = inode->i_size - offset;
-    if (size > LC_BLOCK_SIZE) {
-        size = LC_BLOCK_SIZE;
+    if (xi->xi_hardlink) {
+        lc_free(fs, xi->xi_hardlink, strlen(xi->xi_hardlink) + 1,
+                LC_MEMTYPE_EXTRACT);
     }
-    *buffer = lc_getDirtyPage(inode->i_fs->fs_gfs, inode, pg, NULL);
-    lc_inodeSetFirstPage(inode, pg + 1);
-    return size;
+    lc_freePages(fs, xi->xi_dpages, xi->xi_pcount);
+    lc_free(fs, xi, sizeof(struct xitem), LC_MEMTYPE_EXTRACT);
 }
 
-/* Close the archive */
-static int
-lc_archive_close(struct archive *a, void *client_data) {
-    return ARCHIVE_OK;
+/* Allocate a new item */
+static struct xitem *
+lc_extractItem(struct fs *fs) {
+    struct xitem *xi;
+
+    xi = lc_malloc(fs, sizeof(struct xitem), LC_MEMTYPE_EXTRACT);
+    memset(xi, 0, sizeof(struct xitem));
+    return xi;
 }
 
-/* Extract data of a regular file */
+/* Make a copy of a string in the archive entry */
+static char *
+lc_extractString(struct fs *fs, const char *str) {
+    size_t len;
+    char *copy;
+
+    if (str == NULL) {
+        return NULL;
+    }
+    len = strlen(str) + 1;
+    copy = lc_malloc(fs, len, LC_MEMTYPE_EXTRACT);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+/* Stop extracting the archive after an error */
 static void
-lc_extract_data(struct fs *fs, struct inode *inode, struct archive *a) {
-    uint64_t size, psize, count = 0;
-    int64_t offset, off;
-    struct dpage dpage;
-    const char *page;
-    char *pdata;
+lc_extractAbort(struct xqueue *xq, int err) {
+    pthread_mutex_lock(&xq->xq_lock);
+    if (xq->xq_err == 0) {
+        xq->xq_err = err;
+    }
+    pthread_cond_broadcast(&xq->xq_cond);
+    pthread_mutex_unlock(&xq->xq_lock);
+}
+
+/* Queue an item for applying, waiting while the queue is full.  The item is
+ * freed if extraction was stopped after an error.
+ */
+static bool
+lc_extractQueue(struct xqueue *xq, struct xitem *xi) {
+    pthread_mutex_lock(&xq->xq_lock);
+    while ((xq->xq_count >= LC_EXTRACT_QUEUE) && !xq->xq_err) {
+        pthread_cond_wait(&xq->xq_cond, &xq->xq_lock);
+    }
+    if (unlikely(xq->xq_err)) {
+        pthread_mutex_unlock(&xq->xq_lock);
+        lc_extractFree(xq->xq_fs, xi);
+        return false;
+    }
+    if (xq->xq_tail) {
+        xq->xq_tail->xi_next = xi;
+    } else {
+        xq->xq_head = xi;
+    }
+    xq->xq_tail = xi;
+    xq->xq_count++;
+    pthread_cond_broadcast(&xq->xq_cond);
+    pthread_mutex_unlock(&xq->xq_lock);
+    return true;
+}
+
+/* Take the next item off the queue, waiting while the queue is empty.
+ * Returns NULL after the reader is done and all items are taken.  Any error
+ * stopping the extraction is returned as well.
+ */
+static struct xitem *
+lc_extractDequeue(struct xqueue *xq, int *errp) {
+    struct xitem *xi;
+
+    pthread_mutex_lock(&xq->xq_lock);
+    while ((xq->xq_head == NULL) && !xq->xq_done) {
+        pthread_cond_wait(&xq->xq_cond, &xq->xq_lock);
+    }
+    xi = xq->xq_head;
+    if (xi) {
+        xq->xq_head = xi->xi_next;
+        if (xq->xq_head == NULL) {
+            xq->xq_tail = NULL;
+        }
+        xq->xq_count--;
+        pthread_cond_broadcast(&xq->xq_cond);
+    }
+    *errp = xq->xq_err;
+    pthread_mutex_unlock(&xq->xq_lock);
+    return xi;
+}
+
+/* Read data of a regular file, copying it into pages which are queued in
+ * batches of contiguous pages.
+ */
+static int
+lc_extractReadData(struct xqueue *xq) {
+    struct archive *a = xq->xq_archive;
+    struct fs *fs = xq->xq_fs;
+    struct xitem *xi = NULL;
+    uint64_t size, psize;
+    struct dpage *dpage;
+    const char *data;
+    int64_t offset;
+    off_t off;
     int err;
 
     for (;;) {
-        err = archive_read_data_block(a, (const void **)&page, &size, &offset);
+        err = archive_read_data_block(a, (const void **)&data, &size,
+                                      &offset);
         if (err == ARCHIVE_EOF) {
             break;
         }
-        off = offset % LC_BLOCK_SIZE;
-        psize = LC_BLOCK_SIZE - off;
-        if (psize > size) {
-            psize = size;
+        if (unlikely(err < ARCHIVE_WARN)) {
+            lc_syslog(LOG_ERR, "Failed to read archive: %s\n",
+                      archive_error_string(a));
+            if (xi) {
+                lc_extractFree(fs, xi);
+            }
+            return EIO;
         }
         while (size) {
-            lc_mallocBlockAligned(fs, (void **)&pdata, LC_MEMTYPE_DATA);
-            memcpy(&pdata[off], &page[offset], psize);
-            dpage.dp_data = pdata;
-            dpage.dp_poffset = off;
-            dpage.dp_psize = psize;
-            if (lc_addPages(inode, offset, psize, &dpage, 1)) {
-                count++;
-            }
-            lc_freePages(fs, &dpage, 1);
-            offset += psize;
-            size -= psize;
-            off = 0;
-            psize = LC_BLOCK_SIZE;
+            off = offset % LC_BLOCK_SIZE;
+            psize = LC_BLOCK_SIZE - off;
             if (psize > size) {
                 psize = size;
             }
+
+            /* Start a new batch when the current one is full or the data is
+             * not contiguous with the data in the batch.
+             */
+            if (xi && (((xi->xi_offset + xi->xi_size) != offset) ||
+                       ((off == 0) && (xi->xi_pcount == LC_EXTRACT_BATCH)))) {
+                if (!lc_extractQueue(xq, xi)) {
+                    return ECANCELED;
+                }
+                xi = NULL;
+            }
+            if (xi == NULL) {
+                xi = lc_extractItem(fs);
+                xi->xi_offset = offset;
+            }
+
+            /* Continue filling the last page of the batch if the data
+             * starts in the middle of that page.
+             */
+            if (off && xi->xi_size) {
+                dpage = &xi->xi_dpages[xi->xi_pcount - 1];
+                assert((dpage->dp_poffset + dpage->dp_psize) == off);
+            } else {
+                dpage = &xi->xi_dpages[xi->xi_pcount++];
+                lc_mallocBlockAligned(fs, (void **)&dpage->dp_data,
+                                      LC_MEMTYPE_DATA);
+                dpage->dp_poffset = off;
+                dpage->dp_psize = 0;
+            }
+            memcpy(&dpage->dp_data[off], data, psize);
+            dpage->dp_psize += psize;
+            xi->xi_size += psize;
+            data += psize;
+            offset += psize;
+            size -= psize;
+        }
+    }
+    if (xi && !lc_extractQueue(xq, xi)) {
+        return ECANCELED;
+    }
+    return 0;
+}
+
+/* Read entries of the archive, decompressing those, and queue those for
+ * applying.
+ */
+static void *
+lc_extractReader(void *data) {
+    struct xqueue *xq = (struct xqueue *)data;
+    struct archive *a = xq->xq_archive;
+    struct archive_entry *entry;
+    struct fs *fs = xq->xq_fs;
+    struct xitem *xi;
+    int err = 0;
+
+    while (err == 0) {
+        err = archive_read_next_header(a, &entry);
+        if (err == ARCHIVE_EOF) {
+            err = 0;
+            break;
+        }
+        if (unlikely(err < ARCHIVE_WARN)) {
+            lc_syslog(LOG_ERR, "Failed to read archive: %s\n",
+                      archive_error_string(a));
+            err = EIO;
+            break;
+        }
+        err = 0;
+        xi = lc_extractItem(fs);
+        xi->xi_path = lc_extractString(fs, archive_entry_pathname(entry));
+        xi->xi_symlink = lc_extractString(fs, archive_entry_symlink(entry));
+        xi->xi_hardlink = lc_extractString(fs, archive_entry_hardlink(entry));
+        xi->xi_mode = archive_entry_mode(entry);
+        xi->xi_uid = archive_entry_uid(entry);
+        xi->xi_gid = archive_entry_gid(entry);
+        xi->xi_rdev = archive_entry_rdev(entry);
+        xi->xi_mtime.tv_sec = archive_entry_mtime(entry);
+        xi->xi_mtime.tv_nsec = archive_entry_mtime_nsec(entry);
+        xi->xi_size = archive_entry_size(entry);
+        if (unlikely(xi->xi_path == NULL)) {
+            lc_extractFree(fs, xi);
+            err = EINVAL;
+            break;
+        }
+        if (!lc_extractQueue(xq, xi)) {
+            break;
+        }
+        if (S_ISREG(xi->xi_mode) && xi->xi_size && (xi->xi_hardlink == NULL)) {
+            err = lc_extractReadData(xq);
+        }
+    }
+    pthread_mutex_lock(&xq->xq_lock);
+    if (err && (xq->xq_err == 0)) {
+        xq->xq_err = err;
+    }
+    xq->xq_done = true;
+    pthread_cond_broadcast(&xq->xq_cond);
+    pthread_mutex_unlock(&xq->xq_lock);
+    return NULL;
+}
+
+/* Strip leading "/" and "./" and trailing "/" of a path in the archive,
+ * returning the length of what is left.
+ */
+static const char *
+lc_extractPath(const char *path, int *lenp) {
+    int len;
+
+    while ((path[0] == '/') || ((path[0] == '.') && (path[1] == '/'))) {
+        path += (path[0] == '/') ? 1 : 2;
+    }
+    len = strlen(path);
+    while (len && (path[len - 1] == '/')) {
+        len--;
+    }
+    if ((len == 1) && (path[0] == '.')) {
+        len = 0;
+    }
+    *lenp = len;
+    return path;
+}
+
+/* Lookup a path relative to the root directory of the layer */
+static ino_t
+lc_extractLookup(struct fs *fs, const char *path, int len) {
+    struct dirent *dirent;
+    ino_t ino = fs->fs_root;
+    struct inode *dir;
+    int i = 0, j;
+
+    while ((i < len) && (ino != LC_INVALID_INODE)) {
+        j = i;
+        while ((j < len) && (path[j] != '/')) {
+            j++;
+        }
+
+        /* Skip empty components and "." */
+        if ((j == i) || (((j - i) == 1) && (path[i] == '.'))) {
+            i = j + 1;
+            continue;
+        }
+
+        /* Paths are not allowed to escape the layer */
+        if (((j - i) == 2) && (path[i] == '.') && (path[i + 1] == '.')) {
+            return LC_INVALID_INODE;
+        }
+        dir = lc_getInode(fs, ino, NULL, false, false);
+        if (unlikely(dir == NULL)) {
+            return LC_INVALID_INODE;
+        }
+        if (S_ISDIR(dir->i_mode)) {
+            dirent = lc_dirFindEntry(dir, &path[i], j - i);
+            ino = dirent ? dirent->di_ino : LC_INVALID_INODE;
+        } else {
+            ino = LC_INVALID_INODE;
+        }
+        lc_inodeUnlock(dir);
+        i = j + 1;
+    }
+    return ino;
+}
+
+/* Remove all entries from a directory locked exclusive */
+static int
+lc_extractEmpty(struct fs *fs, struct inode *dir) {
+    bool hashed = (dir->i_flags & LC_INODE_DHASHED);
+    int i = 0, max = hashed ? LC_DIRCACHE_SIZE : 1, err;
+    struct dirent *dirent;
+
+    assert(!(dir->i_flags & LC_INODE_SHARED));
+    while ((i < max) && dir->i_size) {
+        dirent = hashed ? dir->i_hdirent[i] : dir->i_dirent;
+        if (dirent == NULL) {
+            i++;
+            continue;
+        }
+        char name[dirent->di_size + 1];
+
+        memcpy(name, dirent->di_name, dirent->di_size + 1);
+        err = lc_extractRemove(fs, dir, name);
+        if (unlikely(err)) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* Remove an entry from a directory locked exclusive, along with everything
+ * under it if that is a directory.
+ */
+static int
+lc_extractRemove(struct fs *fs, struct inode *dir, const char *name) {
+    struct dirent *dirent = lc_dirFindEntry(dir, name, strlen(name));
+    struct inode *inode;
+    bool rmdir;
+    int err;
+
+    if (dirent == NULL) {
+        return ENOENT;
+    }
+    rmdir = S_ISDIR(dirent->di_mode);
+    if (rmdir) {
+        inode = lc_getInode(fs, dirent->di_ino, NULL, true, true);
+        if (unlikely(inode == NULL)) {
+            return ESTALE;
+        }
+        if (inode->i_flags & LC_INODE_SHARED) {
+            lc_dirCopy(inode);
+        }
+        err = lc_extractEmpty(fs, inode);
+        lc_inodeUnlock(inode);
+        if (unlikely(err)) {
+            return err;
         }
     }
-    lc_markInodeDirty(inode, LC_INODE_EMAPDIRTY);
+    return lc_dirRemoveName(fs, dir, name, rmdir, NULL, false);
+}
+
+/* Finish extracting a file */
+static void
+lc_extractDone(struct inode *inode, uint64_t count) {
+    struct fs *fs = inode->i_fs;
+
     if (count) {
         __sync_add_and_fetch(&fs->fs_pcount, count);
         __sync_add_and_fetch(&fs->fs_gfs->gfs_dcount, count);
     }
+
+    /* XXX Extract ACLs and extended attributes */
+    lc_markInodeDirty(inode, 0);
+    lc_inodeUnlock(inode);
 }
 
-/* Extract an entry */
-static void
-lc_extract_entry(struct inode *target, struct archive *a,
-                 struct archive_entry *entry) {
-    const char *path, *symlink, *hardlink, *name;
-    struct inode *inode, *dir = target;
-    struct fs *fs = target->i_fs;
-    uint64_t size;
-    mode_t mode;
-    int i, len;
-    dev_t rdev;
-    ino_t ino;
-    uid_t uid;
-    gid_t gid;
-
-    path = archive_entry_pathname(entry);
-    mode = archive_entry_mode(entry);
-    uid = archive_entry_uid(entry);
-    gid = archive_entry_gid(entry);
-    rdev = archive_entry_rdev(entry);
-    size = archive_entry_size(entry);
-    symlink = archive_entry_symlink(entry);
-    hardlink = archive_entry_hardlink(entry);
+/* Create an entry, returning the inode locked.  Existing entries are
+ * replaced, except directories which take the attributes from the archive.
+ * Whiteout entries remove the entry named or all entries of the directory,
+ * and NULL is returned for those.
+ */
+static struct inode *
+lc_extractEntry(struct fs *fs, struct xitem *xi, int *errp) {
+    ino_t ino, lino = LC_INVALID_INODE;
+    struct inode *dir, *inode = NULL;
+    mode_t mode = xi->xi_mode;
+    struct dirent *dirent;
+    const char *path;
+    uint64_t pages;
+    int i, len, nlen;
+
     lc_printf("x %s mode 0x%x uid %d gid %d rdev %ld size %ld"
               " symlink %s hardlink %s\n",
-              path, mode, uid, gid, rdev, size, symlink, hardlink);
-    len = strlen(path);
-    i = len - 1;
-    while (i) {
-        if (path[i] == '/') {
-            if (i < (len - 1)) {
-                i++;
-                break;
+              xi->xi_path, mode, xi->xi_uid, xi->xi_gid, xi->xi_rdev,
+              xi->xi_size, xi->xi_symlink, xi->xi_hardlink);
+    path = lc_extractPath(xi->xi_path, &len);
+
+    /* Root directory of the layer exists already */
+    if (len == 0) {
+        return NULL;
+    }
+    if (!lc_hasSpace(fs->fs_gfs, fs == lc_getGlobalFs(fs->fs_gfs), false)) {
+        *errp = ENOSPC;
+        return NULL;
+    }
+    i = len;
+    while (i && (path[i - 1] != '/')) {
+        i--;
+    }
+    nlen = len - i;
+    char name[nlen + 1];
+
+    memcpy(name, &path[i], nlen);
+    name[nlen] = 0;
+    if (!strcmp(name, "..")) {
+        *errp = EINVAL;
+        return NULL;
+    }
+
+    /* Find the file linked to before locking the directory */
+    if (xi->xi_hardlink) {
+        path = lc_extractPath(xi->xi_hardlink, &len);
+        lino = lc_extractLookup(fs, path, len);
+        if (lino == LC_INVALID_INODE) {
+            *errp = ENOENT;
+            return NULL;
+        }
+        path = lc_extractPath(xi->xi_path, &len);
+    }
+    ino = i ? lc_extractLookup(fs, path, i - 1) : fs->fs_root;
+    dir = (ino != LC_INVALID_INODE) ?
+          lc_getInode(fs, ino, NULL, true, true) : NULL;
+    if (unlikely(dir == NULL)) {
+        *errp = ENOENT;
+        return NULL;
+    }
+    if (unlikely(!S_ISDIR(dir->i_mode))) {
+        lc_inodeUnlock(dir);
+        *errp = ENOTDIR;
+        return NULL;
+    }
+    if (dir->i_flags & LC_INODE_SHARED) {
+        lc_dirCopy(dir);
+    }
+
+    /* Whiteouts remove entries inherited from parent layers */
+    if (!strncmp(name, LC_WHITEOUT_PREFIX, strlen(LC_WHITEOUT_PREFIX))) {
+        if (!strcmp(name, LC_WHITEOUT_OPAQUE)) {
+            *errp = lc_extractEmpty(fs, dir);
+        } else {
+            *errp = lc_extractRemove(fs, dir,
+                                     &name[strlen(LC_WHITEOUT_PREFIX)]);
+            if (*errp == ENOENT) {
+                *errp = 0;
             }
-            len--;
         }
-        i--;
+        lc_inodeUnlock(dir);
+        return NULL;
     }
-    if (i) {
-        dir = lc_pathLookup(fs, dir, path, i - 1);
+
+    /* Replace an existing entry, unless both are directories */
+    dirent = lc_dirFindEntry(dir, name, nlen);
+    if (dirent) {
+        if (S_ISDIR(mode) && S_ISDIR(dirent->di_mode)) {
+            ino = dirent->di_ino;
+            lc_inodeUnlock(dir);
+            inode = lc_getInode(fs, ino, NULL, true, true);
+            if (unlikely(inode == NULL)) {
+                *errp = ESTALE;
+                return NULL;
+            }
+            inode->i_mode = mode;
+            inode->i_dinode.di_uid = xi->xi_uid;
+            inode->i_dinode.di_gid = xi->xi_gid;
+            inode->i_dinode.di_mtime = xi->xi_mtime;
+            lc_updateInodeTimes(inode, false, true);
+            return inode;
+        }
+        if ((lino != LC_INVALID_INODE) && (dirent->di_ino == lino)) {
+            lc_inodeUnlock(dir);
+            *errp = EINVAL;
+            return NULL;
+        }
+        *errp = lc_extractRemove(fs, dir, name);
+        if (unlikely(*errp)) {
+            lc_inodeUnlock(dir);
+            return NULL;
+        }
     }
-    name = &path[i];
-    if (hardlink) {
-        inode = lc_pathLookup(fs, target, hardlink, strlen(hardlink));
-        lc_inodeLock(inode, true);
+    if (xi->xi_hardlink) {
+        inode = lc_getInode(fs, lino, NULL, true, true);
+        if (unlikely((inode == NULL) || S_ISDIR(inode->i_mode))) {
+            if (inode) {
+                lc_inodeUnlock(inode);
+            }
+            lc_inodeUnlock(dir);
+            *errp = inode ? EPERM : ENOENT;
+            return NULL;
+        }
+        lc_addHlink(fs, inode, dir->i_ino);
         inode->i_nlink++;
+        lc_updateInodeTimes(inode, false, true);
+        mode = inode->i_mode;
     } else {
-        inode = lc_inodeInit(fs, mode, uid, gid, rdev, dir->i_ino, symlink);
-    }
-    ino = inode->i_ino;
-    lc_inodeLock(dir, true);
-    lc_dirAdd(dir, ino, mode, name, len - i);
-    if (S_ISDIR(mode)) {
-        dir->i_nlink++;
+        inode = lc_inodeInit(fs, mode, xi->xi_uid, xi->xi_gid, xi->xi_rdev,
+                             dir->i_ino, xi->xi_symlink);
+        inode->i_dinode.di_mtime = xi->xi_mtime;
+        if (S_ISDIR(mode)) {
+            dir->i_nlink++;
+        }
     }
+    lc_dirAdd(dir, inode->i_ino, mode, name, nlen);
     lc_updateInodeTimes(dir, true, true);
     lc_markInodeDirty(dir, LC_INODE_DIRDIRTY);
     lc_inodeUnlock(dir);
-    if (S_ISREG(mode) && size) {
-        inode->i_size = size;
-        lc_extract_data(fs, inode, a);
+    if (S_ISREG(mode) && xi->xi_size && (xi->xi_hardlink == NULL)) {
+        inode->i_size = xi->xi_size;
+        pages = (xi->xi_size + LC_BLOCK_SIZE - 1) / LC_BLOCK_SIZE;
+
+        /* Size of the file is known, so reserve a contiguous extent for the
+         * whole file, which data is written into as it is extracted.  Data is
+         * added as dirty pages if space could not be reserved.  Files in a
+         * layer deduplicated are kept as dirty pages instead, so that those
+         * are flushed whole and could share blocks of an identical file.
+         */
+        if (!lc_dedupLayer(fs->fs_gfs, fs) ||
+            (pages >= LC_MAX_FILE_DIRTYPAGES)) {
+            if (lc_emapPrealloc(fs->fs_gfs, fs, inode, 0, pages)) {
+                lc_printf("Could not reserve space for %s\n", xi->xi_path);
+            }
+        }
+        lc_markInodeDirty(inode, LC_INODE_EMAPDIRTY);
     }
+    return inode;
+}
 
-    /* XXX Extract ACLs and extended attributes */
-    lc_markInodeDirty(inode, 0);
-    lc_inodeUnlock(inode);
+/* Link a batch of data to a file.  Complete pages within the extent
+ * reserved for the file are written to disk directly, while others are
+ * added to the file as dirty pages.  Returns the number of dirty pages
+ * added.
+ */
+static uint64_t
+lc_extractData(struct inode *inode, struct xitem *xi) {
+    uint64_t pg = xi->xi_offset / LC_BLOCK_SIZE, i, run = 0, count = 0;
+    struct fs *fs = inode->i_fs;
+    struct dpage *dpage;
+    off_t off;
+
+    for (i = 0; i <= xi->xi_pcount; i++) {
+        dpage = (i < xi->xi_pcount) ? &xi->xi_dpages[i] : NULL;
+        off = ((pg + i) * LC_BLOCK_SIZE) + (dpage ? dpage->dp_poffset : 0);
+        if (dpage && (dpage->dp_poffset == 0) &&
+            ((pg + i) < inode->i_extentLength) &&
+            ((dpage->dp_psize == LC_BLOCK_SIZE) ||
+             ((off + dpage->dp_psize) == inode->i_size))) {
+
+            /* Last page of the file reads as zeroes past the end */
+            memset(&dpage->dp_data[dpage->dp_psize], 0,
+                   LC_BLOCK_SIZE - dpage->dp_psize);
+            continue;
+        }
+
+        /* Write out the pages accumulated so far */
+        if (run < i) {
+            lc_writeExtentPages(fs->fs_gfs, fs, inode, pg + run,
+                                &xi->xi_dpages[run], i - run);
+        }
+        run = i + 1;
+        if (dpage) {
+            count += lc_addPages(inode, off, dpage->dp_psize, dpage, 1);
+        }
+    }
+    return count;
 }
 
-/* Extract an archive */
-void
-lc_extract(struct inode *inode, struct inode *target) {
-    struct archive_entry *entry;
-    struct archive *a;
-    uint64_t pg;
-    int err;
+/* Extract a tar archive, optionally compressed with gzip, from a file into
+ * the root directory of a layer.  A separate thread decompresses and parses
+ * the archive, while this thread creates the entries and links pages of data
+ * to the files, a batch of pages at a time.  Pages are filled once by the
+ * reader and taken over by the files without copying again, with most of
+ * those written to the extent reserved for the file right away.
+ */
+int
+lc_extract(struct fs *fs, const char *path) {
+    struct inode *file = NULL;
+    uint64_t count = 0;
+    struct xqueue xq;
+    pthread_t reader;
+    struct xitem *xi;
+    int err = 0;
 
-    lc_printf("Extracting archive inode %ld\n", inode->i_ino);
-    assert(S_ISREG(inode->i_mode));
-    assert(inode->i_flags & LC_INODE_TMP);
-    assert(S_ISDIR(target->i_mode));
-    lc_inodeLock(inode, true);
-    pg = lc_inodeGetFirstPage(inode);
-    assert(pg == 0);
-    a = archive_read_new();
-    archive_read_support_format_tar(a);
-    archive_read_support_filter_gzip(a);
-
-    err = archive_read_open(a, inode, lc_archive_open, lc_archive_read,
-                            lc_archive_close);
-    assert(err == ARCHIVE_OK);
-    for (;;) {
-        err = archive_read_next_header(a, &entry);
-        if (err == ARCHIVE_EOF) {
-            break;
+    lc_printf("Extracting archive %s to layer %ld\n", path, fs->fs_root);
+    memset(&xq, 0, sizeof(struct xqueue));
+    pthread_mutex_init(&xq.xq_lock, NULL);
+    pthread_cond_init(&xq.xq_cond, NULL);
+    xq.xq_fs = fs;
+    xq.xq_archive = archive_read_new();
+    archive_read_support_format_tar(xq.xq_archive);
+    archive_read_support_filter_gzip(xq.xq_archive);
+    if (archive_read_open_filename(xq.xq_archive, path,
+                                   LC_EXTRACT_BATCH * LC_BLOCK_SIZE) !=
+        ARCHIVE_OK) {
+        lc_syslog(LOG_ERR, "Failed to open archive %s: %s\n",
+                  path, archive_error_string(xq.xq_archive));
+        err = archive_errno(xq.xq_archive);
+        if (err <= 0) {
+            err = EINVAL;
         }
-        assert(err == ARCHIVE_OK);
-        lc_extract_entry(target, a, entry);
+        goto out;
     }
-    archive_read_close(a);
-    archive_read_free(a);
-    lc_inodeSetFirstPage(inode, pg);
-    lc_inodeUnlock(inode);
+    err = pthread_create(&reader, NULL, lc_extractReader, &xq);
+    assert(err == 0);
+
+    /* Apply entries in the order those are in the archive.  After an error,
+     * items queued already are just freed.
+     */
+    while ((xi = lc_extractDequeue(&xq, &err))) {
+        if (err == 0) {
+            if (xi->xi_path) {
+                if (file) {
+                    lc_extractDone(file, count);
+                    file = NULL;
+                    count = 0;
+                }
+                file = lc_extractEntry(fs, xi, &err);
+            } else if (file && S_ISREG(file->i_mode)) {
+                count += lc_extractData(file, xi);
+            }
+            if (unlikely(err)) {
+                lc_extractAbort(&xq, err);
+            }
+        }
+        lc_extractFree(fs, xi);
+    }
+    if (file) {
+        lc_extractDone(file, count);
+    }
+    pthread_join(reader, NULL);
+    err = xq.xq_err;
+    archive_read_close(xq.xq_archive);
+
+out:
+    archive_read_free(xq.xq_archive);
+#ifdef LC_COND_DESTROY
+    pthread_cond_destroy(&xq.xq_cond);
+#endif
+#ifdef LC_MUTEX_DESTROY
+    pthread_mutex_destroy(&xq.xq_lock);
+#endif
+    return err;
 }
@@ -29,6 +29,26 @@ lc_xattrLink(struct inode *inode, const char *name, int len,
     inode->i_xsize += len + 1;
 }
 
+/* Check if an inode could have extended attributes.  Most files do not have
+ * any, which is answered from the inode cache without locking the inode.
+ * Inodes not cached yet are assumed to have some.
+ */
+static bool
+lc_xattrPresent(struct fs *fs, ino_t ino) {
+    struct inode *inode;
+    struct fs *pfs = fs;
+
+    /* Inodes are shared with parent layers, which may have attributes */
+    while (pfs && !pfs->fs_xattrEnabled) {
+        pfs = pfs->fs_parent;
+    }
+    if (pfs == NULL) {
+        return false;
+    }
+    inode = lc_lookupInodeChain(fs, lc_getInodeHandle(ino));
+    return (inode == NULL) || inode->i_xattrData;
+}
+
 /* Allocate xattr data for the inode */
 static void
 lc_xattrInit(struct fs *fs, struct inode *inode) {
@@ -146,6 +166,22 @@ out:
     lc_unlock(fs);
 }
 
+/* Add an extended attribute received in a stream of a layer */
+void
+lc_xattrReceive(struct inode *inode, const char *name, int len,
+                const char *value, size_t size) {
+    struct fs *fs = inode->i_fs;
+
+    if (!fs->fs_xattrEnabled) {
+        fs->fs_gfs->gfs_xattr_enabled = true;
+        fs->fs_xattrEnabled = true;
+    }
+    if (inode->i_xattrData == NULL) {
+        lc_xattrInit(fs, inode);
+    }
+    lc_xattrLink(inode, name, len, value, size);
+}
+
 /* Get the specified attribute of the inode */
 void
 lc_xattrGet(fuse_req_t req, ino_t ino, const char *name,
@@ -160,10 +196,10 @@ lc_xattrGet(fuse_req_t req, ino_t ino, const char *name,
     lc_statsBegin(&start);
     fs = lc_getLayerLocked(ino, false);
 
-    /* If the file system does not have any extended attributes, return without
-     * looking up the inode.
+    /* If the inode does not have any extended attributes, return without
+     * locking the inode.
      */
-    if (!fs->fs_xattrEnabled) {
+    if (!lc_xattrPresent(fs, ino)) {
         fuse_reply_err(req, ENODATA);
         err = ENODATA;
         goto out;
@@ -225,12 +261,16 @@ lc_xattrList(fuse_req_t req, ino_t ino, size_t size) {
     lc_statsBegin(&start);
     fs = lc_getLayerLocked(ino, false);
 
-    /* If the file system does not have any extended attributes, return without
-     * looking up the inode.
+    /* If the inode does not have any extended attributes, return without
+     * locking the inode.
      */
-    if (!fs->fs_xattrEnabled) {
-        fuse_reply_err(req, ENODATA);
-        err = ENODATA;
+    if (!lc_xattrPresent(fs, ino)) {
+        if (size == 0) {
+            fuse_reply_xattr(req, 0);
+        } else {
+            fuse_reply_err(req, ENODATA);
+            err = ENODATA;
+        }
         goto out;
     }
     inode = lc_getInode(fs, ino, NULL, false, false);
@@ -320,10 +360,10 @@ lc_xattrRemove(fuse_req_t req, ino_t ino, const char *name) {
     lc_statsBegin(&start);
     fs = lc_getLayerLocked(ino, false);
 
-    /* If the file system does not have any extended attributes, return without
-     * looking up the inode.
+    /* If the inode does not have any extended attributes, return without
+     * locking the inode.
      */
-    if (!fs->fs_xattrEnabled) {
+    if (!lc_xattrPresent(fs, ino)) {
         fuse_reply_err(req, ENODATA);
         err = ENODATA;
         goto out;
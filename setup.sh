@@ -43,6 +43,10 @@ sudo apt-get install -y zlib1g-dev
 #Install urcu
 sudo apt-get install -y liburcu-dev
 
+#Install libarchive
+sudo apt-get install -y libarchive-dev
+#sudo yum install libarchive-devel
+
 WDIR=/tmp/lcfs
 rm -fr $WDIR
 mkdir -p $WDIR